@@ -1,6 +1,10 @@
+// Generated by pgen. Fingerprint: e2fca2b4ee7deed8
 #ifndef PGEN_BF_PARSER_H
 #define PGEN_BF_PARSER_H
 
+// Changes whenever the grammar file changes.
+#define BF_GRAMMAR_FINGERPRINT UINT64_C(0xaa2ee44d768dabe9)
+
 
 /* START OF UTF8 LIBRARY */
 
@@ -9,9 +13,10 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
 
-#define UTF8_END -1 /* 1111 1111 */
-#define UTF8_ERR -2 /* 1111 1110 */
+#define UTF8_END (char)(CHAR_MIN ? CHAR_MIN     : CHAR_MAX    ) /* 1111 1111 */
+#define UTF8_ERR (char)(CHAR_MIN ? CHAR_MIN + 1 : CHAR_MAX - 1) /* 1111 1110 */
 
 #ifndef UTF8_MALLOC
 #define UTF8_MALLOC malloc
@@ -51,6 +56,24 @@ static inline char UTF8_contByte(UTF8Decoder *state) {
   return ((c & 0xC0) == 0x80) ? (c & 0x3F) : UTF8_ERR;
 }
 
+static inline int UTF8_validByte(char c) {
+  return (c != UTF8_ERR) & (c != UTF8_END);
+}
+
+/* Returns the length of the sequence that starts with c0, or 0 if c0 can't
+ * start one. */
+static inline size_t UTF8_seqLen(char c0) {
+  if ((c0 & 0x80) == 0)
+    return 1;
+  else if ((c0 & 0xE0) == 0xC0)
+    return 2;
+  else if ((c0 & 0xF0) == 0xE0)
+    return 3;
+  else if ((c0 & 0xF8) == 0xF0)
+    return 4;
+  return 0;
+}
+
 /* Extract the next unicode code point. Returns the codepoint, UTF8_END, or
  * UTF8_ERR. */
 static inline codepoint_t UTF8_decodeNext(UTF8Decoder *state) {
@@ -66,7 +89,7 @@ static inline codepoint_t UTF8_decodeNext(UTF8Decoder *state) {
     return (codepoint_t)c0;
   } else if ((c0 & 0xE0) == 0xC0) {
     c1 = UTF8_contByte(state);
-    if (c1 >= 0) {
+    if (UTF8_validByte(c1)) {
       c = ((c0 & 0x1F) << 6) | c1;
       if (c >= 128)
         return c;
@@ -74,7 +97,7 @@ static inline codepoint_t UTF8_decodeNext(UTF8Decoder *state) {
   } else if ((c0 & 0xF0) == 0xE0) {
     c1 = UTF8_contByte(state);
     c2 = UTF8_contByte(state);
-    if ((c1 | c2) >= 0) {
+    if (UTF8_validByte(c1) & UTF8_validByte(c2)) {
       c = ((c0 & 0x0F) << 12) | (c1 << 6) | c2;
       if ((c >= 2048) & ((c < 55296) | (c > 57343)))
         return c;
@@ -83,7 +106,7 @@ static inline codepoint_t UTF8_decodeNext(UTF8Decoder *state) {
     c1 = UTF8_contByte(state);
     c2 = UTF8_contByte(state);
     c3 = UTF8_contByte(state);
-    if ((c1 | c2 | c3) >= 0) {
+    if (UTF8_validByte(c1) & UTF8_validByte(c2) & UTF8_validByte(c3)) {
       c = ((c0 & 0x07) << 18) | (c1 << 12) | (c2 << 6) | c3;
       if ((c >= 65536) & (c <= 1114111))
         return c;
@@ -238,6 +261,7 @@ static inline int UTF8_decode(char *str, size_t len, codepoint_t **retcps,
 
 #ifndef PGEN_ARENA_INCLUDED
 #define PGEN_ARENA_INCLUDED
+#include <stdbool.h>
 #include <limits.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -271,6 +295,14 @@ static inline int UTF8_decode(char *str, size_t len, codepoint_t **retcps,
   } while (0);
 #endif
 
+#ifndef PGEN_PREFETCH
+#if defined(__GNUC__) || defined(__clang__)
+#define PGEN_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PGEN_PREFETCH(addr) ((void)(addr))
+#endif
+#endif
+
 #ifndef PGEN_DEBUG
 #define PGEN_DEBUG 0
 #endif
@@ -475,6 +507,32 @@ static inline char *pgen_alloc(pgen_allocator *allocator, size_t n,
   return ret;
 }
 
+// Allocates the arenas that the next n bytes of allocations will need, so
+// that pgen_alloc() doesn't have to stop to allocate them. Arenas are kept
+// across rewinds, so they're only ever allocated once.
+static inline void pgen_allocator_reserve(pgen_allocator *allocator,
+                                          size_t n) {
+  size_t i = allocator->rew.arena_idx;
+  size_t avail = 0;
+  if (allocator->arenas[i].buf) {
+    avail = allocator->arenas[i].cap - allocator->rew.filled;
+    i++;
+  }
+  for (; (avail < n) & (i + 1 < PGEN_NUM_ARENAS); i++) {
+    if (!allocator->arenas[i].buf) {
+      char *nb = (char *)PGEN_MALLOC(PGEN_BUFFER_SIZE);
+      if (!nb)
+        PGEN_OOM();
+      pgen_arena_t new_arena;
+      new_arena.freefn = free;
+      new_arena.buf = nb;
+      new_arena.cap = PGEN_BUFFER_SIZE;
+      allocator->arenas[i] = new_arena;
+    }
+    avail += allocator->arenas[i].cap;
+  }
+}
+
 // Does not take a pgen_allocator_rewind_t, does not rebind the
 // lifetime of the reallocated object.
 static inline void pgen_allocator_realloced(pgen_allocator *allocator,
@@ -563,23 +621,23 @@ static inline void pgen_allocator_rewind(pgen_allocator *allocator,
 #endif
 
   // Free all the objects associated with nodes implicitly destroyed.
-  // These are the ones located beyond the rew we're rewinding back to.
-  int freed_any = 0;
+  // These are the ones located beyond the rew we're rewinding back to,
+  // ordered by arena first and then by position in the arena.
   size_t i = allocator->freelist.len;
-  while (i--) {
+  while (i) {
 
-    pgen_freelist_entry_t entry = allocator->freelist.entries[i];
+    pgen_freelist_entry_t entry = allocator->freelist.entries[i - 1];
     uint32_t arena_idx = entry.rew.arena_idx;
     uint32_t filled = entry.rew.filled;
 
-    if ((rew.arena_idx <= arena_idx) | (rew.filled <= filled))
+    if ((arena_idx < rew.arena_idx) |
+        ((arena_idx == rew.arena_idx) & (filled <= rew.filled)))
       break;
 
-    freed_any = 1;
     entry.freefn(entry.ptr);
+    i--;
   }
-  if (freed_any)
-    allocator->freelist.len = (uint32_t)i;
+  allocator->freelist.len = (uint32_t)i;
   allocator->rew = rew;
 
 #if PGEN_ALLOCATOR_DEBUG
@@ -593,6 +651,367 @@ static inline void pgen_allocator_rewind(pgen_allocator *allocator,
 #endif /* PGEN_ARENA_INCLUDED */
 
 
+
+/* START OF IO LIBRARY */
+
+#ifndef PGEN_IO_INCLUDED
+#define PGEN_IO_INCLUDED
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef PGEN_USE_POSIX
+#define PGEN_USE_POSIX 0
+#endif
+
+#if PGEN_USE_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifndef PGEN_WRITER_BUFSZ
+#define PGEN_WRITER_BUFSZ (4096 * 16)
+#endif
+
+/*
+ * A buffered output sink. Writes go to buf. A memory writer grows buf as
+ * needed, and the caller takes the result from buf and len. A file or fd
+ * writer flushes buf to its sink whenever it fills up.
+ * After any failure, err is set and further writes are dropped.
+ */
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t cap;
+  FILE *f;
+  int fd;
+  int err;
+} pgen_writer;
+
+static inline pgen_writer pgen_writer_mem(void) {
+  pgen_writer w;
+  w.buf = NULL;
+  w.len = 0;
+  w.cap = 0;
+  w.f = NULL;
+  w.fd = -1;
+  w.err = 0;
+  return w;
+}
+
+static inline pgen_writer pgen_writer_file(FILE *f) {
+  pgen_writer w = pgen_writer_mem();
+  w.f = f;
+  w.buf = (char *)malloc(PGEN_WRITER_BUFSZ);
+  if (w.buf)
+    w.cap = PGEN_WRITER_BUFSZ;
+  else
+    w.err = 1;
+  return w;
+}
+
+#if PGEN_USE_POSIX
+static inline pgen_writer pgen_writer_fd(int fd) {
+  pgen_writer w = pgen_writer_file(NULL);
+  w.fd = fd;
+  return w;
+}
+#endif
+
+static inline int pgen_writer_has_sink(pgen_writer *w) {
+  return (w->f != NULL) | (w->fd != -1);
+}
+
+// Writes n bytes straight to the sink, bypassing the buffer.
+static inline void pgen_writer_sink(pgen_writer *w, const char *data,
+                                    size_t n) {
+  if (w->f) {
+    if (fwrite(data, 1, n, w->f) != n)
+      w->err = 1;
+    return;
+  }
+#if PGEN_USE_POSIX
+  while (n) {
+    ssize_t written = write(w->fd, data, n);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      w->err = 1;
+      return;
+    }
+    data += written;
+    n -= (size_t)written;
+  }
+#else
+  (void)data;
+  (void)n;
+  w->err = 1;
+#endif
+}
+
+static inline void pgen_writer_flush(pgen_writer *w) {
+  if (w->err | !pgen_writer_has_sink(w))
+    return;
+  if (w->len)
+    pgen_writer_sink(w, w->buf, w->len);
+  w->len = 0;
+  if (w->f && fflush(w->f))
+    w->err = 1;
+}
+
+// Makes room for at least n more bytes in the buffer.
+// Returns 0 if that's impossible. A writer with a sink may still accept the
+// bytes by writing them through with pgen_writer_sink().
+static inline int pgen_writer_grow(pgen_writer *w, size_t n) {
+  if (w->err)
+    return 0;
+  if (pgen_writer_has_sink(w)) {
+    pgen_writer_flush(w);
+    return !w->err && n <= w->cap;
+  }
+
+  size_t new_cap = w->cap ? w->cap : 256;
+  while (new_cap - w->len < n) {
+    if (new_cap > SIZE_MAX / 2)
+      return w->err = 1, 0;
+    new_cap *= 2;
+  }
+  char *new_buf = (char *)realloc(w->buf, new_cap);
+  if (!new_buf)
+    return w->err = 1, 0;
+  w->buf = new_buf;
+  w->cap = new_cap;
+  return 1;
+}
+
+static inline void pgen_write(pgen_writer *w, const void *data, size_t n) {
+  if (w->cap - w->len < n && !pgen_writer_grow(w, n)) {
+    if (!w->err && pgen_writer_has_sink(w))
+      pgen_writer_sink(w, (const char *)data, n);
+    return;
+  }
+  memcpy(w->buf + w->len, data, n);
+  w->len += n;
+}
+
+static inline void pgen_writec(pgen_writer *w, char c) {
+  if (w->len == w->cap && !pgen_writer_grow(w, 1))
+    return;
+  w->buf[w->len++] = c;
+}
+
+static inline void pgen_writes(pgen_writer *w, const char *s) {
+  pgen_write(w, s, strlen(s));
+}
+
+static inline void pgen_write_u32(pgen_writer *w, uint32_t u) {
+  pgen_write(w, &u, sizeof(uint32_t));
+}
+
+// Flushes to the sink if there is one, then frees the buffer.
+// The buffer of a memory writer is freed too, so take it first if you want it.
+static inline int pgen_writer_destroy(pgen_writer *w) {
+  pgen_writer_flush(w);
+  free(w->buf);
+  w->buf = NULL;
+  w->len = 0;
+  w->cap = 0;
+  return !w->err;
+}
+
+/*
+ * JSON helpers. Strings are arrays of codepoints (codepoint_t is int32_t),
+ * written as escaped UTF-8. Invalid codepoints are written as U+FFFD.
+ */
+static inline void pgen_write_json_string(pgen_writer *w, const int32_t *cps,
+                                          size_t len) {
+  // 0 means the character is written as is, 'u' means it's written as
+  // \u00XX, and anything else is written after a backslash.
+  static const char esc[128] = {
+      'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f',
+      'r', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+      'u', 'u', 'u', 'u', 'u', 'u', 0,   0,   '"', 0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   '\\', 0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0};
+  static const char hex[] = "0123456789abcdef";
+
+  pgen_writec(w, '"');
+  for (size_t i = 0; i < len; i++) {
+    // Every codepoint takes at most 6 bytes.
+    if (w->cap - w->len < 6 && !pgen_writer_grow(w, 6))
+      return;
+    char *out = w->buf + w->len;
+    uint32_t c = (uint32_t)cps[i];
+    if (c < 0x80) {
+      char e = esc[c];
+      if (!e) {
+        *out++ = (char)c;
+      } else if (e == 'u') {
+        memcpy(out, "\\u00", 4);
+        out[4] = hex[c >> 4];
+        out[5] = hex[c & 0xF];
+        out += 6;
+      } else {
+        *out++ = '\\';
+        *out++ = e;
+      }
+    } else {
+      if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+        c = 0xFFFD;
+      if (c < 0x800) {
+        *out++ = (char)(0xC0 | (c >> 6));
+      } else if (c < 0x10000) {
+        *out++ = (char)(0xE0 | (c >> 12));
+        *out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+      } else {
+        *out++ = (char)(0xF0 | (c >> 18));
+        *out++ = (char)(0x80 | ((c >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+      }
+      *out++ = (char)(0x80 | (c & 0x3F));
+    }
+    w->len = (size_t)(out - w->buf);
+  }
+  pgen_writec(w, '"');
+}
+
+// With pretty set, starts a new line indented to the given level.
+static inline void pgen_write_json_indent(pgen_writer *w, int pretty,
+                                          size_t level) {
+  if (!pretty)
+    return;
+  pgen_writec(w, '\n');
+  for (size_t i = 0; i < level; i++)
+    pgen_write(w, "  ", 2);
+}
+
+/*
+ * A fast non-cryptographic 64 bit hash. It reads 8 bytes at a time in
+ * native byte order, so results are only stable on machines with the same
+ * endianness.
+ */
+static inline uint64_t pgen_hash_rotl(uint64_t x, unsigned r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t pgen_hash_fmix(uint64_t h) {
+  h ^= h >> 33;
+  h *= UINT64_C(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  h *= UINT64_C(0xc4ceb9fe1a85ec53);
+  h ^= h >> 33;
+  return h;
+}
+
+static inline uint64_t pgen_hash64(const void *data, size_t len,
+                                   uint64_t seed) {
+  const uint64_t c1 = UINT64_C(0x87c37b91114253d5);
+  const uint64_t c2 = UINT64_C(0x4cf5ad432745937f);
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t h = seed ^ ((uint64_t)len * UINT64_C(0x9e3779b97f4a7c15));
+
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t k;
+    memcpy(&k, p, 8);
+    h ^= pgen_hash_rotl(k * c1, 31) * c2;
+    h = pgen_hash_rotl(h, 27) * 5 + 0x52dce729;
+  }
+
+  uint64_t k = 0;
+  for (size_t i = 0; i < len; i++)
+    k |= (uint64_t)p[i] << (8 * i);
+  h ^= pgen_hash_rotl(k * c1, 31) * c2;
+
+  return pgen_hash_fmix(h);
+}
+
+/*
+ * A read-only view of a whole file. It's mmap()ed when PGEN_USE_POSIX is
+ * enabled, and read into a malloc()ed buffer otherwise. Either way, data is
+ * aligned to at least _Alignof(max_align_t).
+ */
+typedef struct {
+  void *data;
+  size_t len;
+  int mapped;
+} pgen_mapped_file;
+
+// Returns 1 on success, 0 on failure.
+static inline int pgen_map_file(const char *path, pgen_mapped_file *out) {
+  out->data = NULL;
+  out->len = 0;
+  out->mapped = 0;
+
+#if PGEN_USE_POSIX
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size <= 0)
+    return close(fd), 0;
+  void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    return 0;
+  out->data = m;
+  out->len = (size_t)st.st_size;
+  out->mapped = 1;
+  return 1;
+#else
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return 0;
+  long flen;
+  if (fseek(f, 0, SEEK_END) || (flen = ftell(f)) <= 0 ||
+      fseek(f, 0, SEEK_SET))
+    return fclose(f), 0;
+  char *buf = (char *)malloc((size_t)flen);
+  if (!buf)
+    return fclose(f), 0;
+  if (fread(buf, 1, (size_t)flen, f) != (size_t)flen)
+    return free(buf), fclose(f), 0;
+  fclose(f);
+  out->data = buf;
+  out->len = (size_t)flen;
+  return 1;
+#endif
+}
+
+static inline void pgen_unmap_file(pgen_mapped_file *m) {
+#if PGEN_USE_POSIX
+  if (m->mapped)
+    munmap(m->data, m->len);
+  else
+    free(m->data);
+#else
+  free(m->data);
+#endif
+  m->data = NULL;
+  m->len = 0;
+  m->mapped = 0;
+}
+
+// Unmaps and frees a malloc()ed pgen_mapped_file. Suitable for pgen_defer().
+static inline void pgen_free_mapped_file(void *m) {
+  pgen_unmap_file((pgen_mapped_file *)m);
+  free(m);
+}
+
+#endif /* PGEN_IO_INCLUDED */
+
+/* END OF IO LIBRARY */
+
+
 struct bf_astnode_t;
 typedef struct bf_astnode_t bf_astnode_t;
 
@@ -706,7 +1125,8 @@ static inline bf_token bf_nextToken(bf_tokenizer* tokenizer) {
   size_t smaut_munch_size_0 = 0;
   bf_token_kind trie_tokenkind = BF_TOK_STREAMEND;
 
-  for (size_t iidx = 0; iidx < remaining; iidx++) {
+  size_t iidx = 0;
+  for (; iidx < remaining; iidx++) {
     codepoint_t c = current[iidx];
     int all_dead = 1;
 
@@ -768,7 +1188,7 @@ static inline bf_token bf_nextToken(bf_tokenizer* tokenizer) {
       all_dead = 0;
 
       if ((smaut_state_0 == 0) &
-         (!(((c >= '+') & (c <= '[')) | (c == ']') | (c == '>') | (c == '<') | (c == '.') | (c == ',')))) {
+         (!(((c >= '+') & (c <= '[')) | (c == ']')))) {
           smaut_state_0 = 1;
       }
       else {
@@ -835,6 +1255,19 @@ struct bf_parse_err {
 #ifndef BF_MAX_PARSER_ERRORS
 #define BF_MAX_PARSER_ERRORS 20
 #endif
+// How deep rules can nest before the parse stops, rather than overflowing
+// the stack. Each level is a C stack frame.
+#ifndef BF_MAX_DEPTH
+#define BF_MAX_DEPTH 4096
+#endif
+// Why a parse was stopped early by its budget or depth limit.
+typedef enum {
+  BF_ABORT_NONE,
+  BF_ABORT_STEPS,
+  BF_ABORT_DEADLINE,
+  BF_ABORT_DEPTH,
+} bf_abort_reason;
+
 typedef struct {
   bf_token* tokens;
   size_t len;
@@ -843,6 +1276,14 @@ typedef struct {
   pgen_allocator *alloc;
   size_t num_errors;
   bf_parse_err errlist[BF_MAX_PARSER_ERRORS];
+  size_t fuel; // Steps left until the budget is checked.
+  size_t fuel_given;
+  size_t steps; // Steps taken before the fuel was given.
+  size_t max_steps;
+  uint64_t deadline;
+  size_t depth;
+  size_t max_depth;
+  bf_abort_reason aborted;
 } bf_parser_ctx;
 
 static inline void bf_parser_ctx_init(bf_parser_ctx* parser,
@@ -856,14 +1297,70 @@ static inline void bf_parser_ctx_init(bf_parser_ctx* parser,
   parser->num_errors = 0;
   size_t to_zero = sizeof(bf_parse_err) * BF_MAX_PARSER_ERRORS;
   memset(&parser->errlist, 0, to_zero);
+  parser->fuel = parser->fuel_given = SIZE_MAX;
+  parser->steps = 0;
+  parser->max_steps = 0;
+  parser->deadline = 0;
+  parser->depth = 0;
+  parser->max_depth = BF_MAX_DEPTH;
+  parser->aborted = BF_ABORT_NONE;
+}
+/*
+ * Sizing hints. BF_ARENA_BYTES_PER_TOKEN is how much of its allocator a parse
+ * uses for each token, and BF_LIST_INITIAL_SIZE is how many children a new list
+ * has room for. They're guesses unless pgen was given --stats.
+ */
+#ifndef BF_ARENA_BYTES_PER_TOKEN
+#define BF_ARENA_BYTES_PER_TOKEN 64
+#endif
+#ifndef BF_LIST_INITIAL_SIZE
+#define BF_LIST_INITIAL_SIZE 16
+#endif
+
+// Allocates the arenas that parsing the parser's tokens will need, before
+// parsing, going by BF_ARENA_BYTES_PER_TOKEN.
+static inline void bf_parser_reserve(bf_parser_ctx* parser) {
+  pgen_allocator_reserve(parser->alloc, parser->len * BF_ARENA_BYTES_PER_TOKEN);
+}
+
+/*
+ * Define BF_COLLECT_STATS to 1 for a profiling run. Give each parse a new
+ * allocator and record it with bf_stats_record(), then save what
+ * bf_stats_write() writes and pass the file to pgen --stats.
+ */
+#ifndef BF_COLLECT_STATS
+#define BF_COLLECT_STATS 0
+#endif
+#if BF_COLLECT_STATS
+static size_t bf_stats_tokens, bf_stats_bytes, bf_stats_lists;
+// How many lists grew past 2^i children.
+static size_t bf_stats_outgrew[16];
+
+// Called when a list gets its nth child.
+static inline void bf_stats_child(size_t n) {
+  for (size_t i = 0; i < 16; i++)
+    if (n == ((size_t)1 << i) + 1)
+      bf_stats_outgrew[i]++;
 }
-static inline void freemsg(const char* msg, void* extra) {
-  (void)extra;
-  PGEN_FREE((void*)msg);
+
+static inline void bf_stats_record(bf_parser_ctx* parser) {
+  bf_stats_tokens += parser->len;
+  bf_stats_bytes += (size_t)parser->alloc->rew.arena_idx * PGEN_BUFFER_SIZE + parser->alloc->rew.filled;
 }
 
-static inline bf_parse_err* bf_report_parse_error(bf_parser_ctx* ctx,
-              const char* msg, void (*msgfree)(const char* msg, void* extra), int severity) {
+static inline void bf_stats_write(FILE* f) {
+  size_t per_token = 1;
+  if (bf_stats_tokens)
+    per_token = (bf_stats_bytes + bf_stats_tokens - 1) / bf_stats_tokens;
+  // Nine out of ten lists should fit in their initial size.
+  size_t i = 0;
+  while (i < 15 && bf_stats_outgrew[i] * 10 > bf_stats_lists)
+    i++;
+  fprintf(f, "arena_bytes_per_token %zu\n", per_token ? per_token : 1);
+  fprintf(f, "list_initial_size %zu\n", (size_t)1 << i);
+}
+#endif
+static inline bf_parse_err* bf_report_parse_error(bf_parser_ctx* ctx, const char* msg, int severity) {
   if (ctx->num_errors >= BF_MAX_PARSER_ERRORS) {
     ctx->exit = 1;
     return NULL;
@@ -871,7 +1368,7 @@ static inline bf_parse_err* bf_report_parse_error(bf_parser_ctx* ctx,
   bf_parse_err* err = &ctx->errlist[ctx->num_errors++];
   err->msg = (const char*)msg;
   err->severity = severity;
-  size_t toknum = ctx->pos + (ctx->pos != ctx->len - 1);
+  size_t toknum = ctx->pos;
   bf_token tok = ctx->tokens[toknum];
   err->line = tok.line;
   err->col = tok.col;
@@ -881,6 +1378,75 @@ static inline bf_parse_err* bf_report_parse_error(bf_parser_ctx* ctx,
   return err;
 }
 
+#include <time.h>
+
+/*
+ * Parse budgets. Every rule call and every iteration of a loop is a step, and
+ * takes one unit of fuel. The budget is only checked when the fuel runs out,
+ * so with no budget set a step costs a decrement. With a deadline, the clock
+ * is read every BF_DEADLINE_INTERVAL steps. A parse that runs over stops as if
+ * by FATAL(), with ctx->aborted saying why.
+ */
+#ifndef BF_DEADLINE_INTERVAL
+#define BF_DEADLINE_INTERVAL 4096
+#endif
+
+static inline uint64_t bf_parser_clock(void) {
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+  timespec_get(&ts, TIME_UTC);
+#endif
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// The number of steps the parser has taken.
+static inline size_t bf_parser_steps(bf_parser_ctx* ctx) {
+  return ctx->steps + (ctx->fuel_given - ctx->fuel);
+}
+
+// Called when the fuel runs out. Returns 1 if the parse has to stop.
+static inline int bf_parser_refuel(bf_parser_ctx* ctx) {
+  ctx->steps += ctx->fuel_given;
+  ctx->fuel = ctx->fuel_given = 0;
+  // The step that ran out of fuel has been counted, so a parse that used up
+  // exactly max_steps steps is still within budget.
+  if (ctx->max_steps && ctx->steps > ctx->max_steps)
+    ctx->aborted = BF_ABORT_STEPS;
+  else if (ctx->deadline && bf_parser_clock() >= ctx->deadline)
+    ctx->aborted = BF_ABORT_DEADLINE;
+  if (ctx->aborted) {
+    bf_report_parse_error(ctx, ctx->aborted == BF_ABORT_STEPS ?
+        "Parse step budget exceeded." : "Parse deadline passed.", 3);
+    ctx->exit = 1;
+    return 1;
+  }
+  size_t fuel = ctx->deadline ? BF_DEADLINE_INTERVAL : SIZE_MAX;
+  // Run out on the first step past the budget.
+  if (ctx->max_steps && ctx->max_steps - ctx->steps < fuel - 1)
+    fuel = ctx->max_steps - ctx->steps + 1;
+  ctx->fuel = ctx->fuel_given = fuel;
+  return 0;
+}
+
+// Limits the parse to max_steps steps, and to max_ns nanoseconds from now.
+// Zero means no limit.
+static inline void bf_parser_set_budget(bf_parser_ctx* ctx, size_t max_steps, uint64_t max_ns) {
+  ctx->steps = bf_parser_steps(ctx);
+  ctx->max_steps = max_steps;
+  ctx->deadline = max_ns ? bf_parser_clock() + max_ns : 0;
+  // The next step refuels, which checks the new budget.
+  ctx->fuel = ctx->fuel_given = 1;
+}
+
+// Called when rules nest deeper than ctx->max_depth.
+static inline void bf_parser_too_deep(bf_parser_ctx* ctx) {
+  ctx->aborted = BF_ABORT_DEPTH;
+  bf_report_parse_error(ctx, "Input is nested too deeply.", 3);
+  ctx->exit = 1;
+}
+
 typedef enum {
   BF_NODE_PLUS,
   BF_NODE_MINUS,
@@ -923,11 +1489,21 @@ struct bf_astnode_t {
 #define PGEN_MIN3(a, b, c) PGEN_MIN(a, PGEN_MIN2(b, c))
 #define PGEN_MIN4(a, b, c, d) PGEN_MIN(a, PGEN_MIN3(b, c, d))
 #define PGEN_MIN5(a, b, c, d, e) PGEN_MIN(a, PGEN_MIN4(b, c, d, e))
+#define PGEN_MIN6(a, b, c, d, e, f) PGEN_MIN(a, PGEN_MIN5(b, c, d, e, f))
+#define PGEN_MIN7(a, b, c, d, e, f, g) PGEN_MIN(a, PGEN_MIN6(b, c, d, e, f, g))
+#define PGEN_MIN8(a, b, c, d, e, f, g, h) PGEN_MIN(a, PGEN_MIN7(b, c, d, e, f, g, h))
+#define PGEN_MIN9(a, b, c, d, e, f, g, h, i) PGEN_MIN(a, PGEN_MIN8(b, c, d, e, f, g, h, i))
+#define PGEN_MIN10(a, b, c, d, e, f, g, h, i, j) PGEN_MIN(a, PGEN_MIN9(b, c, d, e, f, g, h, i, j))
 #define PGEN_MAX1(a) a
 #define PGEN_MAX2(a, b) PGEN_MAX(a, PGEN_MAX1(b))
 #define PGEN_MAX3(a, b, c) PGEN_MAX(a, PGEN_MAX2(b, c))
 #define PGEN_MAX4(a, b, c, d) PGEN_MAX(a, PGEN_MAX3(b, c, d))
 #define PGEN_MAX5(a, b, c, d, e) PGEN_MAX(a, PGEN_MAX4(b, c, d, e))
+#define PGEN_MAX6(a, b, c, d, e, f) PGEN_MAX(a, PGEN_MAX5(b, c, d, e, f))
+#define PGEN_MAX7(a, b, c, d, e, f, g) PGEN_MAX(a, PGEN_MAX6(b, c, d, e, f, g))
+#define PGEN_MAX8(a, b, c, d, e, f, g, h) PGEN_MAX(a, PGEN_MAX7(b, c, d, e, f, g, h))
+#define PGEN_MAX9(a, b, c, d, e, f, g, h, i) PGEN_MAX(a, PGEN_MAX8(b, c, d, e, f, g, h, i))
+#define PGEN_MAX10(a, b, c, d, e, f, g, h, i, j) PGEN_MAX(a, PGEN_MAX9(b, c, d, e, f, g, h, i, j))
 #define PGEN_MAX(a, b) ((a) > (b) ? (a) : (b))
 #define PGEN_MIN(a, b) ((a) ? ((a) > (b) ? (b) : (a)) : (b))
 
@@ -941,7 +1517,14 @@ static inline bf_astnode_t* bf_astnode_list(
                          _Alignof(bf_astnode_t));
   bf_astnode_t *node = (bf_astnode_t*)ret;
 
+#if BF_COLLECT_STATS
+  bf_stats_lists++;
+#endif
   bf_astnode_t **children;
+  // max_children is a uint16_t, and UINT16_MAX marks a big list. 32768 is
+  // the most it can hold that doubles into one.
+  if (initial_size > 32768)
+    initial_size = 32768;
   if (initial_size) {
     children = (bf_astnode_t**)PGEN_MALLOC(sizeof(bf_astnode_t*) * initial_size);
     if (!children) PGEN_OOM();
@@ -1118,26 +1701,321 @@ static inline bf_astnode_t* bf_astnode_fixed_5(
   return node;
 }
 
+static inline bf_astnode_t* bf_astnode_fixed_6(
+                             pgen_allocator* alloc,
+                             bf_astnode_kind kind,
+                             bf_astnode_t* PGEN_RESTRICT n0,
+                             bf_astnode_t* PGEN_RESTRICT n1,
+                             bf_astnode_t* PGEN_RESTRICT n2,
+                             bf_astnode_t* PGEN_RESTRICT n3,
+                             bf_astnode_t* PGEN_RESTRICT n4,
+                             bf_astnode_t* PGEN_RESTRICT n5) {
+  char* ret = pgen_alloc(alloc,
+                         sizeof(bf_astnode_t) +
+                         sizeof(bf_astnode_t *) * 6,
+                         _Alignof(bf_astnode_t));
+  bf_astnode_t *node = (bf_astnode_t *)ret;
+  bf_astnode_t **children = (bf_astnode_t **)(node + 1);
+  node->kind = kind;
+  node->parent = NULL;
+  node->max_children = 0;
+  node->num_children = 6;
+  node->children = children;
+  node->tok_repr = NULL;
+  node->repr_len = 0;
+  children[0] = n0;
+  n0->parent = node;
+  children[1] = n1;
+  n1->parent = node;
+  children[2] = n2;
+  n2->parent = node;
+  children[3] = n3;
+  n3->parent = node;
+  children[4] = n4;
+  n4->parent = node;
+  children[5] = n5;
+  n5->parent = node;
+  return node;
+}
+
+static inline bf_astnode_t* bf_astnode_fixed_7(
+                             pgen_allocator* alloc,
+                             bf_astnode_kind kind,
+                             bf_astnode_t* PGEN_RESTRICT n0,
+                             bf_astnode_t* PGEN_RESTRICT n1,
+                             bf_astnode_t* PGEN_RESTRICT n2,
+                             bf_astnode_t* PGEN_RESTRICT n3,
+                             bf_astnode_t* PGEN_RESTRICT n4,
+                             bf_astnode_t* PGEN_RESTRICT n5,
+                             bf_astnode_t* PGEN_RESTRICT n6) {
+  char* ret = pgen_alloc(alloc,
+                         sizeof(bf_astnode_t) +
+                         sizeof(bf_astnode_t *) * 7,
+                         _Alignof(bf_astnode_t));
+  bf_astnode_t *node = (bf_astnode_t *)ret;
+  bf_astnode_t **children = (bf_astnode_t **)(node + 1);
+  node->kind = kind;
+  node->parent = NULL;
+  node->max_children = 0;
+  node->num_children = 7;
+  node->children = children;
+  node->tok_repr = NULL;
+  node->repr_len = 0;
+  children[0] = n0;
+  n0->parent = node;
+  children[1] = n1;
+  n1->parent = node;
+  children[2] = n2;
+  n2->parent = node;
+  children[3] = n3;
+  n3->parent = node;
+  children[4] = n4;
+  n4->parent = node;
+  children[5] = n5;
+  n5->parent = node;
+  children[6] = n6;
+  n6->parent = node;
+  return node;
+}
+
+static inline bf_astnode_t* bf_astnode_fixed_8(
+                             pgen_allocator* alloc,
+                             bf_astnode_kind kind,
+                             bf_astnode_t* PGEN_RESTRICT n0,
+                             bf_astnode_t* PGEN_RESTRICT n1,
+                             bf_astnode_t* PGEN_RESTRICT n2,
+                             bf_astnode_t* PGEN_RESTRICT n3,
+                             bf_astnode_t* PGEN_RESTRICT n4,
+                             bf_astnode_t* PGEN_RESTRICT n5,
+                             bf_astnode_t* PGEN_RESTRICT n6,
+                             bf_astnode_t* PGEN_RESTRICT n7) {
+  char* ret = pgen_alloc(alloc,
+                         sizeof(bf_astnode_t) +
+                         sizeof(bf_astnode_t *) * 8,
+                         _Alignof(bf_astnode_t));
+  bf_astnode_t *node = (bf_astnode_t *)ret;
+  bf_astnode_t **children = (bf_astnode_t **)(node + 1);
+  node->kind = kind;
+  node->parent = NULL;
+  node->max_children = 0;
+  node->num_children = 8;
+  node->children = children;
+  node->tok_repr = NULL;
+  node->repr_len = 0;
+  children[0] = n0;
+  n0->parent = node;
+  children[1] = n1;
+  n1->parent = node;
+  children[2] = n2;
+  n2->parent = node;
+  children[3] = n3;
+  n3->parent = node;
+  children[4] = n4;
+  n4->parent = node;
+  children[5] = n5;
+  n5->parent = node;
+  children[6] = n6;
+  n6->parent = node;
+  children[7] = n7;
+  n7->parent = node;
+  return node;
+}
+
+static inline bf_astnode_t* bf_astnode_fixed_9(
+                             pgen_allocator* alloc,
+                             bf_astnode_kind kind,
+                             bf_astnode_t* PGEN_RESTRICT n0,
+                             bf_astnode_t* PGEN_RESTRICT n1,
+                             bf_astnode_t* PGEN_RESTRICT n2,
+                             bf_astnode_t* PGEN_RESTRICT n3,
+                             bf_astnode_t* PGEN_RESTRICT n4,
+                             bf_astnode_t* PGEN_RESTRICT n5,
+                             bf_astnode_t* PGEN_RESTRICT n6,
+                             bf_astnode_t* PGEN_RESTRICT n7,
+                             bf_astnode_t* PGEN_RESTRICT n8) {
+  char* ret = pgen_alloc(alloc,
+                         sizeof(bf_astnode_t) +
+                         sizeof(bf_astnode_t *) * 9,
+                         _Alignof(bf_astnode_t));
+  bf_astnode_t *node = (bf_astnode_t *)ret;
+  bf_astnode_t **children = (bf_astnode_t **)(node + 1);
+  node->kind = kind;
+  node->parent = NULL;
+  node->max_children = 0;
+  node->num_children = 9;
+  node->children = children;
+  node->tok_repr = NULL;
+  node->repr_len = 0;
+  children[0] = n0;
+  n0->parent = node;
+  children[1] = n1;
+  n1->parent = node;
+  children[2] = n2;
+  n2->parent = node;
+  children[3] = n3;
+  n3->parent = node;
+  children[4] = n4;
+  n4->parent = node;
+  children[5] = n5;
+  n5->parent = node;
+  children[6] = n6;
+  n6->parent = node;
+  children[7] = n7;
+  n7->parent = node;
+  children[8] = n8;
+  n8->parent = node;
+  return node;
+}
+
+static inline bf_astnode_t* bf_astnode_fixed_10(
+                             pgen_allocator* alloc,
+                             bf_astnode_kind kind,
+                             bf_astnode_t* PGEN_RESTRICT n0,
+                             bf_astnode_t* PGEN_RESTRICT n1,
+                             bf_astnode_t* PGEN_RESTRICT n2,
+                             bf_astnode_t* PGEN_RESTRICT n3,
+                             bf_astnode_t* PGEN_RESTRICT n4,
+                             bf_astnode_t* PGEN_RESTRICT n5,
+                             bf_astnode_t* PGEN_RESTRICT n6,
+                             bf_astnode_t* PGEN_RESTRICT n7,
+                             bf_astnode_t* PGEN_RESTRICT n8,
+                             bf_astnode_t* PGEN_RESTRICT n9) {
+  char* ret = pgen_alloc(alloc,
+                         sizeof(bf_astnode_t) +
+                         sizeof(bf_astnode_t *) * 10,
+                         _Alignof(bf_astnode_t));
+  bf_astnode_t *node = (bf_astnode_t *)ret;
+  bf_astnode_t **children = (bf_astnode_t **)(node + 1);
+  node->kind = kind;
+  node->parent = NULL;
+  node->max_children = 0;
+  node->num_children = 10;
+  node->children = children;
+  node->tok_repr = NULL;
+  node->repr_len = 0;
+  children[0] = n0;
+  n0->parent = node;
+  children[1] = n1;
+  n1->parent = node;
+  children[2] = n2;
+  n2->parent = node;
+  children[3] = n3;
+  n3->parent = node;
+  children[4] = n4;
+  n4->parent = node;
+  children[5] = n5;
+  n5->parent = node;
+  children[6] = n6;
+  n6->parent = node;
+  children[7] = n7;
+  n7->parent = node;
+  children[8] = n8;
+  n8->parent = node;
+  children[9] = n9;
+  n9->parent = node;
+  return node;
+}
+
+// A list with more than UINT16_MAX - 1 children keeps them in chunks of
+// 65536. The first chunk is where a small list keeps its children, so code
+// that only looks at num_children still sees the first of them. A big list
+// has max_children == UINT16_MAX, and its num_children stops there.
+typedef struct {
+  size_t num_children;
+  size_t num_chunks;
+  bf_astnode_t*** chunks;
+  bf_astnode_t* first[65536];
+} bf_astnode_biglist;
+
+static inline bf_astnode_biglist* bf_astnode_biglist_of(bf_astnode_t* list) {
+  char* first = (char*)list->children;
+  return (bf_astnode_biglist*)(void*)(first - offsetof(bf_astnode_biglist, first));
+}
+
+static inline void bf_astnode_biglist_free(void* ptr) {
+  bf_astnode_biglist* big = (bf_astnode_biglist*)ptr;
+  for (size_t i = 1; i < big->num_chunks; i++)
+    free(big->chunks[i]);
+  free(big->chunks);
+  free(big);
+}
+
+static inline size_t bf_astnode_num_children(bf_astnode_t* node) {
+  if (node->max_children == UINT16_MAX)
+    return bf_astnode_biglist_of(node)->num_children;
+  return node->num_children;
+}
+
+static inline bf_astnode_t* bf_astnode_child(bf_astnode_t* node, size_t i) {
+  if (i < 65536)
+    return node->children[i];
+  return bf_astnode_biglist_of(node)->chunks[i >> 16][i & 65535];
+}
+
 static inline void bf_astnode_add(pgen_allocator* alloc, bf_astnode_t *list, bf_astnode_t *node) {
+  node->parent = list;
+#if BF_COLLECT_STATS
+  bf_stats_child(bf_astnode_num_children(list) + 1);
+#endif
+  if (list->max_children == UINT16_MAX) {
+    bf_astnode_biglist* big = bf_astnode_biglist_of(list);
+    size_t i = big->num_children;
+    if (!(i & 65535)) {
+      size_t chunks_bytes = sizeof(bf_astnode_t**) * (big->num_chunks + 1);
+      void* chunks = realloc(big->chunks, chunks_bytes);
+      if (!chunks) PGEN_OOM();
+      big->chunks = (bf_astnode_t***)chunks;
+      big->chunks[big->num_chunks] = (bf_astnode_t**)malloc(sizeof(bf_astnode_t*) * 65536);
+      if (!big->chunks[big->num_chunks]) PGEN_OOM();
+      big->num_chunks++;
+    }
+    big->chunks[i >> 16][i & 65535] = node;
+    big->num_children = i + 1;
+    if (list->num_children < UINT16_MAX)
+      list->num_children++;
+    return;
+  }
+
   if (list->max_children == list->num_children) {
-    // Figure out the new size. Check for overflow where applicable.
-    uint64_t new_max = (uint64_t)list->max_children * 2;
-    if (new_max > UINT16_MAX || new_max > SIZE_MAX) PGEN_OOM();
-    if (SIZE_MAX < UINT16_MAX && (size_t)new_max > SIZE_MAX / sizeof(bf_astnode_t)) PGEN_OOM();
-    size_t new_bytes = (size_t)new_max * sizeof(bf_astnode_t);
+    size_t new_max = list->max_children ? (size_t)list->max_children * 2 : 16;
+    if (new_max > UINT16_MAX) {
+      // Move the children into the first chunk of a big list.
+      bf_astnode_biglist* big = (bf_astnode_biglist*)malloc(sizeof(bf_astnode_biglist));
+      if (!big) PGEN_OOM();
+      big->chunks = (bf_astnode_t***)malloc(sizeof(bf_astnode_t**));
+      if (!big->chunks) PGEN_OOM();
+      big->chunks[0] = big->first;
+      big->num_chunks = 1;
+      big->num_children = list->num_children;
+      void* old_ptr = list->children;
+      memcpy(big->first, old_ptr, sizeof(bf_astnode_t*) * list->num_children);
+      pgen_allocator_realloced(alloc, old_ptr, big, bf_astnode_biglist_free);
+      free(old_ptr);
+      list->children = big->first;
+      list->max_children = UINT16_MAX;
+      bf_astnode_add(alloc, list, node);
+      return;
+    }
 
-    // Reallocate the list, and inform the allocator.
+    // Move the children to a bigger buffer, and inform the allocator. The old
+    // buffer is replaced before it's freed, so it's never looked at after.
     void* old_ptr = list->children;
-    void* new_ptr = realloc(list->children, new_bytes);
+    void* new_ptr = malloc(sizeof(bf_astnode_t*) * new_max);
     if (!new_ptr) PGEN_OOM();
+    if (old_ptr) {
+      memcpy(new_ptr, old_ptr, sizeof(bf_astnode_t*) * list->num_children);
+      pgen_allocator_realloced(alloc, old_ptr, new_ptr, free);
+      free(old_ptr);
+    } else {
+      // A list made with no room has nothing to replace. The buffer lives as
+      // long as the first child, which was allocated before alloc->rew.
+      pgen_defer(alloc, free, new_ptr, alloc->rew);
+    }
     list->children = (bf_astnode_t **)new_ptr;
     list->max_children = (uint16_t)new_max;
-    pgen_allocator_realloced(alloc, old_ptr, new_ptr, free);
   }
-  node->parent = list;
   list->children[list->num_children++] = node;
 }
-
 static inline void bf_parser_rewind(bf_parser_ctx *ctx, pgen_parser_rewind_t rew) {
   pgen_allocator_rewind(ctx->alloc, rew.arew);
   ctx->pos = rew.prew;
@@ -1172,10 +2050,11 @@ static inline int bf_node_print_content(bf_astnode_t* node, bf_token* tokens) {
   if (node->tok_repr && node->repr_len) {
     utf32 = node->tok_repr;
     utf32len = node->repr_len;
-    int success = UTF8_encode(node->tok_repr, node->repr_len, &utf8, &utf8len);
+    int success = UTF8_encode(utf32, utf32len, &utf8, &utf8len);
     if (success) {
       for (size_t i = 0; i < utf8len; i++)
         if (utf8[i] == '\n') fputc('\\', stdout), fputc('n', stdout);
+        else if (utf8[i] == '"') fputc('\\', stdout), fputc(utf8[i], stdout);
         else fputc(utf8[i], stdout);
       return PGEN_FREE(utf8), 1;
     }
@@ -1199,13 +2078,13 @@ static inline int bf_astnode_print_h(bf_token* tokens, bf_astnode_t *node, size_
     bf_node_print_content(node, tokens);
     printf("\",\n");
   }
-  size_t cnum = node->num_children;
+  size_t cnum = bf_astnode_num_children(node);
   if (cnum) {
     indent(); printf("\"num_children\": %zu,\n", cnum);
     indent(); printf("\"children\": [");
     putchar('\n');
     for (size_t i = 0; i < cnum; i++)
-      bf_astnode_print_h(tokens, node->children[i], depth + 1, i == cnum - 1);
+      bf_astnode_print_h(tokens, bf_astnode_child(node, i), depth + 1, i == cnum - 1);
     indent();
     printf("]\n");
   }
@@ -1219,13 +2098,586 @@ static inline void bf_astnode_print_json(bf_token* tokens, bf_astnode_t *node) {
   if (node)    bf_astnode_print_h(tokens, node, 0, 1);
   else    puts("The AST is null.");}
 
+/*
+ * Writes the AST as JSON. Each node is an object with a "kind", a "content"
+ * string if it has a tok_repr, and a "children" array if it has children.
+ * NULL nodes are written as null. With pretty set, the output is indented.
+ * The writer flushes to its sink as it fills up, so output streams.
+ * Returns 1 on success, 0 on failure.
+ */
+static inline int bf_astnode_write_json(pgen_writer* w, bf_astnode_t* root, int pretty) {
+  typedef struct {
+    bf_astnode_t* node;
+    size_t next;
+  } frame;
+  const uintptr_t succ = (uintptr_t)_Alignof(bf_astnode_t);
+  const char* sep = pretty ? ": " : ":";
+  size_t cap = 64, depth = 0;
+  frame* stack = (frame*)malloc(sizeof(frame) * cap);
+  if (!stack) return 0;
+
+  bf_astnode_t* node = root;
+  while (1) {
+    // Write the node. If it has children, open the array and descend.
+    if ((uintptr_t)node <= succ) {
+      pgen_write(w, "null", 4);
+    } else {
+      pgen_writec(w, '{');
+      pgen_write_json_indent(w, pretty, depth * 2 + 1);
+      pgen_write(w, "\"kind\"", 6);
+      pgen_writes(w, sep);
+      pgen_writec(w, '"');
+      pgen_writes(w, bf_nodekind_name[node->kind]);
+      pgen_writec(w, '"');
+      if (node->tok_repr || node->repr_len) {
+        pgen_writec(w, ',');
+        pgen_write_json_indent(w, pretty, depth * 2 + 1);
+        pgen_write(w, "\"content\"", 9);
+        pgen_writes(w, sep);
+        pgen_write_json_string(w, node->tok_repr, node->tok_repr ? node->repr_len : 0);
+      }
+      if (node->num_children) {
+        pgen_writec(w, ',');
+        pgen_write_json_indent(w, pretty, depth * 2 + 1);
+        pgen_write(w, "\"children\"", 10);
+        pgen_writes(w, sep);
+        pgen_writec(w, '[');
+        if (depth == cap) {
+          void* new_stack = realloc(stack, sizeof(frame) * (cap *= 2));
+          if (!new_stack) return free(stack), 0;
+          stack = (frame*)new_stack;
+        }
+        stack[depth].node = node;
+        stack[depth].next = 0;
+        depth++;
+        pgen_write_json_indent(w, pretty, depth * 2);
+        node = bf_astnode_child(node, 0);
+        continue;
+      }
+      pgen_write_json_indent(w, pretty, depth * 2);
+      pgen_writec(w, '}');
+    }
+
+    // Move on to the next sibling, closing every finished parent.
+    node = NULL;
+    while (depth) {
+      frame* top = stack + depth - 1;
+      if (++top->next < bf_astnode_num_children(top->node)) {
+        pgen_writec(w, ',');
+        pgen_write_json_indent(w, pretty, depth * 2);
+        node = bf_astnode_child(top->node, top->next);
+        break;
+      }
+      depth--;
+      pgen_write_json_indent(w, pretty, depth * 2 + 1);
+      pgen_writec(w, ']');
+      pgen_write_json_indent(w, pretty, depth * 2);
+      pgen_writec(w, '}');
+    }
+    if (!depth && !node) break;
+  }
+  if (pretty) pgen_writec(w, '\n');
+  free(stack);
+  return !w->err;
+}
+
+/*
+ * Walks the AST depth first, with a stack on the heap instead of recursion,
+ * so deep trees can't overflow the C stack. pre is called on each node before
+ * its children, and post after them. Either may be NULL. NULL children are
+ * skipped. The next sibling of each node is prefetched while the node and its
+ * children are visited.
+ */
+typedef enum {
+  BF_WALK_CONTINUE,
+  // Don't visit the children of this node. Only meaningful from pre.
+  BF_WALK_SKIP,
+  // End the walk.
+  BF_WALK_STOP,
+} bf_walk_action;
+
+typedef bf_walk_action (*bf_walk_fn)(bf_astnode_t* node, void* user);
+
+// Returns 1 if the whole tree was walked, 0 if a callback stopped the walk or
+// memory ran out.
+static inline int bf_astnode_walk(bf_astnode_t* root, bf_walk_fn pre, bf_walk_fn post, void* user) {
+  typedef struct {
+    bf_astnode_t* node;
+    size_t next;
+    size_t num;
+  } frame;
+  const uintptr_t succ = (uintptr_t)_Alignof(bf_astnode_t);
+  size_t cap = 64, depth = 0;
+  frame* stack = (frame*)malloc(sizeof(frame) * cap);
+  if (!stack) return 0;
+
+  bf_astnode_t* node = root;
+  while (1) {
+    if ((uintptr_t)node > succ) {
+      bf_walk_action act = pre ? pre(node, user) : BF_WALK_CONTINUE;
+      if (act == BF_WALK_STOP) return free(stack), 0;
+      size_t num = act == BF_WALK_SKIP ? 0 : bf_astnode_num_children(node);
+      if (num) {
+        if (depth == cap) {
+          void* new_stack = realloc(stack, sizeof(frame) * (cap *= 2));
+          if (!new_stack) return free(stack), 0;
+          stack = (frame*)new_stack;
+        }
+        stack[depth].node = node;
+        stack[depth].next = 0;
+        stack[depth].num = num;
+        depth++;
+        if (num > 1) PGEN_PREFETCH(bf_astnode_child(node, 1));
+        node = bf_astnode_child(node, 0);
+        continue;
+      }
+      if (post && post(node, user) == BF_WALK_STOP) return free(stack), 0;
+    }
+
+    // Move on to the next sibling, finishing every parent on the way up.
+    node = NULL;
+    while (depth) {
+      frame* top = stack + depth - 1;
+      if (++top->next < top->num) {
+        if (top->next + 1 < top->num)
+          PGEN_PREFETCH(bf_astnode_child(top->node, top->next + 1));
+        node = bf_astnode_child(top->node, top->next);
+        break;
+      }
+      depth--;
+      if (post && post(top->node, user) == BF_WALK_STOP) return free(stack), 0;
+    }
+    if (!depth && !node) break;
+  }
+  free(stack);
+  return 1;
+}
+
+// Callbacks for each kind of node, indexed by kind, for bf_astnode_visit().
+// Nodes of kinds without a callback are walked through. user is passed to
+// every callback.
+typedef struct {
+  bf_walk_fn pre[BF_NUM_NODEKINDS];
+  bf_walk_fn post[BF_NUM_NODEKINDS];
+  void* user;
+} bf_visitor;
+
+static inline bf_walk_action bf_visitor_pre(bf_astnode_t* node, void* v) {
+  bf_walk_fn fn = ((bf_visitor*)v)->pre[node->kind];
+  return fn ? fn(node, ((bf_visitor*)v)->user) : BF_WALK_CONTINUE;
+}
+
+static inline bf_walk_action bf_visitor_post(bf_astnode_t* node, void* v) {
+  bf_walk_fn fn = ((bf_visitor*)v)->post[node->kind];
+  return fn ? fn(node, ((bf_visitor*)v)->user) : BF_WALK_CONTINUE;
+}
+
+// Walks the tree, calling the visitor's callbacks for the kind of each node.
+static inline int bf_astnode_visit(bf_astnode_t* root, bf_visitor* visitor) {
+  return bf_astnode_walk(root, bf_visitor_pre, bf_visitor_post, visitor);
+}
+/*
+ * Copies a finished AST into one block of memory, in depth first order, so
+ * that it takes no more space than it needs and is read front to back when
+ * it's walked. The block is freed along with out. Every node in the copy is
+ * fixed, so children can't be added to it.
+ * Token contents are copied too, so the copy doesn't depend on the tokens or
+ * on the parser's allocator, which may be destroyed.
+ * %extra fields are copied as they are. Whatever they point to has to be kept
+ * alive by the caller.
+ */
+static inline size_t bf_ast_compact_nodesize(size_t num_children) {
+  size_t size = sizeof(bf_astnode_t);
+  if (num_children < UINT16_MAX) {
+    size += sizeof(bf_astnode_t*) * num_children;
+  } else {
+    size_t num_chunks = (num_children + 65535) / 65536;
+    size += sizeof(bf_astnode_biglist) + sizeof(bf_astnode_t**) * num_chunks +
+            sizeof(bf_astnode_t*) * (num_children - 65536);
+  }
+  return pgen_align(size, _Alignof(bf_astnode_t));
+}
+
+static inline bf_walk_action bf_ast_compact_size(bf_astnode_t* node, void* user) {
+  size_t* size = (size_t*)user;
+  size[0] += bf_ast_compact_nodesize(bf_astnode_num_children(node));
+  if (node->tok_repr) size[1] += node->repr_len;
+  return BF_WALK_CONTINUE;
+}
+
+// Copies one node to *at, with room for its children after it, and returns
+// the copy. The children are filled in later.
+static inline bf_astnode_t* bf_ast_compact_node(bf_astnode_t* node, bf_astnode_t* parent, char** at, codepoint_t** text) {
+  size_t num = bf_astnode_num_children(node);
+  bf_astnode_t* copy = (bf_astnode_t*)(void*)*at;
+  *at += bf_ast_compact_nodesize(num);
+  *copy = *node;
+  copy->parent = parent;
+  if (num < UINT16_MAX) {
+    copy->max_children = 0;
+    copy->num_children = (uint16_t)num;
+    copy->children = num ? (bf_astnode_t**)(copy + 1) : NULL;
+  } else {
+    bf_astnode_biglist* big = (bf_astnode_biglist*)(void*)(copy + 1);
+    copy->children = big->first;
+    copy->max_children = UINT16_MAX;
+    copy->num_children = UINT16_MAX;
+    big->num_children = num;
+    big->num_chunks = (num + 65535) / 65536;
+    big->chunks = (bf_astnode_t***)(void*)(big + 1);
+    bf_astnode_t** rest = (bf_astnode_t**)(void*)(big->chunks + big->num_chunks);
+    big->chunks[0] = big->first;
+    for (size_t i = 1; i < big->num_chunks; i++)
+      big->chunks[i] = rest + (i - 1) * 65536;
+  }
+  if (node->tok_repr) {
+    memcpy(*text, node->tok_repr, sizeof(codepoint_t) * node->repr_len);
+    copy->tok_repr = *text;
+    *text += node->repr_len;
+  }
+  return copy;
+}
+
+// Returns the copy of root, or NULL if root is NULL.
+static inline bf_astnode_t* bf_ast_compact(bf_astnode_t* root, pgen_allocator* out) {
+  typedef struct {
+    bf_astnode_t* node;
+    bf_astnode_t* copy;
+    size_t next;
+    size_t num;
+  } frame;
+  if (!root) return NULL;
+  size_t size[2] = {0, 0};
+  frame* stack = (frame*)malloc(sizeof(frame) * 64);
+  char* block = NULL;
+  if (stack && bf_astnode_walk(root, bf_ast_compact_size, NULL, size))
+    block = (char*)PGEN_MALLOC(size[0] + sizeof(codepoint_t) * size[1]);
+  if (!stack | !block) PGEN_OOM();
+  pgen_defer(out, PGEN_FREE, block, out->rew);
+
+  char* at = block;
+  codepoint_t* text = (codepoint_t*)(void*)(block + size[0]);
+  size_t cap = 64, depth = 1;
+  bf_astnode_t* ret = bf_ast_compact_node(root, NULL, &at, &text);
+  stack[0].node = root;
+  stack[0].copy = ret;
+  stack[0].next = 0;
+  stack[0].num = bf_astnode_num_children(root);
+  while (depth) {
+    frame* top = stack + depth - 1;
+    if (top->next == top->num) {
+      depth--;
+      continue;
+    }
+    size_t i = top->next++;
+    bf_astnode_t* child = bf_astnode_child(top->node, i);
+    bf_astnode_t** slot = i < 65536 ? top->copy->children + i
+                                    : bf_astnode_biglist_of(top->copy)->chunks[i >> 16] + (i & 65535);
+    if (!child) {
+      *slot = NULL;
+      continue;
+    }
+    *slot = bf_ast_compact_node(child, top->copy, &at, &text);
+    size_t num = bf_astnode_num_children(child);
+    if (!num) continue;
+    if (depth == cap) {
+      void* new_stack = realloc(stack, sizeof(frame) * (cap *= 2));
+      if (!new_stack) PGEN_OOM();
+      stack = (frame*)new_stack;
+    }
+    stack[depth].node = child;
+    stack[depth].copy = *slot;
+    stack[depth].next = 0;
+    stack[depth].num = num;
+    depth++;
+  }
+  free(stack);
+  return ret;
+}
+/*
+ * Binary AST format. Every field is a native endian uint32_t.
+ *
+ * Header:
+ *   magic, version, number of node kinds, grammar fingerprint (low word,
+ *   then high word), number of nodes, pool length
+ * Node records, in breadth first order, root first:
+ *   kind, num_children, first_child, repr_off, repr_len
+ * Pool:
+ *   The codepoints of every node's tok_repr, back to back.
+ *
+ * The children of a node are the records first_child through
+ * first_child + num_children - 1. A NULL child has kind BF_AST_NULL.
+ * A NULL tok_repr has repr_off BF_AST_NULL. Offsets are indices, not
+ * pointers, so the format is position independent. %extra data is not
+ * stored.
+ */
+#define BF_AST_MAGIC 0x54534750u
+#define BF_AST_VERSION 2u
+#define BF_AST_NULL UINT32_MAX
+#define BF_AST_HEADER_WORDS 7u
+#define BF_AST_RECORD_WORDS 5u
+
+// Returns 1 on success, 0 on failure.
+static inline int bf_astnode_serialize(bf_astnode_t* root, pgen_writer* w) {
+  const uintptr_t succ = (uintptr_t)_Alignof(bf_astnode_t);
+  size_t cap = 256, len = 0;
+  uint64_t pool_len = 0;
+  bf_astnode_t** order = (bf_astnode_t**)malloc(sizeof(bf_astnode_t*) * cap);
+  if (!order) return 0;
+  order[len++] = root;
+
+  // Lay the tree out breadth first, so that siblings are contiguous.
+  for (size_t i = 0; i < len; i++) {
+    bf_astnode_t* node = order[i];
+    if ((uintptr_t)node <= succ) continue;
+    if (node->tok_repr) pool_len += node->repr_len;
+    if (node->repr_len > UINT32_MAX) goto fail;
+    size_t nc = bf_astnode_num_children(node);
+    if (cap - len < nc) {
+      while (cap - len < nc) cap *= 2;
+      void* new_order = realloc(order, sizeof(bf_astnode_t*) * cap);
+      if (!new_order) goto fail;
+      order = (bf_astnode_t**)new_order;
+    }
+    for (size_t c = 0; c < nc; c++)
+      order[len++] = bf_astnode_child(node, c);
+  }
+  if (len >= UINT32_MAX || pool_len >= UINT32_MAX) goto fail;
+
+  pgen_write_u32(w, BF_AST_MAGIC);
+  pgen_write_u32(w, BF_AST_VERSION);
+  pgen_write_u32(w, BF_NUM_NODEKINDS);
+  pgen_write_u32(w, (uint32_t)BF_GRAMMAR_FINGERPRINT);
+  pgen_write_u32(w, (uint32_t)(BF_GRAMMAR_FINGERPRINT >> 32));
+  pgen_write_u32(w, (uint32_t)len);
+  pgen_write_u32(w, (uint32_t)pool_len);
+
+  uint32_t next_child = 1, repr_off = 0;
+  for (size_t i = 0; i < len; i++) {
+    bf_astnode_t* node = order[i];
+    uint32_t rec[BF_AST_RECORD_WORDS] = {BF_AST_NULL, 0, 0, BF_AST_NULL, 0};
+    if ((uintptr_t)node > succ) {
+      rec[0] = (uint32_t)node->kind;
+      rec[1] = (uint32_t)bf_astnode_num_children(node);
+      rec[2] = next_child;
+      rec[4] = (uint32_t)node->repr_len;
+      next_child += rec[1];
+      if (node->tok_repr) {
+        rec[3] = repr_off;
+        repr_off += rec[4];
+      }
+    }
+    pgen_write(w, rec, sizeof(rec));
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    bf_astnode_t* node = order[i];
+    if ((uintptr_t)node > succ && node->tok_repr)
+      pgen_write(w, node->tok_repr, node->repr_len * sizeof(codepoint_t));
+  }
+
+  free(order);
+  return !w->err;
+fail:
+  free(order);
+  return 0;
+}
+
+// A read only view of a serialized AST, which is used in place.
+// Node 0 is the root.
+typedef struct {
+  const uint32_t* nodes;
+  const codepoint_t* pool;
+  uint32_t num_nodes;
+  uint32_t pool_len;
+} bf_ast_view;
+
+// Validates the data and initializes the view. Returns 1 on success, 0 if
+// the data is not a well formed AST for this grammar. data must be 4 byte
+// aligned, and must outlive the view.
+static inline int bf_ast_view_init(bf_ast_view* view, const void* data, size_t len) {
+  const uint32_t* words = (const uint32_t*)data;
+  if ((uintptr_t)data % _Alignof(uint32_t)) return 0;
+  if (len % sizeof(uint32_t) || len < BF_AST_HEADER_WORDS * sizeof(uint32_t)) return 0;
+  uint64_t fingerprint = words[3] | ((uint64_t)words[4] << 32);
+  if ((words[0] != BF_AST_MAGIC) | (words[1] != BF_AST_VERSION) |
+      (words[2] != BF_NUM_NODEKINDS) |
+      (fingerprint != BF_GRAMMAR_FINGERPRINT) | !words[5]) return 0;
+  uint64_t num_nodes = words[5], pool_len = words[6];
+  uint64_t total = BF_AST_HEADER_WORDS + num_nodes * BF_AST_RECORD_WORDS + pool_len;
+  if (total != (uint64_t)(len / sizeof(uint32_t))) return 0;
+
+  const uint32_t* rec = words + BF_AST_HEADER_WORDS;
+  uint64_t next_child = 1;
+  for (uint64_t i = 0; i < num_nodes; i++, rec += BF_AST_RECORD_WORDS) {
+    if (rec[0] == BF_AST_NULL) {
+      if (rec[1]) return 0;
+      continue;
+    }
+    // Children come after their parents, so the view has no cycles and can
+    // be loaded from the back.
+    if ((rec[0] >= BF_NUM_NODEKINDS) | (rec[2] != next_child) |
+        ((rec[1] != 0) & (rec[2] <= i)))
+      return 0;
+    next_child += rec[1];
+    if (rec[3] != BF_AST_NULL && (uint64_t)rec[3] + rec[4] > pool_len) return 0;
+  }
+  if (next_child != num_nodes) return 0;
+
+  view->nodes = words + BF_AST_HEADER_WORDS;
+  view->pool = (const codepoint_t*)rec;
+  view->num_nodes = (uint32_t)num_nodes;
+  view->pool_len = (uint32_t)pool_len;
+  return 1;
+}
+
+static inline int bf_ast_view_isnull(const bf_ast_view* view, uint32_t n) {
+  return view->nodes[n * BF_AST_RECORD_WORDS] == BF_AST_NULL;
+}
+
+static inline bf_astnode_kind bf_ast_view_kind(const bf_ast_view* view, uint32_t n) {
+  return (bf_astnode_kind)view->nodes[n * BF_AST_RECORD_WORDS];
+}
+
+static inline uint32_t bf_ast_view_num_children(const bf_ast_view* view, uint32_t n) {
+  return view->nodes[n * BF_AST_RECORD_WORDS + 1];
+}
+
+static inline uint32_t bf_ast_view_child(const bf_ast_view* view, uint32_t n, uint32_t i) {
+  return view->nodes[n * BF_AST_RECORD_WORDS + 2] + i;
+}
+
+// Returns NULL if the node has no tok_repr.
+static inline const codepoint_t* bf_ast_view_repr(const bf_ast_view* view, uint32_t n, size_t* len) {
+  const uint32_t* rec = view->nodes + n * BF_AST_RECORD_WORDS;
+  *len = rec[4];
+  return rec[3] == BF_AST_NULL ? NULL : view->pool + rec[3];
+}
+
+// Rebuilds a bf_astnode_t tree from a view. The tok_repr of each node points
+// into the view's pool, so the view's data must outlive the tree. The nodes
+// are allocated like fixed nodes, so children cannot be added to them.
+static inline bf_astnode_t* bf_ast_view_load(const bf_ast_view* view, pgen_allocator* alloc) {
+  bf_astnode_t** built = (bf_astnode_t**)malloc(sizeof(bf_astnode_t*) * view->num_nodes);
+  if (!built) PGEN_OOM();
+  // Children come after their parents, so build from the back.
+  for (uint32_t i = view->num_nodes; i-- > 0;) {
+    const uint32_t* rec = view->nodes + i * BF_AST_RECORD_WORDS;
+    if (rec[0] == BF_AST_NULL) {
+      built[i] = NULL;
+      continue;
+    }
+    uint32_t nc = rec[1];
+    bf_astnode_t *node;
+    if (nc >= UINT16_MAX) {
+      // Too many children for a fixed node. Only lists get this big, and
+      // lists have no NULL children.
+      node = bf_astnode_list(alloc, (bf_astnode_kind)rec[0], 16);
+      for (uint32_t c = 0; c < nc; c++)
+        if (built[rec[2] + c])
+          bf_astnode_add(alloc, node, built[rec[2] + c]);
+    } else {
+      char* ret = pgen_alloc(alloc,
+                             sizeof(bf_astnode_t) +
+                             sizeof(bf_astnode_t *) * nc,
+                             _Alignof(bf_astnode_t));
+      node = (bf_astnode_t *)ret;
+      node->kind = (bf_astnode_kind)rec[0];
+      node->parent = NULL;
+      node->max_children = 0;
+      node->num_children = (uint16_t)nc;
+      node->children = nc ? (bf_astnode_t **)(node + 1) : NULL;
+      for (uint32_t c = 0; c < nc; c++) {
+        node->children[c] = built[rec[2] + c];
+        if (node->children[c]) node->children[c]->parent = node;
+      }
+    }
+    node->tok_repr = rec[3] == BF_AST_NULL ? NULL : (codepoint_t*)(uintptr_t)(view->pool + rec[3]);
+    node->repr_len = rec[4];
+    built[i] = node;
+  }
+  bf_astnode_t* root = built[0];
+  free(built);
+  return root;
+}
+
+/*
+ * Parse cache. Serialized ASTs are stored in a directory, in files named
+ * after a hash of the UTF-8 input and the grammar fingerprint. Only store
+ * the results of parses without errors.
+ */
+static inline uint64_t bf_parse_cache_key(const char* utf8, size_t len) {
+  return pgen_hash64(utf8, len, BF_GRAMMAR_FINGERPRINT);
+}
+
+static inline char* bf_parse_cache_path(const char* dir, uint64_t key, uint64_t tmp) {
+  size_t dirlen = strlen(dir);
+  size_t pathlen = dirlen + 64;
+  char* path = (char*)malloc(pathlen);
+  if (!path) return NULL;
+  const char* sep = (dirlen && dir[dirlen - 1] != '/') ? "/" : "";
+  if (tmp)
+    snprintf(path, pathlen, "%s%s%016" PRIx64 ".ast.%016" PRIx64, dir, sep, key, tmp);
+  else
+    snprintf(path, pathlen, "%s%s%016" PRIx64 ".ast", dir, sep, key);
+  return path;
+}
+
+// Returns the cached AST for the input, allocated on alloc, or NULL on a miss.
+// The cache file stays mapped until alloc is destroyed.
+static inline bf_astnode_t* bf_parse_cache_load(const char* dir, const char* utf8, size_t len, pgen_allocator* alloc) {
+  char* path = bf_parse_cache_path(dir, bf_parse_cache_key(utf8, len), 0);
+  pgen_mapped_file* m = (pgen_mapped_file*)malloc(sizeof(pgen_mapped_file));
+  bf_ast_view view;
+  int hit = path && m && pgen_map_file(path, m) &&
+            bf_ast_view_init(&view, m->data, m->len);
+  free(path);
+  if (!hit) {
+    if (m) pgen_free_mapped_file(m);
+    return NULL;
+  }
+  bf_astnode_t* ast = bf_ast_view_load(&view, alloc);
+  pgen_defer(alloc, pgen_free_mapped_file, m, alloc->rew);
+  return ast;
+}
+
+// Saves the AST for the input. The file is written under a temporary name
+// and then renamed, so readers never see a partial file. Returns 1 on success.
+static inline int bf_parse_cache_store(const char* dir, const char* utf8, size_t len, bf_astnode_t* ast) {
+  static uint64_t counter = 0;
+  if (!ast) return 0;
+  // Make the temporary name unique between threads and processes.
+  uintptr_t here = (uintptr_t)&counter ^ (uintptr_t)&here;
+  uint64_t tmp = pgen_hash64(&here, sizeof(here), ++counter);
+#if PGEN_USE_POSIX
+  tmp ^= (uint64_t)getpid() << 32;
+#endif
+  tmp |= 1;
+  uint64_t key = bf_parse_cache_key(utf8, len);
+  char* path = bf_parse_cache_path(dir, key, 0);
+  char* tmp_path = bf_parse_cache_path(dir, key, tmp);
+  FILE* f = (path && tmp_path) ? fopen(tmp_path, "wb") : NULL;
+  int success = 0;
+  if (f) {
+    pgen_writer w = pgen_writer_file(f);
+    success = bf_astnode_serialize(ast, &w);
+    success &= pgen_writer_destroy(&w);
+    success &= !fclose(f);
+    if (success) success = !rename(tmp_path, path);
+    if (!success) remove(tmp_path);
+  }
+  free(path);
+  free(tmp_path);
+  return success;
+}
+
 #define SUCC                     (bf_astnode_t*)(void*)(uintptr_t)_Alignof(bf_astnode_t)
 
 #define rec(label)               pgen_parser_rewind_t _rew_##label = (pgen_parser_rewind_t){ctx->alloc->rew, ctx->pos};
 #define rew(label)               bf_parser_rewind(ctx, _rew_##label)
 #define node(kindname, ...)      PGEN_CAT(bf_astnode_fixed_, PGEN_NARG(__VA_ARGS__))(ctx->alloc, kind(kindname), __VA_ARGS__)
 #define kind(name)               BF_NODE_##name
-#define list(kind)               bf_astnode_list(ctx->alloc, BF_NODE_##kind, 16)
+#define list(kind)               bf_astnode_list(ctx->alloc, BF_NODE_##kind, BF_LIST_INITIAL_SIZE)
 #define leaf(kind)               bf_astnode_leaf(ctx->alloc, BF_NODE_##kind)
 #define add(list, node)          bf_astnode_add(ctx->alloc, list, node)
 #define has(node)                (((uintptr_t)node <= (uintptr_t)SUCC) ? 0 : 1)
@@ -1237,14 +2689,10 @@ static inline void bf_astnode_print_json(bf_token* tokens, bf_astnode_t *node) {
 #define LB {
 #define RB }
 
-#define INFO(msg)                bf_report_parse_error(ctx, (const char*)msg, NULL,   0)
-#define WARNING(msg)             bf_report_parse_error(ctx, (const char*)msg, NULL,   1)
-#define ERROR(msg)               bf_report_parse_error(ctx, (const char*)msg, NULL,   2)
-#define FATAL(msg)               bf_report_parse_error(ctx, (const char*)msg, NULL,   3)
-#define INFO_F(msg, freefn)      bf_report_parse_error(ctx, (const char*)msg, freefn, 0)
-#define WARNING_F(msg, freefn)   bf_report_parse_error(ctx, (const char*)msg, freefn, 1)
-#define ERROR_F(msg, freefn)     bf_report_parse_error(ctx, (const char*)msg, freefn, 2)
-#define FATAL_F(msg, freefn)     bf_report_parse_error(ctx, (const char*)msg, freefn, 3)
+#define INFO(msg)                bf_report_parse_error(ctx, (const char*)msg, 0)
+#define WARNING(msg)             bf_report_parse_error(ctx, (const char*)msg, 1)
+#define ERROR(msg)               bf_report_parse_error(ctx, (const char*)msg, 2)
+#define FATAL(msg)               bf_report_parse_error(ctx, (const char*)msg, 3)
 
 /******************/
 /* Mid Directives */
@@ -1262,6 +2710,11 @@ static inline bf_astnode_t* bf_parse_runprogam(bf_parser_ctx* ctx) {
   #define rule expr_ret_0
   bf_astnode_t* expr_ret_0 = NULL;
   bf_astnode_t* expr_ret_1 = NULL;
+  if (++ctx->depth > ctx->max_depth) {
+    bf_parser_too_deep(ctx);
+    return NULL;
+  }
+  if (!--ctx->fuel && bf_parser_refuel(ctx)) return NULL;
   bf_astnode_t* expr_ret_2 = NULL;
   rec(mod_2);
   // ModExprList 0
@@ -1276,6 +2729,7 @@ static inline bf_astnode_t* bf_parse_runprogam(bf_parser_ctx* ctx) {
     bf_astnode_t* expr_ret_4 = SUCC;
     while (expr_ret_4)
     {
+      if (!--ctx->fuel && bf_parser_refuel(ctx)) return NULL;
       rec(kleene_rew_3);
       expr_ret_4 = bf_parse_char(ctx);
       if (ctx->exit) return NULL;
@@ -1285,11 +2739,21 @@ static inline bf_astnode_t* bf_parse_runprogam(bf_parser_ctx* ctx) {
     expr_ret_2 = expr_ret_3;
   }
 
+  // ModExprList 2
+  if (expr_ret_2) {
+    // CodeExpr
+    #define ret expr_ret_2
+    ret = SUCC;
+    rule=leaf(COMMENT);
+    #undef ret
+  }
+
   // ModExprList end
   if (!expr_ret_2) rew(mod_2);
   expr_ret_1 = expr_ret_2;
   if (!rule) rule = expr_ret_1;
   if (!expr_ret_1) rule = NULL;
+  ctx->depth--;
   return rule;
   #undef rule
 }
@@ -1298,6 +2762,11 @@ static inline bf_astnode_t* bf_parse_char(bf_parser_ctx* ctx) {
   #define rule expr_ret_5
   bf_astnode_t* expr_ret_5 = NULL;
   bf_astnode_t* expr_ret_6 = NULL;
+  if (++ctx->depth > ctx->max_depth) {
+    bf_parser_too_deep(ctx);
+    return NULL;
+  }
+  if (!--ctx->fuel && bf_parser_refuel(ctx)) return NULL;
   bf_astnode_t* expr_ret_7 = NULL;
 
   // SlashExpr 0
@@ -1429,6 +2898,7 @@ static inline bf_astnode_t* bf_parse_char(bf_parser_ctx* ctx) {
       
         if (*ptr == 0) {
           int m = 1;
+          ctx->pos--;
           while(m) {
             ctx->pos++;
             if (ctx->tokens[ctx->pos].kind == BF_TOK_LBRACK) m++;
@@ -1466,6 +2936,7 @@ static inline bf_astnode_t* bf_parse_char(bf_parser_ctx* ctx) {
       
         if (*ptr) {
           int m = 1;
+          ctx->pos--;
           while (m) {
             ctx->pos--;
             if (ctx->tokens[ctx->pos].kind == BF_TOK_LBRACK) m--;
@@ -1568,6 +3039,7 @@ static inline bf_astnode_t* bf_parse_char(bf_parser_ctx* ctx) {
 
   if (!rule) rule = expr_ret_6;
   if (!expr_ret_6) rule = NULL;
+  ctx->depth--;
   return rule;
   #undef rule
 }
@@ -1602,6 +3074,16 @@ static inline bf_astnode_t* bf_parse_char(bf_parser_ctx* ctx) {
 #undef PGEN_MAX4
 #undef PGEN_MIN5
 #undef PGEN_MAX5
+#undef PGEN_MIN6
+#undef PGEN_MAX6
+#undef PGEN_MIN7
+#undef PGEN_MAX7
+#undef PGEN_MIN8
+#undef PGEN_MAX8
+#undef PGEN_MIN9
+#undef PGEN_MAX9
+#undef PGEN_MIN10
+#undef PGEN_MAX10
 
 #undef LB
 #undef RB
@@ -0,0 +1,67 @@
+#!/bin/sh
+
+# Writes a synthetic grammar with thousands of rules to stdout, for timing
+# pgen itself on big grammars. The number of rules defaults to 5000.
+#   sh examples/big.sh 5000 > big.peg && ./pgen big.peg
+
+awk -v n="${1:-5000}" '
+# Identifiers can only have letters and underscores, so number them in base 26.
+function name(i, s) {
+  s = ""
+  do {
+    s = substr("abcdefghijklmnopqrstuvwxyz", i % 26 + 1, 1) s
+    i = int(i / 26)
+  } while (i)
+  return s
+}
+
+BEGIN {
+  k = int(n / 10)
+  if (k < 8)
+    k = 8
+
+  print "// A synthetic grammar with " n " rules. See examples/big.sh."
+  print ""
+  print "OPEN: \"(\";"
+  print "CLOSE: \")\";"
+  print "COMMA: \",\";"
+  for (i = 0; i < k; i++)
+    printf "KW_%s: \"kw_%s\";\n", toupper(name(i)), name(i)
+  print ""
+  print "IDENT: (1, 2) {"
+  print "  (0, [_a-zA-Z]) -> 1;"
+  print "  ((1, 2), [_a-zA-Z0-9]) -> 2;"
+  print "};"
+  print ""
+  print "NUM: 1 {"
+  print "  ((0, 1), [0-9]) -> 1;"
+  print "};"
+  print ""
+  print "%ignore WS"
+  print "WS: 1 {"
+  print "  ((0, 1), [ \\n\\r\\t]) -> 1;"
+  print "};"
+  print ""
+  print "%node LIST"
+  print "%node PAIR"
+  print ""
+
+  # Each rule only refers to rules after it, so there is no left recursion,
+  # and the last ones bottom out in tokens.
+  for (i = 0; i < n; i++) {
+    r = "r_" name(i)
+    kw = "KW_" toupper(name(i % k))
+    if (i + 2 >= n) {
+      printf "%s <- IDENT / NUM / OPEN i:IDENT CLOSE {rule=i}\n\n", r
+      continue
+    }
+    a = "r_" name(i + 1)
+    b = "r_" name(i + 2)
+    printf "%s <- %s a:%s b:%s {rule=node(PAIR, a, b)}\n", r, kw, a, b
+    printf "%*s/ {rule=list(LIST)}\n", length(r) + 4, ""
+    printf "%*s  OPEN (x:%s {add(rule, x)} (COMMA x:%s {add(rule, x)})*)?\n",
+           length(r) + 4, "", b, b
+    printf "%*s  CLOSE|\"Expected a closing parenthesis\"\n", length(r) + 4, ""
+    printf "%*s/ IDENT\n\n", length(r) + 4, ""
+  }
+}'
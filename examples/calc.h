@@ -1,6 +1,10 @@
+// Generated by pgen. Fingerprint: 5dd6456b0663493f
 #ifndef PGEN_CALC_PARSER_H
 #define PGEN_CALC_PARSER_H
 
+// Changes whenever the grammar file changes.
+#define CALC_GRAMMAR_FINGERPRINT UINT64_C(0xb638fd43d8674fc8)
+
 
 /* START OF UTF8 LIBRARY */
 
@@ -56,6 +60,20 @@ static inline int UTF8_validByte(char c) {
   return (c != UTF8_ERR) & (c != UTF8_END);
 }
 
+/* Returns the length of the sequence that starts with c0, or 0 if c0 can't
+ * start one. */
+static inline size_t UTF8_seqLen(char c0) {
+  if ((c0 & 0x80) == 0)
+    return 1;
+  else if ((c0 & 0xE0) == 0xC0)
+    return 2;
+  else if ((c0 & 0xF0) == 0xE0)
+    return 3;
+  else if ((c0 & 0xF8) == 0xF0)
+    return 4;
+  return 0;
+}
+
 /* Extract the next unicode code point. Returns the codepoint, UTF8_END, or
  * UTF8_ERR. */
 static inline codepoint_t UTF8_decodeNext(UTF8Decoder *state) {
@@ -232,7 +250,7 @@ static inline int UTF8_decode(char *str, size_t len, codepoint_t **retcps,
 
 
 #ifndef PGEN_INTERACTIVE
-#define PGEN_INTERACTIVE 1
+#define PGEN_INTERACTIVE 0
 
 #define PGEN_ALLOCATOR_DEBUG 0
 
@@ -277,6 +295,14 @@ static inline int UTF8_decode(char *str, size_t len, codepoint_t **retcps,
   } while (0);
 #endif
 
+#ifndef PGEN_PREFETCH
+#if defined(__GNUC__) || defined(__clang__)
+#define PGEN_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PGEN_PREFETCH(addr) ((void)(addr))
+#endif
+#endif
+
 #ifndef PGEN_DEBUG
 #define PGEN_DEBUG 0
 #endif
@@ -481,6 +507,32 @@ static inline char *pgen_alloc(pgen_allocator *allocator, size_t n,
   return ret;
 }
 
+// Allocates the arenas that the next n bytes of allocations will need, so
+// that pgen_alloc() doesn't have to stop to allocate them. Arenas are kept
+// across rewinds, so they're only ever allocated once.
+static inline void pgen_allocator_reserve(pgen_allocator *allocator,
+                                          size_t n) {
+  size_t i = allocator->rew.arena_idx;
+  size_t avail = 0;
+  if (allocator->arenas[i].buf) {
+    avail = allocator->arenas[i].cap - allocator->rew.filled;
+    i++;
+  }
+  for (; (avail < n) & (i + 1 < PGEN_NUM_ARENAS); i++) {
+    if (!allocator->arenas[i].buf) {
+      char *nb = (char *)PGEN_MALLOC(PGEN_BUFFER_SIZE);
+      if (!nb)
+        PGEN_OOM();
+      pgen_arena_t new_arena;
+      new_arena.freefn = free;
+      new_arena.buf = nb;
+      new_arena.cap = PGEN_BUFFER_SIZE;
+      allocator->arenas[i] = new_arena;
+    }
+    avail += allocator->arenas[i].cap;
+  }
+}
+
 // Does not take a pgen_allocator_rewind_t, does not rebind the
 // lifetime of the reallocated object.
 static inline void pgen_allocator_realloced(pgen_allocator *allocator,
@@ -569,23 +621,23 @@ static inline void pgen_allocator_rewind(pgen_allocator *allocator,
 #endif
 
   // Free all the objects associated with nodes implicitly destroyed.
-  // These are the ones located beyond the rew we're rewinding back to.
-  int freed_any = 0;
+  // These are the ones located beyond the rew we're rewinding back to,
+  // ordered by arena first and then by position in the arena.
   size_t i = allocator->freelist.len;
-  while (i--) {
+  while (i) {
 
-    pgen_freelist_entry_t entry = allocator->freelist.entries[i];
+    pgen_freelist_entry_t entry = allocator->freelist.entries[i - 1];
     uint32_t arena_idx = entry.rew.arena_idx;
     uint32_t filled = entry.rew.filled;
 
-    if ((rew.arena_idx <= arena_idx) | (rew.filled <= filled))
+    if ((arena_idx < rew.arena_idx) |
+        ((arena_idx == rew.arena_idx) & (filled <= rew.filled)))
       break;
 
-    freed_any = 1;
     entry.freefn(entry.ptr);
+    i--;
   }
-  if (freed_any)
-    allocator->freelist.len = (uint32_t)i;
+  allocator->freelist.len = (uint32_t)i;
   allocator->rew = rew;
 
 #if PGEN_ALLOCATOR_DEBUG
@@ -599,6 +651,367 @@ static inline void pgen_allocator_rewind(pgen_allocator *allocator,
 #endif /* PGEN_ARENA_INCLUDED */
 
 
+
+/* START OF IO LIBRARY */
+
+#ifndef PGEN_IO_INCLUDED
+#define PGEN_IO_INCLUDED
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef PGEN_USE_POSIX
+#define PGEN_USE_POSIX 0
+#endif
+
+#if PGEN_USE_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifndef PGEN_WRITER_BUFSZ
+#define PGEN_WRITER_BUFSZ (4096 * 16)
+#endif
+
+/*
+ * A buffered output sink. Writes go to buf. A memory writer grows buf as
+ * needed, and the caller takes the result from buf and len. A file or fd
+ * writer flushes buf to its sink whenever it fills up.
+ * After any failure, err is set and further writes are dropped.
+ */
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t cap;
+  FILE *f;
+  int fd;
+  int err;
+} pgen_writer;
+
+static inline pgen_writer pgen_writer_mem(void) {
+  pgen_writer w;
+  w.buf = NULL;
+  w.len = 0;
+  w.cap = 0;
+  w.f = NULL;
+  w.fd = -1;
+  w.err = 0;
+  return w;
+}
+
+static inline pgen_writer pgen_writer_file(FILE *f) {
+  pgen_writer w = pgen_writer_mem();
+  w.f = f;
+  w.buf = (char *)malloc(PGEN_WRITER_BUFSZ);
+  if (w.buf)
+    w.cap = PGEN_WRITER_BUFSZ;
+  else
+    w.err = 1;
+  return w;
+}
+
+#if PGEN_USE_POSIX
+static inline pgen_writer pgen_writer_fd(int fd) {
+  pgen_writer w = pgen_writer_file(NULL);
+  w.fd = fd;
+  return w;
+}
+#endif
+
+static inline int pgen_writer_has_sink(pgen_writer *w) {
+  return (w->f != NULL) | (w->fd != -1);
+}
+
+// Writes n bytes straight to the sink, bypassing the buffer.
+static inline void pgen_writer_sink(pgen_writer *w, const char *data,
+                                    size_t n) {
+  if (w->f) {
+    if (fwrite(data, 1, n, w->f) != n)
+      w->err = 1;
+    return;
+  }
+#if PGEN_USE_POSIX
+  while (n) {
+    ssize_t written = write(w->fd, data, n);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      w->err = 1;
+      return;
+    }
+    data += written;
+    n -= (size_t)written;
+  }
+#else
+  (void)data;
+  (void)n;
+  w->err = 1;
+#endif
+}
+
+static inline void pgen_writer_flush(pgen_writer *w) {
+  if (w->err | !pgen_writer_has_sink(w))
+    return;
+  if (w->len)
+    pgen_writer_sink(w, w->buf, w->len);
+  w->len = 0;
+  if (w->f && fflush(w->f))
+    w->err = 1;
+}
+
+// Makes room for at least n more bytes in the buffer.
+// Returns 0 if that's impossible. A writer with a sink may still accept the
+// bytes by writing them through with pgen_writer_sink().
+static inline int pgen_writer_grow(pgen_writer *w, size_t n) {
+  if (w->err)
+    return 0;
+  if (pgen_writer_has_sink(w)) {
+    pgen_writer_flush(w);
+    return !w->err && n <= w->cap;
+  }
+
+  size_t new_cap = w->cap ? w->cap : 256;
+  while (new_cap - w->len < n) {
+    if (new_cap > SIZE_MAX / 2)
+      return w->err = 1, 0;
+    new_cap *= 2;
+  }
+  char *new_buf = (char *)realloc(w->buf, new_cap);
+  if (!new_buf)
+    return w->err = 1, 0;
+  w->buf = new_buf;
+  w->cap = new_cap;
+  return 1;
+}
+
+static inline void pgen_write(pgen_writer *w, const void *data, size_t n) {
+  if (w->cap - w->len < n && !pgen_writer_grow(w, n)) {
+    if (!w->err && pgen_writer_has_sink(w))
+      pgen_writer_sink(w, (const char *)data, n);
+    return;
+  }
+  memcpy(w->buf + w->len, data, n);
+  w->len += n;
+}
+
+static inline void pgen_writec(pgen_writer *w, char c) {
+  if (w->len == w->cap && !pgen_writer_grow(w, 1))
+    return;
+  w->buf[w->len++] = c;
+}
+
+static inline void pgen_writes(pgen_writer *w, const char *s) {
+  pgen_write(w, s, strlen(s));
+}
+
+static inline void pgen_write_u32(pgen_writer *w, uint32_t u) {
+  pgen_write(w, &u, sizeof(uint32_t));
+}
+
+// Flushes to the sink if there is one, then frees the buffer.
+// The buffer of a memory writer is freed too, so take it first if you want it.
+static inline int pgen_writer_destroy(pgen_writer *w) {
+  pgen_writer_flush(w);
+  free(w->buf);
+  w->buf = NULL;
+  w->len = 0;
+  w->cap = 0;
+  return !w->err;
+}
+
+/*
+ * JSON helpers. Strings are arrays of codepoints (codepoint_t is int32_t),
+ * written as escaped UTF-8. Invalid codepoints are written as U+FFFD.
+ */
+static inline void pgen_write_json_string(pgen_writer *w, const int32_t *cps,
+                                          size_t len) {
+  // 0 means the character is written as is, 'u' means it's written as
+  // \u00XX, and anything else is written after a backslash.
+  static const char esc[128] = {
+      'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f',
+      'r', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+      'u', 'u', 'u', 'u', 'u', 'u', 0,   0,   '"', 0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   '\\', 0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0};
+  static const char hex[] = "0123456789abcdef";
+
+  pgen_writec(w, '"');
+  for (size_t i = 0; i < len; i++) {
+    // Every codepoint takes at most 6 bytes.
+    if (w->cap - w->len < 6 && !pgen_writer_grow(w, 6))
+      return;
+    char *out = w->buf + w->len;
+    uint32_t c = (uint32_t)cps[i];
+    if (c < 0x80) {
+      char e = esc[c];
+      if (!e) {
+        *out++ = (char)c;
+      } else if (e == 'u') {
+        memcpy(out, "\\u00", 4);
+        out[4] = hex[c >> 4];
+        out[5] = hex[c & 0xF];
+        out += 6;
+      } else {
+        *out++ = '\\';
+        *out++ = e;
+      }
+    } else {
+      if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+        c = 0xFFFD;
+      if (c < 0x800) {
+        *out++ = (char)(0xC0 | (c >> 6));
+      } else if (c < 0x10000) {
+        *out++ = (char)(0xE0 | (c >> 12));
+        *out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+      } else {
+        *out++ = (char)(0xF0 | (c >> 18));
+        *out++ = (char)(0x80 | ((c >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+      }
+      *out++ = (char)(0x80 | (c & 0x3F));
+    }
+    w->len = (size_t)(out - w->buf);
+  }
+  pgen_writec(w, '"');
+}
+
+// With pretty set, starts a new line indented to the given level.
+static inline void pgen_write_json_indent(pgen_writer *w, int pretty,
+                                          size_t level) {
+  if (!pretty)
+    return;
+  pgen_writec(w, '\n');
+  for (size_t i = 0; i < level; i++)
+    pgen_write(w, "  ", 2);
+}
+
+/*
+ * A fast non-cryptographic 64 bit hash. It reads 8 bytes at a time in
+ * native byte order, so results are only stable on machines with the same
+ * endianness.
+ */
+static inline uint64_t pgen_hash_rotl(uint64_t x, unsigned r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t pgen_hash_fmix(uint64_t h) {
+  h ^= h >> 33;
+  h *= UINT64_C(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  h *= UINT64_C(0xc4ceb9fe1a85ec53);
+  h ^= h >> 33;
+  return h;
+}
+
+static inline uint64_t pgen_hash64(const void *data, size_t len,
+                                   uint64_t seed) {
+  const uint64_t c1 = UINT64_C(0x87c37b91114253d5);
+  const uint64_t c2 = UINT64_C(0x4cf5ad432745937f);
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t h = seed ^ ((uint64_t)len * UINT64_C(0x9e3779b97f4a7c15));
+
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t k;
+    memcpy(&k, p, 8);
+    h ^= pgen_hash_rotl(k * c1, 31) * c2;
+    h = pgen_hash_rotl(h, 27) * 5 + 0x52dce729;
+  }
+
+  uint64_t k = 0;
+  for (size_t i = 0; i < len; i++)
+    k |= (uint64_t)p[i] << (8 * i);
+  h ^= pgen_hash_rotl(k * c1, 31) * c2;
+
+  return pgen_hash_fmix(h);
+}
+
+/*
+ * A read-only view of a whole file. It's mmap()ed when PGEN_USE_POSIX is
+ * enabled, and read into a malloc()ed buffer otherwise. Either way, data is
+ * aligned to at least _Alignof(max_align_t).
+ */
+typedef struct {
+  void *data;
+  size_t len;
+  int mapped;
+} pgen_mapped_file;
+
+// Returns 1 on success, 0 on failure.
+static inline int pgen_map_file(const char *path, pgen_mapped_file *out) {
+  out->data = NULL;
+  out->len = 0;
+  out->mapped = 0;
+
+#if PGEN_USE_POSIX
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size <= 0)
+    return close(fd), 0;
+  void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    return 0;
+  out->data = m;
+  out->len = (size_t)st.st_size;
+  out->mapped = 1;
+  return 1;
+#else
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return 0;
+  long flen;
+  if (fseek(f, 0, SEEK_END) || (flen = ftell(f)) <= 0 ||
+      fseek(f, 0, SEEK_SET))
+    return fclose(f), 0;
+  char *buf = (char *)malloc((size_t)flen);
+  if (!buf)
+    return fclose(f), 0;
+  if (fread(buf, 1, (size_t)flen, f) != (size_t)flen)
+    return free(buf), fclose(f), 0;
+  fclose(f);
+  out->data = buf;
+  out->len = (size_t)flen;
+  return 1;
+#endif
+}
+
+static inline void pgen_unmap_file(pgen_mapped_file *m) {
+#if PGEN_USE_POSIX
+  if (m->mapped)
+    munmap(m->data, m->len);
+  else
+    free(m->data);
+#else
+  free(m->data);
+#endif
+  m->data = NULL;
+  m->len = 0;
+  m->mapped = 0;
+}
+
+// Unmaps and frees a malloc()ed pgen_mapped_file. Suitable for pgen_defer().
+static inline void pgen_free_mapped_file(void *m) {
+  pgen_unmap_file((pgen_mapped_file *)m);
+  free(m);
+}
+
+#endif /* PGEN_IO_INCLUDED */
+
+/* END OF IO LIBRARY */
+
+
 struct calc_astnode_t;
 typedef struct calc_astnode_t calc_astnode_t;
 
@@ -700,6 +1113,74 @@ static inline void calc_tokenizer_init(calc_tokenizer* tokenizer, codepoint_t* s
   tokenizer->pos_col = 0;
 }
 
+// Skip runs of codepoints that leave a state machine in the same state.
+#if (defined(__AVX2__) || defined(__SSE2__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+
+static inline size_t calc_skip_0_2(const codepoint_t* s, size_t n) {
+  size_t i = 0;
+#if defined(__AVX2__) && (defined(__GNUC__) || defined(__clang__))
+  for (; i + 8 <= n; i += 8) {
+    __m256i c = _mm256_loadu_si256((const __m256i*)(s + i));
+    __m256i in = _mm256_setzero_si256();
+    in = _mm256_or_si256(in, _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(48), c), _mm256_cmpgt_epi32(c, _mm256_set1_epi32(57))), _mm256_set1_epi32(-1)));
+    unsigned stop = ~(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(in)) & 0xFFu;
+    if (stop)
+      return i + (size_t)__builtin_ctz(stop);
+  }
+#elif defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+  for (; i + 4 <= n; i += 4) {
+    __m128i c = _mm_loadu_si128((const __m128i*)(s + i));
+    __m128i in = _mm_setzero_si128();
+    in = _mm_or_si128(in, _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi32(_mm_set1_epi32(48), c), _mm_cmpgt_epi32(c, _mm_set1_epi32(57))), _mm_set1_epi32(-1)));
+    unsigned stop = ~(unsigned)_mm_movemask_ps(_mm_castsi128_ps(in)) & 0xFu;
+    if (stop)
+      return i + (size_t)__builtin_ctz(stop);
+  }
+#endif
+  for (; i < n; i++) {
+    codepoint_t c = s[i];
+    if (!((c >= '0') & (c <= '9')))
+      break;
+  }
+  return i;
+}
+
+static inline size_t calc_skip_1_1(const codepoint_t* s, size_t n) {
+  size_t i = 0;
+#if defined(__AVX2__) && (defined(__GNUC__) || defined(__clang__))
+  for (; i + 8 <= n; i += 8) {
+    __m256i c = _mm256_loadu_si256((const __m256i*)(s + i));
+    __m256i in = _mm256_setzero_si256();
+    in = _mm256_or_si256(in, _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(9), c), _mm256_cmpgt_epi32(c, _mm256_set1_epi32(10))), _mm256_set1_epi32(-1)));
+    in = _mm256_or_si256(in, _mm256_cmpeq_epi32(c, _mm256_set1_epi32(13)));
+    in = _mm256_or_si256(in, _mm256_cmpeq_epi32(c, _mm256_set1_epi32(32)));
+    unsigned stop = ~(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(in)) & 0xFFu;
+    if (stop)
+      return i + (size_t)__builtin_ctz(stop);
+  }
+#elif defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+  for (; i + 4 <= n; i += 4) {
+    __m128i c = _mm_loadu_si128((const __m128i*)(s + i));
+    __m128i in = _mm_setzero_si128();
+    in = _mm_or_si128(in, _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi32(_mm_set1_epi32(9), c), _mm_cmpgt_epi32(c, _mm_set1_epi32(10))), _mm_set1_epi32(-1)));
+    in = _mm_or_si128(in, _mm_cmpeq_epi32(c, _mm_set1_epi32(13)));
+    in = _mm_or_si128(in, _mm_cmpeq_epi32(c, _mm_set1_epi32(32)));
+    unsigned stop = ~(unsigned)_mm_movemask_ps(_mm_castsi128_ps(in)) & 0xFu;
+    if (stop)
+      return i + (size_t)__builtin_ctz(stop);
+  }
+#endif
+  for (; i < n; i++) {
+    codepoint_t c = s[i];
+    if (!(((c == 9) | (c == '\n')) | (c == 13) | (c == 32)))
+      break;
+  }
+  return i;
+}
+
 static inline calc_token calc_nextToken(calc_tokenizer* tokenizer) {
   codepoint_t* current = tokenizer->start + tokenizer->pos;
   size_t remaining = tokenizer->len - tokenizer->pos;
@@ -712,7 +1193,8 @@ static inline calc_token calc_nextToken(calc_tokenizer* tokenizer) {
   size_t smaut_munch_size_1 = 0;
   calc_token_kind trie_tokenkind = CALC_TOK_STREAMEND;
 
-  for (size_t iidx = 0; iidx < remaining; iidx++) {
+  size_t iidx = 0;
+  for (; iidx < remaining; iidx++) {
     codepoint_t c = current[iidx];
     int all_dead = 1;
 
@@ -764,7 +1246,7 @@ static inline calc_token calc_nextToken(calc_tokenizer* tokenizer) {
       all_dead = 0;
 
       if ((smaut_state_0 == 0) &
-         ((c == '-') | (c == '+'))) {
+         ((c == '+') | (c == '-'))) {
           smaut_state_0 = 1;
       }
       else if (((smaut_state_0 >= 0) & (smaut_state_0 <= 2)) &
@@ -786,7 +1268,7 @@ static inline calc_token calc_nextToken(calc_tokenizer* tokenizer) {
       all_dead = 0;
 
       if (((smaut_state_1 == 0) | (smaut_state_1 == 1)) &
-         ((c == 32) | (c == '\n') | (c == 13) | (c == 9))) {
+         (((c == 9) | (c == '\n')) | (c == 13) | (c == 32))) {
           smaut_state_1 = 1;
       }
       else {
@@ -801,6 +1283,14 @@ static inline calc_token calc_nextToken(calc_tokenizer* tokenizer) {
 
     if (all_dead)
       break;
+    if ((smaut_state_0 == 2) && (trie_state == -1) && (smaut_state_1 == -1)) {
+      iidx += calc_skip_0_2(current + iidx + 1, remaining - iidx - 1);
+      smaut_munch_size_0 = iidx + 1;
+    }
+    else if ((smaut_state_1 == 1) && (trie_state == -1) && (smaut_state_0 == -1)) {
+      iidx += calc_skip_1_1(current + iidx + 1, remaining - iidx - 1);
+      smaut_munch_size_1 = iidx + 1;
+    }
   }
 
   // Determine what token was accepted, if any.
@@ -857,6 +1347,19 @@ struct calc_parse_err {
 #ifndef CALC_MAX_PARSER_ERRORS
 #define CALC_MAX_PARSER_ERRORS 20
 #endif
+// How deep rules can nest before the parse stops, rather than overflowing
+// the stack. Each level is a C stack frame.
+#ifndef CALC_MAX_DEPTH
+#define CALC_MAX_DEPTH 4096
+#endif
+// Why a parse was stopped early by its budget or depth limit.
+typedef enum {
+  CALC_ABORT_NONE,
+  CALC_ABORT_STEPS,
+  CALC_ABORT_DEADLINE,
+  CALC_ABORT_DEPTH,
+} calc_abort_reason;
+
 typedef struct {
   calc_token* tokens;
   size_t len;
@@ -865,6 +1368,14 @@ typedef struct {
   pgen_allocator *alloc;
   size_t num_errors;
   calc_parse_err errlist[CALC_MAX_PARSER_ERRORS];
+  size_t fuel; // Steps left until the budget is checked.
+  size_t fuel_given;
+  size_t steps; // Steps taken before the fuel was given.
+  size_t max_steps;
+  uint64_t deadline;
+  size_t depth;
+  size_t max_depth;
+  calc_abort_reason aborted;
 } calc_parser_ctx;
 
 static inline void calc_parser_ctx_init(calc_parser_ctx* parser,
@@ -878,14 +1389,70 @@ static inline void calc_parser_ctx_init(calc_parser_ctx* parser,
   parser->num_errors = 0;
   size_t to_zero = sizeof(calc_parse_err) * CALC_MAX_PARSER_ERRORS;
   memset(&parser->errlist, 0, to_zero);
+  parser->fuel = parser->fuel_given = SIZE_MAX;
+  parser->steps = 0;
+  parser->max_steps = 0;
+  parser->deadline = 0;
+  parser->depth = 0;
+  parser->max_depth = CALC_MAX_DEPTH;
+  parser->aborted = CALC_ABORT_NONE;
+}
+/*
+ * Sizing hints. CALC_ARENA_BYTES_PER_TOKEN is how much of its allocator a parse
+ * uses for each token, and CALC_LIST_INITIAL_SIZE is how many children a new list
+ * has room for. They're guesses unless pgen was given --stats.
+ */
+#ifndef CALC_ARENA_BYTES_PER_TOKEN
+#define CALC_ARENA_BYTES_PER_TOKEN 64
+#endif
+#ifndef CALC_LIST_INITIAL_SIZE
+#define CALC_LIST_INITIAL_SIZE 16
+#endif
+
+// Allocates the arenas that parsing the parser's tokens will need, before
+// parsing, going by CALC_ARENA_BYTES_PER_TOKEN.
+static inline void calc_parser_reserve(calc_parser_ctx* parser) {
+  pgen_allocator_reserve(parser->alloc, parser->len * CALC_ARENA_BYTES_PER_TOKEN);
+}
+
+/*
+ * Define CALC_COLLECT_STATS to 1 for a profiling run. Give each parse a new
+ * allocator and record it with calc_stats_record(), then save what
+ * calc_stats_write() writes and pass the file to pgen --stats.
+ */
+#ifndef CALC_COLLECT_STATS
+#define CALC_COLLECT_STATS 0
+#endif
+#if CALC_COLLECT_STATS
+static size_t calc_stats_tokens, calc_stats_bytes, calc_stats_lists;
+// How many lists grew past 2^i children.
+static size_t calc_stats_outgrew[16];
+
+// Called when a list gets its nth child.
+static inline void calc_stats_child(size_t n) {
+  for (size_t i = 0; i < 16; i++)
+    if (n == ((size_t)1 << i) + 1)
+      calc_stats_outgrew[i]++;
 }
-static inline void freemsg(const char* msg, void* extra) {
-  (void)extra;
-  PGEN_FREE((void*)msg);
+
+static inline void calc_stats_record(calc_parser_ctx* parser) {
+  calc_stats_tokens += parser->len;
+  calc_stats_bytes += (size_t)parser->alloc->rew.arena_idx * PGEN_BUFFER_SIZE + parser->alloc->rew.filled;
 }
 
-static inline calc_parse_err* calc_report_parse_error(calc_parser_ctx* ctx,
-              const char* msg, void (*msgfree)(const char* msg, void* extra), int severity) {
+static inline void calc_stats_write(FILE* f) {
+  size_t per_token = 1;
+  if (calc_stats_tokens)
+    per_token = (calc_stats_bytes + calc_stats_tokens - 1) / calc_stats_tokens;
+  // Nine out of ten lists should fit in their initial size.
+  size_t i = 0;
+  while (i < 15 && calc_stats_outgrew[i] * 10 > calc_stats_lists)
+    i++;
+  fprintf(f, "arena_bytes_per_token %zu\n", per_token ? per_token : 1);
+  fprintf(f, "list_initial_size %zu\n", (size_t)1 << i);
+}
+#endif
+static inline calc_parse_err* calc_report_parse_error(calc_parser_ctx* ctx, const char* msg, int severity) {
   if (ctx->num_errors >= CALC_MAX_PARSER_ERRORS) {
     ctx->exit = 1;
     return NULL;
@@ -893,7 +1460,7 @@ static inline calc_parse_err* calc_report_parse_error(calc_parser_ctx* ctx,
   calc_parse_err* err = &ctx->errlist[ctx->num_errors++];
   err->msg = (const char*)msg;
   err->severity = severity;
-  size_t toknum = ctx->pos + (ctx->pos != ctx->len - 1);
+  size_t toknum = ctx->pos;
   calc_token tok = ctx->tokens[toknum];
   err->line = tok.line;
   err->col = tok.col;
@@ -903,6 +1470,75 @@ static inline calc_parse_err* calc_report_parse_error(calc_parser_ctx* ctx,
   return err;
 }
 
+#include <time.h>
+
+/*
+ * Parse budgets. Every rule call and every iteration of a loop is a step, and
+ * takes one unit of fuel. The budget is only checked when the fuel runs out,
+ * so with no budget set a step costs a decrement. With a deadline, the clock
+ * is read every CALC_DEADLINE_INTERVAL steps. A parse that runs over stops as if
+ * by FATAL(), with ctx->aborted saying why.
+ */
+#ifndef CALC_DEADLINE_INTERVAL
+#define CALC_DEADLINE_INTERVAL 4096
+#endif
+
+static inline uint64_t calc_parser_clock(void) {
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+  timespec_get(&ts, TIME_UTC);
+#endif
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// The number of steps the parser has taken.
+static inline size_t calc_parser_steps(calc_parser_ctx* ctx) {
+  return ctx->steps + (ctx->fuel_given - ctx->fuel);
+}
+
+// Called when the fuel runs out. Returns 1 if the parse has to stop.
+static inline int calc_parser_refuel(calc_parser_ctx* ctx) {
+  ctx->steps += ctx->fuel_given;
+  ctx->fuel = ctx->fuel_given = 0;
+  // The step that ran out of fuel has been counted, so a parse that used up
+  // exactly max_steps steps is still within budget.
+  if (ctx->max_steps && ctx->steps > ctx->max_steps)
+    ctx->aborted = CALC_ABORT_STEPS;
+  else if (ctx->deadline && calc_parser_clock() >= ctx->deadline)
+    ctx->aborted = CALC_ABORT_DEADLINE;
+  if (ctx->aborted) {
+    calc_report_parse_error(ctx, ctx->aborted == CALC_ABORT_STEPS ?
+        "Parse step budget exceeded." : "Parse deadline passed.", 3);
+    ctx->exit = 1;
+    return 1;
+  }
+  size_t fuel = ctx->deadline ? CALC_DEADLINE_INTERVAL : SIZE_MAX;
+  // Run out on the first step past the budget.
+  if (ctx->max_steps && ctx->max_steps - ctx->steps < fuel - 1)
+    fuel = ctx->max_steps - ctx->steps + 1;
+  ctx->fuel = ctx->fuel_given = fuel;
+  return 0;
+}
+
+// Limits the parse to max_steps steps, and to max_ns nanoseconds from now.
+// Zero means no limit.
+static inline void calc_parser_set_budget(calc_parser_ctx* ctx, size_t max_steps, uint64_t max_ns) {
+  ctx->steps = calc_parser_steps(ctx);
+  ctx->max_steps = max_steps;
+  ctx->deadline = max_ns ? calc_parser_clock() + max_ns : 0;
+  // The next step refuels, which checks the new budget.
+  ctx->fuel = ctx->fuel_given = 1;
+}
+
+// Called when rules nest deeper than ctx->max_depth.
+static inline void calc_parser_too_deep(calc_parser_ctx* ctx) {
+  ctx->aborted = CALC_ABORT_DEPTH;
+  calc_report_parse_error(ctx, "Input is nested too deeply.", 3);
+  ctx->exit = 1;
+}
+
 typedef enum {
   CALC_NODE_PLUS,
   CALC_NODE_MINUS,
@@ -943,11 +1579,21 @@ struct calc_astnode_t {
 #define PGEN_MIN3(a, b, c) PGEN_MIN(a, PGEN_MIN2(b, c))
 #define PGEN_MIN4(a, b, c, d) PGEN_MIN(a, PGEN_MIN3(b, c, d))
 #define PGEN_MIN5(a, b, c, d, e) PGEN_MIN(a, PGEN_MIN4(b, c, d, e))
+#define PGEN_MIN6(a, b, c, d, e, f) PGEN_MIN(a, PGEN_MIN5(b, c, d, e, f))
+#define PGEN_MIN7(a, b, c, d, e, f, g) PGEN_MIN(a, PGEN_MIN6(b, c, d, e, f, g))
+#define PGEN_MIN8(a, b, c, d, e, f, g, h) PGEN_MIN(a, PGEN_MIN7(b, c, d, e, f, g, h))
+#define PGEN_MIN9(a, b, c, d, e, f, g, h, i) PGEN_MIN(a, PGEN_MIN8(b, c, d, e, f, g, h, i))
+#define PGEN_MIN10(a, b, c, d, e, f, g, h, i, j) PGEN_MIN(a, PGEN_MIN9(b, c, d, e, f, g, h, i, j))
 #define PGEN_MAX1(a) a
 #define PGEN_MAX2(a, b) PGEN_MAX(a, PGEN_MAX1(b))
 #define PGEN_MAX3(a, b, c) PGEN_MAX(a, PGEN_MAX2(b, c))
 #define PGEN_MAX4(a, b, c, d) PGEN_MAX(a, PGEN_MAX3(b, c, d))
 #define PGEN_MAX5(a, b, c, d, e) PGEN_MAX(a, PGEN_MAX4(b, c, d, e))
+#define PGEN_MAX6(a, b, c, d, e, f) PGEN_MAX(a, PGEN_MAX5(b, c, d, e, f))
+#define PGEN_MAX7(a, b, c, d, e, f, g) PGEN_MAX(a, PGEN_MAX6(b, c, d, e, f, g))
+#define PGEN_MAX8(a, b, c, d, e, f, g, h) PGEN_MAX(a, PGEN_MAX7(b, c, d, e, f, g, h))
+#define PGEN_MAX9(a, b, c, d, e, f, g, h, i) PGEN_MAX(a, PGEN_MAX8(b, c, d, e, f, g, h, i))
+#define PGEN_MAX10(a, b, c, d, e, f, g, h, i, j) PGEN_MAX(a, PGEN_MAX9(b, c, d, e, f, g, h, i, j))
 #define PGEN_MAX(a, b) ((a) > (b) ? (a) : (b))
 #define PGEN_MIN(a, b) ((a) ? ((a) > (b) ? (b) : (a)) : (b))
 
@@ -961,7 +1607,14 @@ static inline calc_astnode_t* calc_astnode_list(
                          _Alignof(calc_astnode_t));
   calc_astnode_t *node = (calc_astnode_t*)ret;
 
+#if CALC_COLLECT_STATS
+  calc_stats_lists++;
+#endif
   calc_astnode_t **children;
+  // max_children is a uint16_t, and UINT16_MAX marks a big list. 32768 is
+  // the most it can hold that doubles into one.
+  if (initial_size > 32768)
+    initial_size = 32768;
   if (initial_size) {
     children = (calc_astnode_t**)PGEN_MALLOC(sizeof(calc_astnode_t*) * initial_size);
     if (!children) PGEN_OOM();
@@ -1138,26 +1791,321 @@ static inline calc_astnode_t* calc_astnode_fixed_5(
   return node;
 }
 
+static inline calc_astnode_t* calc_astnode_fixed_6(
+                             pgen_allocator* alloc,
+                             calc_astnode_kind kind,
+                             calc_astnode_t* PGEN_RESTRICT n0,
+                             calc_astnode_t* PGEN_RESTRICT n1,
+                             calc_astnode_t* PGEN_RESTRICT n2,
+                             calc_astnode_t* PGEN_RESTRICT n3,
+                             calc_astnode_t* PGEN_RESTRICT n4,
+                             calc_astnode_t* PGEN_RESTRICT n5) {
+  char* ret = pgen_alloc(alloc,
+                         sizeof(calc_astnode_t) +
+                         sizeof(calc_astnode_t *) * 6,
+                         _Alignof(calc_astnode_t));
+  calc_astnode_t *node = (calc_astnode_t *)ret;
+  calc_astnode_t **children = (calc_astnode_t **)(node + 1);
+  node->kind = kind;
+  node->parent = NULL;
+  node->max_children = 0;
+  node->num_children = 6;
+  node->children = children;
+  node->tok_repr = NULL;
+  node->repr_len = 0;
+  children[0] = n0;
+  n0->parent = node;
+  children[1] = n1;
+  n1->parent = node;
+  children[2] = n2;
+  n2->parent = node;
+  children[3] = n3;
+  n3->parent = node;
+  children[4] = n4;
+  n4->parent = node;
+  children[5] = n5;
+  n5->parent = node;
+  return node;
+}
+
+static inline calc_astnode_t* calc_astnode_fixed_7(
+                             pgen_allocator* alloc,
+                             calc_astnode_kind kind,
+                             calc_astnode_t* PGEN_RESTRICT n0,
+                             calc_astnode_t* PGEN_RESTRICT n1,
+                             calc_astnode_t* PGEN_RESTRICT n2,
+                             calc_astnode_t* PGEN_RESTRICT n3,
+                             calc_astnode_t* PGEN_RESTRICT n4,
+                             calc_astnode_t* PGEN_RESTRICT n5,
+                             calc_astnode_t* PGEN_RESTRICT n6) {
+  char* ret = pgen_alloc(alloc,
+                         sizeof(calc_astnode_t) +
+                         sizeof(calc_astnode_t *) * 7,
+                         _Alignof(calc_astnode_t));
+  calc_astnode_t *node = (calc_astnode_t *)ret;
+  calc_astnode_t **children = (calc_astnode_t **)(node + 1);
+  node->kind = kind;
+  node->parent = NULL;
+  node->max_children = 0;
+  node->num_children = 7;
+  node->children = children;
+  node->tok_repr = NULL;
+  node->repr_len = 0;
+  children[0] = n0;
+  n0->parent = node;
+  children[1] = n1;
+  n1->parent = node;
+  children[2] = n2;
+  n2->parent = node;
+  children[3] = n3;
+  n3->parent = node;
+  children[4] = n4;
+  n4->parent = node;
+  children[5] = n5;
+  n5->parent = node;
+  children[6] = n6;
+  n6->parent = node;
+  return node;
+}
+
+static inline calc_astnode_t* calc_astnode_fixed_8(
+                             pgen_allocator* alloc,
+                             calc_astnode_kind kind,
+                             calc_astnode_t* PGEN_RESTRICT n0,
+                             calc_astnode_t* PGEN_RESTRICT n1,
+                             calc_astnode_t* PGEN_RESTRICT n2,
+                             calc_astnode_t* PGEN_RESTRICT n3,
+                             calc_astnode_t* PGEN_RESTRICT n4,
+                             calc_astnode_t* PGEN_RESTRICT n5,
+                             calc_astnode_t* PGEN_RESTRICT n6,
+                             calc_astnode_t* PGEN_RESTRICT n7) {
+  char* ret = pgen_alloc(alloc,
+                         sizeof(calc_astnode_t) +
+                         sizeof(calc_astnode_t *) * 8,
+                         _Alignof(calc_astnode_t));
+  calc_astnode_t *node = (calc_astnode_t *)ret;
+  calc_astnode_t **children = (calc_astnode_t **)(node + 1);
+  node->kind = kind;
+  node->parent = NULL;
+  node->max_children = 0;
+  node->num_children = 8;
+  node->children = children;
+  node->tok_repr = NULL;
+  node->repr_len = 0;
+  children[0] = n0;
+  n0->parent = node;
+  children[1] = n1;
+  n1->parent = node;
+  children[2] = n2;
+  n2->parent = node;
+  children[3] = n3;
+  n3->parent = node;
+  children[4] = n4;
+  n4->parent = node;
+  children[5] = n5;
+  n5->parent = node;
+  children[6] = n6;
+  n6->parent = node;
+  children[7] = n7;
+  n7->parent = node;
+  return node;
+}
+
+static inline calc_astnode_t* calc_astnode_fixed_9(
+                             pgen_allocator* alloc,
+                             calc_astnode_kind kind,
+                             calc_astnode_t* PGEN_RESTRICT n0,
+                             calc_astnode_t* PGEN_RESTRICT n1,
+                             calc_astnode_t* PGEN_RESTRICT n2,
+                             calc_astnode_t* PGEN_RESTRICT n3,
+                             calc_astnode_t* PGEN_RESTRICT n4,
+                             calc_astnode_t* PGEN_RESTRICT n5,
+                             calc_astnode_t* PGEN_RESTRICT n6,
+                             calc_astnode_t* PGEN_RESTRICT n7,
+                             calc_astnode_t* PGEN_RESTRICT n8) {
+  char* ret = pgen_alloc(alloc,
+                         sizeof(calc_astnode_t) +
+                         sizeof(calc_astnode_t *) * 9,
+                         _Alignof(calc_astnode_t));
+  calc_astnode_t *node = (calc_astnode_t *)ret;
+  calc_astnode_t **children = (calc_astnode_t **)(node + 1);
+  node->kind = kind;
+  node->parent = NULL;
+  node->max_children = 0;
+  node->num_children = 9;
+  node->children = children;
+  node->tok_repr = NULL;
+  node->repr_len = 0;
+  children[0] = n0;
+  n0->parent = node;
+  children[1] = n1;
+  n1->parent = node;
+  children[2] = n2;
+  n2->parent = node;
+  children[3] = n3;
+  n3->parent = node;
+  children[4] = n4;
+  n4->parent = node;
+  children[5] = n5;
+  n5->parent = node;
+  children[6] = n6;
+  n6->parent = node;
+  children[7] = n7;
+  n7->parent = node;
+  children[8] = n8;
+  n8->parent = node;
+  return node;
+}
+
+static inline calc_astnode_t* calc_astnode_fixed_10(
+                             pgen_allocator* alloc,
+                             calc_astnode_kind kind,
+                             calc_astnode_t* PGEN_RESTRICT n0,
+                             calc_astnode_t* PGEN_RESTRICT n1,
+                             calc_astnode_t* PGEN_RESTRICT n2,
+                             calc_astnode_t* PGEN_RESTRICT n3,
+                             calc_astnode_t* PGEN_RESTRICT n4,
+                             calc_astnode_t* PGEN_RESTRICT n5,
+                             calc_astnode_t* PGEN_RESTRICT n6,
+                             calc_astnode_t* PGEN_RESTRICT n7,
+                             calc_astnode_t* PGEN_RESTRICT n8,
+                             calc_astnode_t* PGEN_RESTRICT n9) {
+  char* ret = pgen_alloc(alloc,
+                         sizeof(calc_astnode_t) +
+                         sizeof(calc_astnode_t *) * 10,
+                         _Alignof(calc_astnode_t));
+  calc_astnode_t *node = (calc_astnode_t *)ret;
+  calc_astnode_t **children = (calc_astnode_t **)(node + 1);
+  node->kind = kind;
+  node->parent = NULL;
+  node->max_children = 0;
+  node->num_children = 10;
+  node->children = children;
+  node->tok_repr = NULL;
+  node->repr_len = 0;
+  children[0] = n0;
+  n0->parent = node;
+  children[1] = n1;
+  n1->parent = node;
+  children[2] = n2;
+  n2->parent = node;
+  children[3] = n3;
+  n3->parent = node;
+  children[4] = n4;
+  n4->parent = node;
+  children[5] = n5;
+  n5->parent = node;
+  children[6] = n6;
+  n6->parent = node;
+  children[7] = n7;
+  n7->parent = node;
+  children[8] = n8;
+  n8->parent = node;
+  children[9] = n9;
+  n9->parent = node;
+  return node;
+}
+
+// A list with more than UINT16_MAX - 1 children keeps them in chunks of
+// 65536. The first chunk is where a small list keeps its children, so code
+// that only looks at num_children still sees the first of them. A big list
+// has max_children == UINT16_MAX, and its num_children stops there.
+typedef struct {
+  size_t num_children;
+  size_t num_chunks;
+  calc_astnode_t*** chunks;
+  calc_astnode_t* first[65536];
+} calc_astnode_biglist;
+
+static inline calc_astnode_biglist* calc_astnode_biglist_of(calc_astnode_t* list) {
+  char* first = (char*)list->children;
+  return (calc_astnode_biglist*)(void*)(first - offsetof(calc_astnode_biglist, first));
+}
+
+static inline void calc_astnode_biglist_free(void* ptr) {
+  calc_astnode_biglist* big = (calc_astnode_biglist*)ptr;
+  for (size_t i = 1; i < big->num_chunks; i++)
+    free(big->chunks[i]);
+  free(big->chunks);
+  free(big);
+}
+
+static inline size_t calc_astnode_num_children(calc_astnode_t* node) {
+  if (node->max_children == UINT16_MAX)
+    return calc_astnode_biglist_of(node)->num_children;
+  return node->num_children;
+}
+
+static inline calc_astnode_t* calc_astnode_child(calc_astnode_t* node, size_t i) {
+  if (i < 65536)
+    return node->children[i];
+  return calc_astnode_biglist_of(node)->chunks[i >> 16][i & 65535];
+}
+
 static inline void calc_astnode_add(pgen_allocator* alloc, calc_astnode_t *list, calc_astnode_t *node) {
+  node->parent = list;
+#if CALC_COLLECT_STATS
+  calc_stats_child(calc_astnode_num_children(list) + 1);
+#endif
+  if (list->max_children == UINT16_MAX) {
+    calc_astnode_biglist* big = calc_astnode_biglist_of(list);
+    size_t i = big->num_children;
+    if (!(i & 65535)) {
+      size_t chunks_bytes = sizeof(calc_astnode_t**) * (big->num_chunks + 1);
+      void* chunks = realloc(big->chunks, chunks_bytes);
+      if (!chunks) PGEN_OOM();
+      big->chunks = (calc_astnode_t***)chunks;
+      big->chunks[big->num_chunks] = (calc_astnode_t**)malloc(sizeof(calc_astnode_t*) * 65536);
+      if (!big->chunks[big->num_chunks]) PGEN_OOM();
+      big->num_chunks++;
+    }
+    big->chunks[i >> 16][i & 65535] = node;
+    big->num_children = i + 1;
+    if (list->num_children < UINT16_MAX)
+      list->num_children++;
+    return;
+  }
+
   if (list->max_children == list->num_children) {
-    // Figure out the new size. Check for overflow where applicable.
-    uint64_t new_max = (uint64_t)list->max_children * 2;
-    if (new_max > UINT16_MAX || new_max > SIZE_MAX) PGEN_OOM();
-    if (SIZE_MAX < UINT16_MAX && (size_t)new_max > SIZE_MAX / sizeof(calc_astnode_t)) PGEN_OOM();
-    size_t new_bytes = (size_t)new_max * sizeof(calc_astnode_t);
+    size_t new_max = list->max_children ? (size_t)list->max_children * 2 : 16;
+    if (new_max > UINT16_MAX) {
+      // Move the children into the first chunk of a big list.
+      calc_astnode_biglist* big = (calc_astnode_biglist*)malloc(sizeof(calc_astnode_biglist));
+      if (!big) PGEN_OOM();
+      big->chunks = (calc_astnode_t***)malloc(sizeof(calc_astnode_t**));
+      if (!big->chunks) PGEN_OOM();
+      big->chunks[0] = big->first;
+      big->num_chunks = 1;
+      big->num_children = list->num_children;
+      void* old_ptr = list->children;
+      memcpy(big->first, old_ptr, sizeof(calc_astnode_t*) * list->num_children);
+      pgen_allocator_realloced(alloc, old_ptr, big, calc_astnode_biglist_free);
+      free(old_ptr);
+      list->children = big->first;
+      list->max_children = UINT16_MAX;
+      calc_astnode_add(alloc, list, node);
+      return;
+    }
 
-    // Reallocate the list, and inform the allocator.
+    // Move the children to a bigger buffer, and inform the allocator. The old
+    // buffer is replaced before it's freed, so it's never looked at after.
     void* old_ptr = list->children;
-    void* new_ptr = realloc(list->children, new_bytes);
+    void* new_ptr = malloc(sizeof(calc_astnode_t*) * new_max);
     if (!new_ptr) PGEN_OOM();
+    if (old_ptr) {
+      memcpy(new_ptr, old_ptr, sizeof(calc_astnode_t*) * list->num_children);
+      pgen_allocator_realloced(alloc, old_ptr, new_ptr, free);
+      free(old_ptr);
+    } else {
+      // A list made with no room has nothing to replace. The buffer lives as
+      // long as the first child, which was allocated before alloc->rew.
+      pgen_defer(alloc, free, new_ptr, alloc->rew);
+    }
     list->children = (calc_astnode_t **)new_ptr;
     list->max_children = (uint16_t)new_max;
-    pgen_allocator_realloced(alloc, old_ptr, new_ptr, free);
   }
-  node->parent = list;
   list->children[list->num_children++] = node;
 }
-
 static inline void calc_parser_rewind(calc_parser_ctx *ctx, pgen_parser_rewind_t rew) {
   pgen_allocator_rewind(ctx->alloc, rew.arew);
   ctx->pos = rew.prew;
@@ -1192,7 +2140,7 @@ static inline int calc_node_print_content(calc_astnode_t* node, calc_token* toke
   if (node->tok_repr && node->repr_len) {
     utf32 = node->tok_repr;
     utf32len = node->repr_len;
-    int success = UTF8_encode(node->tok_repr, node->repr_len, &utf8, &utf8len);
+    int success = UTF8_encode(utf32, utf32len, &utf8, &utf8len);
     if (success) {
       for (size_t i = 0; i < utf8len; i++)
         if (utf8[i] == '\n') fputc('\\', stdout), fputc('n', stdout);
@@ -1220,13 +2168,13 @@ static inline int calc_astnode_print_h(calc_token* tokens, calc_astnode_t *node,
     calc_node_print_content(node, tokens);
     printf("\",\n");
   }
-  size_t cnum = node->num_children;
+  size_t cnum = calc_astnode_num_children(node);
   if (cnum) {
     indent(); printf("\"num_children\": %zu,\n", cnum);
     indent(); printf("\"children\": [");
     putchar('\n');
     for (size_t i = 0; i < cnum; i++)
-      calc_astnode_print_h(tokens, node->children[i], depth + 1, i == cnum - 1);
+      calc_astnode_print_h(tokens, calc_astnode_child(node, i), depth + 1, i == cnum - 1);
     indent();
     printf("]\n");
   }
@@ -1240,191 +2188,603 @@ static inline void calc_astnode_print_json(calc_token* tokens, calc_astnode_t *n
   if (node)    calc_astnode_print_h(tokens, node, 0, 1);
   else    puts("The AST is null.");}
 
-#define SUCC                     (calc_astnode_t*)(void*)(uintptr_t)_Alignof(calc_astnode_t)
-
-#define rec(label)               pgen_parser_rewind_t _rew_##label = (pgen_parser_rewind_t){ctx->alloc->rew, ctx->pos};
-#define rew(label)               calc_parser_rewind(ctx, _rew_##label)
-#define node(kindname, ...)      PGEN_CAT(calc_astnode_fixed_, PGEN_NARG(__VA_ARGS__))(ctx->alloc, kind(kindname), __VA_ARGS__)
-#define kind(name)               CALC_NODE_##name
-#define list(kind)               calc_astnode_list(ctx->alloc, CALC_NODE_##kind, 16)
-#define leaf(kind)               calc_astnode_leaf(ctx->alloc, CALC_NODE_##kind)
-#define add(list, node)          calc_astnode_add(ctx->alloc, list, node)
-#define has(node)                (((uintptr_t)node <= (uintptr_t)SUCC) ? 0 : 1)
-#define repr(node, t)            calc_astnode_repr(node, t)
-#define srepr(node, s)           calc_astnode_srepr(ctx->alloc, node, (char*)s)
-#define cprepr(node, cps, len)   calc_astnode_cprepr(node, cps, len)
-#define expect(kind, cap)        ((ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == calc_TOK_##kind) ? ctx->pos++, (cap ? cprepr(leaf(kind), NULL, ctx->pos-1) : SUCC) : NULL)
+/*
+ * Writes the AST as JSON. Each node is an object with a "kind", a "content"
+ * string if it has a tok_repr, and a "children" array if it has children.
+ * NULL nodes are written as null. With pretty set, the output is indented.
+ * The writer flushes to its sink as it fills up, so output streams.
+ * Returns 1 on success, 0 on failure.
+ */
+static inline int calc_astnode_write_json(pgen_writer* w, calc_astnode_t* root, int pretty) {
+  typedef struct {
+    calc_astnode_t* node;
+    size_t next;
+  } frame;
+  const uintptr_t succ = (uintptr_t)_Alignof(calc_astnode_t);
+  const char* sep = pretty ? ": " : ":";
+  size_t cap = 64, depth = 0;
+  frame* stack = (frame*)malloc(sizeof(frame) * cap);
+  if (!stack) return 0;
+
+  calc_astnode_t* node = root;
+  while (1) {
+    // Write the node. If it has children, open the array and descend.
+    if ((uintptr_t)node <= succ) {
+      pgen_write(w, "null", 4);
+    } else {
+      pgen_writec(w, '{');
+      pgen_write_json_indent(w, pretty, depth * 2 + 1);
+      pgen_write(w, "\"kind\"", 6);
+      pgen_writes(w, sep);
+      pgen_writec(w, '"');
+      pgen_writes(w, calc_nodekind_name[node->kind]);
+      pgen_writec(w, '"');
+      if (node->tok_repr || node->repr_len) {
+        pgen_writec(w, ',');
+        pgen_write_json_indent(w, pretty, depth * 2 + 1);
+        pgen_write(w, "\"content\"", 9);
+        pgen_writes(w, sep);
+        pgen_write_json_string(w, node->tok_repr, node->tok_repr ? node->repr_len : 0);
+      }
+      if (node->num_children) {
+        pgen_writec(w, ',');
+        pgen_write_json_indent(w, pretty, depth * 2 + 1);
+        pgen_write(w, "\"children\"", 10);
+        pgen_writes(w, sep);
+        pgen_writec(w, '[');
+        if (depth == cap) {
+          void* new_stack = realloc(stack, sizeof(frame) * (cap *= 2));
+          if (!new_stack) return free(stack), 0;
+          stack = (frame*)new_stack;
+        }
+        stack[depth].node = node;
+        stack[depth].next = 0;
+        depth++;
+        pgen_write_json_indent(w, pretty, depth * 2);
+        node = calc_astnode_child(node, 0);
+        continue;
+      }
+      pgen_write_json_indent(w, pretty, depth * 2);
+      pgen_writec(w, '}');
+    }
 
-#define LB {
-#define RB }
+    // Move on to the next sibling, closing every finished parent.
+    node = NULL;
+    while (depth) {
+      frame* top = stack + depth - 1;
+      if (++top->next < calc_astnode_num_children(top->node)) {
+        pgen_writec(w, ',');
+        pgen_write_json_indent(w, pretty, depth * 2);
+        node = calc_astnode_child(top->node, top->next);
+        break;
+      }
+      depth--;
+      pgen_write_json_indent(w, pretty, depth * 2 + 1);
+      pgen_writec(w, ']');
+      pgen_write_json_indent(w, pretty, depth * 2);
+      pgen_writec(w, '}');
+    }
+    if (!depth && !node) break;
+  }
+  if (pretty) pgen_writec(w, '\n');
+  free(stack);
+  return !w->err;
+}
 
-#define INFO(msg)                calc_report_parse_error(ctx, (const char*)msg, NULL,   0)
-#define WARNING(msg)             calc_report_parse_error(ctx, (const char*)msg, NULL,   1)
-#define ERROR(msg)               calc_report_parse_error(ctx, (const char*)msg, NULL,   2)
-#define FATAL(msg)               calc_report_parse_error(ctx, (const char*)msg, NULL,   3)
-#define INFO_F(msg, freefn)      calc_report_parse_error(ctx, (const char*)msg, freefn, 0)
-#define WARNING_F(msg, freefn)   calc_report_parse_error(ctx, (const char*)msg, freefn, 1)
-#define ERROR_F(msg, freefn)     calc_report_parse_error(ctx, (const char*)msg, freefn, 2)
-#define FATAL_F(msg, freefn)     calc_report_parse_error(ctx, (const char*)msg, freefn, 3)
+/*
+ * Walks the AST depth first, with a stack on the heap instead of recursion,
+ * so deep trees can't overflow the C stack. pre is called on each node before
+ * its children, and post after them. Either may be NULL. NULL children are
+ * skipped. The next sibling of each node is prefetched while the node and its
+ * children are visited.
+ */
+typedef enum {
+  CALC_WALK_CONTINUE,
+  // Don't visit the children of this node. Only meaningful from pre.
+  CALC_WALK_SKIP,
+  // End the walk.
+  CALC_WALK_STOP,
+} calc_walk_action;
+
+typedef calc_walk_action (*calc_walk_fn)(calc_astnode_t* node, void* user);
+
+// Returns 1 if the whole tree was walked, 0 if a callback stopped the walk or
+// memory ran out.
+static inline int calc_astnode_walk(calc_astnode_t* root, calc_walk_fn pre, calc_walk_fn post, void* user) {
+  typedef struct {
+    calc_astnode_t* node;
+    size_t next;
+    size_t num;
+  } frame;
+  const uintptr_t succ = (uintptr_t)_Alignof(calc_astnode_t);
+  size_t cap = 64, depth = 0;
+  frame* stack = (frame*)malloc(sizeof(frame) * cap);
+  if (!stack) return 0;
+
+  calc_astnode_t* node = root;
+  while (1) {
+    if ((uintptr_t)node > succ) {
+      calc_walk_action act = pre ? pre(node, user) : CALC_WALK_CONTINUE;
+      if (act == CALC_WALK_STOP) return free(stack), 0;
+      size_t num = act == CALC_WALK_SKIP ? 0 : calc_astnode_num_children(node);
+      if (num) {
+        if (depth == cap) {
+          void* new_stack = realloc(stack, sizeof(frame) * (cap *= 2));
+          if (!new_stack) return free(stack), 0;
+          stack = (frame*)new_stack;
+        }
+        stack[depth].node = node;
+        stack[depth].next = 0;
+        stack[depth].num = num;
+        depth++;
+        if (num > 1) PGEN_PREFETCH(calc_astnode_child(node, 1));
+        node = calc_astnode_child(node, 0);
+        continue;
+      }
+      if (post && post(node, user) == CALC_WALK_STOP) return free(stack), 0;
+    }
 
+    // Move on to the next sibling, finishing every parent on the way up.
+    node = NULL;
+    while (depth) {
+      frame* top = stack + depth - 1;
+      if (++top->next < top->num) {
+        if (top->next + 1 < top->num)
+          PGEN_PREFETCH(calc_astnode_child(top->node, top->next + 1));
+        node = calc_astnode_child(top->node, top->next);
+        break;
+      }
+      depth--;
+      if (post && post(top->node, user) == CALC_WALK_STOP) return free(stack), 0;
+    }
+    if (!depth && !node) break;
+  }
+  free(stack);
+  return 1;
+}
 
-#define PGEN_INTERACTIVE_WIDTH 11
+// Callbacks for each kind of node, indexed by kind, for calc_astnode_visit().
+// Nodes of kinds without a callback are walked through. user is passed to
+// every callback.
 typedef struct {
-  const char* rule_name;
-  size_t pos;
-} intr_entry;
+  calc_walk_fn pre[CALC_NUM_NODEKINDS];
+  calc_walk_fn post[CALC_NUM_NODEKINDS];
+  void* user;
+} calc_visitor;
+
+static inline calc_walk_action calc_visitor_pre(calc_astnode_t* node, void* v) {
+  calc_walk_fn fn = ((calc_visitor*)v)->pre[node->kind];
+  return fn ? fn(node, ((calc_visitor*)v)->user) : CALC_WALK_CONTINUE;
+}
 
-static struct {
-  intr_entry rules[500];
-  size_t size;
-  int status;
-  int first;
-} intr_stack;
+static inline calc_walk_action calc_visitor_post(calc_astnode_t* node, void* v) {
+  calc_walk_fn fn = ((calc_visitor*)v)->post[node->kind];
+  return fn ? fn(node, ((calc_visitor*)v)->user) : CALC_WALK_CONTINUE;
+}
 
-#include <unistd.h>
-#include <sys/ioctl.h>
-#include <string.h>
-static inline void intr_display(calc_parser_ctx* ctx, const char* last) {
-  if (!intr_stack.first) intr_stack.first = 1;
-  else getchar();
-
-  struct winsize w;
-  ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-  size_t width = w.ws_col;
-  size_t leftwidth = (width - (1 + 3 + 1)) / 2;
-  size_t rightwidth = leftwidth + (leftwidth % 2);
-  size_t height = w.ws_row - 6;
-
-// Clear screen, cursor to top left
-  printf("\x1b[2J\x1b[H");
-
-  // Write first line in color.
-  if (intr_stack.status == -1) {
-    printf("\x1b[31m"); // Red
-    printf("Failed: %-32s", last);
-  } else if (intr_stack.status == 0) {
-    printf("\x1b[34m"); // Blue
-    printf("Entering: %-30s", last);
-  } else if (intr_stack.status == 1) {
-    printf("\x1b[32m"); // Green
-    printf("Accepted: %-30s", last);
+// Walks the tree, calling the visitor's callbacks for the kind of each node.
+static inline int calc_astnode_visit(calc_astnode_t* root, calc_visitor* visitor) {
+  return calc_astnode_walk(root, calc_visitor_pre, calc_visitor_post, visitor);
+}
+/*
+ * Copies a finished AST into one block of memory, in depth first order, so
+ * that it takes no more space than it needs and is read front to back when
+ * it's walked. The block is freed along with out. Every node in the copy is
+ * fixed, so children can't be added to it.
+ * Token contents are copied too, so the copy doesn't depend on the tokens or
+ * on the parser's allocator, which may be destroyed.
+ * %extra fields are copied as they are. Whatever they point to has to be kept
+ * alive by the caller.
+ */
+static inline size_t calc_ast_compact_nodesize(size_t num_children) {
+  size_t size = sizeof(calc_astnode_t);
+  if (num_children < UINT16_MAX) {
+    size += sizeof(calc_astnode_t*) * num_children;
   } else {
-    printf("\x1b[33m"); // Green
-    printf("SUCCED: %-32s", last), exit(1);
-  }
-  printf("\x1b[0m"); // Clear Formatting
-  for (size_t i = 40; i < width; i++)
-    putchar(' ');
-  putchar('\n');
-
-  // Write labels and line.
-  putchar('-');
-  for (size_t i = 0; i < 11; i++)
-    putchar('-');
-  printf("-+-");
-  for (size_t i = 0; i < 11; i++)
-    putchar('-');
-  printf("-+-");
-  for (size_t i = 29; i < width; i++)
-    putchar('-');
-  putchar('\n');
-  printf(" %-11s | %-11s | %-11s", "Call Stack",  "Token Stack",  "Token Repr");
-  for (size_t i = 40; i < width; i++)
-    putchar(' ');
-  putchar('\n');
-  putchar('-');
-  for (size_t i = 0; i < 11; i++)
-    putchar('-');
-  printf("-+-");
-  for (size_t i = 0; i < 11; i++)
-    putchar('-');
-  printf("-+-");
-  for (size_t i = 29; i < width; i++)
-    putchar('-');
-  putchar('\n');
-  // Write following lines
-  for (size_t i = height; i --> 0;) {
-    putchar(' ');
-
-    // Print rule stack
-    if (i < intr_stack.size) {
-      ssize_t d = (ssize_t)intr_stack.size - (ssize_t)height;
-      size_t disp = d > 0 ? i + (size_t)d : i;
-      printf("%-11s", intr_stack.rules[disp].rule_name);
-    } else {
-      for (size_t sp = 0; sp < 11; sp++)
-        putchar(' ');
+    size_t num_chunks = (num_children + 65535) / 65536;
+    size += sizeof(calc_astnode_biglist) + sizeof(calc_astnode_t**) * num_chunks +
+            sizeof(calc_astnode_t*) * (num_children - 65536);
+  }
+  return pgen_align(size, _Alignof(calc_astnode_t));
+}
+
+static inline calc_walk_action calc_ast_compact_size(calc_astnode_t* node, void* user) {
+  size_t* size = (size_t*)user;
+  size[0] += calc_ast_compact_nodesize(calc_astnode_num_children(node));
+  if (node->tok_repr) size[1] += node->repr_len;
+  return CALC_WALK_CONTINUE;
+}
+
+// Copies one node to *at, with room for its children after it, and returns
+// the copy. The children are filled in later.
+static inline calc_astnode_t* calc_ast_compact_node(calc_astnode_t* node, calc_astnode_t* parent, char** at, codepoint_t** text) {
+  size_t num = calc_astnode_num_children(node);
+  calc_astnode_t* copy = (calc_astnode_t*)(void*)*at;
+  *at += calc_ast_compact_nodesize(num);
+  *copy = *node;
+  copy->parent = parent;
+  if (num < UINT16_MAX) {
+    copy->max_children = 0;
+    copy->num_children = (uint16_t)num;
+    copy->children = num ? (calc_astnode_t**)(copy + 1) : NULL;
+  } else {
+    calc_astnode_biglist* big = (calc_astnode_biglist*)(void*)(copy + 1);
+    copy->children = big->first;
+    copy->max_children = UINT16_MAX;
+    copy->num_children = UINT16_MAX;
+    big->num_children = num;
+    big->num_chunks = (num + 65535) / 65536;
+    big->chunks = (calc_astnode_t***)(void*)(big + 1);
+    calc_astnode_t** rest = (calc_astnode_t**)(void*)(big->chunks + big->num_chunks);
+    big->chunks[0] = big->first;
+    for (size_t i = 1; i < big->num_chunks; i++)
+      big->chunks[i] = rest + (i - 1) * 65536;
+  }
+  if (node->tok_repr) {
+    memcpy(*text, node->tok_repr, sizeof(codepoint_t) * node->repr_len);
+    copy->tok_repr = *text;
+    *text += node->repr_len;
+  }
+  return copy;
+}
+
+// Returns the copy of root, or NULL if root is NULL.
+static inline calc_astnode_t* calc_ast_compact(calc_astnode_t* root, pgen_allocator* out) {
+  typedef struct {
+    calc_astnode_t* node;
+    calc_astnode_t* copy;
+    size_t next;
+    size_t num;
+  } frame;
+  if (!root) return NULL;
+  size_t size[2] = {0, 0};
+  frame* stack = (frame*)malloc(sizeof(frame) * 64);
+  char* block = NULL;
+  if (stack && calc_astnode_walk(root, calc_ast_compact_size, NULL, size))
+    block = (char*)PGEN_MALLOC(size[0] + sizeof(codepoint_t) * size[1]);
+  if (!stack | !block) PGEN_OOM();
+  pgen_defer(out, PGEN_FREE, block, out->rew);
+
+  char* at = block;
+  codepoint_t* text = (codepoint_t*)(void*)(block + size[0]);
+  size_t cap = 64, depth = 1;
+  calc_astnode_t* ret = calc_ast_compact_node(root, NULL, &at, &text);
+  stack[0].node = root;
+  stack[0].copy = ret;
+  stack[0].next = 0;
+  stack[0].num = calc_astnode_num_children(root);
+  while (depth) {
+    frame* top = stack + depth - 1;
+    if (top->next == top->num) {
+      depth--;
+      continue;
     }
-    printf(" | "); // Left bar
-
-    size_t remaining_tokens = ctx->len - ctx->pos;
-
-    bool tokens_trunkated = remaining_tokens > height;
-    if (tokens_trunkated)
-      remaining_tokens = height;
-    // Print tokens
-    if (i == 0 && tokens_trunkated) {
-      printf("%-11s", "...");
-    } else if (i < remaining_tokens) {
-      calc_token tok = ctx->tokens[ctx->pos + remaining_tokens - 1 - i];
-      const char *name = calc_tokenkind_name[tok.kind];
-      printf("%-11s", name);
-    } else {
-      printf("%-11s", "");
+    size_t i = top->next++;
+    calc_astnode_t* child = calc_astnode_child(top->node, i);
+    calc_astnode_t** slot = i < 65536 ? top->copy->children + i
+                                    : calc_astnode_biglist_of(top->copy)->chunks[i >> 16] + (i & 65535);
+    if (!child) {
+      *slot = NULL;
+      continue;
     }
-    printf(" | "); // Right bar
-
-    // Print token content
-    if (i == 0 && tokens_trunkated) {
-      printf("%-11s", "...");
-    } else if (i < remaining_tokens) {
-      calc_token tok = ctx->tokens[ctx->pos + remaining_tokens - 1 - i];
-      if (tok.content && tok.len) {
-        char *tok_content = NULL;
-        size_t _tok_content_len = 0;
-        if (tok.len > 11) {
-          UTF8_encode(tok.content, 8, &tok_content, &_tok_content_len);
-          printf("%s...", tok_content);
-        } else {
-          UTF8_encode(tok.content, tok.len, &tok_content, &_tok_content_len);
-          printf("%-11s", tok_content);
-        }
-        UTF8_FREE(tok_content);
-      } else {
-        printf("%-11s", "");
+    *slot = calc_ast_compact_node(child, top->copy, &at, &text);
+    size_t num = calc_astnode_num_children(child);
+    if (!num) continue;
+    if (depth == cap) {
+      void* new_stack = realloc(stack, sizeof(frame) * (cap *= 2));
+      if (!new_stack) PGEN_OOM();
+      stack = (frame*)new_stack;
+    }
+    stack[depth].node = child;
+    stack[depth].copy = *slot;
+    stack[depth].next = 0;
+    stack[depth].num = num;
+    depth++;
+  }
+  free(stack);
+  return ret;
+}
+/*
+ * Binary AST format. Every field is a native endian uint32_t.
+ *
+ * Header:
+ *   magic, version, number of node kinds, grammar fingerprint (low word,
+ *   then high word), number of nodes, pool length
+ * Node records, in breadth first order, root first:
+ *   kind, num_children, first_child, repr_off, repr_len
+ * Pool:
+ *   The codepoints of every node's tok_repr, back to back.
+ *
+ * The children of a node are the records first_child through
+ * first_child + num_children - 1. A NULL child has kind CALC_AST_NULL.
+ * A NULL tok_repr has repr_off CALC_AST_NULL. Offsets are indices, not
+ * pointers, so the format is position independent. %extra data is not
+ * stored.
+ */
+#define CALC_AST_MAGIC 0x54534750u
+#define CALC_AST_VERSION 2u
+#define CALC_AST_NULL UINT32_MAX
+#define CALC_AST_HEADER_WORDS 7u
+#define CALC_AST_RECORD_WORDS 5u
+
+// Returns 1 on success, 0 on failure.
+static inline int calc_astnode_serialize(calc_astnode_t* root, pgen_writer* w) {
+  const uintptr_t succ = (uintptr_t)_Alignof(calc_astnode_t);
+  size_t cap = 256, len = 0;
+  uint64_t pool_len = 0;
+  calc_astnode_t** order = (calc_astnode_t**)malloc(sizeof(calc_astnode_t*) * cap);
+  if (!order) return 0;
+  order[len++] = root;
+
+  // Lay the tree out breadth first, so that siblings are contiguous.
+  for (size_t i = 0; i < len; i++) {
+    calc_astnode_t* node = order[i];
+    if ((uintptr_t)node <= succ) continue;
+    if (node->tok_repr) pool_len += node->repr_len;
+    if (node->repr_len > UINT32_MAX) goto fail;
+    size_t nc = calc_astnode_num_children(node);
+    if (cap - len < nc) {
+      while (cap - len < nc) cap *= 2;
+      void* new_order = realloc(order, sizeof(calc_astnode_t*) * cap);
+      if (!new_order) goto fail;
+      order = (calc_astnode_t**)new_order;
+    }
+    for (size_t c = 0; c < nc; c++)
+      order[len++] = calc_astnode_child(node, c);
+  }
+  if (len >= UINT32_MAX || pool_len >= UINT32_MAX) goto fail;
+
+  pgen_write_u32(w, CALC_AST_MAGIC);
+  pgen_write_u32(w, CALC_AST_VERSION);
+  pgen_write_u32(w, CALC_NUM_NODEKINDS);
+  pgen_write_u32(w, (uint32_t)CALC_GRAMMAR_FINGERPRINT);
+  pgen_write_u32(w, (uint32_t)(CALC_GRAMMAR_FINGERPRINT >> 32));
+  pgen_write_u32(w, (uint32_t)len);
+  pgen_write_u32(w, (uint32_t)pool_len);
+
+  uint32_t next_child = 1, repr_off = 0;
+  for (size_t i = 0; i < len; i++) {
+    calc_astnode_t* node = order[i];
+    uint32_t rec[CALC_AST_RECORD_WORDS] = {CALC_AST_NULL, 0, 0, CALC_AST_NULL, 0};
+    if ((uintptr_t)node > succ) {
+      rec[0] = (uint32_t)node->kind;
+      rec[1] = (uint32_t)calc_astnode_num_children(node);
+      rec[2] = next_child;
+      rec[4] = (uint32_t)node->repr_len;
+      next_child += rec[1];
+      if (node->tok_repr) {
+        rec[3] = repr_off;
+        repr_off += rec[4];
       }
-    } else {
-      printf("%-11s", "");
     }
+    pgen_write(w, rec, sizeof(rec));
+  }
 
-    for (size_t i = 40; i < width; i++)
-      putchar(' ');
-    putchar('\n');
+  for (size_t i = 0; i < len; i++) {
+    calc_astnode_t* node = order[i];
+    if ((uintptr_t)node > succ && node->tok_repr)
+      pgen_write(w, node->tok_repr, node->repr_len * sizeof(codepoint_t));
+  }
+
+  free(order);
+  return !w->err;
+fail:
+  free(order);
+  return 0;
+}
+
+// A read only view of a serialized AST, which is used in place.
+// Node 0 is the root.
+typedef struct {
+  const uint32_t* nodes;
+  const codepoint_t* pool;
+  uint32_t num_nodes;
+  uint32_t pool_len;
+} calc_ast_view;
+
+// Validates the data and initializes the view. Returns 1 on success, 0 if
+// the data is not a well formed AST for this grammar. data must be 4 byte
+// aligned, and must outlive the view.
+static inline int calc_ast_view_init(calc_ast_view* view, const void* data, size_t len) {
+  const uint32_t* words = (const uint32_t*)data;
+  if ((uintptr_t)data % _Alignof(uint32_t)) return 0;
+  if (len % sizeof(uint32_t) || len < CALC_AST_HEADER_WORDS * sizeof(uint32_t)) return 0;
+  uint64_t fingerprint = words[3] | ((uint64_t)words[4] << 32);
+  if ((words[0] != CALC_AST_MAGIC) | (words[1] != CALC_AST_VERSION) |
+      (words[2] != CALC_NUM_NODEKINDS) |
+      (fingerprint != CALC_GRAMMAR_FINGERPRINT) | !words[5]) return 0;
+  uint64_t num_nodes = words[5], pool_len = words[6];
+  uint64_t total = CALC_AST_HEADER_WORDS + num_nodes * CALC_AST_RECORD_WORDS + pool_len;
+  if (total != (uint64_t)(len / sizeof(uint32_t))) return 0;
+
+  const uint32_t* rec = words + CALC_AST_HEADER_WORDS;
+  uint64_t next_child = 1;
+  for (uint64_t i = 0; i < num_nodes; i++, rec += CALC_AST_RECORD_WORDS) {
+    if (rec[0] == CALC_AST_NULL) {
+      if (rec[1]) return 0;
+      continue;
+    }
+    // Children come after their parents, so the view has no cycles and can
+    // be loaded from the back.
+    if ((rec[0] >= CALC_NUM_NODEKINDS) | (rec[2] != next_child) |
+        ((rec[1] != 0) & (rec[2] <= i)))
+      return 0;
+    next_child += rec[1];
+    if (rec[3] != CALC_AST_NULL && (uint64_t)rec[3] + rec[4] > pool_len) return 0;
   }
+  if (next_child != num_nodes) return 0;
+
+  view->nodes = words + CALC_AST_HEADER_WORDS;
+  view->pool = (const codepoint_t*)rec;
+  view->num_nodes = (uint32_t)num_nodes;
+  view->pool_len = (uint32_t)pool_len;
+  return 1;
+}
+
+static inline int calc_ast_view_isnull(const calc_ast_view* view, uint32_t n) {
+  return view->nodes[n * CALC_AST_RECORD_WORDS] == CALC_AST_NULL;
 }
 
-static inline void intr_enter(calc_parser_ctx* ctx, const char* name, size_t pos) {
-  intr_stack.rules[intr_stack.size++] = (intr_entry){name, pos};
-  intr_stack.status = 0;
-  intr_display(ctx, name);
+static inline calc_astnode_kind calc_ast_view_kind(const calc_ast_view* view, uint32_t n) {
+  return (calc_astnode_kind)view->nodes[n * CALC_AST_RECORD_WORDS];
 }
 
-static inline void intr_accept(calc_parser_ctx* ctx, const char* accpeting) {
-  intr_stack.size--;
-  intr_stack.status = 1;
-  intr_display(ctx, accpeting);
+static inline uint32_t calc_ast_view_num_children(const calc_ast_view* view, uint32_t n) {
+  return view->nodes[n * CALC_AST_RECORD_WORDS + 1];
 }
 
-static inline void intr_reject(calc_parser_ctx* ctx, const char* rejecting) {
-  intr_stack.size--;
-  intr_stack.status = -1;
-  intr_display(ctx, rejecting);
+static inline uint32_t calc_ast_view_child(const calc_ast_view* view, uint32_t n, uint32_t i) {
+  return view->nodes[n * CALC_AST_RECORD_WORDS + 2] + i;
 }
-static inline void intr_succ(calc_parser_ctx* ctx, const char* succing) {
-  intr_stack.size--;
-  intr_stack.status = 2;
-  intr_display(ctx, succing);
+
+// Returns NULL if the node has no tok_repr.
+static inline const codepoint_t* calc_ast_view_repr(const calc_ast_view* view, uint32_t n, size_t* len) {
+  const uint32_t* rec = view->nodes + n * CALC_AST_RECORD_WORDS;
+  *len = rec[4];
+  return rec[3] == CALC_AST_NULL ? NULL : view->pool + rec[3];
 }
+
+// Rebuilds a calc_astnode_t tree from a view. The tok_repr of each node points
+// into the view's pool, so the view's data must outlive the tree. The nodes
+// are allocated like fixed nodes, so children cannot be added to them.
+static inline calc_astnode_t* calc_ast_view_load(const calc_ast_view* view, pgen_allocator* alloc) {
+  calc_astnode_t** built = (calc_astnode_t**)malloc(sizeof(calc_astnode_t*) * view->num_nodes);
+  if (!built) PGEN_OOM();
+  // Children come after their parents, so build from the back.
+  for (uint32_t i = view->num_nodes; i-- > 0;) {
+    const uint32_t* rec = view->nodes + i * CALC_AST_RECORD_WORDS;
+    if (rec[0] == CALC_AST_NULL) {
+      built[i] = NULL;
+      continue;
+    }
+    uint32_t nc = rec[1];
+    calc_astnode_t *node;
+    if (nc >= UINT16_MAX) {
+      // Too many children for a fixed node. Only lists get this big, and
+      // lists have no NULL children.
+      node = calc_astnode_list(alloc, (calc_astnode_kind)rec[0], 16);
+      for (uint32_t c = 0; c < nc; c++)
+        if (built[rec[2] + c])
+          calc_astnode_add(alloc, node, built[rec[2] + c]);
+    } else {
+      char* ret = pgen_alloc(alloc,
+                             sizeof(calc_astnode_t) +
+                             sizeof(calc_astnode_t *) * nc,
+                             _Alignof(calc_astnode_t));
+      node = (calc_astnode_t *)ret;
+      node->kind = (calc_astnode_kind)rec[0];
+      node->parent = NULL;
+      node->max_children = 0;
+      node->num_children = (uint16_t)nc;
+      node->children = nc ? (calc_astnode_t **)(node + 1) : NULL;
+      for (uint32_t c = 0; c < nc; c++) {
+        node->children[c] = built[rec[2] + c];
+        if (node->children[c]) node->children[c]->parent = node;
+      }
+    }
+    node->tok_repr = rec[3] == CALC_AST_NULL ? NULL : (codepoint_t*)(uintptr_t)(view->pool + rec[3]);
+    node->repr_len = rec[4];
+    built[i] = node;
+  }
+  calc_astnode_t* root = built[0];
+  free(built);
+  return root;
+}
+
+/*
+ * Parse cache. Serialized ASTs are stored in a directory, in files named
+ * after a hash of the UTF-8 input and the grammar fingerprint. Only store
+ * the results of parses without errors.
+ */
+static inline uint64_t calc_parse_cache_key(const char* utf8, size_t len) {
+  return pgen_hash64(utf8, len, CALC_GRAMMAR_FINGERPRINT);
+}
+
+static inline char* calc_parse_cache_path(const char* dir, uint64_t key, uint64_t tmp) {
+  size_t dirlen = strlen(dir);
+  size_t pathlen = dirlen + 64;
+  char* path = (char*)malloc(pathlen);
+  if (!path) return NULL;
+  const char* sep = (dirlen && dir[dirlen - 1] != '/') ? "/" : "";
+  if (tmp)
+    snprintf(path, pathlen, "%s%s%016" PRIx64 ".ast.%016" PRIx64, dir, sep, key, tmp);
+  else
+    snprintf(path, pathlen, "%s%s%016" PRIx64 ".ast", dir, sep, key);
+  return path;
+}
+
+// Returns the cached AST for the input, allocated on alloc, or NULL on a miss.
+// The cache file stays mapped until alloc is destroyed.
+static inline calc_astnode_t* calc_parse_cache_load(const char* dir, const char* utf8, size_t len, pgen_allocator* alloc) {
+  char* path = calc_parse_cache_path(dir, calc_parse_cache_key(utf8, len), 0);
+  pgen_mapped_file* m = (pgen_mapped_file*)malloc(sizeof(pgen_mapped_file));
+  calc_ast_view view;
+  int hit = path && m && pgen_map_file(path, m) &&
+            calc_ast_view_init(&view, m->data, m->len);
+  free(path);
+  if (!hit) {
+    if (m) pgen_free_mapped_file(m);
+    return NULL;
+  }
+  calc_astnode_t* ast = calc_ast_view_load(&view, alloc);
+  pgen_defer(alloc, pgen_free_mapped_file, m, alloc->rew);
+  return ast;
+}
+
+// Saves the AST for the input. The file is written under a temporary name
+// and then renamed, so readers never see a partial file. Returns 1 on success.
+static inline int calc_parse_cache_store(const char* dir, const char* utf8, size_t len, calc_astnode_t* ast) {
+  static uint64_t counter = 0;
+  if (!ast) return 0;
+  // Make the temporary name unique between threads and processes.
+  uintptr_t here = (uintptr_t)&counter ^ (uintptr_t)&here;
+  uint64_t tmp = pgen_hash64(&here, sizeof(here), ++counter);
+#if PGEN_USE_POSIX
+  tmp ^= (uint64_t)getpid() << 32;
+#endif
+  tmp |= 1;
+  uint64_t key = calc_parse_cache_key(utf8, len);
+  char* path = calc_parse_cache_path(dir, key, 0);
+  char* tmp_path = calc_parse_cache_path(dir, key, tmp);
+  FILE* f = (path && tmp_path) ? fopen(tmp_path, "wb") : NULL;
+  int success = 0;
+  if (f) {
+    pgen_writer w = pgen_writer_file(f);
+    success = calc_astnode_serialize(ast, &w);
+    success &= pgen_writer_destroy(&w);
+    success &= !fclose(f);
+    if (success) success = !rename(tmp_path, path);
+    if (!success) remove(tmp_path);
+  }
+  free(path);
+  free(tmp_path);
+  return success;
+}
+
+#define SUCC                     (calc_astnode_t*)(void*)(uintptr_t)_Alignof(calc_astnode_t)
+
+#define rec(label)               pgen_parser_rewind_t _rew_##label = (pgen_parser_rewind_t){ctx->alloc->rew, ctx->pos};
+#define rew(label)               calc_parser_rewind(ctx, _rew_##label)
+#define node(kindname, ...)      PGEN_CAT(calc_astnode_fixed_, PGEN_NARG(__VA_ARGS__))(ctx->alloc, kind(kindname), __VA_ARGS__)
+#define kind(name)               CALC_NODE_##name
+#define list(kind)               calc_astnode_list(ctx->alloc, CALC_NODE_##kind, CALC_LIST_INITIAL_SIZE)
+#define leaf(kind)               calc_astnode_leaf(ctx->alloc, CALC_NODE_##kind)
+#define add(list, node)          calc_astnode_add(ctx->alloc, list, node)
+#define has(node)                (((uintptr_t)node <= (uintptr_t)SUCC) ? 0 : 1)
+#define repr(node, t)            calc_astnode_repr(node, t)
+#define srepr(node, s)           calc_astnode_srepr(ctx->alloc, node, (char*)s)
+#define cprepr(node, cps, len)   calc_astnode_cprepr(node, cps, len)
+#define expect(kind, cap)        ((ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == calc_TOK_##kind) ? ctx->pos++, (cap ? cprepr(leaf(kind), NULL, ctx->pos-1) : SUCC) : NULL)
+
+#define LB {
+#define RB }
+
+#define INFO(msg)                calc_report_parse_error(ctx, (const char*)msg, 0)
+#define WARNING(msg)             calc_report_parse_error(ctx, (const char*)msg, 1)
+#define ERROR(msg)               calc_report_parse_error(ctx, (const char*)msg, 2)
+#define FATAL(msg)               calc_report_parse_error(ctx, (const char*)msg, 3)
+
+
 static inline calc_astnode_t* calc_parse_expr(calc_parser_ctx* ctx);
 static inline calc_astnode_t* calc_parse_sumexpr(calc_parser_ctx* ctx);
 static inline calc_astnode_t* calc_parse_multexpr(calc_parser_ctx* ctx);
@@ -1435,7 +2795,11 @@ static inline calc_astnode_t* calc_parse_expr(calc_parser_ctx* ctx) {
   #define rule expr_ret_0
   calc_astnode_t* expr_ret_0 = NULL;
   calc_astnode_t* expr_ret_1 = NULL;
-  intr_enter(ctx, "expr", ctx->pos);
+  if (++ctx->depth > ctx->max_depth) {
+    calc_parser_too_deep(ctx);
+    return NULL;
+  }
+  if (!--ctx->fuel && calc_parser_refuel(ctx)) return NULL;
   calc_astnode_t* expr_ret_2 = NULL;
   rec(mod_2);
   // ModExprList Forwarding
@@ -1446,9 +2810,7 @@ static inline calc_astnode_t* calc_parse_expr(calc_parser_ctx* ctx) {
   expr_ret_1 = expr_ret_2;
   if (!rule) rule = expr_ret_1;
   if (!expr_ret_1) rule = NULL;
-  if (rule==SUCC) intr_succ(ctx, "expr");
-  else if (rule) intr_accept(ctx, "expr");
-  else intr_reject(ctx, "expr");
+  ctx->depth--;
   return rule;
   #undef rule
 }
@@ -1459,7 +2821,11 @@ static inline calc_astnode_t* calc_parse_sumexpr(calc_parser_ctx* ctx) {
   #define rule expr_ret_3
   calc_astnode_t* expr_ret_3 = NULL;
   calc_astnode_t* expr_ret_4 = NULL;
-  intr_enter(ctx, "sumexpr", ctx->pos);
+  if (++ctx->depth > ctx->max_depth) {
+    calc_parser_too_deep(ctx);
+    return NULL;
+  }
+  if (!--ctx->fuel && calc_parser_refuel(ctx)) return NULL;
   calc_astnode_t* expr_ret_5 = NULL;
   rec(mod_5);
   // ModExprList 0
@@ -1474,6 +2840,7 @@ static inline calc_astnode_t* calc_parse_sumexpr(calc_parser_ctx* ctx) {
     calc_astnode_t* expr_ret_8 = SUCC;
     while (expr_ret_8)
     {
+      if (!--ctx->fuel && calc_parser_refuel(ctx)) return NULL;
       rec(kleene_rew_7);
       calc_astnode_t* expr_ret_9 = NULL;
 
@@ -1482,7 +2849,6 @@ static inline calc_astnode_t* calc_parse_sumexpr(calc_parser_ctx* ctx) {
         calc_astnode_t* expr_ret_10 = NULL;
         rec(mod_10);
         // ModExprList 0
-        intr_enter(ctx, "PLUS", ctx->pos);
         if (ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == CALC_TOK_PLUS) {
           // Not capturing PLUS.
           expr_ret_10 = SUCC;
@@ -1491,7 +2857,6 @@ static inline calc_astnode_t* calc_parse_sumexpr(calc_parser_ctx* ctx) {
           expr_ret_10 = NULL;
         }
 
-        if (expr_ret_10) intr_accept(ctx, "PLUS"); else intr_reject(ctx, "PLUS");
         // ModExprList 1
         if (expr_ret_10) {
           calc_astnode_t* expr_ret_11 = NULL;
@@ -1504,11 +2869,9 @@ static inline calc_astnode_t* calc_parse_sumexpr(calc_parser_ctx* ctx) {
         // ModExprList 2
         if (expr_ret_10) {
           // CodeExpr
-          intr_enter(ctx, "CodeExpr", ctx->pos);
           #define ret expr_ret_10
           ret = SUCC;
           rule=node(PLUS, rule, n);
-          if (ret) intr_accept(ctx, "CodeExpr"); else intr_reject(ctx, "CodeExpr");
           #undef ret
         }
 
@@ -1522,7 +2885,6 @@ static inline calc_astnode_t* calc_parse_sumexpr(calc_parser_ctx* ctx) {
         calc_astnode_t* expr_ret_12 = NULL;
         rec(mod_12);
         // ModExprList 0
-        intr_enter(ctx, "MINUS", ctx->pos);
         if (ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == CALC_TOK_MINUS) {
           // Not capturing MINUS.
           expr_ret_12 = SUCC;
@@ -1531,7 +2893,6 @@ static inline calc_astnode_t* calc_parse_sumexpr(calc_parser_ctx* ctx) {
           expr_ret_12 = NULL;
         }
 
-        if (expr_ret_12) intr_accept(ctx, "MINUS"); else intr_reject(ctx, "MINUS");
         // ModExprList 1
         if (expr_ret_12) {
           calc_astnode_t* expr_ret_13 = NULL;
@@ -1544,11 +2905,9 @@ static inline calc_astnode_t* calc_parse_sumexpr(calc_parser_ctx* ctx) {
         // ModExprList 2
         if (expr_ret_12) {
           // CodeExpr
-          intr_enter(ctx, "CodeExpr", ctx->pos);
           #define ret expr_ret_12
           ret = SUCC;
           rule=node(MINUS, rule, n);
-          if (ret) intr_accept(ctx, "CodeExpr"); else intr_reject(ctx, "CodeExpr");
           #undef ret
         }
 
@@ -1571,9 +2930,7 @@ static inline calc_astnode_t* calc_parse_sumexpr(calc_parser_ctx* ctx) {
   expr_ret_4 = expr_ret_5;
   if (!rule) rule = expr_ret_4;
   if (!expr_ret_4) rule = NULL;
-  if (rule==SUCC) intr_succ(ctx, "sumexpr");
-  else if (rule) intr_accept(ctx, "sumexpr");
-  else intr_reject(ctx, "sumexpr");
+  ctx->depth--;
   return rule;
   #undef rule
 }
@@ -1584,7 +2941,11 @@ static inline calc_astnode_t* calc_parse_multexpr(calc_parser_ctx* ctx) {
   #define rule expr_ret_14
   calc_astnode_t* expr_ret_14 = NULL;
   calc_astnode_t* expr_ret_15 = NULL;
-  intr_enter(ctx, "multexpr", ctx->pos);
+  if (++ctx->depth > ctx->max_depth) {
+    calc_parser_too_deep(ctx);
+    return NULL;
+  }
+  if (!--ctx->fuel && calc_parser_refuel(ctx)) return NULL;
   calc_astnode_t* expr_ret_16 = NULL;
   rec(mod_16);
   // ModExprList 0
@@ -1599,6 +2960,7 @@ static inline calc_astnode_t* calc_parse_multexpr(calc_parser_ctx* ctx) {
     calc_astnode_t* expr_ret_19 = SUCC;
     while (expr_ret_19)
     {
+      if (!--ctx->fuel && calc_parser_refuel(ctx)) return NULL;
       rec(kleene_rew_18);
       calc_astnode_t* expr_ret_20 = NULL;
 
@@ -1607,7 +2969,6 @@ static inline calc_astnode_t* calc_parse_multexpr(calc_parser_ctx* ctx) {
         calc_astnode_t* expr_ret_21 = NULL;
         rec(mod_21);
         // ModExprList 0
-        intr_enter(ctx, "MULT", ctx->pos);
         if (ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == CALC_TOK_MULT) {
           // Not capturing MULT.
           expr_ret_21 = SUCC;
@@ -1616,7 +2977,6 @@ static inline calc_astnode_t* calc_parse_multexpr(calc_parser_ctx* ctx) {
           expr_ret_21 = NULL;
         }
 
-        if (expr_ret_21) intr_accept(ctx, "MULT"); else intr_reject(ctx, "MULT");
         // ModExprList 1
         if (expr_ret_21) {
           calc_astnode_t* expr_ret_22 = NULL;
@@ -1629,11 +2989,9 @@ static inline calc_astnode_t* calc_parse_multexpr(calc_parser_ctx* ctx) {
         // ModExprList 2
         if (expr_ret_21) {
           // CodeExpr
-          intr_enter(ctx, "CodeExpr", ctx->pos);
           #define ret expr_ret_21
           ret = SUCC;
           rule=node(MULT, rule, n);
-          if (ret) intr_accept(ctx, "CodeExpr"); else intr_reject(ctx, "CodeExpr");
           #undef ret
         }
 
@@ -1647,7 +3005,6 @@ static inline calc_astnode_t* calc_parse_multexpr(calc_parser_ctx* ctx) {
         calc_astnode_t* expr_ret_23 = NULL;
         rec(mod_23);
         // ModExprList 0
-        intr_enter(ctx, "DIV", ctx->pos);
         if (ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == CALC_TOK_DIV) {
           // Not capturing DIV.
           expr_ret_23 = SUCC;
@@ -1656,7 +3013,6 @@ static inline calc_astnode_t* calc_parse_multexpr(calc_parser_ctx* ctx) {
           expr_ret_23 = NULL;
         }
 
-        if (expr_ret_23) intr_accept(ctx, "DIV"); else intr_reject(ctx, "DIV");
         // ModExprList 1
         if (expr_ret_23) {
           calc_astnode_t* expr_ret_24 = NULL;
@@ -1669,11 +3025,9 @@ static inline calc_astnode_t* calc_parse_multexpr(calc_parser_ctx* ctx) {
         // ModExprList 2
         if (expr_ret_23) {
           // CodeExpr
-          intr_enter(ctx, "CodeExpr", ctx->pos);
           #define ret expr_ret_23
           ret = SUCC;
           rule=node(DIV,  rule, n);
-          if (ret) intr_accept(ctx, "CodeExpr"); else intr_reject(ctx, "CodeExpr");
           #undef ret
         }
 
@@ -1696,9 +3050,7 @@ static inline calc_astnode_t* calc_parse_multexpr(calc_parser_ctx* ctx) {
   expr_ret_15 = expr_ret_16;
   if (!rule) rule = expr_ret_15;
   if (!expr_ret_15) rule = NULL;
-  if (rule==SUCC) intr_succ(ctx, "multexpr");
-  else if (rule) intr_accept(ctx, "multexpr");
-  else intr_reject(ctx, "multexpr");
+  ctx->depth--;
   return rule;
   #undef rule
 }
@@ -1708,7 +3060,11 @@ static inline calc_astnode_t* calc_parse_baseexpr(calc_parser_ctx* ctx) {
   #define rule expr_ret_25
   calc_astnode_t* expr_ret_25 = NULL;
   calc_astnode_t* expr_ret_26 = NULL;
-  intr_enter(ctx, "baseexpr", ctx->pos);
+  if (++ctx->depth > ctx->max_depth) {
+    calc_parser_too_deep(ctx);
+    return NULL;
+  }
+  if (!--ctx->fuel && calc_parser_refuel(ctx)) return NULL;
   calc_astnode_t* expr_ret_27 = NULL;
 
   // SlashExpr 0
@@ -1716,7 +3072,6 @@ static inline calc_astnode_t* calc_parse_baseexpr(calc_parser_ctx* ctx) {
     calc_astnode_t* expr_ret_28 = NULL;
     rec(mod_28);
     // ModExprList 0
-    intr_enter(ctx, "OPEN", ctx->pos);
     if (ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == CALC_TOK_OPEN) {
       // Not capturing OPEN.
       expr_ret_28 = SUCC;
@@ -1725,7 +3080,6 @@ static inline calc_astnode_t* calc_parse_baseexpr(calc_parser_ctx* ctx) {
       expr_ret_28 = NULL;
     }
 
-    if (expr_ret_28) intr_accept(ctx, "OPEN"); else intr_reject(ctx, "OPEN");
     // ModExprList 1
     if (expr_ret_28) {
       calc_astnode_t* expr_ret_29 = NULL;
@@ -1737,7 +3091,6 @@ static inline calc_astnode_t* calc_parse_baseexpr(calc_parser_ctx* ctx) {
 
     // ModExprList 2
     if (expr_ret_28) {
-      intr_enter(ctx, "CLOSE", ctx->pos);
       if (ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == CALC_TOK_CLOSE) {
         // Capturing CLOSE.
         expr_ret_28 = leaf(CLOSE);
@@ -1748,7 +3101,6 @@ static inline calc_astnode_t* calc_parse_baseexpr(calc_parser_ctx* ctx) {
         expr_ret_28 = NULL;
       }
 
-      if (expr_ret_28) intr_accept(ctx, "CLOSE"); else intr_reject(ctx, "CLOSE");
     }
 
     // ModExprList end
@@ -1761,7 +3113,6 @@ static inline calc_astnode_t* calc_parse_baseexpr(calc_parser_ctx* ctx) {
     calc_astnode_t* expr_ret_30 = NULL;
     rec(mod_30);
     // ModExprList Forwarding
-    intr_enter(ctx, "NUMBER", ctx->pos);
     if (ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == CALC_TOK_NUMBER) {
       // Capturing NUMBER.
       expr_ret_30 = leaf(NUMBER);
@@ -1772,7 +3123,6 @@ static inline calc_astnode_t* calc_parse_baseexpr(calc_parser_ctx* ctx) {
       expr_ret_30 = NULL;
     }
 
-    if (expr_ret_30) intr_accept(ctx, "NUMBER"); else intr_reject(ctx, "NUMBER");
     // ModExprList end
     if (!expr_ret_30) rew(mod_30);
     expr_ret_27 = expr_ret_30;
@@ -1783,9 +3133,7 @@ static inline calc_astnode_t* calc_parse_baseexpr(calc_parser_ctx* ctx) {
 
   if (!rule) rule = expr_ret_26;
   if (!expr_ret_26) rule = NULL;
-  if (rule==SUCC) intr_succ(ctx, "baseexpr");
-  else if (rule) intr_accept(ctx, "baseexpr");
-  else intr_reject(ctx, "baseexpr");
+  ctx->depth--;
   return rule;
   #undef rule
 }
@@ -1820,6 +3168,16 @@ static inline calc_astnode_t* calc_parse_baseexpr(calc_parser_ctx* ctx) {
 #undef PGEN_MAX4
 #undef PGEN_MIN5
 #undef PGEN_MAX5
+#undef PGEN_MIN6
+#undef PGEN_MAX6
+#undef PGEN_MIN7
+#undef PGEN_MAX7
+#undef PGEN_MIN8
+#undef PGEN_MAX8
+#undef PGEN_MIN9
+#undef PGEN_MAX9
+#undef PGEN_MIN10
+#undef PGEN_MAX10
 
 #undef LB
 #undef RB
@@ -44,13 +44,14 @@ static PyObject *ast_to_python_dict(calc_astnode_t *node) {
   Py_DECREF(tok_repr_str);
 
   // Add children to the dictionary
-  PyObject *children_list = PyList_New(node->num_children);
+  size_t num_children = calc_astnode_num_children(node);
+  PyObject *children_list = PyList_New((Py_ssize_t)num_children);
   if (!children_list) {
     Py_DECREF(dict);
     return NULL;
   }
-  for (uint16_t i = 0; i < node->num_children; i++) {
-    PyObject *child = ast_to_python_dict(node->children[i]);
+  for (size_t i = 0; i < num_children; i++) {
+    PyObject *child = ast_to_python_dict(calc_astnode_child(node, i));
     if (!child) {
       Py_DECREF(children_list);
       Py_DECREF(dict);
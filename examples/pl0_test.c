@@ -0,0 +1,689 @@
+#include "pl0.h"
+#include "pl0_all.h"
+
+#include <stdio.h>
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond))                                                               \
+      fprintf(stderr, "Check failed on line %i: %s\n", __LINE__, #cond),       \
+          exit(1);                                                             \
+  } while (0)
+
+// xorshift64*, seeded the same every run, so failures reproduce.
+static uint64_t rng_state = 1;
+static inline uint32_t rng(uint32_t n) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (uint32_t)((rng_state * UINT64_C(2685821657736338717)) >> 32) % n;
+}
+
+typedef struct {
+  pl0_token *buf;
+  size_t len;
+  size_t cap;
+} toklist;
+
+// Tokenizes the input, leaving out the tokens the parser ignores.
+static inline toklist tokenize(codepoint_t *cps, size_t cpslen) {
+  toklist toks = {NULL, 0, 0};
+  pl0_tokenizer tokenizer;
+  pl0_tokenizer_init(&tokenizer, cps, cpslen);
+  pl0_token tok;
+  do {
+    tok = pl0_nextToken(&tokenizer);
+    if (tok.kind == PL0_TOK_SLCOM || tok.kind == PL0_TOK_MLCOM ||
+        tok.kind == PL0_TOK_WS || tok.kind == PL0_TOK_STREAMEND)
+      continue;
+    if (toks.len == toks.cap) {
+      toks.cap = toks.cap ? toks.cap * 2 : 4096;
+      toks.buf = (pl0_token *)realloc(toks.buf, sizeof(pl0_token) * toks.cap);
+      CHECK(toks.buf);
+    }
+    toks.buf[toks.len++] = tok;
+  } while (tok.kind != PL0_TOK_STREAMEND);
+  return toks;
+}
+
+static void *deferred[3];
+static size_t num_freed;
+static inline void count_free(void *ptr) {
+  for (size_t i = 0; i < 3; i++)
+    if (deferred[i] == ptr)
+      deferred[i] = NULL;
+  num_freed++;
+  free(ptr);
+}
+
+// Rewinding frees what was deferred after the rewind point, and nothing
+// before it, even when the two are in different arenas.
+static inline void test_rewind_across_arenas(void) {
+  pgen_allocator alloc = pgen_allocator_new();
+  pgen_alloc(&alloc, PGEN_BUFFER_SIZE - 64, 1);
+  deferred[0] = malloc(1);
+  pgen_defer(&alloc, count_free, deferred[0], alloc.rew);
+
+  pgen_alloc(&alloc, 128, 1);
+  CHECK(alloc.rew.arena_idx == 1);
+  pgen_allocator_rewind_t rew = alloc.rew;
+  deferred[1] = malloc(1);
+  pgen_defer(&alloc, count_free, deferred[1], rew);
+
+  pgen_alloc(&alloc, 8, 1);
+  deferred[2] = malloc(1);
+  pgen_defer(&alloc, count_free, deferred[2], alloc.rew);
+
+  pgen_allocator_rewind(&alloc, rew);
+  CHECK(num_freed == 1 && !deferred[2]);
+  CHECK(deferred[0] && deferred[1] && alloc.freelist.len == 2);
+
+  pgen_allocator_destroy(&alloc);
+  CHECK(num_freed == 3);
+}
+
+// A list with more children than fit in two chunks. Its nodes spill into
+// later arenas, and the last failed iteration of the loop that reads them
+// rewinds there, after the list was allocated.
+static inline void test_big_list(void) {
+  const char item[] = ", x = 1";
+  size_t items = 140000, ilen = sizeof(item) - 1, len = 0;
+  size_t cpslen = 5 + items * ilen + 2;
+  codepoint_t *cps = (codepoint_t *)malloc(sizeof(codepoint_t) * cpslen);
+  CHECK(cps);
+  for (size_t i = 0; i < 5; i++)
+    cps[len++] = (codepoint_t)"const"[i];
+  for (size_t i = 1; i < items * ilen; i++)
+    cps[len++] = (codepoint_t)item[i % ilen];
+  cps[len++] = ';';
+  cps[len++] = '.';
+
+  toklist toks = tokenize(cps, len);
+  pgen_allocator alloc = pgen_allocator_new();
+  pl0_parser_ctx parser;
+  pl0_parser_ctx_init(&parser, &alloc, toks.buf, toks.len);
+  pl0_astnode_t *ast = pl0_parse_program(&parser);
+  CHECK(ast && !parser.num_errors);
+  CHECK(alloc.rew.arena_idx > 0);
+
+  CHECK(pl0_astnode_num_children(ast) == 1);
+  pl0_astnode_t *list = pl0_astnode_child(ast, 0);
+  CHECK(list->kind == PL0_NODE_CONSTLIST);
+  CHECK(pl0_astnode_num_children(list) == items);
+  for (size_t i = 0; i < items; i++)
+    CHECK(pl0_astnode_child(list, i)->kind == PL0_NODE_CONST);
+
+  pgen_allocator_destroy(&alloc);
+  free(toks.buf);
+  free(cps);
+}
+
+// A list made with no room for children frees the buffer it grows into.
+// The leak check at exit catches it if it doesn't.
+static inline void test_empty_list(void) {
+  pgen_allocator alloc = pgen_allocator_new();
+  pl0_astnode_t *list = pl0_astnode_list(&alloc, PL0_NODE_VARLIST, 0);
+  CHECK(!alloc.freelist.len);
+  for (size_t i = 0; i < 70000; i++)
+    pl0_astnode_add(&alloc, list, pl0_astnode_leaf(&alloc, PL0_NODE_IDENT));
+  CHECK(alloc.freelist.len == 1);
+  CHECK(pl0_astnode_num_children(list) == 70000);
+  pgen_allocator_destroy(&alloc);
+}
+
+// Parses a small program. The tokens and the codepoints they point into
+// have to outlive the AST.
+static inline pl0_astnode_t *parse(const char *src, pgen_allocator *alloc,
+                                   toklist *toks, codepoint_t **cps) {
+  size_t len = strlen(src);
+  *cps = (codepoint_t *)malloc(sizeof(codepoint_t) * len);
+  CHECK(*cps);
+  for (size_t i = 0; i < len; i++)
+    (*cps)[i] = (codepoint_t)src[i];
+  *toks = tokenize(*cps, len);
+  pl0_parser_ctx parser;
+  pl0_parser_ctx_init(&parser, alloc, toks->buf, toks->len);
+  pl0_astnode_t *ast = pl0_parse_program(&parser);
+  CHECK(ast && !parser.num_errors);
+  return ast;
+}
+
+// Serializes a small program's AST into a buffer of words.
+static inline uint32_t *serialize(const char *src, size_t *num_words) {
+  pgen_allocator alloc = pgen_allocator_new();
+  toklist toks;
+  codepoint_t *cps;
+  pl0_astnode_t *ast = parse(src, &alloc, &toks, &cps);
+
+  pgen_writer w = pgen_writer_mem();
+  CHECK(pl0_astnode_serialize(ast, &w));
+  uint32_t *words = (uint32_t *)malloc(w.len);
+  CHECK(words);
+  memcpy(words, w.buf, w.len);
+  *num_words = w.len / sizeof(uint32_t);
+
+  pgen_writer_destroy(&w);
+  pgen_allocator_destroy(&alloc);
+  free(toks.buf);
+  free(cps);
+  return words;
+}
+
+static inline size_t count_nodes(pl0_astnode_t *node) {
+  size_t n = 1;
+  for (size_t i = 0; i < pl0_astnode_num_children(node); i++)
+    if (pl0_astnode_child(node, i))
+      n += count_nodes(pl0_astnode_child(node, i));
+  return n;
+}
+
+// Records 1 and 2 are their own children.
+static const uint32_t self_child[] = {
+    0, 0, 1, PL0_AST_NULL, 0, 0, 1, 1, PL0_AST_NULL, 0,
+    0, 1, 2, PL0_AST_NULL, 0};
+
+// Header words, then (kind, num_children, first_child, repr_off, repr_len)
+// for each of the 3 records, and no pool.
+static inline void set_records(uint32_t *words, const uint32_t *recs) {
+  uint32_t header[PL0_AST_HEADER_WORDS] = {
+      PL0_AST_MAGIC, PL0_AST_VERSION, PL0_NUM_NODEKINDS,
+      (uint32_t)PL0_GRAMMAR_FINGERPRINT,
+      (uint32_t)(PL0_GRAMMAR_FINGERPRINT >> 32), 3, 0};
+  memcpy(words, header, sizeof(header));
+  memcpy(words + PL0_AST_HEADER_WORDS, recs,
+         sizeof(uint32_t) * 3 * PL0_AST_RECORD_WORDS);
+}
+
+// Malformed data is rejected by view_init, and whatever it accepts can be
+// loaded.
+static inline void test_view_init(void) {
+  size_t len;
+  uint32_t *words = serialize("var x, y; const z = 2;\n"
+                              "procedure p; x := y * (z + 1);\n"
+                              "begin call p; write x end;\n.",
+                              &len);
+  size_t bytes = len * sizeof(uint32_t);
+  pl0_ast_view view;
+  CHECK(pl0_ast_view_init(&view, words, bytes));
+  pgen_allocator alloc = pgen_allocator_new();
+  size_t num_nodes = count_nodes(pl0_ast_view_load(&view, &alloc));
+  pgen_allocator_destroy(&alloc);
+
+  for (size_t cut = 0; cut < len; cut++)
+    CHECK(!pl0_ast_view_init(&view, words, cut * sizeof(uint32_t)));
+  CHECK(!pl0_ast_view_init(&view, words, bytes - 1));
+  CHECK(!pl0_ast_view_init(&view, (char *)words + 4, bytes - 4));
+
+  // Records whose children are themselves, or come before them.
+  uint32_t crafted[PL0_AST_HEADER_WORDS + 3 * PL0_AST_RECORD_WORDS];
+  const uint32_t back[] = {0, 0, 1, PL0_AST_NULL, 0, 0, 0, 1, PL0_AST_NULL,
+                           0, 0, 2, 1, PL0_AST_NULL, 0};
+  const uint32_t ok[] = {0, 2, 1, PL0_AST_NULL, 0, 0, 0, 3, PL0_AST_NULL,
+                         0, 0, 0, 3, PL0_AST_NULL, 0};
+  set_records(crafted, self_child);
+  CHECK(!pl0_ast_view_init(&view, crafted, sizeof(crafted)));
+  set_records(crafted, back);
+  CHECK(!pl0_ast_view_init(&view, crafted, sizeof(crafted)));
+  set_records(crafted, ok);
+  CHECK(pl0_ast_view_init(&view, crafted, sizeof(crafted)));
+
+  // Change every word in a few ways.
+  uint32_t *bad = (uint32_t *)malloc(bytes);
+  CHECK(bad);
+  for (size_t i = 0; i < len; i++) {
+    uint32_t values[] = {0, 1, 2, words[i] + 1, words[i] - 1, UINT32_MAX};
+    for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); v++) {
+      memcpy(bad, words, bytes);
+      bad[i] = values[v];
+      if (!pl0_ast_view_init(&view, bad, bytes))
+        continue;
+      alloc = pgen_allocator_new();
+      pl0_astnode_t *ast = pl0_ast_view_load(&view, &alloc);
+      CHECK(!ast || count_nodes(ast) <= num_nodes);
+      pgen_allocator_destroy(&alloc);
+    }
+  }
+
+  free(bad);
+  free(words);
+}
+
+// Goes through the parse cache in the current directory, the way the
+// README does, and returns the number of nodes in the AST. Sets parsed if
+// it missed and had to parse.
+static inline size_t cached_parse(const char *src, int *parsed) {
+  pgen_allocator alloc = pgen_allocator_new();
+  toklist toks = {NULL, 0, 0};
+  codepoint_t *cps = NULL;
+  pl0_astnode_t *ast = pl0_parse_cache_load("", src, strlen(src), &alloc);
+  *parsed = !ast;
+  if (!ast) {
+    ast = parse(src, &alloc, &toks, &cps);
+    CHECK(pl0_parse_cache_store("", src, strlen(src), ast));
+  }
+  size_t n = count_nodes(ast);
+  pgen_allocator_destroy(&alloc);
+  free(toks.buf);
+  free(cps);
+  return n;
+}
+
+// A corrupt or truncated cache file is a miss, and gets parsed again.
+static inline void test_corrupt_cache(void) {
+  const char *src = "var x; x := x + 1; while odd x do x := x * 2;\n.";
+  char path[64];
+  snprintf(path, sizeof(path), "%016" PRIx64 ".ast",
+           pl0_parse_cache_key(src, strlen(src)));
+  remove(path);
+
+  int parsed;
+  size_t n = cached_parse(src, &parsed);
+  CHECK(parsed);
+  CHECK(cached_parse(src, &parsed) == n && !parsed);
+
+  // Empty, truncated, from another version, with the root's children in
+  // the wrong place, and with a record that's its own child.
+  size_t len;
+  uint32_t *words = serialize(src, &len);
+  uint32_t crafted[PL0_AST_HEADER_WORDS + 3 * PL0_AST_RECORD_WORDS];
+  set_records(crafted, self_child);
+  for (size_t corruption = 0; corruption < 5; corruption++) {
+    uint32_t *data = words, saved = 0, *word = NULL;
+    size_t data_len = len;
+    if (corruption == 0)
+      data_len = 0;
+    else if (corruption == 1)
+      data_len = len / 2;
+    else if (corruption == 2)
+      word = words + 1;
+    else if (corruption == 3)
+      word = words + PL0_AST_HEADER_WORDS + 2;
+    else
+      data = crafted, data_len = sizeof(crafted) / sizeof(uint32_t);
+    if (word)
+      saved = *word, *word = 0;
+
+    FILE *f = fopen(path, "wb");
+    CHECK(f);
+    CHECK(fwrite(data, sizeof(uint32_t), data_len, f) == data_len);
+    fclose(f);
+    if (word)
+      *word = saved;
+
+    CHECK(cached_parse(src, &parsed) == n && parsed);
+    CHECK(cached_parse(src, &parsed) == n && !parsed);
+  }
+
+  free(words);
+  remove(path);
+}
+
+// Parses the source with a step budget, returning the number of steps it
+// took, and whether it ran out.
+static inline size_t budgeted_parse(const char *src, size_t max_steps,
+                                    int *aborted) {
+  pgen_allocator alloc = pgen_allocator_new();
+  size_t len = strlen(src);
+  codepoint_t *cps = (codepoint_t *)malloc(sizeof(codepoint_t) * len);
+  CHECK(cps);
+  for (size_t i = 0; i < len; i++)
+    cps[i] = (codepoint_t)src[i];
+  toklist toks = tokenize(cps, len);
+  pl0_parser_ctx parser;
+  pl0_parser_ctx_init(&parser, &alloc, toks.buf, toks.len);
+  pl0_parser_set_budget(&parser, max_steps, 0);
+  pl0_astnode_t *ast = pl0_parse_program(&parser);
+  *aborted = parser.aborted == PL0_ABORT_STEPS;
+  CHECK(*aborted ? !ast : ast && !parser.num_errors);
+  size_t steps = pl0_parser_steps(&parser);
+  pgen_allocator_destroy(&alloc);
+  free(toks.buf);
+  free(cps);
+  return steps;
+}
+
+// A budget of exactly the steps a parse takes is enough, and one less
+// isn't.
+static inline void test_budget(void) {
+  const char *src = "var x, y; procedure p; begin x := x - 1; y := y * 2 end;\n"
+                    "begin x := 9; y := 1; while x > 0 do call p end;\n.";
+  int aborted;
+  size_t steps = budgeted_parse(src, 0, &aborted);
+  CHECK(!aborted && steps > 1);
+  CHECK(budgeted_parse(src, steps, &aborted) == steps && !aborted);
+  budgeted_parse(src, steps - 1, &aborted);
+  CHECK(aborted);
+  budgeted_parse(src, 1, &aborted);
+  CHECK(aborted);
+}
+
+typedef size_t (*skip_fn)(const codepoint_t *, size_t);
+
+// The SIMD parts of the skip loops stop where the scalar part does. A skip
+// loop given one codepoint never gets to its SIMD part, so that's the
+// reference.
+static inline void test_skip_loops(void) {
+  const skip_fn skips[] = {pl0_skip_0_1, pl0_skip_1_2, pl0_skip_2_1,
+                           pl0_skip_3_2, pl0_skip_3_3, pl0_skip_4_2};
+  // Codepoints on either side of the ranges that the loops check.
+  const codepoint_t near[] = {
+      0,       '\t',    '\n',     '\r',    ' ',     '*',  '/',  '0' - 1,
+      '0',     '9',     '9' + 1,  'A' - 1, 'A',     'Z',  '[',  '_',
+      'a' - 1, 'a',     'z',      'z' + 1, 0x7F,    0x80, 0xE9, 0x4E16,
+      0xFFFF,  0x10000, 0x10FFFF};
+  const size_t num_near = sizeof(near) / sizeof(near[0]);
+  codepoint_t s[8 + 64], skipped[sizeof(near) / sizeof(near[0])];
+  for (size_t iter = 0; iter < 100000; iter++) {
+    skip_fn skip = skips[rng(sizeof(skips) / sizeof(skips[0]))];
+    size_t num_skipped = 0;
+    for (size_t i = 0; i < num_near; i++)
+      if (skip(near + i, 1))
+        skipped[num_skipped++] = near[i];
+    CHECK(num_skipped);
+
+    // Mostly codepoints that get skipped, so that the runs are long. The
+    // start is unaligned, and the length isn't a multiple of the width.
+    size_t off = rng(8), n = rng(65);
+    for (size_t i = 0; i < n; i++) {
+      uint32_t pick = rng(32);
+      s[off + i] = pick > 1    ? skipped[rng((uint32_t)num_skipped)]
+                   : pick == 1 ? near[rng((uint32_t)num_near)]
+                               : (codepoint_t)rng(0x110000);
+    }
+    size_t expected = 0;
+    while (expected < n && skip(s + off + expected, 1))
+      expected++;
+    CHECK(skip(s + off, n) == expected);
+  }
+}
+
+// Decodes utf8 that's known to be valid. Returns NULL for "".
+static inline codepoint_t *decode(const char *utf8, size_t *len) {
+  codepoint_t *cps = NULL;
+  *len = 0;
+  if (!*utf8)
+    return cps;
+  CHECK(UTF8_decode((char *)utf8, strlen(utf8), &cps, len));
+  return cps;
+}
+
+// Serializes an AST made with pl0_all.h. Returns NULL for a NULL AST.
+static inline pgen_writer *serialize_all(pl0_all_astnode_t *ast,
+                                         pgen_writer *w) {
+  if (!ast)
+    return NULL;
+  *w = pgen_writer_mem();
+  CHECK(pl0_all_astnode_serialize(ast, w));
+  return w;
+}
+
+// Text to insert, including pieces of tokens, and comments with codepoints
+// that take more than one byte.
+static const char *edits[] = {
+    "begin ", " end", ";",         "x := x + 1", " call p", "while x > 0 do ",
+    "if odd y then ", "write x",  "(",         ")",       " ",
+    "\n",    "/* é ",  "*/",        "// 🙂\n", "1",      "y",
+    ".",      ":=",     ":",         "var z; ",  "const c = 3, d = 4; ",
+    "procedure q; ", "begi", "n", "x", "-"};
+
+// Picks an edit to the text. Most keep a valid program valid: changing a
+// digit or a letter, or adding a statement after a semicolon. The rest are
+// anything at all. Once the text has had errors for a while, it's changed
+// back to the last text that didn't.
+static inline void pick_edit(codepoint_t *text, size_t len, codepoint_t *valid,
+                             size_t valid_len, size_t errors_for,
+                             pl0_all_edit *edit, codepoint_t **ins) {
+  size_t ins_len = 0;
+  *ins = NULL;
+  if (errors_for > 4) {
+    size_t pre = 0, suf = 0;
+    while (pre < len && pre < valid_len && text[pre] == valid[pre])
+      pre++;
+    while (suf < len - pre && suf < valid_len - pre &&
+           text[len - suf - 1] == valid[valid_len - suf - 1])
+      suf++;
+    ins_len = valid_len - pre - suf;
+    *ins = (codepoint_t *)malloc(sizeof(codepoint_t) * (ins_len + 1));
+    CHECK(*ins);
+    memcpy(*ins, valid + pre, sizeof(codepoint_t) * ins_len);
+    edit->start = pre;
+    edit->old_end = len - suf;
+  } else if (rng(4)) {
+    size_t at = rng((uint32_t)len + 1);
+    while (at < len && !(text[at] >= '0' && text[at] <= '9') &&
+           !(text[at] >= 'a' && text[at] <= 'z') && text[at] != ';')
+      at++;
+    const char *with = "x := x + 1;";
+    char c[2] = {0, 0};
+    if (at == len) {
+      with = "";
+    } else if (text[at] != ';') {
+      with = c;
+      c[0] = text[at] <= '9' ? (char)('0' + rng(10)) : (char)('a' + rng(26));
+    } else {
+      at++;
+    }
+    *ins = decode(with, &ins_len);
+    edit->start = at;
+    edit->old_end = at + (with == c);
+  } else {
+    // Replace up to 8 codepoints with one of the edits, or with nothing.
+    edit->start = rng((uint32_t)len + 1);
+    size_t max_del = len - edit->start < 8 ? len - edit->start : 8;
+    edit->old_end = edit->start + rng((uint32_t)max_del + 1);
+    if (rng(3))
+      *ins = decode(edits[rng(sizeof(edits) / sizeof(edits[0]))], &ins_len);
+  }
+  edit->new_end = edit->start + ins_len;
+}
+
+// A document reparsed after each of a series of random edits has the same
+// AST and errors as a fresh parse of the new text.
+static inline void test_incremental(void) {
+  size_t len, valid_len = 0, errors_for = 0;
+  codepoint_t *text = decode(
+      "const n = 10;\n"
+      "var x, y; procedure p; begin x := x - 1; y := y * 2 end;\n"
+      "/* Double y n times. */\n"
+      "begin x := n; y := 1; while x > 0 do call p; write y end;\n.",
+      &len);
+  codepoint_t *valid = NULL;
+  pl0_all_document doc;
+  pl0_all_document_init(&doc);
+  pl0_all_document_parse(&doc, text, len, pl0_all_parse_program);
+
+  for (size_t iter = 0; iter < 2500; iter++) {
+    if (!doc.parser.num_errors) {
+      free(valid);
+      valid = (codepoint_t *)malloc(sizeof(codepoint_t) * (len + 1));
+      CHECK(valid);
+      memcpy(valid, text, sizeof(codepoint_t) * len);
+      valid_len = len;
+      errors_for = 0;
+    } else {
+      errors_for++;
+    }
+
+    // Keep the text from growing without bound.
+    pl0_all_edit edit;
+    codepoint_t *ins;
+    for (;;) {
+      pick_edit(text, len, valid, valid_len, errors_for, &edit, &ins);
+      if (len < 1000 || edit.new_end <= edit.old_end)
+        break;
+      free(ins);
+    }
+
+    size_t ins_len = edit.new_end - edit.start;
+    size_t new_len = len - (edit.old_end - edit.start) + ins_len;
+    codepoint_t *new_text =
+        (codepoint_t *)malloc(sizeof(codepoint_t) * (new_len + 1));
+    CHECK(new_text);
+    memcpy(new_text, text, sizeof(codepoint_t) * edit.start);
+    if (ins_len)
+      memcpy(new_text + edit.start, ins, sizeof(codepoint_t) * ins_len);
+    memcpy(new_text + edit.new_end, text + edit.old_end,
+           sizeof(codepoint_t) * (len - edit.old_end));
+    free(ins);
+    free(text);
+    text = new_text;
+    len = new_len;
+
+    pl0_all_astnode_t *ast =
+        pl0_all_reparse(&doc, text, len, edit, pl0_all_parse_program);
+    pl0_all_document fresh;
+    pl0_all_document_init(&fresh);
+    pl0_all_astnode_t *expected =
+        pl0_all_document_parse(&fresh, text, len, pl0_all_parse_program);
+
+    pgen_writer w, expected_w;
+    pgen_writer *got = serialize_all(ast, &w);
+    pgen_writer *want = serialize_all(expected, &expected_w);
+    CHECK(!got == !want);
+    if (got) {
+      CHECK(got->len == want->len && !memcmp(got->buf, want->buf, got->len));
+      pgen_writer_destroy(got);
+      pgen_writer_destroy(want);
+    }
+    CHECK(doc.parser.num_errors == fresh.parser.num_errors);
+    for (size_t i = 0; i < doc.parser.num_errors; i++) {
+      pl0_all_parse_err *e = doc.parser.errlist + i;
+      pl0_all_parse_err *f = fresh.parser.errlist + i;
+      CHECK(!strcmp(e->msg, f->msg) && e->severity == f->severity);
+      CHECK(e->line == f->line && e->col == f->col);
+    }
+    pl0_all_document_destroy(&fresh);
+  }
+
+  pl0_all_document_destroy(&doc);
+  free(valid);
+  free(text);
+}
+
+// Pieces of random text. Words run into each other sometimes, making longer
+// identifiers and numbers. Everything else is set apart with whitespace, so
+// the text always tokenizes.
+static const char *words[] = {
+    "var", "const", "procedure", "begin", "end", "if", "then", "while", "do",
+    "odd", "call", "write", "x", "y1", "_z", "42", "007",
+    // Keywords with a letter more or less, or with the case changed.
+    "begi", "beginx", "End", "ENd", "_do", "odd_", "whilE", "d", "calls",
+    "procedur", "constant", "iff", "wr", "thenn"};
+static const char *symbols[] = {
+    ":=", "=", "#",  "<",  "<=", ">",  ">=",  "+",  "-",  "*",    "/",   "(",
+    ")",  ",", ";",  ".",  "-5", "+3", "/**/", "/* é → 世界 😀 */",
+    "// ünï 🙂\n",   "/* * / */"};
+static const char *spaces[] = {" ", "\n", "\t", "\r\n", "  "};
+
+#define COUNT(a) (uint32_t)(sizeof(a) / sizeof((a)[0]))
+
+// Writes up to about max bytes of random utf8 to buf, which holds max + 64.
+// Returns its length.
+static inline size_t random_text(char *buf, size_t max) {
+  size_t len = 0, target = rng((uint32_t)max + 1);
+  int after_word = 0;
+  while (len < target) {
+    int word = (int)rng(3);
+    if (!word || !after_word || rng(3))
+      len += (size_t)sprintf(buf + len, "%s", spaces[rng(COUNT(spaces))]);
+    if (word) {
+      len += (size_t)sprintf(buf + len, "%s", words[rng(COUNT(words))]);
+    } else {
+      len += (size_t)sprintf(buf + len, "%s ", symbols[rng(COUNT(symbols))]);
+    }
+    after_word = word;
+  }
+  return len;
+}
+
+static inline void check_same_token(pl0_all_token a, pl0_all_token b) {
+  CHECK(a.kind == b.kind && a.len == b.len);
+  CHECK(!memcmp(a.content, b.content, sizeof(codepoint_t) * a.len));
+  CHECK(a.line == b.line && a.col == b.col);
+}
+
+// Tokenizing a stream of utf8 pushed in random chunks gives the same tokens
+// as tokenizing all of it at once, even when a chunk ends partway through a
+// multibyte sequence.
+static inline void test_stream_chunks(void) {
+  static char text[4096 + 64];
+  for (size_t iter = 0; iter < 1000; iter++) {
+    size_t len = random_text(text, 4096), cpslen;
+    text[len] = '\0';
+    codepoint_t *cps = decode(text, &cpslen);
+
+    pl0_all_tokenizer tokenizer;
+    pl0_all_tokenizer_init(&tokenizer, cps, cpslen);
+    pl0_all_stream stream;
+    pl0_all_stream_init(&stream);
+    pl0_all_token tok, expected;
+    pl0_all_stream_status status;
+    size_t pos = 0;
+    int finished = 0;
+    for (;;) {
+      CHECK(!finished);
+      if (pos < len) {
+        // Mostly small chunks, so that many sequences get split up.
+        size_t n = rng(8) ? 1 + rng(16) : 1 + rng(512);
+        n = n < len - pos ? n : len - pos;
+        CHECK(pl0_all_stream_push_utf8(&stream, text + pos, n));
+        pos += n;
+      } else {
+        CHECK(pl0_all_stream_finish(&stream));
+        finished = 1;
+      }
+      while ((status = pl0_all_stream_next(&stream, &tok)) ==
+             PL0_ALL_STREAM_TOKEN) {
+        expected = pl0_all_nextToken(&tokenizer);
+        check_same_token(tok, expected);
+      }
+      if (status != PL0_ALL_STREAM_NEED_INPUT)
+        break;
+    }
+    CHECK(status == PL0_ALL_STREAM_END);
+    CHECK(pl0_all_nextToken(&tokenizer).kind == PL0_ALL_TOK_STREAMEND);
+    pl0_all_stream_destroy(&stream);
+    free(cps);
+  }
+}
+
+// Looking keywords up with --keyword-hash gives the same tokens as the trie,
+// including for identifiers that are a keyword with a letter more or less,
+// or with the case changed.
+static inline void test_keyword_hash(void) {
+  static char text[4096 + 64];
+  for (size_t iter = 0; iter < 1000; iter++) {
+    size_t len = random_text(text, 4096), cpslen;
+    text[len] = '\0';
+    codepoint_t *cps = decode(text, &cpslen);
+
+    pl0_tokenizer trie;
+    pl0_all_tokenizer hash;
+    pl0_tokenizer_init(&trie, cps, cpslen);
+    pl0_all_tokenizer_init(&hash, cps, cpslen);
+    pl0_token a;
+    do {
+      a = pl0_nextToken(&trie);
+      pl0_all_token b = pl0_all_nextToken(&hash);
+      CHECK(!strcmp(pl0_tokenkind_name[a.kind],
+                    pl0_all_tokenkind_name[b.kind]));
+      CHECK(a.content == b.content && a.len == b.len);
+      CHECK(a.line == b.line && a.col == b.col);
+    } while (a.kind != PL0_TOK_STREAMEND);
+    free(cps);
+  }
+}
+
+int main(void) {
+  test_rewind_across_arenas();
+  test_big_list();
+  test_empty_list();
+  test_view_init();
+  test_corrupt_cache();
+  test_budget();
+  test_skip_loops();
+  test_incremental();
+  test_stream_chunks();
+  test_keyword_hash();
+  puts("Passed.");
+}
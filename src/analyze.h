@@ -0,0 +1,514 @@
+#ifndef PGEN_ANALYZE_INCLUDE
+#define PGEN_ANALYZE_INCLUDE
+#include "argparse.h"
+#include "ast.h"
+#include "pegparser.h"
+#include "symtab.h"
+#include "util.h"
+
+// Static analysis of the grammar for --analyze. The generated parser
+// backtracks without memoizing, so it finds the places where that costs
+// something: choices whose alternatives can start with the same token, and
+// repetitions of expressions that can match nothing.
+
+typedef struct {
+  list_ASTNodePtr *defs;
+  list_ASTNodePtr *tokdefs;
+  size_t num_rules;
+  Symindex rule_ix;
+  Symindex tok_ix;
+  size_t words; // Per FIRST set.
+  // Per rule. FIRST sets hold a bit for each token definition.
+  bool *nullable;
+  uint64_t *first;
+  // The rule that first calls each rule, searching from the first rule.
+  size_t *caller;
+  size_t num_findings;
+} analyze_ctx;
+
+static inline char *analyze_rule_name(analyze_ctx *ctx, size_t rule) {
+  return (char *)ctx->defs->buf[rule]->children[0]->extra;
+}
+
+static inline size_t analyze_rule_idx(analyze_ctx *ctx, char *name) {
+  return symindex_find(&ctx->rule_ix, name);
+}
+
+static inline size_t analyze_tok_idx(analyze_ctx *ctx, char *name) {
+  return symindex_find(&ctx->tok_ix, name);
+}
+
+static inline bool analyze_set_has(uint64_t *set, size_t tok) {
+  return (set[tok / 64] >> (tok % 64)) & 1;
+}
+
+// Whether the expression can succeed without consuming a token.
+static inline bool analyze_nullable(analyze_ctx *ctx, ASTNode *expr) {
+  if (expr->kind == AST_SlashExpr) {
+    for (size_t i = 0; i < expr->num_children; i++)
+      if (analyze_nullable(ctx, expr->children[i]))
+        return 1;
+    return 0;
+  } else if (expr->kind == AST_ModExprList) {
+    for (size_t i = 0; i < expr->num_children; i++)
+      if (!analyze_nullable(ctx, expr->children[i]))
+        return 0;
+    return 1;
+  } else if (expr->kind == AST_ModExpr) {
+    ModExprOpts opts = *(ModExprOpts *)expr->extra;
+    if (opts.inverted | opts.rewind | opts.optional | (opts.kleene_plus == 2))
+      return 1;
+    return analyze_nullable(ctx, expr->children[0]);
+  } else if (expr->kind == AST_BaseExpr) {
+    return analyze_nullable(ctx, expr->children[0]);
+  } else if (expr->kind == AST_LowerIdent) {
+    size_t rule = analyze_rule_idx(ctx, (char *)expr->extra);
+    return rule != SIZE_MAX && ctx->nullable[rule];
+  } else if (expr->kind == AST_UpperIdent) {
+    return 0;
+  }
+  return 1; // CodeExpr
+}
+
+// Adds the tokens that the expression can start with to set.
+static inline void analyze_first(analyze_ctx *ctx, ASTNode *expr,
+                                 uint64_t *set) {
+  if (expr->kind == AST_SlashExpr) {
+    for (size_t i = 0; i < expr->num_children; i++)
+      analyze_first(ctx, expr->children[i], set);
+  } else if (expr->kind == AST_ModExprList) {
+    for (size_t i = 0; i < expr->num_children; i++) {
+      analyze_first(ctx, expr->children[i], set);
+      if (!analyze_nullable(ctx, expr->children[i]))
+        break;
+    }
+  } else if (expr->kind == AST_ModExpr) {
+    ModExprOpts opts = *(ModExprOpts *)expr->extra;
+    if (!(opts.inverted | opts.rewind))
+      analyze_first(ctx, expr->children[0], set);
+  } else if (expr->kind == AST_BaseExpr) {
+    analyze_first(ctx, expr->children[0], set);
+  } else if (expr->kind == AST_LowerIdent) {
+    size_t rule = analyze_rule_idx(ctx, (char *)expr->extra);
+    if (rule != SIZE_MAX)
+      for (size_t w = 0; w < ctx->words; w++)
+        set[w] |= ctx->first[rule * ctx->words + w];
+  } else if (expr->kind == AST_UpperIdent) {
+    size_t tok = analyze_tok_idx(ctx, (char *)expr->extra);
+    if (tok != SIZE_MAX)
+      set[tok / 64] |= (uint64_t)1 << (tok % 64);
+  }
+}
+
+// Both only grow, so iterate until neither changes.
+static inline void analyze_fixpoint(analyze_ctx *ctx) {
+  uint64_t *set = (uint64_t *)malloc(sizeof(uint64_t) * ctx->words);
+  if (!set)
+    OOM();
+  bool changed = 1;
+  while (changed) {
+    changed = 0;
+    for (size_t r = 0; r < ctx->num_rules; r++) {
+      ASTNode *expr = ctx->defs->buf[r]->children[1];
+      if (!ctx->nullable[r] && analyze_nullable(ctx, expr))
+        ctx->nullable[r] = changed = 1;
+      memset(set, 0, sizeof(uint64_t) * ctx->words);
+      analyze_first(ctx, expr, set);
+      uint64_t *cur = ctx->first + r * ctx->words;
+      for (size_t w = 0; w < ctx->words; w++)
+        if (set[w] & ~cur[w])
+          cur[w] |= set[w], changed = 1;
+    }
+  }
+  free(set);
+}
+
+// Marks the rules that the expression calls.
+static inline void analyze_calls(analyze_ctx *ctx, ASTNode *expr,
+                                 bool *called) {
+  if (expr->kind == AST_LowerIdent) {
+    size_t rule = analyze_rule_idx(ctx, (char *)expr->extra);
+    if (rule != SIZE_MAX)
+      called[rule] = 1;
+  } else if (expr->kind == AST_ModExpr) {
+    analyze_calls(ctx, expr->children[0], called);
+  } else {
+    for (size_t i = 0; i < expr->num_children; i++)
+      analyze_calls(ctx, expr->children[i], called);
+  }
+}
+
+// Fills in ctx->caller by a breadth first search from the first rule, so that
+// witness paths are as short as they can be.
+static inline void analyze_callers(analyze_ctx *ctx) {
+  bool *called = (bool *)malloc(sizeof(bool) * ctx->num_rules);
+  size_t *queue = (size_t *)malloc(sizeof(size_t) * ctx->num_rules);
+  if (!called | !queue)
+    OOM();
+  for (size_t r = 0; r < ctx->num_rules; r++)
+    ctx->caller[r] = SIZE_MAX;
+  size_t head = 0, tail = 0;
+  ctx->caller[0] = 0;
+  queue[tail++] = 0;
+  while (head < tail) {
+    size_t r = queue[head++];
+    memset(called, 0, sizeof(bool) * ctx->num_rules);
+    analyze_calls(ctx, ctx->defs->buf[r]->children[1], called);
+    for (size_t c = 0; c < ctx->num_rules; c++)
+      if (called[c] && ctx->caller[c] == SIZE_MAX)
+        ctx->caller[c] = r, queue[tail++] = c;
+  }
+  free(called);
+  free(queue);
+}
+
+// Whether the expression can call the rule, directly or through other rules.
+// The path to it is left in trace.
+static inline bool analyze_reaches(analyze_ctx *ctx, ASTNode *expr,
+                                   size_t target, bool *seen,
+                                   list_cstr *trace) {
+  if (expr->kind == AST_LowerIdent) {
+    size_t rule = analyze_rule_idx(ctx, (char *)expr->extra);
+    if (rule == SIZE_MAX || seen[rule])
+      return 0;
+    seen[rule] = 1;
+    list_cstr_add(trace, (char *)expr->extra);
+    if (rule == target ||
+        analyze_reaches(ctx, ctx->defs->buf[rule]->children[1], target, seen,
+                        trace))
+      return 1;
+    trace->len--;
+    return 0;
+  }
+  size_t n = expr->kind == AST_ModExpr ? 1 : expr->num_children;
+  for (size_t i = 0; i < n; i++)
+    if (analyze_reaches(ctx, expr->children[i], target, seen, trace))
+      return 1;
+  return 0;
+}
+
+// Leaves the rules through which the expression starts with tok in trace.
+static inline bool analyze_first_trace(analyze_ctx *ctx, ASTNode *expr,
+                                       size_t tok, bool *seen,
+                                       list_cstr *trace) {
+  if (expr->kind == AST_UpperIdent) {
+    return analyze_tok_idx(ctx, (char *)expr->extra) == tok;
+  } else if (expr->kind == AST_LowerIdent) {
+    size_t rule = analyze_rule_idx(ctx, (char *)expr->extra);
+    if (rule == SIZE_MAX || seen[rule] ||
+        !analyze_set_has(ctx->first + rule * ctx->words, tok))
+      return 0;
+    seen[rule] = 1;
+    list_cstr_add(trace, (char *)expr->extra);
+    if (analyze_first_trace(ctx, ctx->defs->buf[rule]->children[1], tok, seen,
+                            trace))
+      return 1;
+    trace->len--;
+    return 0;
+  } else if (expr->kind == AST_ModExpr) {
+    ModExprOpts opts = *(ModExprOpts *)expr->extra;
+    return !(opts.inverted | opts.rewind) &&
+           analyze_first_trace(ctx, expr->children[0], tok, seen, trace);
+  } else if (expr->kind == AST_ModExprList) {
+    for (size_t i = 0; i < expr->num_children; i++) {
+      if (analyze_first_trace(ctx, expr->children[i], tok, seen, trace))
+        return 1;
+      if (!analyze_nullable(ctx, expr->children[i]))
+        return 0;
+    }
+    return 0;
+  }
+  for (size_t i = 0; i < expr->num_children; i++)
+    if (analyze_first_trace(ctx, expr->children[i], tok, seen, trace))
+      return 1;
+  return 0;
+}
+
+static inline void analyze_print_expr(ASTNode *expr) {
+  if (expr->kind == AST_SlashExpr) {
+    for (size_t i = 0; i < expr->num_children; i++) {
+      if (i)
+        printf(" / ");
+      analyze_print_expr(expr->children[i]);
+    }
+  } else if (expr->kind == AST_ModExprList) {
+    for (size_t i = 0; i < expr->num_children; i++) {
+      if (i)
+        printf(" ");
+      analyze_print_expr(expr->children[i]);
+    }
+  } else if (expr->kind == AST_ModExpr) {
+    ModExprOpts opts = *(ModExprOpts *)expr->extra;
+    printf("%s%s", opts.rewind ? "&" : "", opts.inverted ? "!" : "");
+    analyze_print_expr(expr->children[0]);
+    printf("%s", opts.optional           ? "?"
+                 : opts.kleene_plus == 1 ? "+"
+                 : opts.kleene_plus == 2 ? "*"
+                                         : "");
+  } else if (expr->kind == AST_BaseExpr) {
+    int paren = expr->children[0]->kind == AST_SlashExpr;
+    printf(paren ? "(" : "");
+    analyze_print_expr(expr->children[0]);
+    printf(paren ? ")" : "");
+  } else if (expr->kind == AST_CodeExpr) {
+    printf("{...}");
+  } else {
+    printf("%s", (char *)expr->extra);
+  }
+}
+
+// Compares the parts of two expressions that decide what they match, so
+// labels, error handlers, and the contents of code are ignored.
+static inline bool analyze_expr_equal(ASTNode *a, ASTNode *b) {
+  if (a->kind != b->kind)
+    return 0;
+  if (a->kind == AST_UpperIdent || a->kind == AST_LowerIdent)
+    return !strcmp((char *)a->extra, (char *)b->extra);
+  if (a->kind == AST_CodeExpr)
+    return 0;
+  if (a->kind == AST_ModExpr) {
+    ModExprOpts x = *(ModExprOpts *)a->extra, y = *(ModExprOpts *)b->extra;
+    return x.inverted == y.inverted && x.rewind == y.rewind &&
+           x.optional == y.optional && x.kleene_plus == y.kleene_plus &&
+           analyze_expr_equal(a->children[0], b->children[0]);
+  }
+  if (a->num_children != b->num_children)
+    return 0;
+  for (size_t i = 0; i < a->num_children; i++)
+    if (!analyze_expr_equal(a->children[i], b->children[i]))
+      return 0;
+  return 1;
+}
+
+// An alternative as a list of ModExprs. Parentheses around a single
+// alternative are looked through.
+static inline ASTNode **analyze_seq(ASTNode **alt, size_t *len) {
+  if ((*alt)->kind == AST_ModExprList) {
+    *len = (*alt)->num_children;
+    return (*alt)->children;
+  }
+  *len = 1;
+  return alt;
+}
+
+// The number of ModExprs at the start of the alternative that run before it
+// commits. Once an expression with an error handler is reached, its failure
+// ends the rule instead of trying the next alternative.
+static inline size_t analyze_uncommitted(ASTNode **alt) {
+  size_t len;
+  ASTNode **seq = analyze_seq(alt, &len);
+  for (size_t i = 0; i < len; i++) {
+    ASTNode *mod = seq[i];
+    size_t has_label = mod->num_children >= 2 &&
+                       mod->children[1]->kind == AST_LowerIdent;
+    if (mod->num_children - has_label == 2)
+      return i;
+  }
+  return len;
+}
+
+static inline void analyze_print_path(analyze_ctx *ctx, size_t rule) {
+  if (ctx->caller[rule] == SIZE_MAX) {
+    printf("%s (not reachable from %s)", analyze_rule_name(ctx, rule),
+           analyze_rule_name(ctx, 0));
+    return;
+  }
+  list_size_t path = list_size_t_new();
+  for (size_t r = rule; r; r = ctx->caller[r])
+    list_size_t_add(&path, r);
+  printf("%s", analyze_rule_name(ctx, 0));
+  for (size_t i = path.len; i--;)
+    printf(" -> %s", analyze_rule_name(ctx, path.buf[i]));
+  list_size_t_clear(&path);
+}
+
+static inline void analyze_print_trace(list_cstr *trace, char *tok) {
+  for (size_t i = 0; i < trace->len; i++)
+    printf("%s -> ", trace->buf[i]);
+  printf("%s", tok);
+}
+
+static inline void analyze_choice(analyze_ctx *ctx, size_t rule,
+                                  ASTNode *choice) {
+  size_t n = choice->num_children, words = ctx->words;
+  uint64_t *first = (uint64_t *)calloc(n * words, sizeof(uint64_t));
+  bool *seen = (bool *)malloc(sizeof(bool) * ctx->num_rules);
+  if (!first | !seen)
+    OOM();
+  for (size_t i = 0; i < n; i++)
+    analyze_first(ctx, choice->children[i], first + i * words);
+
+  for (size_t i = 0; i < n; i++) {
+    // How many alternatives start like this one does. Each of them can
+    // parse the same tokens again.
+    size_t k = 1;
+    for (size_t j = 0; j < n; j++)
+      for (size_t w = 0; j != i && w < words; w++)
+        if (first[i * words + w] & first[j * words + w]) {
+          k++;
+          break;
+        }
+
+    for (size_t j = i + 1; j < n; j++) {
+      size_t tok = SIZE_MAX;
+      for (size_t w = 0; tok == SIZE_MAX && w < words; w++) {
+        uint64_t both = first[i * words + w] & first[j * words + w];
+        if (both)
+          tok = w * 64 + (size_t)__builtin_ctzll(both);
+      }
+      if (tok == SIZE_MAX)
+        continue;
+
+      ctx->num_findings++;
+      ASTNode *a = choice->children[i], *b = choice->children[j];
+      char *tokname = (char *)ctx->tokdefs->buf[tok]->children[0]->extra;
+      printf("Overlapping choice in %s, alternatives %zu and %zu:\n",
+             analyze_rule_name(ctx, rule), i + 1, j + 1);
+      printf("  %zu: ", i + 1);
+      analyze_print_expr(a);
+      printf("\n  %zu: ", j + 1);
+      analyze_print_expr(b);
+      printf("\n");
+
+      printf("  Witness: ");
+      analyze_print_path(ctx, rule);
+      printf(", then %s", tokname);
+      list_cstr trace = list_cstr_new();
+      memset(seen, 0, sizeof(bool) * ctx->num_rules);
+      analyze_first_trace(ctx, a, tok, seen, &trace);
+      printf(" (%zu: ", i + 1);
+      analyze_print_trace(&trace, tokname);
+      list_cstr_clear(&trace);
+      memset(seen, 0, sizeof(bool) * ctx->num_rules);
+      analyze_first_trace(ctx, b, tok, seen, &trace);
+      printf(", %zu: ", j + 1);
+      analyze_print_trace(&trace, tokname);
+      list_cstr_clear(&trace);
+      printf(")\n");
+
+      size_t alen, blen, prefix = 0;
+      ASTNode **aseq = analyze_seq(choice->children + i, &alen);
+      ASTNode **bseq = analyze_seq(choice->children + j, &blen);
+      while (prefix < alen && prefix < blen &&
+             analyze_expr_equal(aseq[prefix], bseq[prefix]))
+        prefix++;
+      if (prefix) {
+        printf("  Shared prefix:");
+        for (size_t p = 0; p < prefix; p++) {
+          printf(" ");
+          analyze_print_expr(aseq[p]);
+        }
+        printf("\n");
+      }
+
+      // What alternative i can consume and throw away before j runs.
+      size_t span = analyze_uncommitted(choice->children + i);
+      if (!span) {
+        printf("  Cost: none, but %zu is never tried on %s, because %zu "
+               "reports an error instead.\n",
+               j + 1, tokname, i + 1);
+        continue;
+      }
+      memset(seen, 0, sizeof(bool) * ctx->num_rules);
+      bool recursive = 0;
+      for (size_t p = 0; p < span && !recursive; p++)
+        recursive = analyze_reaches(ctx, aseq[p], rule, seen, &trace);
+      if (recursive) {
+        printf("  Cost: O(%zu^n) for input nested n deep, through %s", k,
+               analyze_rule_name(ctx, rule));
+        for (size_t t = 0; t < trace.len; t++)
+          printf(" -> %s", trace.buf[t]);
+        printf(".\n");
+      } else if (prefix) {
+        printf("  Cost: the shared prefix is parsed up to %zu times.\n", k);
+      } else {
+        printf("  Cost: %zu rereads what %zu consumed before failing.\n",
+               j + 1, i + 1);
+      }
+      list_cstr_clear(&trace);
+    }
+  }
+  free(first);
+  free(seen);
+}
+
+static inline void analyze_visit(analyze_ctx *ctx, size_t rule,
+                                 ASTNode *expr) {
+  if (expr->kind == AST_SlashExpr && expr->num_children > 1)
+    analyze_choice(ctx, rule, expr);
+
+  if (expr->kind == AST_ModExpr) {
+    ModExprOpts opts = *(ModExprOpts *)expr->extra;
+    if (opts.kleene_plus && analyze_nullable(ctx, expr->children[0])) {
+      ctx->num_findings++;
+      printf("Repetition of a nullable expression in %s:\n",
+             analyze_rule_name(ctx, rule));
+      printf("  ");
+      analyze_print_expr(expr);
+      printf("\n  Witness: ");
+      analyze_print_path(ctx, rule);
+      printf(", then any input that ");
+      analyze_print_expr(expr->children[0]);
+      printf(" matches without consuming a token\n");
+      printf("  Cost: unbounded. The loop never ends once an iteration "
+             "consumes nothing.\n");
+    }
+    analyze_visit(ctx, rule, expr->children[0]);
+    return;
+  }
+
+  for (size_t i = 0; i < expr->num_children; i++)
+    analyze_visit(ctx, rule, expr->children[i]);
+}
+
+static inline void analyzeGrammar(Symtabs symtabs) {
+  analyze_ctx ctx;
+  ctx.defs = &symtabs.definitions;
+  ctx.tokdefs = &symtabs.tokendefs;
+  ctx.num_rules = symtabs.definitions.len;
+  ctx.words = (symtabs.tokendefs.len + 63) / 64;
+  ctx.num_findings = 0;
+  if (!ctx.num_rules) {
+    printf("No rules to analyze.\n");
+    return;
+  }
+  if (!ctx.words)
+    ctx.words = 1;
+  ctx.nullable = (bool *)calloc(ctx.num_rules, sizeof(bool));
+  ctx.first = (uint64_t *)calloc(ctx.num_rules * ctx.words, sizeof(uint64_t));
+  ctx.caller = (size_t *)malloc(sizeof(size_t) * ctx.num_rules);
+  if (!ctx.nullable | !ctx.first | !ctx.caller)
+    OOM();
+
+  size_t num_toks = ctx.tokdefs->len;
+  char **names = (char **)malloc(sizeof(char *) * (ctx.num_rules + num_toks));
+  if (!names)
+    OOM();
+  for (size_t r = 0; r < ctx.num_rules; r++)
+    names[r] = analyze_rule_name(&ctx, r);
+  for (size_t t = 0; t < num_toks; t++)
+    names[ctx.num_rules + t] = (char *)ctx.tokdefs->buf[t]->children[0]->extra;
+  ctx.rule_ix = symindex_new(names, ctx.num_rules);
+  ctx.tok_ix = symindex_new(names + ctx.num_rules, num_toks);
+  free(names);
+
+  analyze_fixpoint(&ctx);
+  analyze_callers(&ctx);
+  for (size_t r = 0; r < ctx.num_rules; r++)
+    analyze_visit(&ctx, r, ctx.defs->buf[r]->children[1]);
+
+  for (size_t r = 0; r < ctx.num_rules; r++)
+    if (ctx.nullable[r])
+      printf("Note: %s can match without consuming a token.\n",
+             analyze_rule_name(&ctx, r));
+  printf("%zu finding%s.\n", ctx.num_findings,
+         ctx.num_findings == 1 ? "" : "s");
+
+  free(ctx.nullable);
+  free(ctx.first);
+  free(ctx.caller);
+  symindex_destroy(&ctx.rule_ix);
+  symindex_destroy(&ctx.tok_ix);
+}
+
+#endif /* PGEN_ANALYZE_INCLUDE */
@@ -7,6 +7,11 @@ typedef struct {
   char *grammarTarget; // (path to .peg) May be null
   char *outputTarget;  // (path to output) May be null
   char *pythonTarget;  // (path to module folder) May be null, may not exist.
+  char *statsTarget;   // (path to profiling stats) May be null
+  size_t genInputs;    // Random inputs to write instead of a parser, or 0
+  size_t genSize;      // Bytes in each random input
+  size_t genDepth;     // How deep rules nest in random inputs
+  size_t genSeed;      // Where the random inputs start
   bool h : 1;          // Help
   bool i : 1;          // Interactive
   bool d : 1;          // Debug runtime errors
@@ -15,13 +20,45 @@ typedef struct {
   bool s : 1;          // Grammar debug automatically
   bool m : 1;          // Memory allocator debugging
   bool l : 1;          // Line directives
+  bool incremental : 1; // Incremental reparsing API
+  bool stream : 1;      // Streaming tokenizer API
+  bool compact : 1;     // Compact astnode layout
+  bool profile : 1;     // Per-rule profiling counters
+  bool analyze : 1;     // Report backtracking instead of generating
+  bool vm : 1;          // Compile rules to bytecode
+  bool split : 1;       // Write a header and an implementation file
+  bool check : 1;       // Only report whether the output is out of date
+  bool kwhash : 1;      // Look up keywords in a perfect hash table
+  bool bench : 1;       // Write a benchmark runner beside the output
 } Args;
 
+// Parses a count for an option, with an optional K, M, or G suffix for
+// thousands, millions, or billions.
+static inline size_t argparse_count(char *opt, char *s) {
+  char *end;
+  unsigned long long n = strtoull(s, &end, 10);
+  size_t mult = 1;
+  if (*end == 'k' || *end == 'K')
+    mult = 1000, end++;
+  else if (*end == 'm' || *end == 'M')
+    mult = 1000000, end++;
+  else if (*end == 'g' || *end == 'G')
+    mult = 1000000000, end++;
+  if (end == s || *end || *s == '-')
+    ERROR("%s requires a number, not \"%s\".", opt, s);
+  return (size_t)n * mult;
+}
+
 static inline Args argparse(int argc, char **argv) {
   Args args;
   args.grammarTarget = NULL;
   args.outputTarget = NULL;
   args.pythonTarget = NULL;
+  args.statsTarget = NULL;
+  args.genInputs = 0;
+  args.genSize = 0;
+  args.genDepth = 0;
+  args.genSeed = 1;
   args.h = 0;
   args.i = 0;
   args.d = 0;
@@ -30,6 +67,16 @@ static inline Args argparse(int argc, char **argv) {
   args.s = 0;
   args.m = 0;
   args.l = 0;
+  args.incremental = 0;
+  args.stream = 0;
+  args.compact = 0;
+  args.profile = 0;
+  args.analyze = 0;
+  args.vm = 0;
+  args.split = 0;
+  args.check = 0;
+  args.kwhash = 0;
+  args.bench = 0;
 
   char helpmsg[] =
       "pgen - A tokenizer and parser generator.\n"
@@ -45,6 +92,22 @@ static inline Args argparse(int argc, char **argv) {
       "    -m, --memdebug           Debug the generated memory allocator.    \n"
       "    -l, --lines              Generate #line directives.               \n"
       "    -p, --python             Generate a python module for your parser.\n"
+      "    --incremental            Generate an incremental reparsing API.   \n"
+      "    --stream                 Generate a tokenizer for chunked input.  \n"
+      "    --compact-nodes          Generate smaller AST nodes.              \n"
+      "    --stats FILE             Size allocations from a profiling run.   \n"
+      "    --profile-rules          Count calls and time spent in each rule. \n"
+      "    --analyze                Report where the parser will backtrack.  \n"
+      "    --backend=c|vm           Compile rules to C (default) or bytecode.\n"
+      "    --emit=header|split      Write one header (default), or a header \n"
+      "                             and a .c file to compile once.           \n"
+      "    --check                  Exit 1 if the output is out of date.     \n"
+      "    --keyword-hash           Match keywords with a perfect hash table.\n"
+      "    --bench                  Also write a benchmark, OUTPUT_bench.c.  \n"
+      "    --gen-inputs N           Write N random inputs, not a parser.     \n"
+      "    --size S                 Make them about S bytes (default 1M).    \n"
+      "    --depth D                Nest rules up to D deep (default 32).    \n"
+      "    --seed X                 Start from random seed X (default 1).    \n"
       "\n";
 
   // Unsafe strips comments, disables checking the result of malloc, and removes
@@ -70,12 +133,55 @@ static inline Args argparse(int argc, char **argv) {
       args.m = 1;
     } else if (!strcmp(a, "-l") || !strcmp(a, "--lines")) {
       args.l = 1;
+    } else if (!strcmp(a, "--incremental")) {
+      args.incremental = 1;
+    } else if (!strcmp(a, "--stream")) {
+      args.stream = 1;
+    } else if (!strcmp(a, "--compact-nodes")) {
+      args.compact = 1;
+    } else if (!strcmp(a, "--profile-rules")) {
+      args.profile = 1;
+    } else if (!strcmp(a, "--analyze")) {
+      args.analyze = 1;
+    } else if (!strcmp(a, "--backend=c")) {
+      args.vm = 0;
+    } else if (!strcmp(a, "--backend=vm")) {
+      args.vm = 1;
+    } else if (!strcmp(a, "--emit=header")) {
+      args.split = 0;
+    } else if (!strcmp(a, "--emit=split")) {
+      args.split = 1;
+    } else if (!strcmp(a, "--check")) {
+      args.check = 1;
+    } else if (!strcmp(a, "--keyword-hash")) {
+      args.kwhash = 1;
+    } else if (!strcmp(a, "--bench")) {
+      args.bench = 1;
     } else if (!strcmp(a, "-o") || !strcmp(a, "--output")) {
       if (i != argc - 1) {
         args.outputTarget = argv[++i];
       } else {
         ERROR("-o requires an argument.");
       }
+    } else if (!strcmp(a, "--stats")) {
+      if (i != argc - 1) {
+        args.statsTarget = argv[++i];
+      } else {
+        ERROR("--stats requires an argument, the path to the stats file.");
+      }
+    } else if (!strcmp(a, "--gen-inputs") || !strcmp(a, "--size") ||
+               !strcmp(a, "--depth") || !strcmp(a, "--seed")) {
+      if (i == argc - 1)
+        ERROR("%s requires an argument.", a);
+      size_t n = argparse_count(a, argv[++i]);
+      if (!strcmp(a, "--gen-inputs"))
+        args.genInputs = n;
+      else if (!strcmp(a, "--size"))
+        args.genSize = n;
+      else if (!strcmp(a, "--depth"))
+        args.genDepth = n;
+      else
+        args.genSeed = n;
     } else if (!strcmp(a, "-p") || !strcmp(a, "--python")) {
       if (i != argc - 1) {
         args.pythonTarget = argv[++i];
@@ -115,6 +221,39 @@ static inline Args argparse(int argc, char **argv) {
     ERROR("Cannot specify both -o and -p.");
   }
 
+  // Compact nodes refer to tokens by index, which the python module can't
+  // follow, and which an incremental reparse would shift.
+  if (args.compact && args.pythonTarget) {
+    ERROR("Cannot specify both --compact-nodes and -p.");
+  }
+  if (args.compact && args.incremental) {
+    ERROR("Cannot specify both --compact-nodes and --incremental.");
+  }
+  // The interactive parser traces every expression, which bytecode doesn't
+  // have a place to do.
+  if (args.vm && args.i) {
+    ERROR("Cannot specify both -i and --backend=vm.");
+  }
+  // The python module builds the header it's given as one unit.
+  if (args.split && args.pythonTarget) {
+    ERROR("Cannot specify both --emit=split and -p.");
+  }
+  if (args.bench && args.pythonTarget) {
+    ERROR("Cannot specify both --bench and -p.");
+  }
+
+  // Generating inputs replaces generating a parser. -o is where they go.
+  if ((args.genSize | args.genDepth) && !args.genInputs) {
+    ERROR("--size and --depth only go with --gen-inputs.");
+  }
+  if (args.genInputs && (args.pythonTarget || args.analyze)) {
+    ERROR("Cannot specify --gen-inputs with -p or --analyze.");
+  }
+  if (!args.genSize)
+    args.genSize = 1000000;
+  if (!args.genDepth)
+    args.genDepth = 32;
+
   return args;
 }
 
@@ -14,7 +14,50 @@
 
 struct ASTNode;
 typedef struct ASTNode ASTNode;
+
+// The kinds of node that pegparser.h builds, so passes can dispatch on an
+// integer instead of comparing names.
+#define ASTKIND_LIST(X)                                                        \
+  X(GrammarFile)                                                               \
+  X(Directive)                                                                 \
+  X(Definition)                                                                \
+  X(Variables)                                                                 \
+  X(Member)                                                                    \
+  X(SlashExpr)                                                                 \
+  X(ModExprList)                                                               \
+  X(ModExpr)                                                                   \
+  X(ErrString)                                                                 \
+  X(BaseExpr)                                                                  \
+  X(CodeExpr)                                                                  \
+  X(TokenDef)                                                                  \
+  X(LitDef)                                                                    \
+  X(SMDef)                                                                     \
+  X(RegexDef)                                                                  \
+  X(Rule)                                                                      \
+  X(Num)                                                                       \
+  X(NumRange)                                                                  \
+  X(NumSetList)                                                                \
+  X(Char)                                                                      \
+  X(CharSet)                                                                   \
+  X(CharRange)                                                                 \
+  X(Pair)                                                                      \
+  X(UpperIdent)                                                                \
+  X(LowerIdent)
+
+typedef enum {
+#define ASTKIND_ENUM(k) AST_##k,
+  ASTKIND_LIST(ASTKIND_ENUM)
+#undef ASTKIND_ENUM
+} ASTKind;
+
+static const char *ASTKind_name[] = {
+#define ASTKIND_NAME(k) #k,
+    ASTKIND_LIST(ASTKIND_NAME)
+#undef ASTKIND_NAME
+};
+
 struct ASTNode {
+  ASTKind kind;
   const char *name;
   // ASTNode *parent;
   ASTNode **children;
@@ -32,11 +75,12 @@ LIST_DEFINE(ASTNodePtr)
     exit(1);                                                                   \
   } while (0)
 
-static inline ASTNode *ASTNode_new(const char *name) {
+static inline ASTNode *ASTNode_new(ASTKind kind) {
   ASTNode *node = (ASTNode *)malloc(sizeof(ASTNode));
   if (!node)
     PGENAST_OOM();
-  node->name = name;
+  node->kind = kind;
+  node->name = ASTKind_name[kind];
   // node->parent = NULL;
   node->children = NULL; // realloc() as children are added
   node->num_children = 0;
@@ -29,7 +29,7 @@ static inline void validateTokdefs(list_ASTNodePtr tokdefs) {
               "because it's reserved for the beginning of the token stream.\n");
       exit(1);
     }
-    if (strcmp(def1->name, "LitDef"))
+    if (def1->kind != AST_LitDef)
       continue;
 
     for (size_t j = 0; j < tokdefs.len; j++) {
@@ -42,7 +42,7 @@ static inline void validateTokdefs(list_ASTNodePtr tokdefs) {
       char *identstr2 = (char *)rule2->children[0]->extra;
       // Triangular comparisons
       if (j > n) {
-        if (strcmp(def2->name, "LitDef"))
+        if (def2->kind != AST_LitDef)
           continue;
 
         if (!strcmp(identstr1, identstr2)) {
@@ -66,53 +66,36 @@ static inline void validateTokdefs(list_ASTNodePtr tokdefs) {
   }
 }
 
-static inline void validateVisitLabel(ASTNode *label, list_cstr *names) {
+static inline void validateVisitLabel(ASTNode *label, Symindex *names) {
   char *lname = (char *)label->extra;
   if (!strcmp(lname, "ret"))
     ERROR("Labels cannot be named \"ret\".");
-  for (size_t i = 0; i < names->len; i++) {
-    if (!strcmp(lname, names->buf[i]))
-      ERROR("Cannot use %s as both a rule and a label.", lname);
-  }
+  if (symindex_find(names, lname) != SIZE_MAX)
+    ERROR("Cannot use %s as both a rule and a label.", lname);
 }
 
-static inline void validatePegVisit(ASTNode *node, list_ASTNodePtr *tokdefs,
-                                    list_cstr *names) {
+static inline void validatePegVisit(ASTNode *node, Symindex *toknames,
+                                    Symindex *names) {
   // Pull out all the upperidents from pegast and find them in the tokast.
-  if (!strcmp(node->name, "UpperIdent")) {
+  if (node->kind == AST_UpperIdent) {
     char *name = (char *)node->extra;
-    int tokfound = 0;
-    for (size_t i = 0; i < tokdefs->len; i++) {
-      char *tokname = (char *)tokdefs->buf[i]->children[0]->extra;
-      if (!strcmp(name, tokname)) {
-        tokfound = 1;
-        break;
-      }
-    }
-    if (!tokfound)
+    if (symindex_find(toknames, name) == SIZE_MAX)
       ERROR("%s appears in the parser, but does not have a token definition.",
             name);
   }
 
   // Ensure all rules are defined.
-  if (!strcmp(node->name, "LowerIdent")) {
+  if (node->kind == AST_LowerIdent) {
     char *name = (char *)node->extra;
-    int rulefound = 0;
-    for (size_t i = 0; i < names->len; i++) {
-      if (!strcmp(name, names->buf[i])) {
-        rulefound = 1;
-        break;
-      }
-    }
-    if (!rulefound)
+    if (symindex_find(names, name) == SIZE_MAX)
       ERROR("%s appears as a rule, but has no definition.", name);
   }
 
   // Recurse to everything but labels.
   for (size_t i = 0; i < node->num_children; i++) {
-    if (!strcmp(node->name, "Directive")) {
-    } else if (!strcmp(node->name, "ModExpr")) {
-      validatePegVisit(node->children[0], tokdefs, names);
+    if (node->kind == AST_Directive) {
+    } else if (node->kind == AST_ModExpr) {
+      validatePegVisit(node->children[0], toknames, names);
       ModExprOpts opts = *(ModExprOpts *)node->extra;
       if (opts.optional & opts.inverted)
         ERROR("For the sake of preventing ambiguities, a rule "
@@ -122,14 +105,14 @@ static inline void validatePegVisit(ASTNode *node, list_ASTNodePtr *tokdefs,
       // Also recurse to error handler
       if (node->num_children > 1)
         for (size_t z = 1; z < node->num_children; z++) {
-          if (strcmp(node->children[z]->name, "BaseExpr")) {
+          if (node->children[z]->kind != AST_BaseExpr) {
             validateVisitLabel(node->children[z], names);
             break;
           }
         }
     } else {
       for (size_t i = 0; i < node->num_children; i++)
-        validatePegVisit(node->children[i], tokdefs, names);
+        validatePegVisit(node->children[i], toknames, names);
     }
   }
 }
@@ -170,32 +153,32 @@ static inline void validateDirectives(Args args, list_ASTNodePtr *directives) {
 }
 
 static inline int is_left_recursive(list_ASTNodePtr *definitions,
-                                    list_cstr *defnames, ASTNode *rule,
+                                    Symindex *defnames, ASTNode *rule,
                                     char *name, list_cstr *trace) {
   // Find the first-executed rule.
   // If it's not a LowerExpr, return 0.
   // If it is, recurse and check that rule, keeping track of the trace.
   while (1) {
-    if (!strcmp(rule->name, "Definition")) {
+    if (rule->kind == AST_Definition) {
       rule = rule->children[1];
-    } else if (!strcmp(rule->name, "SlashExpr")) {
+    } else if (rule->kind == AST_SlashExpr) {
       rule = rule->children[0];
-    } else if (!strcmp(rule->name, "ModExprList")) {
+    } else if (rule->kind == AST_ModExprList) {
       if (!rule->num_children) {
         list_cstr_clear(trace);
         fprintf(stderr, "PGEN Warning: Empty rule %s.\n", name);
         return 0;
       }
       rule = rule->children[0];
-    } else if (!strcmp(rule->name, "ModExpr")) {
+    } else if (rule->kind == AST_ModExpr) {
       rule = rule->children[0];
-    } else if (!strcmp(rule->name, "BaseExpr")) {
+    } else if (rule->kind == AST_BaseExpr) {
       rule = rule->children[0];
-    } else if (!strcmp(rule->name, "CodeExpr")) {
+    } else if (rule->kind == AST_CodeExpr) {
       return list_cstr_clear(trace), 0;
-    } else if (!strcmp(rule->name, "UpperIdent")) {
+    } else if (rule->kind == AST_UpperIdent) {
       return list_cstr_clear(trace), 0;
-    } else if (!strcmp(rule->name, "LowerIdent")) {
+    } else if (rule->kind == AST_LowerIdent) {
       break;
     } else
       ERROR("Unexpected astnode kind in left recursion check: %s", rule->name);
@@ -218,26 +201,22 @@ static inline int is_left_recursive(list_ASTNodePtr *definitions,
       }
     }
 
-    ASTNode *nextrule = NULL;
-    for (size_t i = 0; i < defnames->len; i++) {
-      if (!strcmp(nextrulename, defnames->buf[i])) {
-        nextrule = definitions->buf[i];
-        break;
-      }
-    }
-    if (!nextrule)
+    size_t next = symindex_find(defnames, nextrulename);
+    if (next == SIZE_MAX)
       ERROR("Rule %s is not defined.\n", nextrulename);
+    ASTNode *nextrule = definitions->buf[next];
     return is_left_recursive(definitions, defnames, nextrule, nextrulename,
                              trace);
   }
 }
 
 static inline void validateLeftRecursion(list_ASTNodePtr *definitions,
-                                         list_cstr *defnames) {
+                                         Symindex *defnames) {
   for (size_t i = 0; i < definitions->len; i++) {
     list_cstr trace = list_cstr_new();
+    char *name = (char *)definitions->buf[i]->children[0]->extra;
     int lr = is_left_recursive(definitions, defnames, definitions->buf[i],
-                               defnames->buf[i], &trace);
+                               name, &trace);
     if (lr) {
       fprintf(stderr, "%s left recursion is not allowed. Trace:\n",
               lr == 2 ? "Direct (or indirect)" : "Indirect (or direct)");
@@ -248,51 +227,46 @@ static inline void validateLeftRecursion(list_ASTNodePtr *definitions,
   }
 }
 
-static inline void validateDefinitions(list_cstr defnames) {
-  for (size_t i = 0; i < defnames.len; i++)
-    for (size_t j = i + 1; j < defnames.len; j++)
-      if (!strcmp(defnames.buf[i], defnames.buf[j]))
-        ERROR("More than one rule is named %s.", defnames.buf[i]);
+// Duplicates are next to each other once the names are sorted.
+static inline void validateDefinitions(Symindex *defnames) {
+  for (size_t i = 1; i < defnames->len; i++)
+    if (!strcmp(defnames->buf[i - 1].name, defnames->buf[i].name))
+      ERROR("More than one rule is named %s.", defnames->buf[i].name);
 }
 
-static inline char *validateSubrulesExist(ASTNode *node, list_cstr *names) {
+static inline char *validateSubrulesExist(ASTNode *node, Symindex *names) {
   char *ret = NULL;
-  if (!strcmp(node->name, "Definition")) {
+  if (node->kind == AST_Definition) {
     return validateSubrulesExist(node->children[node->num_children - 1], names);
-  } else if (!strcmp(node->name, "SlashExpr")) {
+  } else if (node->kind == AST_SlashExpr) {
     for (size_t i = 0; i < node->num_children; i++)
       if ((ret = validateSubrulesExist(node->children[i], names)))
         return ret;
     return NULL;
-  } else if (!strcmp(node->name, "ModExprList")) {
+  } else if (node->kind == AST_ModExprList) {
     for (size_t i = 0; i < node->num_children; i++)
       if ((ret = validateSubrulesExist(node->children[i], names)))
         return ret;
     return NULL;
-  } else if (!strcmp(node->name, "ModExpr")) {
+  } else if (node->kind == AST_ModExpr) {
     return validateSubrulesExist(node->children[0], names);
-  } else if (!strcmp(node->name, "BaseExpr")) {
+  } else if (node->kind == AST_BaseExpr) {
     return validateSubrulesExist(node->children[0], names);
-  } else if (!strcmp(node->name, "CodeExpr")) {
+  } else if (node->kind == AST_CodeExpr) {
     return NULL;
-  } else if (!strcmp(node->name, "UpperIdent")) {
+  } else if (node->kind == AST_UpperIdent) {
     return NULL;
-  } else if (!strcmp(node->name, "Variables")) {
+  } else if (node->kind == AST_Variables) {
     return NULL;
-  } else if (!strcmp(node->name, "LowerIdent")) {
-    int found = 0;
-    for (size_t i = 0; i < names->len; i++)
-      if (!strcmp((char *)node->extra, names->buf[i])) {
-        found = 1;
-        break;
-      }
-    return found ? NULL : (char *)node->extra;
+  } else if (node->kind == AST_LowerIdent) {
+    char *name = (char *)node->extra;
+    return symindex_find(names, name) == SIZE_MAX ? name : NULL;
   } else
     ERROR("Unexpected astnode kind in subrule existence check: %s", node->name);
 }
 
 static inline void validateRulesExist(list_ASTNodePtr *rules,
-                                      list_cstr *names) {
+                                      Symindex *names) {
   char *name = NULL;
   for (size_t i = 0; i < rules->len; i++)
     if ((name = validateSubrulesExist(rules->buf[i], names)))
@@ -306,29 +280,38 @@ static inline void validateSymtabs(Args args, Symtabs symtabs) {
 
   list_cstr *tks = &symtabs.tok_kind_names;
   list_cstr *pks = &symtabs.peg_kind_names;
-  if (!args.u)
-    for (size_t j = 0; j < pks->len; j++)
-      for (size_t i = 0; i < tks->len; i++)
-        if (!strcmp(tks->buf[i], pks->buf[j]))
-          ERROR("%%node kind %s is already declared as a token.\n",
-                tks->buf[i]);
+  Symindex tkindex = symindex_new(tks->buf, tks->len);
+  for (size_t j = 0; j < pks->len; j++)
+    if (symindex_find(&tkindex, pks->buf[j]) != SIZE_MAX)
+      ERROR("%%node kind %s is already declared as a token.\n", pks->buf[j]);
+  symindex_destroy(&tkindex);
 
   list_cstr defnames = list_cstr_new();
   for (size_t i = 0; i < symtabs.definitions.len; i++) {
     cstr defname = (char *)symtabs.definitions.buf[i]->children[0]->extra;
     list_cstr_add(&defnames, defname);
   }
+  list_cstr toknames = list_cstr_new();
+  for (size_t i = 0; i < symtabs.tokendefs.len; i++) {
+    cstr tokname = (char *)symtabs.tokendefs.buf[i]->children[0]->extra;
+    list_cstr_add(&toknames, tokname);
+  }
+  Symindex defindex = symindex_new(defnames.buf, defnames.len);
+  Symindex tokindex = symindex_new(toknames.buf, toknames.len);
 
   validateTokdefs(symtabs.tokendefs);
-  validateDefinitions(defnames);
+  validateDefinitions(&defindex);
   validateDirectives(args, &symtabs.directives);
   for (size_t i = 0; i < symtabs.tokendefs.len; i++)
-    validatePegVisit(symtabs.tokendefs.buf[i], &symtabs.tokendefs, &defnames);
+    validatePegVisit(symtabs.tokendefs.buf[i], &tokindex, &defindex);
 
-  validateRulesExist(&symtabs.definitions, &defnames);
-  validateLeftRecursion(&symtabs.definitions, &defnames);
+  validateRulesExist(&symtabs.definitions, &defindex);
+  validateLeftRecursion(&symtabs.definitions, &defindex);
 
+  symindex_destroy(&defindex);
+  symindex_destroy(&tokindex);
   list_cstr_clear(&defnames);
+  list_cstr_clear(&toknames);
 }
 
 #endif /* PGEN_ASTVALID_INCLUDE */
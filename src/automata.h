@@ -103,13 +103,13 @@ static inline void get_numsetlist_stateranges(ASTNode *numsetlist,
                                               list_StateRange *l) {
   for (size_t i = 0; i < numsetlist->num_children; i++) {
     ASTNode *cld = numsetlist->children[i];
-    if (!strcmp(cld->name, "Num")) {
+    if (cld->kind == AST_Num) {
       StateRange r = get_num_staterange(cld);
       list_StateRange_add(l, r);
-    } else if (!strcmp(cld->name, "NumRange")) {
+    } else if (cld->kind == AST_NumRange) {
       StateRange r = get_numrange_staterange(cld);
       list_StateRange_add(l, r);
-    } else if (!strcmp(cld->name, "NumSetList")) {
+    } else if (cld->kind == AST_NumSetList) {
       get_numsetlist_stateranges(cld, l);
     } else
       ERROR("%s is not a numset.", cld->name);
@@ -118,11 +118,11 @@ static inline void get_numsetlist_stateranges(ASTNode *numsetlist,
 
 static inline list_StateRange numset_to_stateranges(ASTNode *numset) {
   list_StateRange l = list_StateRange_new();
-  if (strcmp(numset->name, "Num") == 0) {
+  if (numset->kind == AST_Num) {
     list_StateRange_add(&l, get_num_staterange(numset));
-  } else if (strcmp(numset->name, "NumRange") == 0) {
+  } else if (numset->kind == AST_NumRange) {
     list_StateRange_add(&l, get_numrange_staterange(numset));
-  } else if (strcmp(numset->name, "NumSetList") == 0) {
+  } else if (numset->kind == AST_NumSetList) {
     get_numsetlist_stateranges(numset, &l);
   } else
     ERROR("%s is not a numset.", numset->name);
@@ -197,7 +197,7 @@ static inline list_CharRange compressCharRanges(list_CharRange crs) {
   codepoint_t min = crs.buf[0].f;
   codepoint_t max = crs.buf[0].s;
   for (size_t i = 1; i < crs.len; i++) {
-    if (crs.buf[i].f > max + 1) {
+    if ((int64_t)crs.buf[i].f > (int64_t)max + 1) {
       crs.buf[ins++] = (CharRange){min, max};
       min = crs.buf[i].f;
       max = crs.buf[i].s;
@@ -223,16 +223,16 @@ static inline list_CharRange charset_to_charranges(ASTNode *charset,
 
   list_CharRange l = list_CharRange_new();
 
-  if (!strcmp(charset->name, "Char")) {
+  if (charset->kind == AST_Char) {
     codepoint_t c = *(codepoint_t *)charset->extra;
     list_CharRange_add(&l, (CharRange){c, c});
     return *inverted = false, l;
   }
 
-  if (!strcmp(charset->name, "CharSet")) {
+  if (charset->kind == AST_CharSet) {
     for (size_t i = 0; i < charset->num_children; i++) {
       ASTNode *cld = charset->children[i];
-      if (!strcmp(cld->name, "CharRange")) {
+      if (cld->kind == AST_CharRange) {
         codepoint_t *cpptr = (codepoint_t *)cld->extra;
         list_CharRange_add(&l, (CharRange){cpptr[0], cpptr[1]});
       } else {
@@ -247,26 +247,32 @@ static inline list_CharRange charset_to_charranges(ASTNode *charset,
   return l;
 }
 
-static inline int trieTransition_compare(const void *trans1,
-                                         const void *trans2) {
-  TrieTransition t1 = *(TrieTransition *)trans1, t2 = *(TrieTransition *)trans2;
-
-  if (t1.from < t2.from)
-    return -1;
-  if (t1.from > t2.from)
-    return 1;
-
-  if (t1.c < t2.c)
-    return -1;
-  if (t1.c > t2.c)
-    return 1;
-
-  if (t1.to < t2.to)
-    return -1;
-  if (t1.to > t2.to)
-    return 1;
-
-  return 0;
+// A node of the trie while it's being built. Its children are sorted by the
+// character that leads to them, so finding one is a binary search, and each
+// literal is added in time proportional to its length.
+typedef struct {
+  codepoint_t c;
+  int to;
+} TrieChild;
+
+LIST_DECLARE(TrieChild)
+LIST_DEFINE(TrieChild)
+LIST_DECLARE(list_TrieChild)
+LIST_DEFINE(list_TrieChild)
+
+// Returns where the child on c is, or where it would be inserted.
+static inline size_t trie_child_search(list_TrieChild *children, codepoint_t c,
+                                       int *found) {
+  size_t lo = 0, hi = children->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (children->buf[mid].c < c)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *found = lo < children->len && children->buf[lo].c == c;
+  return lo;
 }
 
 static inline TrieAutomaton createTrieAutomaton(list_ASTNodePtr tokdefs) {
@@ -278,8 +284,12 @@ static inline TrieAutomaton createTrieAutomaton(list_ASTNodePtr tokdefs) {
   TrieAutomaton trie;
   trie.trans = list_TrieTransition_new();
   trie.accepting = list_State_new();
+
+  // The children of each state, indexed by state number. 0 is the trie root.
+  list_list_TrieChild states = list_list_TrieChild_new();
+  list_list_TrieChild_add(&states, list_TrieChild_new());
+
   // For each token literal in the AST, add it as a path to the trie.
-  int state_num = 1; // 0 is the trie root.
   for (size_t n = 0; n < tokdefs.len; n++) {
 
     ASTNode *rule = tokdefs.buf[n];
@@ -287,7 +297,7 @@ static inline TrieAutomaton createTrieAutomaton(list_ASTNodePtr tokdefs) {
     ASTNode *def = rule->children[1];
     char *identstr = (char *)ident->extra;
 
-    if (strcmp(def->name, "LitDef") != 0)
+    if (def->kind != AST_LitDef)
       continue;
 
     // Add the literal to the trie.
@@ -299,41 +309,39 @@ static inline TrieAutomaton createTrieAutomaton(list_ASTNodePtr tokdefs) {
       if (AUT_DEBUG)
         printf("Current: %c\n", (char)c);
 
-      // Try to find the next state after the transition of c.
-      // See if we've already created a transition from where we are in the trie
-      // to the next character.
-      TrieTransition trans;
-      int found = 0;
-      for (size_t j = 0; j < trie.trans.len; j++) {
-        TrieTransition t = list_TrieTransition_get(&trie.trans, j);
-        if ((t.from == prev_state) & (t.c == c)) {
-          found = true;
-          trans = t;
-          if (AUT_DEBUG)
-            printf("Found a transition from %i to %i on '%c'.\n", trans.from,
-                   trans.to, (char)trans.c);
-          break;
-        }
-      }
-
-      // If the transition hasn't been created, create the transition and the
-      // state that it goes to.
-      if (!found) {
-        trans.from = prev_state;
-        trans.to = state_num++;
-        trans.c = c;
-        list_TrieTransition_add(&trie.trans, trans);
+      // See if we've already created a transition from where we are in the
+      // trie on the next character. If not, create it and the state that it
+      // goes to.
+      int found;
+      list_TrieChild *children = states.buf + prev_state;
+      size_t at = trie_child_search(children, c, &found);
+      int next_state;
+      if (found) {
+        next_state = children->buf[at].to;
+        if (AUT_DEBUG)
+          printf("Found a transition from %i to %i on '%c'.\n", prev_state,
+                 next_state, (char)c);
+      } else {
+        next_state = (int)states.len;
+        TrieChild child;
+        child.c = c;
+        child.to = next_state;
+        list_TrieChild_add(children, child);
+        memmove(children->buf + at + 1, children->buf + at,
+                sizeof(TrieChild) * (children->len - 1 - at));
+        children->buf[at] = child;
+        list_list_TrieChild_add(&states, list_TrieChild_new());
         if (AUT_DEBUG)
-          printf("Created a transition from %i to %i on '%c'.\n", trans.from,
-                 trans.to, (char)trans.c);
+          printf("Created a transition from %i to %i on '%c'.\n", prev_state,
+                 next_state, (char)c);
       }
 
-      // If the state we just created is the last character in the string,
+      // If the state we just got to is the last character in the string,
       // it's accepting.
       if (i == (cplen - 1)) {
         State s;
         s.rule = rule;
-        s.num = trans.to;
+        s.num = next_state;
         list_State_add(&trie.accepting, s);
         if (AUT_DEBUG)
           printf("Marked %i as an accepting state for rule %s.\n", s.num,
@@ -341,14 +349,23 @@ static inline TrieAutomaton createTrieAutomaton(list_ASTNodePtr tokdefs) {
       }
 
       // Traverse over the transition.
-      prev_state = trans.to;
+      prev_state = next_state;
     } // c in cpstr
   }   // litdef in tokast
 
-  // Sort the trie transitions.
-  // First by from, then by to, then by char.
-  qsort(trie.trans.buf, trie.trans.len, sizeof(TrieTransition),
-        trieTransition_compare);
+  // Flatten the trie into its transitions, sorted by from, then by char.
+  for (size_t from = 0; from < states.len; from++) {
+    list_TrieChild children = states.buf[from];
+    for (size_t i = 0; i < children.len; i++) {
+      TrieTransition trans;
+      trans.from = (int)from;
+      trans.c = children.buf[i].c;
+      trans.to = children.buf[i].to;
+      list_TrieTransition_add(&trie.trans, trans);
+    }
+    list_TrieChild_clear(&children);
+  }
+  list_list_TrieChild_clear(&states);
 
   if (AUT_DEBUG)
     printf("Finished building the Trie automaton.\n");
@@ -371,6 +388,440 @@ static inline TrieAutomaton createTrieAutomaton(list_ASTNodePtr tokdefs) {
   return trie;
 }
 
+static inline bool stateranges_contain(list_StateRange ranges, int state) {
+  for (size_t i = 0; i < ranges.len; i++)
+    if ((state >= ranges.buf[i].f) & (state <= ranges.buf[i].s))
+      return 1;
+  return 0;
+}
+
+static inline bool charranges_contain(list_CharRange ranges, codepoint_t c) {
+  for (size_t i = 0; i < ranges.len; i++)
+    if ((c >= ranges.buf[i].f) & (c <= ranges.buf[i].s))
+      return 1;
+  return 0;
+}
+
+// Where the state machine goes from state on c, the way the generated
+// tokenizer does it, taking the first transition that matches.
+static inline int SMAutomaton_step(SMAutomaton *aut, int state,
+                                   codepoint_t c) {
+  for (size_t t = 0; t < aut->trans.len; t++) {
+    SMTransition *trans = aut->trans.buf + t;
+    if (stateranges_contain(trans->from, state) &&
+        charranges_contain(trans->on, c) != trans->inverted)
+      return trans->to < 0 ? -1 : trans->to;
+  }
+  return -1;
+}
+
+// Runs the state machine over the string. Returns whether it ends in an
+// accepting state.
+static inline bool SMAutomaton_accepts(SMAutomaton *aut, codepoint_t *str,
+                                       size_t len) {
+  int state = 0;
+  for (size_t i = 0; i < len; i++)
+    if ((state = SMAutomaton_step(aut, state, str[i])) == -1)
+      return 0;
+  return stateranges_contain(aut->accepting, state);
+}
+
+static inline int codepoint_cmp(const void *a, const void *b) {
+  codepoint_t x = *(const codepoint_t *)a, y = *(const codepoint_t *)b;
+  return (x > y) - (x < y);
+}
+
+typedef struct {
+  uint64_t hash;
+  size_t state;
+} SMRowHash;
+
+static inline int SMRowHash_cmp(const void *a, const void *b) {
+  const SMRowHash *x = (const SMRowHash *)a, *y = (const SMRowHash *)b;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  return (x->state > y->state) - (x->state < y->state);
+}
+
+// The table of a state machine while it's minimized. Codepoints are split
+// into intervals that every transition treats the same way. Interval k
+// starts at starts[k] and ends where the next one starts. Row q of the table
+// has where state q goes on each interval, or -1.
+typedef struct {
+  codepoint_t *starts;
+  size_t num_intervals;
+  size_t num_states;
+  int *table;
+  int *block; // The group of states q was merged into, or -1 if it's dead.
+} SMTable;
+
+static inline int smtable_block(SMTable *t, int q) {
+  return q < 0 ? -1 : t->block[q];
+}
+
+// Whether q and r are in the same group, and go to the same groups.
+static inline bool smtable_same(SMTable *t, size_t q, size_t r) {
+  if (t->block[q] != t->block[r])
+    return 0;
+  int *qrow = t->table + q * t->num_intervals;
+  int *rrow = t->table + r * t->num_intervals;
+  for (size_t k = 0; k < t->num_intervals; k++)
+    if (smtable_block(t, qrow[k]) != smtable_block(t, rrow[k]))
+      return 0;
+  return 1;
+}
+
+static inline uint64_t smtable_hash(SMTable *t, size_t q) {
+  uint64_t h = UINT64_C(14695981039346656037) ^ (uint64_t)t->block[q];
+  int *row = t->table + q * t->num_intervals;
+  for (size_t k = 0; k < t->num_intervals; k++) {
+    h ^= (uint64_t)(int64_t)smtable_block(t, row[k]);
+    h *= UINT64_C(1099511628211);
+  }
+  return h;
+}
+
+// Splits the groups of states until the states in each go to the same
+// groups on every codepoint. Returns the number of groups.
+static inline size_t smtable_refine(SMTable *t, size_t num_blocks) {
+  size_t n = t->num_states;
+  SMRowHash *rows = (SMRowHash *)malloc(sizeof(SMRowHash) * n);
+  int *next = (int *)malloc(sizeof(int) * n);
+  size_t *firsts = (size_t *)malloc(sizeof(size_t) * n);
+  if (!rows | !next | !firsts)
+    OOM();
+
+  for (;;) {
+    size_t num_rows = 0;
+    for (size_t q = 0; q < n; q++) {
+      next[q] = -1;
+      if (t->block[q] != -1)
+        rows[num_rows++] = (SMRowHash){smtable_hash(t, q), q};
+    }
+    qsort(rows, num_rows, sizeof(SMRowHash), SMRowHash_cmp);
+
+    // States with the same hash are almost always the same. Compare them
+    // with the first of each new group in the run to be sure.
+    size_t num_next = 0;
+    for (size_t i = 0; i < num_rows;) {
+      size_t j = i, num_firsts = 0;
+      for (; j < num_rows && rows[j].hash == rows[i].hash; j++) {
+        size_t q = rows[j].state, f = 0;
+        for (; f < num_firsts; f++)
+          if (smtable_same(t, q, firsts[f]))
+            break;
+        if (f == num_firsts) {
+          firsts[num_firsts++] = q;
+          next[q] = (int)num_next++;
+        } else {
+          next[q] = next[firsts[f]];
+        }
+      }
+      i = j;
+    }
+
+    memcpy(t->block, next, sizeof(int) * n);
+    if (num_next == num_blocks)
+      break;
+    num_blocks = num_next;
+  }
+
+  free(rows);
+  free(next);
+  free(firsts);
+  return num_blocks;
+}
+
+// Adds a state to the end of a list of ranges of states, in order.
+static inline void stateranges_append(list_StateRange *l, int state) {
+  if (l->len && l->buf[l->len - 1].s == state - 1)
+    l->buf[l->len - 1].s = state;
+  else
+    list_StateRange_add(l, (StateRange){state, state});
+}
+
+static inline bool charranges_equal(list_CharRange a, list_CharRange b) {
+  if (a.len != b.len)
+    return 0;
+  for (size_t i = 0; i < a.len; i++)
+    if ((a.buf[i].f != b.buf[i].f) | (a.buf[i].s != b.buf[i].s))
+      return 0;
+  return 1;
+}
+
+// The ranges of the intervals of a row that go to (or don't go to) to.
+static inline list_CharRange smtable_ranges(SMTable *t, int *row, int to,
+                                            bool going) {
+  list_CharRange l = list_CharRange_new();
+  for (size_t k = 0; k < t->num_intervals; k++) {
+    if ((row[k] == to) != going)
+      continue;
+    codepoint_t end = k + 1 < t->num_intervals ? t->starts[k + 1] - 1
+                                               : (codepoint_t)INT32_MAX;
+    if (k && l.len && ((row[k - 1] == to) == going))
+      l.buf[l.len - 1].s = end;
+    else
+      list_CharRange_add(&l, (CharRange){t->starts[k], end});
+  }
+  return l;
+}
+
+// Adds state to the transition that goes to to on the same codepoints, or
+// makes one.
+static inline void smtrans_merge(list_SMTransition *l, int state,
+                                 list_CharRange on, bool inverted, int to) {
+  for (size_t i = 0; i < l->len; i++) {
+    SMTransition *t = l->buf + i;
+    if ((t->to == to) & (t->inverted == inverted) &&
+        charranges_equal(t->on, on)) {
+      stateranges_append(&t->from, state);
+      list_CharRange_clear(&on);
+      return;
+    }
+  }
+  SMTransition t;
+  t.from = list_StateRange_new();
+  stateranges_append(&t.from, state);
+  t.on = on;
+  t.inverted = inverted;
+  t.to = to;
+  list_SMTransition_add(l, t);
+}
+
+/*
+ * Rewrites a state machine into the smallest one that matches the same
+ * strings. States that can't be reached are dropped. States that can't
+ * reach an accepting state are replaced by -1, so the machine dies as soon
+ * as it can never accept, instead of scanning to the end of the run. States
+ * that accept the same strings from then on are merged. Then there's one
+ * transition for each set of codepoints and the state they go to, and each
+ * state is in the from of one transition per codepoint. When most
+ * codepoints go to one state, like with [^\n], that transition is inverted
+ * and goes last.
+ */
+static inline void SMAutomaton_minimize(SMAutomaton *aut) {
+  SMTable t;
+
+  // Split the codepoints into intervals.
+  size_t cap = 1;
+  for (size_t i = 0; i < aut->trans.len; i++)
+    cap += aut->trans.buf[i].on.len * 2;
+  t.starts = (codepoint_t *)malloc(sizeof(codepoint_t) * cap);
+  if (!t.starts)
+    OOM();
+  size_t num_starts = 0;
+  t.starts[num_starts++] = INT32_MIN;
+  for (size_t i = 0; i < aut->trans.len; i++) {
+    list_CharRange on = aut->trans.buf[i].on;
+    for (size_t r = 0; r < on.len; r++) {
+      t.starts[num_starts++] = on.buf[r].f;
+      if (on.buf[r].s != INT32_MAX)
+        t.starts[num_starts++] = on.buf[r].s + 1;
+    }
+  }
+  qsort(t.starts, num_starts, sizeof(codepoint_t), codepoint_cmp);
+  t.num_intervals = 0;
+  for (size_t i = 0; i < num_starts; i++)
+    if (!i || t.starts[i] != t.starts[i - 1])
+      t.starts[t.num_intervals++] = t.starts[i];
+  size_t K = t.num_intervals;
+
+  // Find where each state goes on each interval, taking the first transition
+  // that matches, like SMAutomaton_step(). Going through the transitions once
+  // is much faster than stepping, for big machines like the ones regexes make.
+  // Nothing goes to the states past the last one that something goes to, so
+  // they're left out.
+  int max_state = 0;
+  for (size_t i = 0; i < aut->trans.len; i++)
+    max_state = MAX(max_state, aut->trans.buf[i].to);
+  size_t S = (size_t)max_state + 1;
+  int *step = (int *)malloc(sizeof(int) * S * K);
+  bool *match = (bool *)malloc(sizeof(bool) * K);
+  if (!step | !match)
+    OOM();
+  for (size_t i = 0; i < S * K; i++)
+    step[i] = -2;
+  for (size_t i = 0; i < aut->trans.len; i++) {
+    SMTransition *trans = aut->trans.buf + i;
+    int to = trans->to < 0 ? -1 : trans->to;
+    for (size_t k = 0; k < K; k++)
+      match[k] = charranges_contain(trans->on, t.starts[k]) != trans->inverted;
+    for (size_t r = 0; r < trans->from.len; r++) {
+      StateRange from = trans->from.buf[r];
+      for (int q = MAX(from.f, 0); q <= MIN(from.s, max_state); q++)
+        for (size_t k = 0; k < K; k++)
+          if (match[k] && step[(size_t)q * K + k] == -2)
+            step[(size_t)q * K + k] = to;
+    }
+  }
+  free(match);
+
+  // Find the states that can be reached from 0, and fill in the table.
+  // Original state numbers are looked up in index.
+  int *index = (int *)malloc(sizeof(int) * S);
+  if (!index)
+    OOM();
+  for (size_t i = 0; i < S; i++)
+    index[i] = -1;
+  list_int states = list_int_new();
+  list_int table = list_int_new();
+  index[0] = 0;
+  list_int_add(&states, 0);
+  for (size_t q = 0; q < states.len; q++) {
+    for (size_t k = 0; k < K; k++) {
+      int to = step[(size_t)states.buf[q] * K + k];
+      if (to == -2)
+        to = -1;
+      if (to != -1 && index[to] == -1) {
+        index[to] = (int)states.len;
+        list_int_add(&states, to);
+      }
+      list_int_add(&table, to == -1 ? -1 : index[to]);
+    }
+  }
+  free(index);
+  free(step);
+  size_t n = t.num_states = states.len;
+  t.table = table.buf;
+
+  // Find the states that can reach an accepting state.
+  bool *live = (bool *)malloc(sizeof(bool) * n);
+  bool *accepting = (bool *)malloc(sizeof(bool) * n);
+  t.block = (int *)malloc(sizeof(int) * n);
+  if (!live | !accepting | !t.block)
+    OOM();
+  for (size_t q = 0; q < n; q++)
+    live[q] = accepting[q] = stateranges_contain(aut->accepting, states.buf[q]);
+  for (bool changed = 1; changed;) {
+    changed = 0;
+    for (size_t q = 0; q < n; q++)
+      for (size_t k = 0; k < K && !live[q]; k++)
+        if (t.table[q * K + k] != -1 && live[t.table[q * K + k]])
+          live[q] = changed = 1;
+  }
+
+  // A machine that can never accept is left alone. Its accepting states
+  // can't be empty, because no accepting states is written as all of them.
+  if (!live[0]) {
+    free(t.starts);
+    free(t.table);
+    free(t.block);
+    free(live);
+    free(accepting);
+    list_int_clear(&states);
+    return;
+  }
+
+  for (size_t i = 0; i < n * K; i++)
+    if (t.table[i] != -1 && !live[t.table[i]])
+      t.table[i] = -1;
+
+  // Merge the states that accept the same strings, starting from the
+  // accepting and the other live states, if there are both.
+  bool groups[2] = {0, 0};
+  for (size_t q = 0; q < n; q++) {
+    t.block[q] = live[q] ? accepting[q] : -1;
+    if (live[q])
+      groups[accepting[q]] = 1;
+  }
+  size_t num_blocks = smtable_refine(&t, (size_t)groups[0] + groups[1]);
+
+  // Number the groups in the order they're reached from 0.
+  int *number = (int *)malloc(sizeof(int) * num_blocks);
+  size_t *rep = (size_t *)malloc(sizeof(size_t) * num_blocks);
+  if (!number | !rep)
+    OOM();
+  for (size_t b = 0; b < num_blocks; b++)
+    number[b] = -1;
+  size_t num_states = 0;
+  number[t.block[0]] = (int)num_states;
+  rep[num_states++] = 0;
+  for (size_t s = 0; s < num_states; s++) {
+    int *row = t.table + rep[s] * K;
+    for (size_t k = 0; k < K; k++) {
+      int b = smtable_block(&t, row[k]);
+      if (b != -1 && number[b] == -1) {
+        number[b] = (int)num_states;
+        rep[num_states++] = (size_t)row[k];
+      }
+    }
+  }
+
+  // Write the transitions and accepting states of the new states.
+  list_SMTransition plain = list_SMTransition_new();
+  list_SMTransition inverted = list_SMTransition_new();
+  list_StateRange accepts = list_StateRange_new();
+  int *row = (int *)malloc(sizeof(int) * K);
+  if (!row)
+    OOM();
+  for (size_t s = 0; s < num_states; s++) {
+    int state = (int)s;
+    if (accepting[rep[s]])
+      stateranges_append(&accepts, state);
+    for (size_t k = 0; k < K; k++) {
+      int b = smtable_block(&t, t.table[rep[s] * K + k]);
+      row[k] = b == -1 ? -1 : number[b];
+    }
+
+    // Invert the transition where it takes the fewest ranges to say which
+    // codepoints don't go there.
+    int inv_to = -1;
+    long best = 0;
+    for (size_t k = 0; k < K; k++) {
+      int to = row[k];
+      if (to == -1 || (k && row[k - 1] == to))
+        continue;
+      list_CharRange on = smtable_ranges(&t, row, to, 1);
+      list_CharRange off = smtable_ranges(&t, row, to, 0);
+      long gain = (long)on.len - (long)off.len;
+      if (gain > best)
+        best = gain, inv_to = to;
+      list_CharRange_clear(&on);
+      list_CharRange_clear(&off);
+    }
+
+    for (size_t k = 0; k < K; k++) {
+      int to = row[k];
+      if (to == -1 || to == inv_to)
+        continue;
+      size_t first = 0;
+      while (row[first] != to)
+        first++;
+      if (first == k)
+        smtrans_merge(&plain, state, smtable_ranges(&t, row, to, 1), 0, to);
+    }
+    if (inv_to != -1)
+      smtrans_merge(&inverted, state, smtable_ranges(&t, row, inv_to, 0), 1,
+                    inv_to);
+  }
+  for (size_t i = 0; i < inverted.len; i++)
+    list_SMTransition_add(&plain, inverted.buf[i]);
+
+  for (size_t i = 0; i < aut->trans.len; i++) {
+    list_StateRange_clear(&aut->trans.buf[i].from);
+    list_CharRange_clear(&aut->trans.buf[i].on);
+  }
+  list_SMTransition_clear(&aut->trans);
+  list_StateRange_clear(&aut->accepting);
+  list_SMTransition_clear(&inverted);
+  aut->trans = plain;
+  aut->accepting = accepts;
+
+  free(row);
+  free(number);
+  free(rep);
+  free(t.starts);
+  free(t.table);
+  free(t.block);
+  free(live);
+  free(accepting);
+  list_int_clear(&states);
+}
+
+#ifndef PGEN_REGEX_INCLUDE
+#include "regex.h"
+#endif
+
 static inline list_SMAutomaton createSMAutomata(list_ASTNodePtr tokdefs) {
   list_SMAutomaton auts = list_SMAutomaton_new();
 
@@ -386,7 +837,15 @@ static inline list_SMAutomaton createSMAutomata(list_ASTNodePtr tokdefs) {
     char *identstr = (char *)ident->extra;
     aut.ident = identstr;
 
-    if (strcmp(def->name, "SMDef") != 0)
+    // Regexes are compiled into the same kind of state machine.
+    if (def->kind == AST_RegexDef) {
+      regex_compile(&aut, (codepoint_t *)def->extra);
+      SMAutomaton_minimize(&aut);
+      list_SMAutomaton_add(&auts, aut);
+      continue;
+    }
+
+    if (def->kind != AST_SMDef)
       continue;
 
     if (AUT_DEBUG)
@@ -424,6 +883,7 @@ static inline list_SMAutomaton createSMAutomata(list_ASTNodePtr tokdefs) {
         printf("  to:   \n");
       }
     } // rule in smdef
+    SMAutomaton_minimize(&aut);
     list_SMAutomaton_add(&auts, aut);
   } // automaton for smdef in tokast
 
@@ -0,0 +1,249 @@
+#ifndef PGEN_BENCHGEN_INCLUDE
+#define PGEN_BENCHGEN_INCLUDE
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef TOKCODEGEN_INCLUDE
+#include "codegen.h"
+#endif
+
+/*
+ * With --bench, lang.h gets a lang_bench.c beside it. It's a main() that
+ * times decoding, tokenizing, and parsing a file with the generated parser,
+ * separately, and prints the best of a few runs as JSON. `build bench` runs
+ * it on the examples.
+ */
+
+// Generated files refer to each other relative to their own directory.
+static inline const char *bench_basename(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+static inline void bench_write_prologue(codegen_ctx *ctx) {
+  cwrite(CODEGEN_FINGERPRINT_FMT, ctx->output_fingerprint);
+  cwrite("/*\n");
+  cwrite(" * Benchmarks the %s parser on a file. Decoding the UTF-8, "
+         "tokenizing, and\n",
+         ctx->lower);
+  cwrite(" * parsing are timed separately, and the best time of each "
+         "over the runs is\n");
+  cwrite(" * printed as JSON.\n");
+  cwrite(" *   cc -O2 %s%s%s -o %s_bench\n",
+         bench_basename(ctx->benchTarget), ctx->args->split ? " " : "",
+         ctx->args->split ? bench_basename(ctx->implTarget) : "", ctx->lower);
+  cwrite(" *   ./%s_bench INPUT [RUNS]\n", ctx->lower);
+  cwrite(" */\n");
+  cwrite("#define _POSIX_C_SOURCE 200809L\n");
+  cwrite("#include \"%s\"\n\n", bench_basename(ctx->args->outputTarget));
+  cwrite("#include <stdio.h>\n");
+  cwrite("#include <sys/resource.h>\n");
+  cwrite("#include <time.h>\n\n");
+
+  cwrite("static double %s_bench_now(void) {\n", ctx->lower);
+  cwrite("  struct timespec ts;\n");
+  cwrite("#ifdef CLOCK_MONOTONIC\n");
+  cwrite("  clock_gettime(CLOCK_MONOTONIC, &ts);\n");
+  cwrite("#else\n");
+  cwrite("  timespec_get(&ts, TIME_UTC);\n");
+  cwrite("#endif\n");
+  cwrite("  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;\n");
+  cwrite("}\n\n");
+
+  // The parser never sees %ignore tokens.
+  cwrite("static int %s_bench_ignored(%s_token_kind kind) {\n", ctx->lower,
+         ctx->lower);
+  cwrite("  switch (kind) {\n");
+  int any_ignored = 0;
+  for (size_t i = 0; i < ctx->tok_kind_names.len; i++) {
+    if (!peg_token_is_ignored(ctx, ctx->tok_kind_names.buf[i]))
+      continue;
+    any_ignored = 1;
+    cwrite("  case %s_TOK_%s:\n", ctx->upper, ctx->tok_kind_names.buf[i]);
+  }
+  if (any_ignored)
+    cwrite("    return 1;\n");
+  cwrite("  default:\n");
+  cwrite("    return 0;\n");
+  cwrite("  }\n");
+  cwrite("}\n\n");
+
+  // Deep left-recursive trees are common, so the walk has its own stack.
+  cwrite("static size_t %s_bench_count(%s_astnode_t* root) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  size_t count = 0, len = 0, cap = 256;\n");
+  cwrite("  %s_astnode_t** stack = (%s_astnode_t**)malloc(sizeof(%s_"
+         "astnode_t*) * cap);\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  if (!stack)\n");
+  cwrite("    fprintf(stderr, \"Out of memory.\\n\"), exit(1);\n");
+  cwrite("  if (root)\n");
+  cwrite("    stack[len++] = root;\n");
+  cwrite("  while (len) {\n");
+  cwrite("    %s_astnode_t* node = stack[--len];\n", ctx->lower);
+  cwrite("    count++;\n");
+  cwrite("    if (len + node->num_children > cap) {\n");
+  cwrite("      cap = (len + node->num_children) * 2;\n");
+  cwrite("      stack = (%s_astnode_t**)realloc(stack, sizeof(%s_astnode_"
+         "t*) * cap);\n",
+         ctx->lower, ctx->lower);
+  cwrite("      if (!stack)\n");
+  cwrite("        fprintf(stderr, \"Out of memory.\\n\"), exit(1);\n");
+  cwrite("    }\n");
+  if (ctx->args->compact)
+    cwrite("    %s_astnode_t** children = %s_astnode_children(node);\n",
+           ctx->lower, ctx->lower);
+  else
+    cwrite("    %s_astnode_t** children = node->children;\n", ctx->lower);
+  cwrite("    for (size_t i = 0; i < node->num_children; i++)\n");
+  cwrite("      if (children[i])\n");
+  cwrite("        stack[len++] = children[i];\n");
+  cwrite("  }\n");
+  cwrite("  free(stack);\n");
+  cwrite("  return count;\n");
+  cwrite("}\n\n");
+}
+
+static inline void bench_write_main(codegen_ctx *ctx) {
+  char *start = (char *)ctx->definitions.buf[0]->children[0]->extra;
+  const char *l = ctx->lower;
+
+  cwrite("int main(int argc, char** argv) {\n");
+  cwrite("  if ((argc < 2) | (argc > 3)) {\n");
+  cwrite("    fprintf(stderr, \"Usage: %%s INPUT [RUNS]\\n\", argv[0]);\n");
+  cwrite("    return 1;\n");
+  cwrite("  }\n");
+  cwrite("  int runs = argc == 3 ? atoi(argv[2]) : 5;\n");
+  cwrite("  if (runs < 1)\n");
+  cwrite("    runs = 1;\n\n");
+
+  cwrite("  FILE* in = fopen(argv[1], \"rb\");\n");
+  cwrite("  if (!in)\n");
+  cwrite("    fprintf(stderr, \"Could not open %%s.\\n\", argv[1]), "
+         "exit(1);\n");
+  cwrite("  size_t bytes = 0, cap = 1 << 16;\n");
+  cwrite("  char* input = (char*)malloc(cap);\n");
+  cwrite("  size_t got;\n");
+  cwrite("  while (input && (got = fread(input + bytes, 1, cap - bytes, "
+         "in))) {\n");
+  cwrite("    if ((bytes += got) == cap)\n");
+  cwrite("      input = (char*)realloc(input, cap *= 2);\n");
+  cwrite("  }\n");
+  cwrite("  if (!input)\n");
+  cwrite("    fprintf(stderr, \"Out of memory.\\n\"), exit(1);\n");
+  cwrite("  fclose(in);\n\n");
+
+  cwrite("  double best[3] = {1e300, 1e300, 1e300};\n");
+  cwrite("  size_t cpslen = 0, num_tokens = 0, num_nodes = 0;\n");
+  cwrite("  for (int run = 0; run < runs; run++) {\n");
+  cwrite("    double t0 = %s_bench_now();\n", l);
+  cwrite("    codepoint_t* cps = NULL;\n");
+  cwrite("    if (!UTF8_decode(input, bytes, &cps, &cpslen))\n");
+  cwrite("      fprintf(stderr, \"Could not decode the input.\\n\"), "
+         "exit(1);\n\n");
+
+  cwrite("    double t1 = %s_bench_now();\n", l);
+  cwrite("    %s_tokenizer tokenizer;\n", l);
+  cwrite("    %s_tokenizer_init(&tokenizer, cps, cpslen);\n", l);
+  cwrite("    size_t toks_cap = cpslen / 4 + 16;\n");
+  cwrite("    %s_token* toks = (%s_token*)malloc(sizeof(%s_token) * "
+         "toks_cap);\n",
+         l, l, l);
+  cwrite("    num_tokens = 0;\n");
+  cwrite("    %s_token tok;\n", l);
+  cwrite("    do {\n");
+  cwrite("      tok = %s_nextToken(&tokenizer);\n", l);
+  cwrite("      if ((tok.kind == %s_TOK_STREAMEND) | %s_bench_ignored(tok."
+         "kind))\n",
+         ctx->upper, l);
+  cwrite("        continue;\n");
+  cwrite("      if (toks && num_tokens == toks_cap)\n");
+  cwrite("        toks = (%s_token*)realloc(toks, sizeof(%s_token) * "
+         "(toks_cap *= 2));\n",
+         l, l);
+  cwrite("      if (!toks)\n");
+  cwrite("        fprintf(stderr, \"Out of memory.\\n\"), exit(1);\n");
+  cwrite("      toks[num_tokens++] = tok;\n");
+  cwrite("    } while (tok.kind != %s_TOK_STREAMEND);\n", ctx->upper);
+  cwrite("    if (tokenizer.pos != cpslen)\n");
+  cwrite("      fprintf(stderr, \"Could not tokenize the input past "
+         "codepoint %%zu.\\n\",\n");
+  cwrite("              tokenizer.pos), exit(1);\n\n");
+
+  cwrite("    double t2 = %s_bench_now();\n", l);
+  cwrite("    pgen_allocator allocator = pgen_allocator_new();\n");
+  cwrite("    %s_parser_ctx parser;\n", l);
+  cwrite("    %s_parser_ctx_init(&parser, &allocator, toks, num_tokens);\n",
+         l);
+  cwrite("    %s_astnode_t* ast = %s_parse_%s(&parser);\n", l, l, start);
+  cwrite("    double t3 = %s_bench_now();\n", l);
+  cwrite("    if (parser.num_errors | !ast)\n");
+  cwrite("      fprintf(stderr, \"Could not parse the input.\\n\"), "
+         "exit(1);\n");
+  cwrite("    num_nodes = %s_bench_count(ast);\n\n", l);
+
+  cwrite("    double t[3] = {t1 - t0, t2 - t1, t3 - t2};\n");
+  cwrite("    for (int i = 0; i < 3; i++)\n");
+  cwrite("      best[i] = t[i] < best[i] ? t[i] : best[i];\n");
+  cwrite("    pgen_allocator_destroy(&allocator);\n");
+  cwrite("    free(toks);\n");
+  cwrite("    free(cps);\n");
+  cwrite("  }\n");
+  cwrite("  free(input);\n\n");
+
+  // ru_maxrss is in kilobytes, except on macOS, where it's in bytes.
+  cwrite("  struct rusage usage;\n");
+  cwrite("  getrusage(RUSAGE_SELF, &usage);\n");
+  cwrite("  long rss_kb = usage.ru_maxrss;\n");
+  cwrite("#ifdef __APPLE__\n");
+  cwrite("  rss_kb /= 1024;\n");
+  cwrite("#endif\n\n");
+
+  cwrite("  double mb = (double)bytes / 1e6;\n");
+  cwrite("  printf(\"{\\\"parser\\\": \\\"%s\\\", "
+         "\\\"input\\\": \\\"\");\n",
+         l);
+  cwrite("  for (char* c = argv[1]; *c; c++)\n");
+  cwrite("    printf(\"%%s%%c\", (*c == '\"') | (*c == '\\\\') ? "
+         "\"\\\\\" : \"\", *c);\n");
+  cwrite("  printf(\"\\\", \\\"runs\\\": %%d,\\n\", runs);\n");
+  cwrite("  printf(\" \\\"bytes\\\": %%zu, \\\"codepoints\\\": %%zu, "
+         "\\\"tokens\\\": %%zu, \\\"nodes\\\": %%zu,\\n\",\n");
+  cwrite("         bytes, cpslen, num_tokens, num_nodes);\n");
+  cwrite("  printf(\" \\\"decode\\\": {\\\"seconds\\\": %%.6f, "
+         "\\\"mb_per_s\\\": %%.2f},\\n\",\n");
+  cwrite("         best[0], mb / best[0]);\n");
+  cwrite("  printf(\" \\\"tokenize\\\": {\\\"seconds\\\": %%.6f, "
+         "\\\"mb_per_s\\\": %%.2f, \\\"tokens_per_s\\\": %%.0f},\\n\",\n");
+  cwrite("         best[1], mb / best[1], (double)num_tokens / "
+         "best[1]);\n");
+  cwrite("  printf(\" \\\"parse\\\": {\\\"seconds\\\": %%.6f, "
+         "\\\"tokens_per_s\\\": %%.0f, "
+         "\\\"nodes_per_s\\\": %%.0f},\\n\",\n");
+  cwrite("         best[2], (double)num_tokens / best[2], "
+         "(double)num_nodes / best[2]);\n");
+  cwrite("  printf(\" \\\"peak_rss_kb\\\": %%ld}\\n\", rss_kb);\n");
+  cwrite("  return 0;\n");
+  cwrite("}\n");
+}
+
+static inline void generate_bench_runner(codegen_ctx *ctx) {
+  if (!ctx->benchTarget)
+    return;
+  if (!ctx->definitions.len)
+    ERROR("--bench needs a rule to parse with.");
+
+  // Build it in memory and write it out the way the parser is, with cwrite()
+  // pointed at it in the meantime.
+  pgen_writer parser = ctx->f;
+  size_t line_nbr = ctx->line_nbr;
+  ctx->f = pgen_writer_mem();
+  bench_write_prologue(ctx);
+  bench_write_main(ctx);
+  codegen_write_out(&ctx->f, ctx->benchTarget);
+  ctx->f = parser;
+  ctx->line_nbr = line_nbr;
+}
+
+#endif /* PGEN_BENCHGEN_INCLUDE */
@@ -7,6 +7,7 @@
 #include "argparse.h"
 #include "ast.h"
 #include "automata.h"
+#include "io.h"
 #include "list.h"
 #include "parserctx.h"
 #include "pegparser.h"
@@ -15,21 +16,39 @@
 
 #define NODE_NUM_FIXED 10
 
+// Identifies this build of pgen in output fingerprints. ./build sets it to
+// a checksum of the source.
+#ifndef PGEN_BUILD_ID
+#define PGEN_BUILD_ID __DATE__ " " __TIME__
+#endif
+
 /*******/
 /* ctx */
 /*******/
 
 #define PGEN_PREFIX_LEN 8
 typedef struct {
-  FILE *f;
-  char *fbuffer;
+  pgen_writer f; // Where cwrite() goes. Written out on destroy.
+  // For --emit=split, f is the implementation, and the header is kept here
+  // except between codegen_to_header() and codegen_to_impl().
+  pgen_writer hf;
+  size_t h_line_nbr;
+  int in_header;
+  char *implTarget;
+  char *benchTarget; // For --bench
   ASTNode *ast;
   Args *args;
   TrieAutomaton trie;
   list_SMAutomaton smauts;
+  list_ASTNodePtr keywords; // Left out of the trie, for --keyword-hash
   size_t expr_cnt;
   size_t indent_cnt;
   size_t line_nbr;
+  uint64_t fingerprint;
+  uint64_t output_fingerprint; // Of everything that goes into the output.
+  int keep_output;             // Don't write the output on destroy.
+  size_t arena_bytes_per_token; // From --stats, or 0.
+  size_t list_initial_size;     // From --stats, or 0.
   char lower[PGEN_PREFIX_LEN];
   char upper[PGEN_PREFIX_LEN];
   list_ASTNodePtr directives;
@@ -37,58 +56,149 @@ typedef struct {
   list_ASTNodePtr tokendefs;
   list_cstr tok_kind_names;
   list_cstr peg_kind_names;
+  list_size_t vm_code; // Bytecode for --backend=vm
+  list_cstr vm_msgs;   // Error strings the bytecode refers to
+  Symindex vm_rule_ix; // Rule and token indices by name, for --backend=vm
+  Symindex vm_tok_ix;
 } codegen_ctx;
 
-static inline int cwrite_inner(codegen_ctx *ctx, const char *fmt, ...) {
-  size_t newlines = 0;
-  va_list ap;
-  va_start(ap, fmt);
+static inline void cwrite_count_lines(codegen_ctx *ctx, const char *s,
+                                      size_t len) {
+  const char *end = s + len;
+  while ((s = (const char *)memchr(s, '\n', (size_t)(end - s)))) {
+    ctx->line_nbr++;
+    s++;
+  }
+}
+
+// Writes text as is, without formatting it.
+static inline void cwrite_raw(codegen_ctx *ctx, const char *s, size_t len) {
+  pgen_write(&ctx->f, s, len);
+  if (ctx->f.err)
+    OOM();
+  cwrite_count_lines(ctx, s, len);
+}
 
-#define CWRITE_INNER_BUFSZ (4096 * 4)
-  char buf[CWRITE_INNER_BUFSZ];
+static inline int cwrite_inner(codegen_ctx *ctx, const char *fmt, ...) {
+  pgen_writer *w = &ctx->f;
 
-  size_t csize = CWRITE_INNER_BUFSZ;
-  char *cbuf = buf;
-  int written;
-  while (1) {
-    va_list cpy;
-    va_copy(cpy, ap);
-    written = vsnprintf(cbuf, CWRITE_INNER_BUFSZ, fmt, cpy);
-    va_end(cpy);
-
-    if (written >= CWRITE_INNER_BUFSZ) { // C99
-      char *re = csize == CWRITE_INNER_BUFSZ ? NULL : cbuf;
-      csize *= 2;
-      cbuf = (char *)realloc(re, csize);
-    } else if (written < 0) {
-      va_end(ap);
-      return written;
-    } else {
-      break;
-    }
+  // Most fragments are plain text.
+  if (!strchr(fmt, '%')) {
+    size_t len = strlen(fmt);
+    cwrite_raw(ctx, fmt, len);
+    return (int)len;
   }
-  if (csize != CWRITE_INNER_BUFSZ)
-    free(cbuf);
 
-  for (size_t i = 0; i < (size_t)written; i++)
-    if (cbuf[i] == '\n')
-      newlines++;
-  ctx->line_nbr += newlines;
+  va_list ap;
+  va_start(ap, fmt);
 
-  written = vfprintf(ctx->f, fmt, ap);
+  // Format straight into the output buffer. Only fragments that don't fit
+  // in what's left of it get formatted twice.
+#define CWRITE_INNER_RESERVE (4096 * 4)
+  if (w->cap - w->len < CWRITE_INNER_RESERVE &&
+      !pgen_writer_grow(w, CWRITE_INNER_RESERVE))
+    OOM();
+  size_t room = w->cap - w->len;
+  va_list cpy;
+  va_copy(cpy, ap);
+  int written = vsnprintf(w->buf + w->len, room, fmt, cpy);
+  va_end(cpy);
+  if (written >= 0 && (size_t)written >= room) {
+    if (!pgen_writer_grow(w, (size_t)written + 1))
+      OOM();
+    written = vsnprintf(w->buf + w->len, (size_t)written + 1, fmt, ap);
+  }
   va_end(ap);
+  if (written < 0)
+    return written;
+
+  cwrite_count_lines(ctx, w->buf + w->len, (size_t)written);
+  w->len += (size_t)written;
   return written;
 }
 
 #define cwrite(...) cwrite_inner(ctx, __VA_ARGS__)
 
+// With --emit=split, points cwrite() at the header until codegen_to_impl().
+// Otherwise, everything goes to the one header, and these do nothing.
+static inline void codegen_swap_output(codegen_ctx *ctx) {
+  pgen_writer f = ctx->f;
+  ctx->f = ctx->hf;
+  ctx->hf = f;
+  size_t line_nbr = ctx->line_nbr;
+  ctx->line_nbr = ctx->h_line_nbr;
+  ctx->h_line_nbr = line_nbr;
+  ctx->in_header = !ctx->in_header;
+}
+
+static inline void codegen_to_header(codegen_ctx *ctx) {
+  if (ctx->args->split && !ctx->in_header)
+    codegen_swap_output(ctx);
+}
+
+static inline void codegen_to_impl(codegen_ctx *ctx) {
+  if (ctx->args->split && ctx->in_header)
+    codegen_swap_output(ctx);
+}
+
+// The file that cwrite() is writing, for #line directives.
+static inline char *codegen_target(codegen_ctx *ctx) {
+  return (ctx->args->split && !ctx->in_header) ? ctx->implTarget
+                                      : ctx->args->outputTarget;
+}
+
+// Starts the definition of a function that's part of the generated API, from
+// its signature, like "int lang_f(int x)". It's static inline, unless the
+// output is split. Then it's declared in the header and defined in the
+// implementation, which cwrite() is left pointing at.
+static inline void cwrite_api(codegen_ctx *ctx, const char *fmt, ...) {
+  char sig[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(sig, sizeof(sig), fmt, ap);
+  va_end(ap);
+
+  if (!ctx->args->split) {
+    cwrite("static inline %s {\n", sig);
+    return;
+  }
+  codegen_to_header(ctx);
+  cwrite("%s;\n", sig);
+  codegen_to_impl(ctx);
+  cwrite("%s {\n", sig);
+}
+
+// Starts the definition of a table that's part of the generated API, from
+// its declaration, like "const char* lang_names[3]". It's static, unless the
+// output is split. Then it's extern in the header and defined in the
+// implementation.
+static inline void cwrite_api_var(codegen_ctx *ctx, const char *fmt, ...) {
+  char decl[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(decl, sizeof(decl), fmt, ap);
+  va_end(ap);
+
+  if (!ctx->args->split) {
+    cwrite("static %s = ", decl);
+    return;
+  }
+  codegen_to_header(ctx);
+  cwrite("extern %s;\n", decl);
+  codegen_to_impl(ctx);
+  cwrite("%s = ", decl);
+}
+
 static inline void codegen_ctx_init(codegen_ctx *ctx, Args *args, ASTNode *ast,
                                     Symtabs symtabs, TrieAutomaton trie,
-                                    list_SMAutomaton smauts) {
+                                    list_SMAutomaton smauts,
+                                    list_ASTNodePtr keywords,
+                                    Codepoint_String_View grammar) {
   ctx->args = args;
   ctx->ast = ast;
   ctx->trie = trie;
   ctx->smauts = smauts;
+  ctx->keywords = keywords;
   ctx->expr_cnt = 0;
   ctx->indent_cnt = 1;
   ctx->line_nbr = 1;
@@ -97,9 +207,55 @@ static inline void codegen_ctx_init(codegen_ctx *ctx, Args *args, ASTNode *ast,
   ctx->directives = symtabs.directives;
   ctx->definitions = symtabs.definitions;
   ctx->tokendefs = symtabs.tokendefs;
+  ctx->vm_code = list_size_t_new();
+  ctx->vm_msgs = list_cstr_new();
+  if (args->vm) {
+    size_t num_rules = ctx->definitions.len;
+    char **names = (char **)malloc(sizeof(char *) * (num_rules + 1));
+    if (!names)
+      OOM();
+    for (size_t i = 0; i < num_rules; i++)
+      names[i] = (char *)ctx->definitions.buf[i]->children[0]->extra;
+    ctx->vm_rule_ix = symindex_new(names, num_rules);
+    ctx->vm_tok_ix =
+        symindex_new(ctx->tok_kind_names.buf, ctx->tok_kind_names.len);
+    free(names);
+  }
+
+  // Fingerprint the grammar, so that generated code can tell when data it
+  // saved came from a different version of the grammar.
+  String_View grammar_utf8 = UTF8_encode_view(grammar);
+  if (!grammar_utf8.str)
+    ERROR("Could not encode the grammar file.");
+  ctx->fingerprint = pgen_hash64(grammar_utf8.str, grammar_utf8.len, 0);
+  free(grammar_utf8.str);
+
+  // Read the statistics from a profiling run.
+  ctx->arena_bytes_per_token = 0;
+  ctx->list_initial_size = 0;
+  if (args->statsTarget) {
+    FILE *sf = fopen(args->statsTarget, "r");
+    if (!sf)
+      ERROR("Could not open the stats file: %s", args->statsTarget);
+    char key[64];
+    size_t val;
+    while (fscanf(sf, "%63s %zu", key, &val) == 2) {
+      if (!strcmp(key, "arena_bytes_per_token"))
+        ctx->arena_bytes_per_token = val;
+      else if (!strcmp(key, "list_initial_size"))
+        ctx->list_initial_size = val;
+    }
+    fclose(sf);
+    // A profiling run writes at most 1 << 15, which is also the most
+    // lang_astnode_list() will start a list with.
+    if (!ctx->arena_bytes_per_token | !ctx->list_initial_size |
+        (ctx->list_initial_size > 32768))
+      ERROR("The stats file %s is not from a profiling run.",
+            args->statsTarget);
+  }
 
   // Check to make sure we actually have code to generate.
-  if ((!trie.accepting.len) & (!smauts.len))
+  if ((!trie.accepting.len) & (!smauts.len) & (!keywords.len))
     ERROR("No grammar rules defined. Exiting.");
 
   // Parse prefix from grammar file name.
@@ -185,38 +341,138 @@ static inline void codegen_ctx_init(codegen_ctx *ctx, Args *args, ASTNode *ast,
     }
   }
 
-  ctx->f = tmpfile();
-  if (!ctx->f)
-    ERROR("Could not open a temp file.");
+  // With --emit=split, lang.h gets a lang.c beside it.
+  ctx->implTarget = NULL;
+  if (args->split) {
+    size_t len = strlen(args->outputTarget);
+    ctx->implTarget = (char *)malloc(len + 3);
+    if (!ctx->implTarget)
+      OOM();
+    strcpy(ctx->implTarget, args->outputTarget);
+    if (len >= 2 && !strcmp(ctx->implTarget + len - 2, ".h"))
+      ctx->implTarget[len - 1] = 'c';
+    else
+      strcat(ctx->implTarget, ".c");
+  }
+
+  // With --bench, it also gets a lang_bench.c.
+  ctx->benchTarget = NULL;
+  if (args->bench) {
+    size_t len = strlen(args->outputTarget);
+    ctx->benchTarget = (char *)malloc(len + 9);
+    if (!ctx->benchTarget)
+      OOM();
+    strcpy(ctx->benchTarget, args->outputTarget);
+    if (len >= 2 && !strcmp(ctx->benchTarget + len - 2, ".h"))
+      ctx->benchTarget[len - 2] = '\0';
+    strcat(ctx->benchTarget, "_bench.c");
+  }
 
-  // Set fully buffered with 64 pages of memory.
-  size_t bufsz = 4096 * 64;
-  ctx->fbuffer = (char *)malloc(bufsz);
-  if (ctx->fbuffer)
-    setvbuf(ctx->f, ctx->fbuffer, _IOFBF, bufsz);
+  // The output is built in memory, and written out all at once.
+  ctx->f = pgen_writer_mem();
+  ctx->hf = pgen_writer_mem();
+  ctx->h_line_nbr = 1;
+  ctx->in_header = 0;
+  ctx->keep_output = 0;
+
+  // Fingerprint everything the output depends on: the grammar, the options
+  // that change the generated code, the stats, and the build of pgen itself.
+  // If the output already has this fingerprint, it doesn't need rewriting.
+  // New options that change the output have to be added here.
+  unsigned char opts[] = {args->i,       args->d,
+                          args->u,       args->m,
+                          args->l,       args->incremental,
+                          args->stream,  args->compact,
+                          args->profile, args->vm,
+                          args->split,   args->kwhash,
+                          args->pythonTarget != NULL};
+  size_t stats[] = {ctx->arena_bytes_per_token, ctx->list_initial_size};
+  static const char pgen_build[] = PGEN_BUILD_ID;
+  uint64_t h = ctx->fingerprint;
+  h = pgen_hash64(opts, sizeof(opts), h);
+  h = pgen_hash64(stats, sizeof(stats), h);
+  h = pgen_hash64(args->outputTarget, strlen(args->outputTarget), h);
+  h = pgen_hash64(pgen_build, sizeof(pgen_build) - 1, h);
+  ctx->output_fingerprint = h;
 }
 
-static inline void codegen_ctx_destroy(codegen_ctx *ctx) {
+// The first line of every output file.
+#define CODEGEN_FINGERPRINT_FMT "// Generated by pgen. Fingerprint: %016" PRIx64 "\n"
+
+// Whether the file at the path was generated with the same fingerprint.
+static inline int codegen_file_is_fresh(codegen_ctx *ctx, char *path) {
+  char expected[64], line[64];
+  snprintf(expected, sizeof(expected), CODEGEN_FINGERPRINT_FMT,
+           ctx->output_fingerprint);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  int fresh = fgets(line, sizeof(line), f) && !strcmp(line, expected);
+  fclose(f);
+  return fresh;
+}
 
-// Copy the temp file to the other buffer.
-#define DESTR_BUFLEN 4096 * 5
-  char destr_buf[DESTR_BUFLEN];
-  rewind(ctx->f);
-  FILE *outfile = fopen(ctx->args->outputTarget, "w");
-  if (!outfile)
-    ERROR("Could not open output file.");
-  while (!feof(ctx->f)) {
-    if (fgets(destr_buf, DESTR_BUFLEN, ctx->f) == NULL)
-      break;
-    fputs(destr_buf, outfile);
+// Whether all of the output is already up to date.
+static inline int codegen_is_fresh(codegen_ctx *ctx) {
+  if (!codegen_file_is_fresh(ctx, ctx->args->outputTarget))
+    return 0;
+  if (ctx->args->split && !codegen_file_is_fresh(ctx, ctx->implTarget))
+    return 0;
+  return !ctx->args->bench || codegen_file_is_fresh(ctx, ctx->benchTarget);
+}
+
+// Writes the output to a temp file beside the path, then renames it over
+// the path. A build that's watching the file never sees half of it, and a
+// failed run leaves the old one alone.
+static inline void codegen_write_out(pgen_writer *w, char *path) {
+  size_t tmplen = strlen(path) + 32;
+  char *tmp = (char *)malloc(tmplen);
+  if (!tmp)
+    OOM();
+  snprintf(tmp, tmplen, "%s.%ld.tmp", path, (long)getpid());
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1)
+    ERROR("Could not open %s.", tmp);
+  char *data = w->buf;
+  size_t left = w->len;
+  while (left) {
+    ssize_t written = write(fd, data, left);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0) {
+      close(fd);
+      remove(tmp);
+      ERROR("Could not write %s.", tmp);
+    }
+    data += written;
+    left -= (size_t)written;
   }
-  fclose(outfile);
+  if (close(fd) || rename(tmp, path)) {
+    remove(tmp);
+    ERROR("Could not write %s.", path);
+  }
+  free(tmp);
+  pgen_writer_destroy(w);
+}
 
-  fclose(ctx->f);
-  if (ctx->fbuffer)
-    free(ctx->fbuffer);
+static inline void codegen_ctx_destroy(codegen_ctx *ctx) {
+
+  // Write the outputs.
+  if (ctx->keep_output) {
+    pgen_writer_destroy(&ctx->f);
+    pgen_writer_destroy(&ctx->hf);
+  } else if (ctx->args->split) {
+    codegen_write_out(&ctx->hf, ctx->args->outputTarget);
+    codegen_write_out(&ctx->f, ctx->implTarget);
+  } else {
+    codegen_write_out(&ctx->f, ctx->args->outputTarget);
+    pgen_writer_destroy(&ctx->hf);
+  }
 
   free(ctx->args->outputTarget);
+  free(ctx->implTarget);
+  free(ctx->benchTarget);
 
   ASTNode_destroy(ctx->ast);
 
@@ -225,6 +481,15 @@ static inline void codegen_ctx_destroy(codegen_ctx *ctx) {
   list_ASTNodePtr_clear(&ctx->directives);
   list_ASTNodePtr_clear(&ctx->definitions);
   list_ASTNodePtr_clear(&ctx->tokendefs);
+  list_ASTNodePtr_clear(&ctx->keywords);
+  list_size_t_clear(&ctx->vm_code);
+  for (size_t i = 0; i < ctx->vm_msgs.len; i++)
+    free(ctx->vm_msgs.buf[i]);
+  list_cstr_clear(&ctx->vm_msgs);
+  if (ctx->args->vm) {
+    symindex_destroy(&ctx->vm_rule_ix);
+    symindex_destroy(&ctx->vm_tok_ix);
+  }
 }
 
 /****************/
@@ -248,6 +513,16 @@ static inline void write_arena_lib(codegen_ctx *ctx) {
   cwrite("\n\n");
 }
 
+/**************/
+/* IO Library */
+/**************/
+static inline void write_io_lib(codegen_ctx *ctx) {
+#include "strio.xxd"
+  (void)src_io_h_len;
+  cwrite("%s", (char *)src_io_h);
+  cwrite("\n\n");
+}
+
 /************************/
 /* Parser Helper Macros */
 /************************/
@@ -341,13 +616,15 @@ static inline void tok_write_enum(codegen_ctx *ctx) {
          "// This totals %zu kinds of tokens.\n",
          num_defs, num_defs + 2);
   cwrite("#define %s_NUM_TOKENKINDS %zu\n", ctx->upper, num_defs + 2);
-  cwrite("static const char* %s_tokenkind_name[%s_NUM_TOKENKINDS] = {\n"
+  cwrite_api_var(ctx, "const char* %s_tokenkind_name[%s_NUM_TOKENKINDS]",
+                 ctx->lower, ctx->upper);
+  cwrite("{\n"
          "  \"STREAMBEGIN\",\n"
-         "  \"STREAMEND\",\n",
-         ctx->lower, ctx->upper);
+         "  \"STREAMEND\",\n");
   for (size_t i = 0; i < num_defs; i++)
     cwrite("  \"%s\",\n", (char *)(ctx->tok_kind_names.buf[i]));
   cwrite("};\n\n");
+  codegen_to_header(ctx);
 }
 
 static inline void tok_write_tokenstruct(codegen_ctx *ctx) {
@@ -382,19 +659,24 @@ static inline void tok_write_ctxstruct(codegen_ctx *ctx) {
          "  size_t len;\n"
          "  size_t pos;\n"
          "  size_t pos_line;\n"
-         "  size_t pos_col;\n"
-         "} %s_tokenizer;\n\n",
-         ctx->lower);
-
-  cwrite("static inline void %s_tokenizer_init(%s_tokenizer* tokenizer, "
-         "codepoint_t* start, size_t len) {\n"
-         "  tokenizer->start = start;\n"
+         "  size_t pos_col;\n");
+  if (ctx->args->incremental)
+    cwrite("  // One past the last codepoint looked at for the last token.\n"
+           "  size_t reach;\n");
+  cwrite("} %s_tokenizer;\n\n", ctx->lower);
+
+  cwrite_api(ctx,
+             "void %s_tokenizer_init(%s_tokenizer* tokenizer, "
+             "codepoint_t* start, size_t len)",
+             ctx->lower, ctx->lower);
+  cwrite("  tokenizer->start = start;\n"
          "  tokenizer->len = len;\n"
          "  tokenizer->pos = 0;\n"
          "  tokenizer->pos_line = 1;\n"
-         "  tokenizer->pos_col = 0;\n"
-         "}\n\n",
-         ctx->lower, ctx->lower);
+         "  tokenizer->pos_col = 0;\n");
+  if (ctx->args->incremental)
+    cwrite("  tokenizer->reach = 0;\n");
+  cwrite("}\n\n");
 }
 
 static inline void tok_write_staterange(codegen_ctx *ctx, size_t smaut_num,
@@ -488,19 +770,13 @@ static inline void tok_write_charrangecheck(codegen_ctx *ctx,
   }
 }
 
-static inline void tok_write_nexttoken(codegen_ctx *ctx) {
-  // See tokenizer.txt.
-
+// Declares the state of each automaton, for matching one token.
+static inline void tok_write_statevars(codegen_ctx *ctx) {
   TrieAutomaton trie = ctx->trie;
   list_SMAutomaton smauts = ctx->smauts;
   int has_trie = trie.accepting.len ? 1 : 0;
   int has_smauts = smauts.len ? 1 : 0;
 
-  cwrite("static inline %s_token %s_nextToken(%s_tokenizer* tokenizer) {\n"
-         "  codepoint_t* current = tokenizer->start + tokenizer->pos;\n"
-         "  size_t remaining = tokenizer->len - tokenizer->pos;\n\n",
-         ctx->lower, ctx->lower, ctx->lower);
-
   // Variables for each automaton for the current run.
   if (has_trie)
     cwrite("  int trie_state = 0;\n");
@@ -521,10 +797,143 @@ static inline void tok_write_nexttoken(codegen_ctx *ctx) {
            ctx->upper);
   else
     cwrite("\n");
+}
+
+// Finds whether a state loops back to itself on a small class, like the
+// [^\n] of a comment. Once only its automaton is left, the rest of the run
+// can be skipped at once, instead of one codepoint per loop iteration.
+// Codepoints that earlier transitions take somewhere else are left out of an
+// inverted class, like the '*' in the body of a block comment. Leaving out
+// more than that would only end the skip early. The caller clears loop->on.
+#define TOK_SKIP_MAX_RANGES 8
+static inline bool tok_skip_loop(SMAutomaton *aut, int state,
+                                 SMTransition *loop) {
+  list_CharRange exits = list_CharRange_new();
+  for (size_t i = 0; i < aut->trans.len; i++) {
+    SMTransition *trans = aut->trans.buf + i;
+    if (!stateranges_contain(trans->from, state))
+      continue;
+    if (trans->inverted && trans->to != state)
+      break;
+    if (trans->to != state) {
+      for (size_t r = 0; r < trans->on.len; r++)
+        list_CharRange_add(&exits, trans->on.buf[r]);
+      continue;
+    }
+    if (!trans->inverted && exits.len)
+      break;
+    for (size_t r = 0; r < trans->on.len; r++)
+      list_CharRange_add(&exits, trans->on.buf[r]);
+    if ((exits.len > TOK_SKIP_MAX_RANGES) | (!exits.len & !trans->inverted))
+      break;
+    *loop = *trans;
+    loop->on = compressCharRanges(exits);
+    return 1;
+  }
+  list_CharRange_clear(&exits);
+  return 0;
+}
+
+// Whether the state that transition i goes to was already gone to by an
+// earlier one, so that each looping state gets one kernel.
+static inline bool tok_skip_seen(SMAutomaton *aut, size_t i) {
+  for (size_t j = 0; j < i; j++)
+    if (aut->trans.buf[j].to == aut->trans.buf[i].to)
+      return 1;
+  return 0;
+}
+
+// The vector lanes of c that are in the range. w is the prefix of the
+// intrinsics (_mm or _mm256), and t the integer vector type (si128 or si256).
+static inline void tok_write_skiprange(codegen_ctx *ctx, const char *w,
+                                       const char *t, CharRange r) {
+  if (r.f == r.s) {
+    cwrite("%s_cmpeq_epi32(c, %s_set1_epi32(%" PRI_CODEPOINT "))", w, w, r.f);
+    return;
+  }
+  cwrite("%s_andnot_%s(%s_or_%s(%s_cmpgt_epi32(%s_set1_epi32(%" PRI_CODEPOINT
+         "), c), %s_cmpgt_epi32(c, %s_set1_epi32(%" PRI_CODEPOINT
+         "))), %s_set1_epi32(-1))",
+         w, t, w, t, w, w, r.f, w, w, r.s, w);
+}
+
+static inline void tok_write_skipvector(codegen_ctx *ctx, SMTransition *loop,
+                                        const char *w, const char *t,
+                                        size_t lanes) {
+  cwrite("  for (; i + %zu <= n; i += %zu) {\n", lanes, lanes);
+  cwrite("    __m%si c = %s_loadu_%s((const __m%si*)(s + i));\n", t + 2, w, t,
+         t + 2);
+  cwrite("    __m%si in = %s_setzero_%s();\n", t + 2, w, t);
+  for (size_t r = 0; r < loop->on.len; r++) {
+    cwrite("    in = %s_or_%s(in, ", w, t);
+    tok_write_skiprange(ctx, w, t, loop->on.buf[r]);
+    cwrite(");\n");
+  }
+  cwrite("    unsigned stop = %s(unsigned)%s_movemask_ps(%s_cast%s_ps(in))%s;\n",
+         loop->inverted ? "" : "~", w, w, t,
+         loop->inverted ? "" : (lanes == 8 ? " & 0xFFu" : " & 0xFu"));
+  cwrite("    if (stop)\n");
+  cwrite("      return i + (size_t)__builtin_ctz(stop);\n");
+  cwrite("  }\n");
+}
+
+// Writes <prefix>_skip_<aut>_<state>(), which returns how many codepoints
+// from the start of s keep the automaton in the looping state.
+static inline void tok_write_skips(codegen_ctx *ctx) {
+  list_SMAutomaton smauts = ctx->smauts;
+  int any = 0;
+  for (size_t a = 0; a < smauts.len; a++) {
+    SMAutomaton *aut = smauts.buf + a;
+    for (size_t i = 0; i < aut->trans.len; i++) {
+      int state = aut->trans.buf[i].to;
+      SMTransition loop;
+      if (tok_skip_seen(aut, i) || !tok_skip_loop(aut, state, &loop))
+        continue;
+
+      if (!any++) {
+        if (!ctx->args->u)
+          cwrite("// Skip runs of codepoints that leave a state machine in "
+                 "the same state.\n");
+        cwrite("#if (defined(__AVX2__) || defined(__SSE2__)) && \\\n");
+        cwrite("    (defined(__GNUC__) || defined(__clang__))\n");
+        cwrite("#include <immintrin.h>\n");
+        cwrite("#endif\n\n");
+      }
+
+      cwrite("static inline size_t %s_skip_%zu_%i(const codepoint_t* s, "
+             "size_t n) {\n",
+             ctx->lower, a, state);
+      cwrite("  size_t i = 0;\n");
+      cwrite("#if defined(__AVX2__) && (defined(__GNUC__) || "
+             "defined(__clang__))\n");
+      tok_write_skipvector(ctx, &loop, "_mm256", "si256", 8);
+      cwrite("#elif defined(__SSE2__) && (defined(__GNUC__) || "
+             "defined(__clang__))\n");
+      tok_write_skipvector(ctx, &loop, "_mm", "si128", 4);
+      cwrite("#endif\n");
+      cwrite("  for (; i < n; i++) {\n");
+      cwrite("    codepoint_t c = s[i];\n");
+      // Break on the codepoints that leave the loop.
+      cwrite("    if (");
+      tok_write_charrangecheck(ctx, loop.on, !loop.inverted);
+      cwrite(")\n");
+      cwrite("      break;\n");
+      cwrite("  }\n");
+      cwrite("  return i;\n");
+      cwrite("}\n\n");
+      list_CharRange_clear(&loop.on);
+    }
+  }
+}
+
+// Writes the body of the loop over codepoints, which steps every automaton
+// on c. The loop ends when they have all died. c is current[at].
+static inline void tok_write_transitions(codegen_ctx *ctx, const char *at) {
+  TrieAutomaton trie = ctx->trie;
+  list_SMAutomaton smauts = ctx->smauts;
+  int has_trie = trie.accepting.len ? 1 : 0;
+  int has_smauts = smauts.len ? 1 : 0;
 
-  // Outer loop
-  cwrite("  for (size_t iidx = 0; iidx < remaining; iidx++) {\n");
-  cwrite("    codepoint_t c = current[iidx];\n");
   cwrite("    int all_dead = 1;\n\n");
 
   // Inner loop (automaton, unrolled)
@@ -618,7 +1027,42 @@ static inline void tok_write_nexttoken(codegen_ctx *ctx) {
   }
   cwrite("    if (all_dead)\n");
   cwrite("      break;\n");
-  cwrite("  }\n\n"); // For each remaining character
+
+  // Once one automaton is left, in a looping state, skip the rest of the run.
+  int eels = 0;
+  for (size_t a = 0; a < smauts.len; a++) {
+    SMAutomaton *aut = smauts.buf + a;
+    for (size_t i = 0; i < aut->trans.len; i++) {
+      int state = aut->trans.buf[i].to;
+      SMTransition loop;
+      if (tok_skip_seen(aut, i) || !tok_skip_loop(aut, state, &loop))
+        continue;
+      list_CharRange_clear(&loop.on);
+      cwrite("    %sif ((smaut_state_%zu == %i)", eels++ ? "else " : "", a,
+             state);
+      if (has_trie)
+        cwrite(" && (trie_state == -1)");
+      for (size_t b = 0; b < smauts.len; b++)
+        if (b != a)
+          cwrite(" && (smaut_state_%zu == -1)", b);
+      cwrite(") {\n");
+      cwrite("      iidx += %s_skip_%zu_%i(current + %s + 1, remaining - iidx "
+             "- 1);\n",
+             ctx->lower, a, state, at);
+      if (stateranges_contain(aut->accepting, state))
+        cwrite("      smaut_munch_size_%zu = iidx + 1;\n", a);
+      cwrite("    }\n");
+    }
+  }
+}
+
+// Picks the longest match, preferring earlier token definitions. The state
+// of the automata is read from variables prefixed with s.
+static inline void tok_write_accept(codegen_ctx *ctx, const char *s) {
+  TrieAutomaton trie = ctx->trie;
+  list_SMAutomaton smauts = ctx->smauts;
+  int has_trie = trie.accepting.len ? 1 : 0;
+  int has_smauts = smauts.len ? 1 : 0;
 
   if (!ctx->args->u)
     cwrite("  // Determine what token was accepted, if any.\n");
@@ -627,27 +1071,27 @@ static inline void tok_write_nexttoken(codegen_ctx *ctx) {
   if (has_smauts) {
     for (size_t i = smauts.len; i-- > 0;) {
       SMAutomaton aut = smauts.buf[i];
-      cwrite("  if (smaut_munch_size_%zu >= max_munch) {\n", i);
+      cwrite("  if (%ssmaut_munch_size_%zu >= max_munch) {\n", s, i);
       cwrite("    kind = %s_TOK_%s;\n", ctx->upper, aut.ident);
-      cwrite("    max_munch = smaut_munch_size_%zu;\n", i);
+      cwrite("    max_munch = %ssmaut_munch_size_%zu;\n", s, i);
       cwrite("  }\n");
     }
   }
   if (has_trie) {
-    cwrite("  if (trie_munch_size >= max_munch) {\n");
-    cwrite("    kind = trie_tokenkind;\n");
-    cwrite("    max_munch = trie_munch_size;\n");
+    cwrite("  if (%strie_munch_size >= max_munch) {\n", s);
+    cwrite("    kind = %strie_tokenkind;\n", s);
+    cwrite("    max_munch = %strie_munch_size;\n", s);
     cwrite("  }\n");
+  } else {
+    // The trie's kind is STREAMEND when nothing matched. Without it, the
+    // state machines would claim an empty match.
+    cwrite("  if (!max_munch)\n");
+    cwrite("    kind = %s_TOK_STREAMEND;\n", ctx->upper);
   }
   cwrite("\n");
+}
 
-  cwrite("  %s_token tok;\n", ctx->lower);
-  cwrite("  tok.kind = kind;\n");
-  cwrite("  tok.content = tokenizer->start + tokenizer->pos;\n");
-  cwrite("  tok.len = max_munch;\n\n");
-
-  cwrite("  tok.line = tokenizer->pos_line;\n");
-  cwrite("  tok.col = tokenizer->pos_col;\n");
+static inline void tok_write_tokenextrainit(codegen_ctx *ctx) {
   int inserted_tokenextra = 0;
   for (size_t i = 0; i < ctx->directives.len; i++) {
     ASTNode *dir = ctx->directives.buf[i];
@@ -660,6 +1104,41 @@ static inline void tok_write_nexttoken(codegen_ctx *ctx) {
       cwrite("  %s\n", (char *)dir->extra);
     }
   }
+}
+
+#ifndef PGEN_KWHASH_INCLUDE
+#include "kwhash.h"
+#endif
+
+static inline void tok_write_nexttoken(codegen_ctx *ctx) {
+  // See tokenizer.txt.
+
+  cwrite_api(ctx, "%s_token %s_nextToken(%s_tokenizer* tokenizer)",
+             ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  codepoint_t* current = tokenizer->start + tokenizer->pos;\n"
+         "  size_t remaining = tokenizer->len - tokenizer->pos;\n\n");
+
+  tok_write_statevars(ctx);
+
+  // Outer loop
+  cwrite("  size_t iidx = 0;\n");
+  cwrite("  for (; iidx < remaining; iidx++) {\n");
+  cwrite("    codepoint_t c = current[iidx];\n");
+  tok_write_transitions(ctx, "iidx");
+  cwrite("  }\n\n"); // For each remaining character
+
+  tok_write_accept(ctx, "");
+
+  cwrite("  %s_token tok;\n", ctx->lower);
+  cwrite("  tok.kind = kind;\n");
+  cwrite("  tok.content = tokenizer->start + tokenizer->pos;\n");
+  cwrite("  tok.len = max_munch;\n");
+  kwhash_write_lookup(ctx);
+  cwrite("\n");
+
+  cwrite("  tok.line = tokenizer->pos_line;\n");
+  cwrite("  tok.col = tokenizer->pos_col;\n");
+  tok_write_tokenextrainit(ctx);
   cwrite("\n");
   cwrite("  for (size_t i = 0; i < tok.len; i++) {\n");
   cwrite("    if (current[i] == '\\n') {\n");
@@ -670,17 +1149,334 @@ static inline void tok_write_nexttoken(codegen_ctx *ctx) {
   cwrite("    }\n");
   cwrite("  }\n\n");
 
+  // The loop stops on the first codepoint that every automaton rejects, or
+  // at the end of the input, which also counts as looking.
+  if (ctx->args->incremental)
+    cwrite("  tokenizer->reach = tokenizer->pos + iidx + (iidx == remaining);\n");
   cwrite("  tokenizer->pos += max_munch;\n");
   cwrite("  return tok;\n");
   cwrite("}\n\n");
 }
 
+// The automata of a streaming match are kept in the stream between chunks.
+// Declares (0), loads (1), stores (2), or resets (3) one of them.
+static inline void tok_write_streamvar(codegen_ctx *ctx, int what,
+                                       const char *type, const char *name,
+                                       const char *init) {
+  if (what == 0)
+    cwrite("  %s %s;\n", type, name);
+  else if (what == 1)
+    cwrite("  %s %s = stream->%s;\n", type, name, name);
+  else if (what == 2)
+    cwrite("  stream->%s = %s;\n", name, name);
+  else
+    cwrite("    stream->%s = %s;\n", name, init);
+}
+
+static inline void tok_write_streamvars(codegen_ctx *ctx, int what) {
+  char name[64];
+  for (size_t i = 0; i < ctx->smauts.len; i++) {
+    sprintf(name, "smaut_state_%zu", i);
+    tok_write_streamvar(ctx, what, "int", name, "0");
+  }
+  for (size_t i = 0; i < ctx->smauts.len; i++) {
+    sprintf(name, "smaut_munch_size_%zu", i);
+    tok_write_streamvar(ctx, what, "size_t", name, "0");
+  }
+  if (ctx->trie.accepting.len) {
+    char kindtype[PGEN_PREFIX_LEN + 16], kindinit[PGEN_PREFIX_LEN + 16];
+    sprintf(kindtype, "%s_token_kind", ctx->lower);
+    sprintf(kindinit, "%s_TOK_STREAMEND", ctx->upper);
+    tok_write_streamvar(ctx, what, "int", "trie_state", "0");
+    tok_write_streamvar(ctx, what, "size_t", "trie_munch_size", "0");
+    tok_write_streamvar(ctx, what, kindtype, "trie_tokenkind", kindinit);
+  }
+}
+
+// A tokenizer over input that comes in chunks, like from a pipe. It keeps
+// the state of the automata between chunks, and only copies the tokens that
+// span them.
+static inline void tok_write_stream(codegen_ctx *ctx) {
+  if (!ctx->args->stream)
+    return;
+
+  codegen_to_header(ctx);
+  cwrite("typedef enum {\n");
+  cwrite("  %s_STREAM_TOKEN,\n", ctx->upper);
+  cwrite("  %s_STREAM_NEED_INPUT,\n", ctx->upper);
+  cwrite("  %s_STREAM_END,\n", ctx->upper);
+  cwrite("  %s_STREAM_ERROR,\n", ctx->upper);
+  cwrite("} %s_stream_status;\n", ctx->lower);
+  cwrite("\n");
+  cwrite("// Tokenizes input that arrives in chunks. A token that is inside "
+         "a chunk\n");
+  cwrite("// points into it, and a token that spans chunks is copied into "
+         "buf.\n");
+  cwrite("typedef struct {\n");
+  cwrite("  codepoint_t* chunk;\n");
+  cwrite("  size_t chunk_len;\n");
+  cwrite("  size_t chunk_pos;\n");
+  cwrite("  // The part of the current match that came before chunk_pos.\n");
+  cwrite("  codepoint_t* buf;\n");
+  cwrite("  size_t buf_len;\n");
+  cwrite("  size_t buf_cap;\n");
+  cwrite("  // The length of the last token, if it was returned from buf.\n");
+  cwrite("  size_t taken;\n");
+  cwrite("  size_t pos;\n");
+  cwrite("  size_t pos_line;\n");
+  cwrite("  size_t pos_col;\n");
+  cwrite("  int finished;\n");
+  cwrite("  int failed;\n");
+  cwrite("  int matching;\n");
+  cwrite("  // The automata of the current match, which have seen iidx "
+         "codepoints.\n");
+  cwrite("  size_t iidx;\n");
+  tok_write_streamvars(ctx, 0);
+  cwrite("  // Decoded utf8, and the start of a sequence that a chunk cut "
+         "off.\n");
+  cwrite("  codepoint_t* decoded;\n");
+  cwrite("  size_t decoded_cap;\n");
+  cwrite("  char partial[4];\n");
+  cwrite("  size_t partial_len;\n");
+  cwrite("} %s_stream;\n", ctx->lower);
+  cwrite("\n");
+  cwrite_api(ctx, "void %s_stream_init(%s_stream* stream)", ctx->lower,
+             ctx->lower);
+  cwrite("  stream->chunk = NULL;\n");
+  cwrite("  stream->chunk_len = 0;\n");
+  cwrite("  stream->chunk_pos = 0;\n");
+  cwrite("  stream->buf = NULL;\n");
+  cwrite("  stream->buf_len = 0;\n");
+  cwrite("  stream->buf_cap = 0;\n");
+  cwrite("  stream->taken = 0;\n");
+  cwrite("  stream->pos = 0;\n");
+  cwrite("  stream->pos_line = 1;\n");
+  cwrite("  stream->pos_col = 0;\n");
+  cwrite("  stream->finished = 0;\n");
+  cwrite("  stream->failed = 0;\n");
+  cwrite("  stream->matching = 0;\n");
+  cwrite("  stream->iidx = 0;\n");
+  cwrite("  stream->decoded = NULL;\n");
+  cwrite("  stream->decoded_cap = 0;\n");
+  cwrite("  stream->partial_len = 0;\n");
+  cwrite("}\n\n");
+  cwrite_api(ctx, "void %s_stream_destroy(%s_stream* stream)", ctx->lower,
+             ctx->lower);
+  cwrite("  free(stream->buf);\n");
+  cwrite("  free(stream->decoded);\n");
+  cwrite("}\n\n");
+  cwrite("// Moves what's left of the chunk into buf, so the chunk can go "
+         "away.\n");
+  cwrite("static inline void %s_stream_keep(%s_stream* stream, size_t n) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  size_t need = stream->buf_len + n;\n");
+  cwrite("  if (need > stream->buf_cap) {\n");
+  cwrite("    stream->buf_cap = need > stream->buf_cap * 2 ? need : "
+         "stream->buf_cap * 2;\n");
+  cwrite("    stream->buf = (codepoint_t*)realloc(stream->buf, "
+         "sizeof(codepoint_t) * stream->buf_cap);\n");
+  if (!ctx->args->u)
+    cwrite("    if (!stream->buf) PGEN_OOM();\n");
+  cwrite("  }\n");
+  cwrite("  if (n)\n");
+  cwrite("    memcpy(stream->buf + stream->buf_len, stream->chunk + "
+         "stream->chunk_pos, sizeof(codepoint_t) * n);\n");
+  cwrite("  stream->buf_len += n;\n");
+  cwrite("  stream->chunk_pos += n;\n");
+  cwrite("}\n\n");
+  cwrite("// Tokenizes len more codepoints. The chunk must stay alive until\n");
+  cwrite("// %s_stream_next() returns %s_STREAM_NEED_INPUT, or the next "
+         "push.\n",
+         ctx->lower, ctx->upper);
+  cwrite_api(ctx,
+             "void %s_stream_push(%s_stream* stream, codepoint_t* chunk, "
+             "size_t len)",
+             ctx->lower, ctx->lower);
+  cwrite("  %s_stream_keep(stream, stream->chunk_len - stream->chunk_pos);\n",
+         ctx->lower);
+  cwrite("  stream->chunk = chunk;\n");
+  cwrite("  stream->chunk_len = len;\n");
+  cwrite("  stream->chunk_pos = 0;\n");
+  cwrite("}\n\n");
+  cwrite("// Decodes and pushes a chunk of utf8. A sequence that the chunk "
+         "cuts off is\n");
+  cwrite("// finished by the next one. Returns 0 on invalid utf8.\n");
+  cwrite_api(ctx,
+             "int %s_stream_push_utf8(%s_stream* stream, char* bytes, "
+             "size_t len)",
+             ctx->lower, ctx->lower);
+  cwrite("  %s_stream_keep(stream, stream->chunk_len - stream->chunk_pos);\n",
+         ctx->lower);
+  cwrite("  if (len + 1 > stream->decoded_cap) {\n");
+  cwrite("    stream->decoded_cap = len + 1;\n");
+  cwrite("    free(stream->decoded);\n");
+  cwrite("    stream->decoded = (codepoint_t*)malloc(sizeof(codepoint_t) * "
+         "stream->decoded_cap);\n");
+  if (!ctx->args->u)
+    cwrite("    if (!stream->decoded) PGEN_OOM();\n");
+  cwrite("  }\n\n");
+  cwrite("  UTF8Decoder state;\n");
+  cwrite("  codepoint_t cp;\n");
+  cwrite("  size_t n = 0, i = 0;\n");
+  cwrite("  if (stream->partial_len) {\n");
+  cwrite("    size_t need = UTF8_seqLen(stream->partial[0]);\n");
+  cwrite("    while (stream->partial_len < need && i < len)\n");
+  cwrite("      stream->partial[stream->partial_len++] = bytes[i++];\n");
+  cwrite("    if (stream->partial_len == need) {\n");
+  cwrite("      UTF8_decoder_init(&state, stream->partial, need);\n");
+  cwrite("      cp = UTF8_decodeNext(&state);\n");
+  cwrite("      if (cp == UTF8_ERR)\n");
+  cwrite("        return 0;\n");
+  cwrite("      stream->decoded[n++] = cp;\n");
+  cwrite("      stream->partial_len = 0;\n");
+  cwrite("    }\n");
+  cwrite("  }\n");
+  cwrite("  while (i < len) {\n");
+  cwrite("    if (!(bytes[i] & 0x80)) {\n");
+  cwrite("      stream->decoded[n++] = (codepoint_t)bytes[i++];\n");
+  cwrite("      continue;\n");
+  cwrite("    }\n");
+  cwrite("    size_t need = UTF8_seqLen(bytes[i]);\n");
+  cwrite("    if (!need)\n");
+  cwrite("      return 0;\n");
+  cwrite("    if (need > len - i) {\n");
+  cwrite("      memcpy(stream->partial, bytes + i, len - i);\n");
+  cwrite("      stream->partial_len = len - i;\n");
+  cwrite("      break;\n");
+  cwrite("    }\n");
+  cwrite("    UTF8_decoder_init(&state, bytes + i, need);\n");
+  cwrite("    cp = UTF8_decodeNext(&state);\n");
+  cwrite("    if (cp == UTF8_ERR)\n");
+  cwrite("      return 0;\n");
+  cwrite("    stream->decoded[n++] = cp;\n");
+  cwrite("    i += need;\n");
+  cwrite("  }\n\n");
+  cwrite("  stream->chunk = stream->decoded;\n");
+  cwrite("  stream->chunk_len = n;\n");
+  cwrite("  stream->chunk_pos = 0;\n");
+  cwrite("  return 1;\n");
+  cwrite("}\n\n");
+  cwrite("// Marks the end of the input. Returns 0 if it ends partway "
+         "through a utf8\n");
+  cwrite("// sequence.\n");
+  cwrite_api(ctx, "int %s_stream_finish(%s_stream* stream)", ctx->lower,
+             ctx->lower);
+  cwrite("  stream->finished = 1;\n");
+  cwrite("  return !stream->partial_len;\n");
+  cwrite("}\n\n");
+  cwrite("// Steps the automata over the next n codepoints of the current "
+         "match.\n");
+  cwrite("// Returns 1 once they have all died, and 0 if they could take "
+         "more.\n");
+  cwrite("static inline int %s_stream_step(%s_stream* stream, codepoint_t* "
+         "current, size_t n) {\n",
+         ctx->lower, ctx->lower);
+  tok_write_streamvars(ctx, 1);
+  cwrite("  size_t base = stream->iidx;\n");
+  cwrite("  size_t remaining = base + n;\n");
+  cwrite("  size_t iidx = base;\n");
+  cwrite("  for (; iidx < remaining; iidx++) {\n");
+  cwrite("    codepoint_t c = current[iidx - base];\n");
+  tok_write_transitions(ctx, "iidx - base");
+  cwrite("  }\n\n");
+  tok_write_streamvars(ctx, 2);
+  cwrite("  stream->iidx = iidx;\n");
+  cwrite("  return iidx < remaining;\n");
+  cwrite("}\n\n");
+  cwrite("// Gets the next token. Returns %s_STREAM_NEED_INPUT when the "
+         "chunk has run out\n",
+         ctx->upper);
+  cwrite("// before the token is settled, and %s_STREAM_END or "
+         "%s_STREAM_ERROR once the\n",
+         ctx->upper, ctx->upper);
+  cwrite("// input is used up or doesn't match. A token in buf is only valid "
+         "until the\n");
+  cwrite("// next call.\n");
+  cwrite_api(ctx,
+             "%s_stream_status %s_stream_next(%s_stream* stream, "
+             "%s_token* out)",
+             ctx->lower, ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  if (stream->taken) {\n");
+  cwrite("    stream->buf_len -= stream->taken;\n");
+  cwrite("    memmove(stream->buf, stream->buf + stream->taken, "
+         "sizeof(codepoint_t) * stream->buf_len);\n");
+  cwrite("    stream->taken = 0;\n");
+  cwrite("  }\n");
+  cwrite("  if (stream->failed)\n");
+  cwrite("    return %s_STREAM_ERROR;\n", ctx->upper);
+  cwrite("\n");
+  cwrite("  if (!stream->matching) {\n");
+  tok_write_streamvars(ctx, 3);
+  cwrite("    stream->iidx = 0;\n");
+  cwrite("    stream->matching = 1;\n");
+  cwrite("  }\n\n");
+  cwrite("  // Maximal munch is only settled once every automaton has died.\n");
+  cwrite("  int settled = 0;\n");
+  cwrite("  if (stream->iidx < stream->buf_len)\n");
+  cwrite("    settled = %s_stream_step(stream, stream->buf + stream->iidx, "
+         "stream->buf_len - stream->iidx);\n",
+         ctx->lower);
+  cwrite("  if (!settled && stream->chunk_pos < stream->chunk_len)\n");
+  cwrite("    settled = %s_stream_step(stream, stream->chunk + "
+         "stream->chunk_pos, stream->chunk_len - stream->chunk_pos);\n",
+         ctx->lower);
+  cwrite("  if (!settled && !stream->finished) {\n");
+  cwrite("    %s_stream_keep(stream, stream->chunk_len - stream->chunk_pos);\n",
+         ctx->lower);
+  cwrite("    return %s_STREAM_NEED_INPUT;\n", ctx->upper);
+  cwrite("  }\n");
+  cwrite("  if (!settled && !stream->iidx) {\n");
+  cwrite("    stream->matching = 0;\n");
+  cwrite("    return %s_STREAM_END;\n", ctx->upper);
+  cwrite("  }\n\n");
+  tok_write_accept(ctx, "stream->");
+  cwrite("  stream->matching = 0;\n");
+  cwrite("  if (!max_munch) {\n");
+  cwrite("    stream->failed = 1;\n");
+  cwrite("    return %s_STREAM_ERROR;\n", ctx->upper);
+  cwrite("  }\n\n");
+  cwrite("  if (stream->buf_len) {\n");
+  cwrite("    if (max_munch > stream->buf_len)\n");
+  cwrite("      %s_stream_keep(stream, max_munch - stream->buf_len);\n",
+         ctx->lower);
+  cwrite("    stream->taken = max_munch;\n");
+  cwrite("  }\n\n");
+  cwrite("  %s_token tok;\n", ctx->lower);
+  cwrite("  tok.kind = kind;\n");
+  cwrite("  tok.content = stream->buf_len ? stream->buf : stream->chunk + "
+         "stream->chunk_pos;\n");
+  cwrite("  tok.len = max_munch;\n");
+  kwhash_write_lookup(ctx);
+  cwrite("  tok.line = stream->pos_line;\n");
+  cwrite("  tok.col = stream->pos_col;\n");
+  tok_write_tokenextrainit(ctx);
+  cwrite("\n");
+  cwrite("  for (size_t i = 0; i < tok.len; i++) {\n");
+  cwrite("    if (tok.content[i] == '\\n') {\n");
+  cwrite("      stream->pos_line++;\n");
+  cwrite("      stream->pos_col = 0;\n");
+  cwrite("    } else {\n");
+  cwrite("      stream->pos_col++;\n");
+  cwrite("    }\n");
+  cwrite("  }\n");
+  cwrite("  if (!stream->buf_len)\n");
+  cwrite("    stream->chunk_pos += max_munch;\n");
+  cwrite("  stream->pos += max_munch;\n");
+  cwrite("  *out = tok;\n");
+  cwrite("  return %s_STREAM_TOKEN;\n", ctx->upper);
+  cwrite("}\n");
+}
+
 static inline void tok_write_footer(codegen_ctx *ctx) {
   cwrite("#endif /* %s_TOKENIZER_INCLUDE */\n\n", ctx->upper);
 }
 
 static inline void codegen_write_tokenizer(codegen_ctx *ctx) {
 
+  // With --emit=split, the types go to the header, and the functions to the
+  // implementation.
+  codegen_to_header(ctx);
+
   tok_write_header(ctx);
 
   tok_write_enum(ctx);
@@ -689,9 +1485,17 @@ static inline void codegen_write_tokenizer(codegen_ctx *ctx) {
 
   tok_write_ctxstruct(ctx);
 
+  codegen_to_impl(ctx);
+  kwhash_write(ctx);
+  tok_write_skips(ctx);
+
   tok_write_nexttoken(ctx);
 
+  tok_write_stream(ctx);
+
+  codegen_to_header(ctx);
   tok_write_footer(ctx);
+  codegen_to_impl(ctx);
 }
 
 /**********/
@@ -866,10 +1670,37 @@ static inline void peg_write_parser_errdef(codegen_ctx *ctx) {
   cwrite("};\n\n");
 }
 
+// Whether the parser keeps track of the furthest token it looked at.
+static inline int peg_tracks_examined(codegen_ctx *ctx) {
+  return ctx->args->incremental | ctx->args->profile;
+}
+
 static inline void peg_write_parser_ctx(codegen_ctx *ctx) {
   cwrite("#ifndef %s_MAX_PARSER_ERRORS\n", ctx->upper);
   cwrite("#define %s_MAX_PARSER_ERRORS 20\n", ctx->upper);
   cwrite("#endif\n");
+  cwrite("// How deep rules can nest before the parse stops, rather than "
+         "overflowing\n");
+  cwrite("// the stack. Each level is a C stack frame.\n");
+  cwrite("#ifndef %s_MAX_DEPTH\n", ctx->upper);
+  cwrite("#define %s_MAX_DEPTH 4096\n", ctx->upper);
+  cwrite("#endif\n");
+  if (ctx->args->incremental) {
+    cwrite("struct %s_memo;\n", ctx->lower);
+    cwrite("typedef struct %s_memo %s_memo;\n", ctx->lower, ctx->lower);
+    codegen_to_impl(ctx);
+    cwrite("static inline void %s_memo_rewind(%s_memo* memo, "
+           "pgen_allocator_rewind_t rew);\n",
+           ctx->lower, ctx->lower);
+    codegen_to_header(ctx);
+  }
+  cwrite("// Why a parse was stopped early by its budget or depth limit.\n");
+  cwrite("typedef enum {\n");
+  cwrite("  %s_ABORT_NONE,\n", ctx->upper);
+  cwrite("  %s_ABORT_STEPS,\n", ctx->upper);
+  cwrite("  %s_ABORT_DEADLINE,\n", ctx->upper);
+  cwrite("  %s_ABORT_DEPTH,\n", ctx->upper);
+  cwrite("} %s_abort_reason;\n\n", ctx->lower);
   cwrite("typedef struct {\n");
   cwrite("  %s_token* tokens;\n", ctx->lower);
   cwrite("  size_t len;\n");
@@ -879,22 +1710,36 @@ static inline void peg_write_parser_ctx(codegen_ctx *ctx) {
   for (size_t n = 0; n < ctx->directives.len; n++) {
     ASTNode *context_dir = ctx->directives.buf[n];
     char *dir_name = (char *)context_dir->children[0]->extra;
-    if (strcmp(context_dir->name, "Directive") || strcmp(dir_name, "context"))
+    if (context_dir->kind != AST_Directive || strcmp(dir_name, "context"))
       continue;
     cwrite("  %s\n", (char *)context_dir->extra);
   }
   cwrite("  size_t num_errors;\n");
   cwrite("  %s_parse_err errlist[%s_MAX_PARSER_ERRORS];\n", ctx->lower,
          ctx->upper);
+  if (peg_tracks_examined(ctx))
+    cwrite("  size_t hwm; // One past the last token looked at.\n");
+  if (ctx->args->incremental)
+    cwrite("  %s_memo* memo;\n", ctx->lower);
+  cwrite("  size_t fuel; // Steps left until the budget is checked.\n");
+  cwrite("  size_t fuel_given;\n");
+  cwrite("  size_t steps; // Steps taken before the fuel was given.\n");
+  cwrite("  size_t max_steps;\n");
+  cwrite("  uint64_t deadline;\n");
+  cwrite("  size_t depth;\n");
+  cwrite("  size_t max_depth;\n");
+  cwrite("  %s_abort_reason aborted;\n", ctx->lower);
   cwrite("} %s_parser_ctx;\n\n", ctx->lower);
 }
 
 static inline void peg_write_parser_ctx_init(codegen_ctx *ctx) {
-  cwrite("static inline void %s_parser_ctx_init(%s_parser_ctx* parser,\n"
-         "                                       pgen_allocator* allocator,\n"
-         "                                       %s_token* tokens, size_t "
-         "num_tokens) {\n",
-         ctx->lower, ctx->lower, ctx->lower);
+  cwrite_api(ctx,
+             "void %s_parser_ctx_init(%s_parser_ctx* parser,\n"
+             "                                       pgen_allocator* "
+             "allocator,\n"
+             "                                       %s_token* tokens, size_t "
+             "num_tokens)",
+             ctx->lower, ctx->lower, ctx->lower);
   cwrite("  parser->tokens = tokens;\n");
   cwrite("  parser->len = num_tokens;\n");
   cwrite("  parser->pos = 0;\n");
@@ -903,7 +1748,7 @@ static inline void peg_write_parser_ctx_init(codegen_ctx *ctx) {
   for (size_t n = 0; n < ctx->directives.len; n++) {
     ASTNode *context_dir = ctx->directives.buf[n];
     char *dir_name = (char *)context_dir->children[0]->extra;
-    if (strcmp(context_dir->name, "Directive") ||
+    if (context_dir->kind != AST_Directive ||
         strcmp(dir_name, "contextinit"))
       continue;
     cwrite("  %s\n", (char *)context_dir->extra);
@@ -912,13 +1757,104 @@ static inline void peg_write_parser_ctx_init(codegen_ctx *ctx) {
   cwrite("  size_t to_zero = sizeof(%s_parse_err) * %s_MAX_PARSER_ERRORS;\n",
          ctx->lower, ctx->upper);
   cwrite("  memset(&parser->errlist, 0, to_zero);\n");
+  if (peg_tracks_examined(ctx))
+    cwrite("  parser->hwm = 0;\n");
+  if (ctx->args->incremental)
+    cwrite("  parser->memo = NULL;\n");
+  cwrite("  parser->fuel = parser->fuel_given = SIZE_MAX;\n");
+  cwrite("  parser->steps = 0;\n");
+  cwrite("  parser->max_steps = 0;\n");
+  cwrite("  parser->deadline = 0;\n");
+  cwrite("  parser->depth = 0;\n");
+  cwrite("  parser->max_depth = %s_MAX_DEPTH;\n", ctx->upper);
+  cwrite("  parser->aborted = %s_ABORT_NONE;\n", ctx->upper);
   cwrite("}\n");
 }
 
-static inline void peg_write_report_parse_error(codegen_ctx *ctx) {
-  cwrite("static inline %s_parse_err* %s_report_parse_error(%s_parser_ctx* "
-         "ctx, const char* msg, int severity) {\n",
+static inline void peg_write_sizehints(codegen_ctx *ctx) {
+  // Without stats, guess a node and a bit per token.
+  size_t bytes_per_token =
+      ctx->arena_bytes_per_token ? ctx->arena_bytes_per_token : 64;
+  size_t list_size = ctx->list_initial_size ? ctx->list_initial_size : 16;
+
+  cwrite("/*\n");
+  cwrite(" * Sizing hints. %s_ARENA_BYTES_PER_TOKEN is how much of its "
+         "allocator a parse\n",
+         ctx->upper);
+  cwrite(" * uses for each token, and %s_LIST_INITIAL_SIZE is how many "
+         "children a new list\n",
+         ctx->upper);
+  cwrite(" * has room for. They're guesses unless pgen was given --stats.\n");
+  cwrite(" */\n");
+  cwrite("#ifndef %s_ARENA_BYTES_PER_TOKEN\n", ctx->upper);
+  cwrite("#define %s_ARENA_BYTES_PER_TOKEN %zu\n", ctx->upper, bytes_per_token);
+  cwrite("#endif\n");
+  cwrite("#ifndef %s_LIST_INITIAL_SIZE\n", ctx->upper);
+  cwrite("#define %s_LIST_INITIAL_SIZE %zu\n", ctx->upper, list_size);
+  cwrite("#endif\n\n");
+  cwrite("// Allocates the arenas that parsing the parser's tokens will "
+         "need, before\n");
+  cwrite("// parsing, going by %s_ARENA_BYTES_PER_TOKEN.\n", ctx->upper);
+  cwrite_api(ctx, "void %s_parser_reserve(%s_parser_ctx* parser)", ctx->lower,
+             ctx->lower);
+  cwrite("  pgen_allocator_reserve(parser->alloc, parser->len * "
+         "%s_ARENA_BYTES_PER_TOKEN);\n",
+         ctx->upper);
+  cwrite("}\n\n");
+  cwrite("/*\n");
+  cwrite(" * Define %s_COLLECT_STATS to 1 for a profiling run. Give each "
+         "parse a new\n",
+         ctx->upper);
+  cwrite(" * allocator and record it with %s_stats_record(), then save what\n",
+         ctx->lower);
+  cwrite(" * %s_stats_write() writes and pass the file to pgen --stats.\n",
+         ctx->lower);
+  cwrite(" */\n");
+  cwrite("#ifndef %s_COLLECT_STATS\n", ctx->upper);
+  cwrite("#define %s_COLLECT_STATS 0\n", ctx->upper);
+  cwrite("#endif\n");
+  cwrite("#if %s_COLLECT_STATS\n", ctx->upper);
+  cwrite("static size_t %s_stats_tokens, %s_stats_bytes, %s_stats_lists;\n",
          ctx->lower, ctx->lower, ctx->lower);
+  cwrite("// How many lists grew past 2^i children.\n");
+  cwrite("static size_t %s_stats_outgrew[16];\n", ctx->lower);
+  cwrite("\n");
+  cwrite("// Called when a list gets its nth child.\n");
+  cwrite("static inline void %s_stats_child(size_t n) {\n", ctx->lower);
+  cwrite("  for (size_t i = 0; i < 16; i++)\n");
+  cwrite("    if (n == ((size_t)1 << i) + 1)\n");
+  cwrite("      %s_stats_outgrew[i]++;\n", ctx->lower);
+  cwrite("}\n\n");
+  cwrite_api(ctx, "void %s_stats_record(%s_parser_ctx* parser)", ctx->lower,
+             ctx->lower);
+  cwrite("  %s_stats_tokens += parser->len;\n", ctx->lower);
+  cwrite("  %s_stats_bytes += (size_t)parser->alloc->rew.arena_idx * "
+         "PGEN_BUFFER_SIZE + parser->alloc->rew.filled;\n",
+         ctx->lower);
+  cwrite("}\n\n");
+  cwrite_api(ctx, "void %s_stats_write(FILE* f)", ctx->lower);
+  cwrite("  size_t per_token = 1;\n");
+  cwrite("  if (%s_stats_tokens)\n", ctx->lower);
+  cwrite("    per_token = (%s_stats_bytes + %s_stats_tokens - 1) / "
+         "%s_stats_tokens;\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  // Nine out of ten lists should fit in their initial size.\n");
+  cwrite("  size_t i = 0;\n");
+  cwrite("  while (i < 15 && %s_stats_outgrew[i] * 10 > %s_stats_lists)\n",
+         ctx->lower, ctx->lower);
+  cwrite("    i++;\n");
+  cwrite("  fprintf(f, \"arena_bytes_per_token %%zu\\n\", per_token ? "
+         "per_token : 1);\n");
+  cwrite("  fprintf(f, \"list_initial_size %%zu\\n\", (size_t)1 << i);\n");
+  cwrite("}\n");
+  cwrite("#endif\n");
+}
+
+static inline void peg_write_report_parse_error(codegen_ctx *ctx) {
+  cwrite_api(ctx,
+             "%s_parse_err* %s_report_parse_error(%s_parser_ctx* ctx, "
+             "const char* msg, int severity)",
+             ctx->lower, ctx->lower, ctx->lower);
   cwrite("  if (ctx->num_errors >= %s_MAX_PARSER_ERRORS) {\n", ctx->upper);
   cwrite("    ctx->exit = 1;\n");
   cwrite("    return NULL;\n");
@@ -947,10 +1883,95 @@ static inline void peg_write_report_parse_error(codegen_ctx *ctx) {
   cwrite("}\n\n");
 }
 
-static inline void peg_write_astnode_kind(codegen_ctx *ctx) {
-  cwrite("typedef enum {\n");
-  for (size_t i = 0; i < ctx->tok_kind_names.len; i++)
-    cwrite("  %s_NODE_%s,\n", ctx->upper, ctx->tok_kind_names.buf[i]);
+static inline void peg_write_budget(codegen_ctx *ctx) {
+  cwrite("#include <time.h>\n\n");
+  cwrite("/*\n");
+  cwrite(" * Parse budgets. Every rule call and every iteration of a loop "
+         "is a step, and\n");
+  cwrite(" * takes one unit of fuel. The budget is only checked when the "
+         "fuel runs out,\n");
+  cwrite(" * so with no budget set a step costs a decrement. With a "
+         "deadline, the clock\n");
+  cwrite(" * is read every %s_DEADLINE_INTERVAL steps. A parse that runs "
+         "over stops as if\n",
+         ctx->upper);
+  cwrite(" * by FATAL(), with ctx->aborted saying why.\n");
+  cwrite(" */\n");
+  cwrite("#ifndef %s_DEADLINE_INTERVAL\n", ctx->upper);
+  cwrite("#define %s_DEADLINE_INTERVAL 4096\n", ctx->upper);
+  cwrite("#endif\n\n");
+  cwrite("static inline uint64_t %s_parser_clock(void) {\n", ctx->lower);
+  cwrite("  struct timespec ts;\n");
+  cwrite("#ifdef CLOCK_MONOTONIC\n");
+  cwrite("  clock_gettime(CLOCK_MONOTONIC, &ts);\n");
+  cwrite("#else\n");
+  cwrite("  timespec_get(&ts, TIME_UTC);\n");
+  cwrite("#endif\n");
+  cwrite("  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;\n");
+  cwrite("}\n\n");
+  cwrite("// The number of steps the parser has taken.\n");
+  cwrite_api(ctx, "size_t %s_parser_steps(%s_parser_ctx* ctx)", ctx->lower,
+             ctx->lower);
+  cwrite("  return ctx->steps + (ctx->fuel_given - ctx->fuel);\n");
+  cwrite("}\n\n");
+  cwrite("// Called when the fuel runs out. Returns 1 if the parse has to "
+         "stop.\n");
+  cwrite("static inline int %s_parser_refuel(%s_parser_ctx* ctx) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  ctx->steps += ctx->fuel_given;\n");
+  cwrite("  ctx->fuel = ctx->fuel_given = 0;\n");
+  cwrite("  // The step that ran out of fuel has been counted, so a parse "
+         "that used up\n");
+  cwrite("  // exactly max_steps steps is still within budget.\n");
+  cwrite("  if (ctx->max_steps && ctx->steps > ctx->max_steps)\n");
+  cwrite("    ctx->aborted = %s_ABORT_STEPS;\n", ctx->upper);
+  cwrite("  else if (ctx->deadline && %s_parser_clock() >= ctx->deadline)\n",
+         ctx->lower);
+  cwrite("    ctx->aborted = %s_ABORT_DEADLINE;\n", ctx->upper);
+  cwrite("  if (ctx->aborted) {\n");
+  cwrite("    %s_report_parse_error(ctx, ctx->aborted == %s_ABORT_STEPS ?\n",
+         ctx->lower, ctx->upper);
+  cwrite("        \"Parse step budget exceeded.\" : \"Parse deadline "
+         "passed.\", 3);\n");
+  cwrite("    ctx->exit = 1;\n");
+  cwrite("    return 1;\n");
+  cwrite("  }\n");
+  cwrite("  size_t fuel = ctx->deadline ? %s_DEADLINE_INTERVAL : SIZE_MAX;\n",
+         ctx->upper);
+  cwrite("  // Run out on the first step past the budget.\n");
+  cwrite("  if (ctx->max_steps && ctx->max_steps - ctx->steps < fuel - 1)\n");
+  cwrite("    fuel = ctx->max_steps - ctx->steps + 1;\n");
+  cwrite("  ctx->fuel = ctx->fuel_given = fuel;\n");
+  cwrite("  return 0;\n");
+  cwrite("}\n\n");
+  cwrite("// Limits the parse to max_steps steps, and to max_ns nanoseconds "
+         "from now.\n");
+  cwrite("// Zero means no limit.\n");
+  cwrite_api(ctx,
+             "void %s_parser_set_budget(%s_parser_ctx* ctx, size_t "
+             "max_steps, uint64_t max_ns)",
+             ctx->lower, ctx->lower);
+  cwrite("  ctx->steps = %s_parser_steps(ctx);\n", ctx->lower);
+  cwrite("  ctx->max_steps = max_steps;\n");
+  cwrite("  ctx->deadline = max_ns ? %s_parser_clock() + max_ns : 0;\n",
+         ctx->lower);
+  cwrite("  // The next step refuels, which checks the new budget.\n");
+  cwrite("  ctx->fuel = ctx->fuel_given = 1;\n");
+  cwrite("}\n\n");
+  cwrite("// Called when rules nest deeper than ctx->max_depth.\n");
+  cwrite("static inline void %s_parser_too_deep(%s_parser_ctx* ctx) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  ctx->aborted = %s_ABORT_DEPTH;\n", ctx->upper);
+  cwrite("  %s_report_parse_error(ctx, \"Input is nested too deeply.\", 3);\n",
+         ctx->lower);
+  cwrite("  ctx->exit = 1;\n");
+  cwrite("}\n\n");
+}
+
+static inline void peg_write_astnode_kind(codegen_ctx *ctx) {
+  cwrite("typedef enum {\n");
+  for (size_t i = 0; i < ctx->tok_kind_names.len; i++)
+    cwrite("  %s_NODE_%s,\n", ctx->upper, ctx->tok_kind_names.buf[i]);
   for (size_t i = 0; i < ctx->peg_kind_names.len; i++)
     cwrite("  %s_NODE_%s,\n", ctx->upper, ctx->peg_kind_names.buf[i]);
   cwrite("} %s_astnode_kind;\n\n", ctx->lower);
@@ -958,13 +1979,15 @@ static inline void peg_write_astnode_kind(codegen_ctx *ctx) {
   size_t num_kinds = ctx->tok_kind_names.len + ctx->peg_kind_names.len;
   cwrite("#define %s_NUM_NODEKINDS %zu\n", ctx->upper, num_kinds);
 
-  cwrite("static const char* %s_nodekind_name[%s_NUM_NODEKINDS] = {\n",
-         ctx->lower, ctx->upper);
+  cwrite_api_var(ctx, "const char* %s_nodekind_name[%s_NUM_NODEKINDS]",
+                 ctx->lower, ctx->upper);
+  cwrite("{\n");
   for (size_t i = 0; i < ctx->tok_kind_names.len; i++)
     cwrite("  \"%s\",\n", ctx->tok_kind_names.buf[i]);
   for (size_t i = 0; i < ctx->peg_kind_names.len; i++)
     cwrite("  \"%s\",\n", ctx->peg_kind_names.buf[i]);
   cwrite("};\n\n");
+  codegen_to_header(ctx);
 }
 
 // Check to make sure that the given ASTNode kind can be used.
@@ -991,11 +2014,23 @@ static inline void peg_write_astnode_def(codegen_ctx *ctx) {
   cwrite("struct %s_astnode_t {\n", ctx->lower);
 
   cwrite("  %s_astnode_t* parent;\n", ctx->lower);
-  cwrite("  uint16_t num_children;\n");
-  cwrite("  uint16_t max_children;\n");
-  cwrite("  %s_astnode_kind kind;\n\n", ctx->lower);
-  cwrite("  codepoint_t* tok_repr;\n");
-  cwrite("  size_t repr_len;\n");
+  if (ctx->args->compact) {
+    if (ctx->tok_kind_names.len + ctx->peg_kind_names.len > UINT16_MAX)
+      ERROR("Too many node kinds for --compact-nodes.");
+    cwrite("  uint16_t kind;\n");
+    cwrite("  uint16_t num_children;\n");
+    cwrite("  uint16_t max_children;\n\n");
+    cwrite("  // The node was made from tokens tok_start through tok_start + "
+           "tok_len - 1.\n");
+    cwrite("  uint32_t tok_start;\n");
+    cwrite("  uint32_t tok_len;\n");
+  } else {
+    cwrite("  uint16_t num_children;\n");
+    cwrite("  uint16_t max_children;\n");
+    cwrite("  %s_astnode_kind kind;\n\n", ctx->lower);
+    cwrite("  codepoint_t* tok_repr;\n");
+    cwrite("  size_t repr_len;\n");
+  }
 
   // Insert %extra directives.
   int inserted_extra = 0;
@@ -1014,8 +2049,41 @@ static inline void peg_write_astnode_def(codegen_ctx *ctx) {
   }
   cwrite(inserted_extra ? "  // End of extra data.\n"
                         : "  // No %%extra directives.\n");
-  cwrite("  %s_astnode_t** children;\n", ctx->lower);
+  if (!ctx->args->compact) {
+    cwrite("  %s_astnode_t** children;\n", ctx->lower);
+    cwrite("};\n\n");
+    return;
+  }
+  cwrite("  // The children follow the node. A list keeps a pointer to its "
+         "children\n");
+  cwrite("  // there instead, once it has room for any.\n");
   cwrite("};\n\n");
+
+  cwrite("static inline %s_astnode_t** %s_astnode_children(%s_astnode_t* "
+         "node) {\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  %s_astnode_t** after = (%s_astnode_t**)(node + 1);\n", ctx->lower,
+         ctx->lower);
+  cwrite("  return node->max_children ? *(%s_astnode_t***)after : after;\n",
+         ctx->lower);
+  cwrite("}\n\n");
+
+  cwrite("// Returns the text from the start of the node's first token to the "
+         "end of its\n");
+  cwrite("// last, and stores its length to len. Returns NULL if the node has "
+         "no tokens.\n");
+  cwrite("static inline codepoint_t* %s_astnode_text(%s_astnode_t* node, "
+         "%s_token* tokens, size_t* len) {\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  if (!node->tok_len) {\n");
+  cwrite("    *len = 0;\n");
+  cwrite("    return NULL;\n");
+  cwrite("  }\n");
+  cwrite("  %s_token* first = tokens + node->tok_start;\n", ctx->lower);
+  cwrite("  %s_token* last = first + node->tok_len - 1;\n", ctx->lower);
+  cwrite("  *len = (size_t)(last->content + last->len - first->content);\n");
+  cwrite("  return first->content;\n");
+  cwrite("}\n\n");
 }
 
 static inline void peg_write_minmax(codegen_ctx *ctx) {
@@ -1045,6 +2113,23 @@ static inline void peg_write_minmax(codegen_ctx *ctx) {
   cwrite("#define PGEN_MIN(a, b) ((a) ? ((a) > (b) ? (b) : (a)) : (b))\n\n\n");
 }
 
+static inline void peg_write_node_kind(codegen_ctx *ctx) {
+  if (ctx->args->compact)
+    cwrite("  node->kind = (uint16_t)kind;\n");
+  else
+    cwrite("  node->kind = kind;\n");
+}
+
+static inline void peg_write_node_norepr(codegen_ctx *ctx) {
+  if (ctx->args->compact) {
+    cwrite("  node->tok_start = 0;\n");
+    cwrite("  node->tok_len = 0;\n");
+  } else {
+    cwrite("  node->tok_repr = NULL;\n");
+    cwrite("  node->repr_len = 0;\n");
+  }
+}
+
 static inline void peg_write_astnode_init(codegen_ctx *ctx) {
 
   cwrite("static inline %s_astnode_t* %s_astnode_list(\n", ctx->lower,
@@ -1054,12 +2139,20 @@ static inline void peg_write_astnode_init(codegen_ctx *ctx) {
          "                             size_t initial_size) {\n",
          ctx->lower);
   cwrite("  char* ret = pgen_alloc(alloc,\n"
-         "                         sizeof(%s_astnode_t),\n"
+         "                         sizeof(%s_astnode_t)%s,\n"
          "                         _Alignof(%s_astnode_t));\n",
-         ctx->lower, ctx->lower);
+         ctx->lower, ctx->args->compact ? " + sizeof(void*)" : "", ctx->lower);
   cwrite("  %s_astnode_t *node = (%s_astnode_t*)ret;\n\n", ctx->lower,
          ctx->lower);
+  cwrite("#if %s_COLLECT_STATS\n", ctx->upper);
+  cwrite("  %s_stats_lists++;\n", ctx->lower);
+  cwrite("#endif\n");
   cwrite("  %s_astnode_t **children;\n", ctx->lower);
+  cwrite("  // max_children is a uint16_t, and UINT16_MAX marks a big list. "
+         "32768 is\n");
+  cwrite("  // the most it can hold that doubles into one.\n");
+  cwrite("  if (initial_size > 32768)\n");
+  cwrite("    initial_size = 32768;\n");
   cwrite("  if (initial_size) {\n");
   cwrite("    children = (%s_astnode_t**)PGEN_MALLOC("
          "sizeof(%s_astnode_t*) * initial_size);\n",
@@ -1070,13 +2163,15 @@ static inline void peg_write_astnode_init(codegen_ctx *ctx) {
   cwrite("  } else {\n");
   cwrite("    children = NULL;\n");
   cwrite("  }\n\n");
-  cwrite("  node->kind = kind;\n");
+  peg_write_node_kind(ctx);
   cwrite("  node->parent = NULL;\n");
   cwrite("  node->max_children = (uint16_t)initial_size;\n");
   cwrite("  node->num_children = 0;\n");
-  cwrite("  node->children = children;\n");
-  cwrite("  node->tok_repr = NULL;\n");
-  cwrite("  node->repr_len = 0;\n");
+  if (ctx->args->compact)
+    cwrite("  *(%s_astnode_t***)(node + 1) = children;\n", ctx->lower);
+  else
+    cwrite("  node->children = children;\n");
+  peg_write_node_norepr(ctx);
 
   // Insert %extrainit directives.
   int inserted_extrainit = 0;
@@ -1106,18 +2201,19 @@ static inline void peg_write_astnode_init(codegen_ctx *ctx) {
          ctx->lower, ctx->lower);
   cwrite("  %s_astnode_t *node = (%s_astnode_t *)ret;\n", ctx->lower,
          ctx->lower);
-  cwrite("  %s_astnode_t *children = NULL;\n", ctx->lower);
-  cwrite("  node->kind = kind;\n");
+  if (!ctx->args->compact)
+    cwrite("  %s_astnode_t *children = NULL;\n", ctx->lower);
+  peg_write_node_kind(ctx);
   cwrite("  node->parent = NULL;\n");
   cwrite("  node->max_children = 0;\n");
   cwrite("  node->num_children = 0;\n");
-  cwrite("  node->children = NULL;\n");
-  cwrite("  node->tok_repr = NULL;\n");
-  cwrite("  node->repr_len = 0;\n");
+  if (!ctx->args->compact)
+    cwrite("  node->children = NULL;\n");
+  peg_write_node_norepr(ctx);
   inserted_extrainit = 0;
   for (size_t n = 0; n < ctx->directives.len; n++) {
     ASTNode *dir = ctx->directives.buf[n];
-    if (strcmp(dir->name, "Directive"))
+    if (dir->kind != AST_Directive)
       continue;
     char *dir_name = (char *)dir->children[0]->extra;
 
@@ -1169,13 +2265,13 @@ static inline void peg_write_astnode_init(codegen_ctx *ctx) {
            ctx->lower);
     cwrite("  %s_astnode_t **children = (%s_astnode_t **)(node + 1);\n",
            ctx->lower, ctx->lower);
-    cwrite("  node->kind = kind;\n");
+    peg_write_node_kind(ctx);
     cwrite("  node->parent = NULL;\n");
     cwrite("  node->max_children = 0;\n");
     cwrite("  node->num_children = %zu;\n", i);
-    cwrite("  node->children = children;\n");
-    cwrite("  node->tok_repr = NULL;\n");
-    cwrite("  node->repr_len = 0;\n");
+    if (!ctx->args->compact)
+      cwrite("  node->children = children;\n");
+    peg_write_node_norepr(ctx);
     for (size_t j = 0; j < i; j++) {
       cwrite("  children[%zu] = n%zu;\n", j, j);
       cwrite("  n%zu->parent = node;\n", j);
@@ -1206,8 +2302,9 @@ static inline void peg_write_parsermacros(codegen_ctx *ctx) {
          "%s_NODE_##name\n",
          ctx->upper);
   cwrite("#define list(kind)               "
-         "%s_astnode_list(ctx->alloc, %s_NODE_##kind, 16)\n",
-         ctx->lower, ctx->upper);
+         "%s_astnode_list(ctx->alloc, %s_NODE_##kind, "
+         "%s_LIST_INITIAL_SIZE)\n",
+         ctx->lower, ctx->upper, ctx->upper);
   cwrite("#define leaf(kind)               "
          "%s_astnode_leaf(ctx->alloc, %s_NODE_##kind)\n",
          ctx->lower, ctx->upper);
@@ -1219,18 +2316,27 @@ static inline void peg_write_parsermacros(codegen_ctx *ctx) {
   cwrite("#define repr(node, t)            "
          "%s_astnode_repr(node, t)\n",
          ctx->lower);
-  cwrite("#define srepr(node, s)           "
-         "%s_astnode_srepr(ctx->alloc, node, (char*)s)\n",
-         ctx->lower);
-  cwrite("#define cprepr(node, cps, len)   "
-         "%s_astnode_cprepr(node, cps, len)\n",
-         ctx->lower);
-  cwrite(
-      "#define expect(kind, cap)        "
-      "((ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == %s_TOK_##kind) "
-      "? ctx->pos++, (cap ? cprepr(leaf(kind), NULL, ctx->pos-1) : SUCC) "
-      ": NULL)\n",
-      ctx->lower);
+  if (ctx->args->compact) {
+    cwrite("#define tokrepr(node, start, len) "
+           "%s_astnode_tokrepr(node, start, len)\n",
+           ctx->lower);
+  } else {
+    cwrite("#define srepr(node, s)           "
+           "%s_astnode_srepr(ctx->alloc, node, (char*)s)\n",
+           ctx->lower);
+    cwrite("#define cprepr(node, cps, len)   "
+           "%s_astnode_cprepr(node, cps, len)\n",
+           ctx->lower);
+  }
+  cwrite("#define expect(kind, cap)        ");
+  if (peg_tracks_examined(ctx))
+    cwrite("(%s_parser_examine(ctx), ", ctx->lower);
+  cwrite("((ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == %s_TOK_##kind) "
+         "? ctx->pos++, (cap ? %s(leaf(kind), %sctx->pos-1%s) : SUCC) "
+         ": NULL)%s\n",
+         ctx->lower, ctx->args->compact ? "tokrepr" : "cprepr",
+         ctx->args->compact ? "" : "NULL, ", ctx->args->compact ? ", 1" : "",
+         peg_tracks_examined(ctx) ? ")" : "");
   cwrite("\n");
 
   cwrite("#define LB {\n");
@@ -1256,6 +2362,22 @@ static inline void peg_write_repr(codegen_ctx *ctx) {
   cwrite("static inline %s_astnode_t* %s_astnode_repr(%s_astnode_t* node, "
          "%s_astnode_t* t) {\n",
          ctx->lower, ctx->lower, ctx->lower, ctx->lower);
+  if (ctx->args->compact) {
+    // Compact nodes can only refer to tokens, so there's no cprepr or srepr.
+    cwrite("  node->tok_start = t->tok_start;\n");
+    cwrite("  node->tok_len = t->tok_len;\n");
+    cwrite("  return node;\n");
+    cwrite("}\n\n");
+
+    cwrite("static inline %s_astnode_t* %s_astnode_tokrepr("
+           "%s_astnode_t* node, size_t start, size_t len) {\n",
+           ctx->lower, ctx->lower, ctx->lower);
+    cwrite("  node->tok_start = (uint32_t)start;\n");
+    cwrite("  node->tok_len = (uint32_t)len;\n");
+    cwrite("  return node;\n");
+    cwrite("}\n\n");
+    return;
+  }
   cwrite("  node->tok_repr = t->tok_repr;\n");
   cwrite("  node->repr_len = t->repr_len;\n");
   cwrite("  return node;\n");
@@ -1288,41 +2410,170 @@ static inline void peg_write_repr(codegen_ctx *ctx) {
 }
 
 static inline void peg_write_astnode_add(codegen_ctx *ctx) {
-  cwrite("static inline void %s_astnode_add("
-         "pgen_allocator* alloc, %s_astnode_t *list, %s_astnode_t *node) {\n",
+  // The children arrays of a list and a node, and how to assign to the list's.
+  char list_children[PGEN_PREFIX_LEN + 32], node_children[PGEN_PREFIX_LEN + 32];
+  const char *children = ctx->args->compact ? "*slot" : "list->children";
+  if (ctx->args->compact) {
+    sprintf(list_children, "%s_astnode_children(list)", ctx->lower);
+    sprintf(node_children, "%s_astnode_children(node)", ctx->lower);
+  } else {
+    strcpy(list_children, "list->children");
+    strcpy(node_children, "node->children");
+  }
+
+  codegen_to_header(ctx);
+  cwrite("// A list with more than UINT16_MAX - 1 children keeps them in "
+         "chunks of\n");
+  cwrite("// 65536. The first chunk is where a small list keeps its "
+         "children, so code\n");
+  cwrite("// that only looks at num_children still sees the first of them. A "
+         "big list\n");
+  cwrite("// has max_children == UINT16_MAX, and its num_children stops "
+         "there.\n");
+  cwrite("typedef struct {\n");
+  cwrite("  size_t num_children;\n");
+  cwrite("  size_t num_chunks;\n");
+  cwrite("  %s_astnode_t*** chunks;\n", ctx->lower);
+  cwrite("  %s_astnode_t* first[65536];\n", ctx->lower);
+  cwrite("} %s_astnode_biglist;\n", ctx->lower);
+  cwrite("\n");
+  cwrite("static inline %s_astnode_biglist* "
+         "%s_astnode_biglist_of(%s_astnode_t* list) {\n",
          ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  char* first = (char*)%s;\n", list_children);
+  cwrite("  return (%s_astnode_biglist*)(void*)(first - "
+         "offsetof(%s_astnode_biglist, first));\n",
+         ctx->lower, ctx->lower);
+  cwrite("}\n\n");
+  codegen_to_impl(ctx);
+  cwrite("static inline void %s_astnode_biglist_free(void* ptr) {\n",
+         ctx->lower);
+  cwrite("  %s_astnode_biglist* big = (%s_astnode_biglist*)ptr;\n",
+         ctx->lower, ctx->lower);
+  cwrite("  for (size_t i = 1; i < big->num_chunks; i++)\n");
+  cwrite("    free(big->chunks[i]);\n");
+  cwrite("  free(big->chunks);\n");
+  cwrite("  free(big);\n");
+  cwrite("}\n\n");
+  codegen_to_header(ctx);
+  cwrite("static inline size_t %s_astnode_num_children(%s_astnode_t* node) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  if (node->max_children == UINT16_MAX)\n");
+  cwrite("    return %s_astnode_biglist_of(node)->num_children;\n", ctx->lower);
+  cwrite("  return node->num_children;\n");
+  cwrite("}\n\n");
+  cwrite("static inline %s_astnode_t* %s_astnode_child(%s_astnode_t* node, "
+         "size_t i) {\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  if (i < 65536)\n");
+  cwrite("    return %s[i];\n", node_children);
+  cwrite("  return %s_astnode_biglist_of(node)->chunks[i >> 16][i & 65535];\n",
+         ctx->lower);
+  cwrite("}\n\n");
+  codegen_to_impl(ctx);
+  cwrite("static inline void %s_astnode_add(pgen_allocator* alloc, "
+         "%s_astnode_t *list, %s_astnode_t *node) {\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  node->parent = list;\n");
+  cwrite("#if %s_COLLECT_STATS\n", ctx->upper);
+  cwrite("  %s_stats_child(%s_astnode_num_children(list) + 1);\n", ctx->lower,
+         ctx->lower);
+  cwrite("#endif\n");
+  cwrite("  if (list->max_children == UINT16_MAX) {\n");
+  cwrite("    %s_astnode_biglist* big = %s_astnode_biglist_of(list);\n",
+         ctx->lower, ctx->lower);
+  cwrite("    size_t i = big->num_children;\n");
+  cwrite("    if (!(i & 65535)) {\n");
+  cwrite("      size_t chunks_bytes = sizeof(%s_astnode_t**) * "
+         "(big->num_chunks + 1);\n",
+         ctx->lower);
+  cwrite("      void* chunks = realloc(big->chunks, chunks_bytes);\n");
+  if (!ctx->args->u)
+    cwrite("      if (!chunks) PGEN_OOM();\n");
+  cwrite("      big->chunks = (%s_astnode_t***)chunks;\n", ctx->lower);
+  cwrite("      big->chunks[big->num_chunks] = "
+         "(%s_astnode_t**)malloc(sizeof(%s_astnode_t*) * 65536);\n",
+         ctx->lower, ctx->lower);
+  if (!ctx->args->u)
+    cwrite("      if (!big->chunks[big->num_chunks]) PGEN_OOM();\n");
+  cwrite("      big->num_chunks++;\n");
+  cwrite("    }\n");
+  cwrite("    big->chunks[i >> 16][i & 65535] = node;\n");
+  cwrite("    big->num_children = i + 1;\n");
+  cwrite("    if (list->num_children < UINT16_MAX)\n");
+  cwrite("      list->num_children++;\n");
+  cwrite("    return;\n");
+  cwrite("  }\n\n");
   cwrite("  if (list->max_children == list->num_children) {\n");
+  if (ctx->args->compact)
+    cwrite("    %s_astnode_t*** slot = (%s_astnode_t***)(list + 1);\n",
+           ctx->lower, ctx->lower);
+  cwrite("    size_t new_max = list->max_children ? "
+         "(size_t)list->max_children * 2 : 16;\n");
+  cwrite("    if (new_max > UINT16_MAX) {\n");
+  cwrite("      // Move the children into the first chunk of a big list.\n");
+  cwrite("      %s_astnode_biglist* big = "
+         "(%s_astnode_biglist*)malloc(sizeof(%s_astnode_biglist));\n",
+         ctx->lower, ctx->lower, ctx->lower);
   if (!ctx->args->u)
-    cwrite("    // Figure out the new size. Check for overflow where "
-           "applicable.\n");
-  cwrite("    uint64_t new_max = (uint64_t)list->max_children * 2;\n");
-  if (!ctx->args->u) {
-    cwrite("    if (new_max > UINT16_MAX || new_max > SIZE_MAX) PGEN_OOM();\n");
-    cwrite("    if (SIZE_MAX < UINT16_MAX && "
-           "(size_t)new_max > SIZE_MAX / sizeof(%s_astnode_t)) PGEN_OOM();\n",
-           ctx->lower);
-  }
-  cwrite("    size_t new_bytes = (size_t)new_max * sizeof(%s_astnode_t);\n\n",
+    cwrite("      if (!big) PGEN_OOM();\n");
+  cwrite("      big->chunks = "
+         "(%s_astnode_t***)malloc(sizeof(%s_astnode_t**));\n",
+         ctx->lower, ctx->lower);
+  if (!ctx->args->u)
+    cwrite("      if (!big->chunks) PGEN_OOM();\n");
+  cwrite("      big->chunks[0] = big->first;\n");
+  cwrite("      big->num_chunks = 1;\n");
+  cwrite("      big->num_children = list->num_children;\n");
+  cwrite("      void* old_ptr = %s;\n", children);
+  cwrite("      memcpy(big->first, old_ptr, sizeof(%s_astnode_t*) * "
+         "list->num_children);\n",
+         ctx->lower);
+  cwrite("      pgen_allocator_realloced(alloc, old_ptr, big, "
+         "%s_astnode_biglist_free);\n",
+         ctx->lower);
+  cwrite("      free(old_ptr);\n");
+  cwrite("      %s = big->first;\n", children);
+  cwrite("      list->max_children = UINT16_MAX;\n");
+  cwrite("      %s_astnode_add(alloc, list, node);\n", ctx->lower);
+  cwrite("      return;\n");
+  cwrite("    }\n\n");
+  cwrite("    // Move the children to a bigger buffer, and inform the "
+         "allocator. The old\n");
+  cwrite("    // buffer is replaced before it's freed, so it's never "
+         "looked at after.\n");
+  cwrite("    void* old_ptr = %s;\n", children);
+  cwrite("    void* new_ptr = malloc(sizeof(%s_astnode_t*) * new_max);\n",
          ctx->lower);
-
-  cwrite("    // Reallocate the list, and inform the allocator.\n");
-  cwrite("    void* old_ptr = list->children;\n");
-  cwrite("    void* new_ptr = realloc(list->children, new_bytes);\n");
   if (!ctx->args->u)
     cwrite("    if (!new_ptr) PGEN_OOM();\n");
-  cwrite("    list->children = (%s_astnode_t **)new_ptr;\n", ctx->lower);
+  cwrite("    if (old_ptr) {\n");
+  cwrite("      memcpy(new_ptr, old_ptr, sizeof(%s_astnode_t*) * "
+         "list->num_children);\n",
+         ctx->lower);
+  cwrite("      pgen_allocator_realloced(alloc, old_ptr, new_ptr, free);\n");
+  cwrite("      free(old_ptr);\n");
+  cwrite("    } else {\n");
+  cwrite("      // A list made with no room has nothing to replace. The "
+         "buffer lives as\n");
+  cwrite("      // long as the first child, which was allocated before "
+         "alloc->rew.\n");
+  cwrite("      pgen_defer(alloc, free, new_ptr, alloc->rew);\n");
+  cwrite("    }\n");
+  cwrite("    %s = (%s_astnode_t **)new_ptr;\n", children, ctx->lower);
   cwrite("    list->max_children = (uint16_t)new_max;\n");
-  cwrite("    pgen_allocator_realloced(alloc, old_ptr, new_ptr, free);\n");
   cwrite("  }\n");
-  cwrite("  node->parent = list;\n");
-  cwrite("  list->children[list->num_children++] = node;\n");
-  cwrite("}\n\n");
+  cwrite("  %s[list->num_children++] = node;\n", list_children);
+  cwrite("}\n");
 }
 
 static inline void peg_write_parser_rewind(codegen_ctx *ctx) {
   cwrite("static inline void %s_parser_rewind("
          "%s_parser_ctx *ctx, pgen_parser_rewind_t rew) {\n",
          ctx->lower, ctx->lower);
+  if (ctx->args->incremental)
+    cwrite("  if (ctx->memo) %s_memo_rewind(ctx->memo, rew.arew);\n",
+           ctx->lower);
   cwrite("  pgen_allocator_rewind(ctx->alloc, rew.arew);\n");
   cwrite("  ctx->pos = rew.prew;\n");
   cwrite("}\n\n");
@@ -1336,11 +2587,16 @@ static inline void peg_write_node_print(codegen_ctx *ctx) {
   cwrite("  int found = 0;\n");
   cwrite("  codepoint_t* utf32 = NULL; size_t utf32len = 0;\n");
   cwrite("  char* utf8 = NULL; size_t utf8len = 0;\n");
-  cwrite("  if (node->tok_repr && node->repr_len) {\n");
-  cwrite("    utf32 = node->tok_repr;\n");
-  cwrite("    utf32len = node->repr_len;\n");
+  if (ctx->args->compact) {
+    cwrite("  utf32 = %s_astnode_text(node, tokens, &utf32len);\n", ctx->lower);
+    cwrite("  if (utf32) {\n");
+  } else {
+    cwrite("  if (node->tok_repr && node->repr_len) {\n");
+    cwrite("    utf32 = node->tok_repr;\n");
+    cwrite("    utf32len = node->repr_len;\n");
+  }
   cwrite("    int success = UTF8_encode("
-         "node->tok_repr, node->repr_len, &utf8, &utf8len);\n");
+         "utf32, utf32len, &utf8, &utf8len);\n");
   cwrite("    if (success) {\n");
   cwrite("      for (size_t i = 0; i < utf8len; i++)\n");
   cwrite("        if (utf8[i] == '\\n') fputc('\\\\', stdout), fputc('n', "
@@ -1380,22 +2636,25 @@ static inline void peg_write_astnode_print(codegen_ctx *ctx) {
   cwrite("  indent(); printf(\"\\\"kind\\\": \"); "
          "printf(\"\\\"%%s\\\",\\n\", %s_nodekind_name[node->kind]);\n",
          ctx->lower);
-  cwrite("  if (!(!node->tok_repr & !node->repr_len)) {\n"
-         "    indent();\n"
+  if (ctx->args->compact)
+    cwrite("  if (node->tok_len) {\n");
+  else
+    cwrite("  if (!(!node->tok_repr & !node->repr_len)) {\n");
+  cwrite("    indent();\n"
          "    printf(\"\\\"content\\\": \\\"\");\n"
          "    %s_node_print_content(node, tokens);\n"
          "    printf(\"\\\",\\n\");\n"
          "  }\n",
          ctx->lower);
-  cwrite("  size_t cnum = node->num_children;\n");
+  cwrite("  size_t cnum = %s_astnode_num_children(node);\n", ctx->lower);
   cwrite("  if (cnum) {\n");
   cwrite("    indent(); printf(\"\\\"num_children\\\": %%zu,\\n\", cnum);\n");
   cwrite("    indent(); printf(\"\\\"children\\\": [\");\n");
   cwrite("    putchar('\\n');\n");
   cwrite("    for (size_t i = 0; i < cnum; i++)\n"
-         "      %s_astnode_print_h(tokens, node->children[i], depth + 1, "
-         "i == cnum - 1);\n",
-         ctx->lower);
+         "      %s_astnode_print_h(tokens, %s_astnode_child(node, i), "
+         "depth + 1, i == cnum - 1);\n",
+         ctx->lower, ctx->lower);
   cwrite("    indent();\n");
   cwrite("    printf(\"]\\n\");\n");
   cwrite("  }\n");
@@ -1407,9 +2666,9 @@ static inline void peg_write_astnode_print(codegen_ctx *ctx) {
   cwrite("#undef indent\n");
   cwrite("}\n\n"); // End of print helper fn
 
-  cwrite("static inline void %s_astnode_print_json(%s_token* tokens, "
-         "%s_astnode_t *node) {\n",
-         ctx->lower, ctx->lower, ctx->lower);
+  cwrite_api(ctx, "void %s_astnode_print_json(%s_token* tokens, "
+             "%s_astnode_t *node)",
+             ctx->lower, ctx->lower, ctx->lower);
   cwrite("  if (node)");
   cwrite("    %s_astnode_print_h(tokens, node, 0, 1);\n", ctx->lower);
   cwrite("  else");
@@ -1417,16 +2676,1250 @@ static inline void peg_write_astnode_print(codegen_ctx *ctx) {
   cwrite("}\n\n");
 }
 
+static inline void peg_write_astnode_write_json(codegen_ctx *ctx) {
+  cwrite("/*\n");
+  cwrite(" * Writes the AST as JSON. Each node is an object with a \"kind\", "
+         "a \"content\"\n");
+  cwrite(" * string if it has a tok_repr, and a \"children\" array if it has "
+         "children.\n");
+  cwrite(" * NULL nodes are written as null. With pretty set, the output is "
+         "indented.\n");
+  cwrite(" * The writer flushes to its sink as it fills up, so output "
+         "streams.\n");
+  if (ctx->args->compact)
+    cwrite(" * Compact nodes need the tokens they were made from.\n");
+  cwrite(" * Returns 1 on success, 0 on failure.\n");
+  cwrite(" */\n");
+  char tokens_param[PGEN_PREFIX_LEN + 32] = "";
+  if (ctx->args->compact)
+    sprintf(tokens_param, ", %s_token* tokens", ctx->lower);
+  cwrite_api(ctx,
+             "int %s_astnode_write_json(pgen_writer* w, %s_astnode_t* root%s, "
+             "int pretty)",
+             ctx->lower, ctx->lower, tokens_param);
+  cwrite("  typedef struct {\n");
+  cwrite("    %s_astnode_t* node;\n", ctx->lower);
+  cwrite("    size_t next;\n");
+  cwrite("  } frame;\n");
+  cwrite("  const uintptr_t succ = (uintptr_t)_Alignof(%s_astnode_t);\n",
+         ctx->lower);
+  cwrite("  const char* sep = pretty ? \": \" : \":\";\n");
+  cwrite("  size_t cap = 64, depth = 0;\n");
+  cwrite("  frame* stack = (frame*)malloc(sizeof(frame) * cap);\n");
+  cwrite("  if (!stack) return 0;\n\n");
+
+  cwrite("  %s_astnode_t* node = root;\n", ctx->lower);
+  cwrite("  while (1) {\n");
+  cwrite("    // Write the node. If it has children, open the array and "
+         "descend.\n");
+  cwrite("    if ((uintptr_t)node <= succ) {\n");
+  cwrite("      pgen_write(w, \"null\", 4);\n");
+  cwrite("    } else {\n");
+  cwrite("      pgen_writec(w, '{');\n");
+  cwrite("      pgen_write_json_indent(w, pretty, depth * 2 + 1);\n");
+  cwrite("      pgen_write(w, \"\\\"kind\\\"\", 6);\n");
+  cwrite("      pgen_writes(w, sep);\n");
+  cwrite("      pgen_writec(w, '\"');\n");
+  cwrite("      pgen_writes(w, %s_nodekind_name[node->kind]);\n", ctx->lower);
+  cwrite("      pgen_writec(w, '\"');\n");
+  if (ctx->args->compact)
+    cwrite("      if (node->tok_len) {\n");
+  else
+    cwrite("      if (node->tok_repr || node->repr_len) {\n");
+  cwrite("        pgen_writec(w, ',');\n");
+  cwrite("        pgen_write_json_indent(w, pretty, depth * 2 + 1);\n");
+  cwrite("        pgen_write(w, \"\\\"content\\\"\", 9);\n");
+  cwrite("        pgen_writes(w, sep);\n");
+  if (ctx->args->compact) {
+    cwrite("        size_t text_len;\n");
+    cwrite("        codepoint_t* text = %s_astnode_text(node, tokens, "
+           "&text_len);\n",
+           ctx->lower);
+    cwrite("        pgen_write_json_string(w, text, text_len);\n");
+  } else {
+    cwrite("        pgen_write_json_string(w, node->tok_repr, "
+           "node->tok_repr ? node->repr_len : 0);\n");
+  }
+  cwrite("      }\n");
+  cwrite("      if (node->num_children) {\n");
+  cwrite("        pgen_writec(w, ',');\n");
+  cwrite("        pgen_write_json_indent(w, pretty, depth * 2 + 1);\n");
+  cwrite("        pgen_write(w, \"\\\"children\\\"\", 10);\n");
+  cwrite("        pgen_writes(w, sep);\n");
+  cwrite("        pgen_writec(w, '[');\n");
+  cwrite("        if (depth == cap) {\n");
+  cwrite("          void* new_stack = realloc(stack, sizeof(frame) * "
+         "(cap *= 2));\n");
+  cwrite("          if (!new_stack) return free(stack), 0;\n");
+  cwrite("          stack = (frame*)new_stack;\n");
+  cwrite("        }\n");
+  cwrite("        stack[depth].node = node;\n");
+  cwrite("        stack[depth].next = 0;\n");
+  cwrite("        depth++;\n");
+  cwrite("        pgen_write_json_indent(w, pretty, depth * 2);\n");
+  cwrite("        node = %s_astnode_child(node, 0);\n", ctx->lower);
+  cwrite("        continue;\n");
+  cwrite("      }\n");
+  cwrite("      pgen_write_json_indent(w, pretty, depth * 2);\n");
+  cwrite("      pgen_writec(w, '}');\n");
+  cwrite("    }\n\n");
+
+  cwrite("    // Move on to the next sibling, closing every finished parent.\n");
+  cwrite("    node = NULL;\n");
+  cwrite("    while (depth) {\n");
+  cwrite("      frame* top = stack + depth - 1;\n");
+  cwrite("      if (++top->next < %s_astnode_num_children(top->node)) {\n",
+         ctx->lower);
+  cwrite("        pgen_writec(w, ',');\n");
+  cwrite("        pgen_write_json_indent(w, pretty, depth * 2);\n");
+  cwrite("        node = %s_astnode_child(top->node, top->next);\n",
+         ctx->lower);
+  cwrite("        break;\n");
+  cwrite("      }\n");
+  cwrite("      depth--;\n");
+  cwrite("      pgen_write_json_indent(w, pretty, depth * 2 + 1);\n");
+  cwrite("      pgen_writec(w, ']');\n");
+  cwrite("      pgen_write_json_indent(w, pretty, depth * 2);\n");
+  cwrite("      pgen_writec(w, '}');\n");
+  cwrite("    }\n");
+  cwrite("    if (!depth && !node) break;\n");
+  cwrite("  }\n");
+  cwrite("  if (pretty) pgen_writec(w, '\\n');\n");
+  cwrite("  free(stack);\n");
+  cwrite("  return !w->err;\n");
+  cwrite("}\n\n");
+}
+
+static inline void peg_write_astnode_walk(codegen_ctx *ctx) {
+  codegen_to_header(ctx);
+  cwrite("/*\n");
+  cwrite(" * Walks the AST depth first, with a stack on the heap instead of "
+         "recursion,\n");
+  cwrite(" * so deep trees can't overflow the C stack. pre is called on each "
+         "node before\n");
+  cwrite(" * its children, and post after them. Either may be NULL. NULL "
+         "children are\n");
+  cwrite(" * skipped. The next sibling of each node is prefetched while the "
+         "node and its\n");
+  cwrite(" * children are visited.\n");
+  cwrite(" */\n");
+  cwrite("typedef enum {\n");
+  cwrite("  %s_WALK_CONTINUE,\n", ctx->upper);
+  cwrite("  // Don't visit the children of this node. Only meaningful from "
+         "pre.\n");
+  cwrite("  %s_WALK_SKIP,\n", ctx->upper);
+  cwrite("  // End the walk.\n");
+  cwrite("  %s_WALK_STOP,\n", ctx->upper);
+  cwrite("} %s_walk_action;\n", ctx->lower);
+  cwrite("\n");
+  cwrite("typedef %s_walk_action (*%s_walk_fn)(%s_astnode_t* node, void* "
+         "user);\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("\n");
+  cwrite("// Returns 1 if the whole tree was walked, 0 if a callback stopped "
+         "the walk or\n");
+  cwrite("// memory ran out.\n");
+  cwrite_api(ctx,
+             "int %s_astnode_walk(%s_astnode_t* root, %s_walk_fn pre, "
+             "%s_walk_fn post, void* user)",
+             ctx->lower, ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  typedef struct {\n");
+  cwrite("    %s_astnode_t* node;\n", ctx->lower);
+  cwrite("    size_t next;\n");
+  cwrite("    size_t num;\n");
+  cwrite("  } frame;\n");
+  cwrite("  const uintptr_t succ = (uintptr_t)_Alignof(%s_astnode_t);\n",
+         ctx->lower);
+  cwrite("  size_t cap = 64, depth = 0;\n");
+  cwrite("  frame* stack = (frame*)malloc(sizeof(frame) * cap);\n");
+  cwrite("  if (!stack) return 0;\n\n");
+  cwrite("  %s_astnode_t* node = root;\n", ctx->lower);
+  cwrite("  while (1) {\n");
+  cwrite("    if ((uintptr_t)node > succ) {\n");
+  cwrite("      %s_walk_action act = pre ? pre(node, user) : "
+         "%s_WALK_CONTINUE;\n",
+         ctx->lower, ctx->upper);
+  cwrite("      if (act == %s_WALK_STOP) return free(stack), 0;\n", ctx->upper);
+  cwrite("      size_t num = act == %s_WALK_SKIP ? 0 : "
+         "%s_astnode_num_children(node);\n",
+         ctx->upper, ctx->lower);
+  cwrite("      if (num) {\n");
+  cwrite("        if (depth == cap) {\n");
+  cwrite("          void* new_stack = realloc(stack, sizeof(frame) * (cap *= "
+         "2));\n");
+  cwrite("          if (!new_stack) return free(stack), 0;\n");
+  cwrite("          stack = (frame*)new_stack;\n");
+  cwrite("        }\n");
+  cwrite("        stack[depth].node = node;\n");
+  cwrite("        stack[depth].next = 0;\n");
+  cwrite("        stack[depth].num = num;\n");
+  cwrite("        depth++;\n");
+  cwrite("        if (num > 1) PGEN_PREFETCH(%s_astnode_child(node, 1));\n",
+         ctx->lower);
+  cwrite("        node = %s_astnode_child(node, 0);\n", ctx->lower);
+  cwrite("        continue;\n");
+  cwrite("      }\n");
+  cwrite("      if (post && post(node, user) == %s_WALK_STOP) return "
+         "free(stack), 0;\n",
+         ctx->upper);
+  cwrite("    }\n\n");
+  cwrite("    // Move on to the next sibling, finishing every parent on the "
+         "way up.\n");
+  cwrite("    node = NULL;\n");
+  cwrite("    while (depth) {\n");
+  cwrite("      frame* top = stack + depth - 1;\n");
+  cwrite("      if (++top->next < top->num) {\n");
+  cwrite("        if (top->next + 1 < top->num)\n");
+  cwrite("          PGEN_PREFETCH(%s_astnode_child(top->node, top->next + "
+         "1));\n",
+         ctx->lower);
+  cwrite("        node = %s_astnode_child(top->node, top->next);\n",
+         ctx->lower);
+  cwrite("        break;\n");
+  cwrite("      }\n");
+  cwrite("      depth--;\n");
+  cwrite("      if (post && post(top->node, user) == %s_WALK_STOP) return "
+         "free(stack), 0;\n",
+         ctx->upper);
+  cwrite("    }\n");
+  cwrite("    if (!depth && !node) break;\n");
+  cwrite("  }\n");
+  cwrite("  free(stack);\n");
+  cwrite("  return 1;\n");
+  cwrite("}\n\n");
+  codegen_to_header(ctx);
+  cwrite("// Callbacks for each kind of node, indexed by kind, for "
+         "%s_astnode_visit().\n",
+         ctx->lower);
+  cwrite("// Nodes of kinds without a callback are walked through. user is "
+         "passed to\n");
+  cwrite("// every callback.\n");
+  cwrite("typedef struct {\n");
+  cwrite("  %s_walk_fn pre[%s_NUM_NODEKINDS];\n", ctx->lower, ctx->upper);
+  cwrite("  %s_walk_fn post[%s_NUM_NODEKINDS];\n", ctx->lower, ctx->upper);
+  cwrite("  void* user;\n");
+  cwrite("} %s_visitor;\n", ctx->lower);
+  cwrite("\n");
+  codegen_to_impl(ctx);
+  cwrite("static inline %s_walk_action %s_visitor_pre(%s_astnode_t* node, "
+         "void* v) {\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  %s_walk_fn fn = ((%s_visitor*)v)->pre[node->kind];\n",
+         ctx->lower, ctx->lower);
+  cwrite("  return fn ? fn(node, ((%s_visitor*)v)->user) : %s_WALK_CONTINUE;\n",
+         ctx->lower, ctx->upper);
+  cwrite("}\n\n");
+  cwrite("static inline %s_walk_action %s_visitor_post(%s_astnode_t* node, "
+         "void* v) {\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  %s_walk_fn fn = ((%s_visitor*)v)->post[node->kind];\n",
+         ctx->lower, ctx->lower);
+  cwrite("  return fn ? fn(node, ((%s_visitor*)v)->user) : %s_WALK_CONTINUE;\n",
+         ctx->lower, ctx->upper);
+  cwrite("}\n\n");
+  cwrite("// Walks the tree, calling the visitor's callbacks for the kind of "
+         "each node.\n");
+  cwrite_api(ctx, "int %s_astnode_visit(%s_astnode_t* root, %s_visitor* "
+             "visitor)",
+             ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  return %s_astnode_walk(root, %s_visitor_pre, %s_visitor_post, "
+         "visitor);\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("}\n");
+}
+
+static inline void peg_write_ast_compact(codegen_ctx *ctx) {
+  char copy_children[PGEN_PREFIX_LEN + 32];
+  if (ctx->args->compact)
+    sprintf(copy_children, "%s_astnode_children(top->copy)", ctx->lower);
+  else
+    strcpy(copy_children, "top->copy->children");
+
+  cwrite("/*\n");
+  cwrite(" * Copies a finished AST into one block of memory, in depth first "
+         "order, so\n");
+  cwrite(" * that it takes no more space than it needs and is read front to "
+         "back when\n");
+  cwrite(" * it's walked. The block is freed along with out. Every node in "
+         "the copy is\n");
+  cwrite(" * fixed, so children can't be added to it.\n");
+  if (ctx->args->compact) {
+    cwrite(" * Compact nodes refer to their tokens, so the tokens must outlive "
+           "the copy.\n");
+    cwrite(" * Nothing else in the parser's allocator is used, so it may be "
+           "destroyed.\n");
+  } else {
+    cwrite(" * Token contents are copied too, so the copy doesn't depend on "
+           "the tokens or\n");
+    cwrite(" * on the parser's allocator, which may be destroyed.\n");
+  }
+  cwrite(" * %%extra fields are copied as they are. Whatever they point to "
+         "has to be kept\n");
+  cwrite(" * alive by the caller.\n");
+  cwrite(" */\n");
+  cwrite("static inline size_t %s_ast_compact_nodesize(size_t num_children) "
+         "{\n",
+         ctx->lower);
+  cwrite("  size_t size = sizeof(%s_astnode_t);\n", ctx->lower);
+  cwrite("  if (num_children < UINT16_MAX) {\n");
+  cwrite("    size += sizeof(%s_astnode_t*) * num_children;\n", ctx->lower);
+  cwrite("  } else {\n");
+  if (ctx->args->compact)
+    cwrite("    size += sizeof(void*);\n");
+  cwrite("    size_t num_chunks = (num_children + 65535) / 65536;\n");
+  cwrite("    size += sizeof(%s_astnode_biglist) + sizeof(%s_astnode_t**) * "
+         "num_chunks +\n",
+         ctx->lower, ctx->lower);
+  cwrite("            sizeof(%s_astnode_t*) * (num_children - 65536);\n",
+         ctx->lower);
+  cwrite("  }\n");
+  cwrite("  return pgen_align(size, _Alignof(%s_astnode_t));\n", ctx->lower);
+  cwrite("}\n\n");
+  cwrite("static inline %s_walk_action %s_ast_compact_size(%s_astnode_t* "
+         "node, void* user) {\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  size_t* size = (size_t*)user;\n");
+  cwrite("  size[0] += "
+         "%s_ast_compact_nodesize(%s_astnode_num_children(node));\n",
+         ctx->lower, ctx->lower);
+  if (!ctx->args->compact)
+    cwrite("  if (node->tok_repr) size[1] += node->repr_len;\n");
+  cwrite("  return %s_WALK_CONTINUE;\n", ctx->upper);
+  cwrite("}\n\n");
+  cwrite("// Copies one node to *at, with room for its children after it, "
+         "and returns\n");
+  cwrite("// the copy. The children are filled in later.\n");
+  cwrite("static inline %s_astnode_t* %s_ast_compact_node(%s_astnode_t* "
+         "node, %s_astnode_t* parent, char** at, codepoint_t** text) {\n",
+         ctx->lower, ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  size_t num = %s_astnode_num_children(node);\n", ctx->lower);
+  cwrite("  %s_astnode_t* copy = (%s_astnode_t*)(void*)*at;\n",
+         ctx->lower, ctx->lower);
+  cwrite("  *at += %s_ast_compact_nodesize(num);\n", ctx->lower);
+  cwrite("  *copy = *node;\n");
+  cwrite("  copy->parent = parent;\n");
+  cwrite("  if (num < UINT16_MAX) {\n");
+  cwrite("    copy->max_children = 0;\n");
+  cwrite("    copy->num_children = (uint16_t)num;\n");
+  if (!ctx->args->compact)
+    cwrite("    copy->children = num ? (%s_astnode_t**)(copy + 1) : NULL;\n",
+           ctx->lower);
+  cwrite("  } else {\n");
+  if (ctx->args->compact) {
+    cwrite("    %s_astnode_biglist* big = "
+           "(%s_astnode_biglist*)(void*)((char*)(copy + 1) + sizeof(void*));\n",
+           ctx->lower, ctx->lower);
+    cwrite("    *(%s_astnode_t***)(copy + 1) = big->first;\n", ctx->lower);
+  } else {
+    cwrite("    %s_astnode_biglist* big = (%s_astnode_biglist*)(void*)(copy + "
+           "1);\n",
+           ctx->lower, ctx->lower);
+    cwrite("    copy->children = big->first;\n");
+  }
+  cwrite("    copy->max_children = UINT16_MAX;\n");
+  cwrite("    copy->num_children = UINT16_MAX;\n");
+  cwrite("    big->num_children = num;\n");
+  cwrite("    big->num_chunks = (num + 65535) / 65536;\n");
+  cwrite("    big->chunks = (%s_astnode_t***)(void*)(big + 1);\n", ctx->lower);
+  cwrite("    %s_astnode_t** rest = (%s_astnode_t**)(void*)(big->chunks + "
+         "big->num_chunks);\n",
+         ctx->lower, ctx->lower);
+  cwrite("    big->chunks[0] = big->first;\n");
+  cwrite("    for (size_t i = 1; i < big->num_chunks; i++)\n");
+  cwrite("      big->chunks[i] = rest + (i - 1) * 65536;\n");
+  cwrite("  }\n");
+  if (ctx->args->compact) {
+    cwrite("  (void)text;\n");
+  } else {
+    cwrite("  if (node->tok_repr) {\n");
+    cwrite("    memcpy(*text, node->tok_repr, sizeof(codepoint_t) * "
+           "node->repr_len);\n");
+    cwrite("    copy->tok_repr = *text;\n");
+    cwrite("    *text += node->repr_len;\n");
+    cwrite("  }\n");
+  }
+  cwrite("  return copy;\n");
+  cwrite("}\n\n");
+  cwrite("// Returns the copy of root, or NULL if root is NULL.\n");
+  cwrite_api(ctx,
+             "%s_astnode_t* %s_ast_compact(%s_astnode_t* root, "
+             "pgen_allocator* out)",
+             ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  typedef struct {\n");
+  cwrite("    %s_astnode_t* node;\n", ctx->lower);
+  cwrite("    %s_astnode_t* copy;\n", ctx->lower);
+  cwrite("    size_t next;\n");
+  cwrite("    size_t num;\n");
+  cwrite("  } frame;\n");
+  cwrite("  if (!root) return NULL;\n");
+  cwrite("  size_t size[2] = {0, 0};\n");
+  cwrite("  frame* stack = (frame*)malloc(sizeof(frame) * 64);\n");
+  cwrite("  char* block = NULL;\n");
+  cwrite("  if (stack && %s_astnode_walk(root, %s_ast_compact_size, NULL, "
+         "size))\n",
+         ctx->lower, ctx->lower);
+  cwrite("    block = (char*)PGEN_MALLOC(size[0] + sizeof(codepoint_t) * "
+         "size[1]);\n");
+  if (!ctx->args->u)
+    cwrite("  if (!stack | !block) PGEN_OOM();\n");
+  cwrite("  pgen_defer(out, PGEN_FREE, block, out->rew);\n\n");
+  cwrite("  char* at = block;\n");
+  cwrite("  codepoint_t* text = (codepoint_t*)(void*)(block + size[0]);\n");
+  cwrite("  size_t cap = 64, depth = 1;\n");
+  cwrite("  %s_astnode_t* ret = %s_ast_compact_node(root, NULL, &at, &text);\n",
+         ctx->lower, ctx->lower);
+  cwrite("  stack[0].node = root;\n");
+  cwrite("  stack[0].copy = ret;\n");
+  cwrite("  stack[0].next = 0;\n");
+  cwrite("  stack[0].num = %s_astnode_num_children(root);\n", ctx->lower);
+  cwrite("  while (depth) {\n");
+  cwrite("    frame* top = stack + depth - 1;\n");
+  cwrite("    if (top->next == top->num) {\n");
+  cwrite("      depth--;\n");
+  cwrite("      continue;\n");
+  cwrite("    }\n");
+  cwrite("    size_t i = top->next++;\n");
+  cwrite("    %s_astnode_t* child = %s_astnode_child(top->node, i);\n",
+         ctx->lower, ctx->lower);
+  cwrite("    %s_astnode_t** slot = i < 65536 ? %s + i\n",
+         ctx->lower, copy_children);
+  cwrite("                                    : "
+         "%s_astnode_biglist_of(top->copy)->chunks[i >> 16] + (i & 65535);\n",
+         ctx->lower);
+  cwrite("    if (!child) {\n");
+  cwrite("      *slot = NULL;\n");
+  cwrite("      continue;\n");
+  cwrite("    }\n");
+  cwrite("    *slot = %s_ast_compact_node(child, top->copy, &at, &text);\n",
+         ctx->lower);
+  cwrite("    size_t num = %s_astnode_num_children(child);\n", ctx->lower);
+  cwrite("    if (!num) continue;\n");
+  cwrite("    if (depth == cap) {\n");
+  cwrite("      void* new_stack = realloc(stack, sizeof(frame) * (cap *= "
+         "2));\n");
+  if (!ctx->args->u)
+    cwrite("      if (!new_stack) PGEN_OOM();\n");
+  cwrite("      stack = (frame*)new_stack;\n");
+  cwrite("    }\n");
+  cwrite("    stack[depth].node = child;\n");
+  cwrite("    stack[depth].copy = *slot;\n");
+  cwrite("    stack[depth].next = 0;\n");
+  cwrite("    stack[depth].num = num;\n");
+  cwrite("    depth++;\n");
+  cwrite("  }\n");
+  cwrite("  free(stack);\n");
+  cwrite("  return ret;\n");
+  cwrite("}\n");
+}
+
+// Writes the contents of all %extrainit directives, for a variable
+// called node that's in scope.
+static inline void peg_write_extrainit(codegen_ctx *ctx) {
+  int inserted_extrainit = 0;
+  for (size_t n = 0; n < ctx->directives.len; n++) {
+    ASTNode *dir = ctx->directives.buf[n];
+    char *dir_name = (char *)dir->children[0]->extra;
+
+    if (!strcmp(dir_name, "extrainit")) {
+      if (!inserted_extrainit) {
+        inserted_extrainit = 1;
+        cwrite("  // Extra initialization from %%extrainit directives:\n");
+      }
+      cwrite("  %s\n", (char *)dir->extra);
+    }
+  }
+}
+
+static inline void peg_write_astnode_serialize(codegen_ctx *ctx) {
+  codegen_to_header(ctx);
+  cwrite("/*\n");
+  cwrite(" * Binary AST format. Every field is a native endian uint32_t.\n");
+  cwrite(" *\n");
+  cwrite(" * Header:\n");
+  cwrite(" *   magic, version, number of node kinds, grammar fingerprint "
+         "(low word,\n");
+  cwrite(" *   then high word), number of nodes, pool length\n");
+  cwrite(" * Node records, in breadth first order, root first:\n");
+  cwrite(" *   kind, num_children, first_child, repr_off, repr_len\n");
+  cwrite(" * Pool:\n");
+  cwrite(" *   The codepoints of every node's tok_repr, back to back.\n");
+  cwrite(" *\n");
+  cwrite(" * The children of a node are the records first_child through\n");
+  cwrite(" * first_child + num_children - 1. A NULL child has kind "
+         "%s_AST_NULL.\n",
+         ctx->upper);
+  cwrite(" * A NULL tok_repr has repr_off %s_AST_NULL. Offsets are indices, "
+         "not\n",
+         ctx->upper);
+  cwrite(" * pointers, so the format is position independent. %%extra data "
+         "is not\n");
+  cwrite(" * stored.\n");
+  cwrite(" */\n");
+  cwrite("#define %s_AST_MAGIC 0x54534750u\n", ctx->upper);
+  cwrite("#define %s_AST_VERSION 2u\n", ctx->upper);
+  cwrite("#define %s_AST_NULL UINT32_MAX\n", ctx->upper);
+  cwrite("#define %s_AST_HEADER_WORDS 7u\n", ctx->upper);
+  cwrite("#define %s_AST_RECORD_WORDS 5u\n\n", ctx->upper);
+
+  // Serializer
+  char tokens_param[PGEN_PREFIX_LEN + 32] = "";
+  if (ctx->args->compact) {
+    sprintf(tokens_param, "%s_token* tokens, ", ctx->lower);
+    cwrite("// Compact nodes need the tokens they were made from.\n");
+  }
+  cwrite("// Returns 1 on success, 0 on failure.\n");
+  cwrite_api(ctx,
+             "int %s_astnode_serialize(%s_astnode_t* root, %spgen_writer* w)",
+             ctx->lower, ctx->lower, tokens_param);
+  cwrite("  const uintptr_t succ = (uintptr_t)_Alignof(%s_astnode_t);\n",
+         ctx->lower);
+  cwrite("  size_t cap = 256, len = 0;\n");
+  cwrite("  uint64_t pool_len = 0;\n");
+  cwrite("  %s_astnode_t** order = (%s_astnode_t**)malloc("
+         "sizeof(%s_astnode_t*) * cap);\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  if (!order) return 0;\n");
+  cwrite("  order[len++] = root;\n\n");
+
+  cwrite("  // Lay the tree out breadth first, so that siblings are "
+         "contiguous.\n");
+  cwrite("  for (size_t i = 0; i < len; i++) {\n");
+  cwrite("    %s_astnode_t* node = order[i];\n", ctx->lower);
+  cwrite("    if ((uintptr_t)node <= succ) continue;\n");
+  if (ctx->args->compact) {
+    cwrite("    size_t text_len;\n");
+    cwrite("    if (%s_astnode_text(node, tokens, &text_len)) pool_len += "
+           "text_len;\n",
+           ctx->lower);
+    cwrite("    if (text_len > UINT32_MAX) goto fail;\n");
+  } else {
+    cwrite("    if (node->tok_repr) pool_len += node->repr_len;\n");
+    cwrite("    if (node->repr_len > UINT32_MAX) goto fail;\n");
+  }
+  cwrite("    size_t nc = %s_astnode_num_children(node);\n", ctx->lower);
+  cwrite("    if (cap - len < nc) {\n");
+  cwrite("      while (cap - len < nc) cap *= 2;\n");
+  cwrite("      void* new_order = realloc(order, sizeof(%s_astnode_t*) * "
+         "cap);\n",
+         ctx->lower);
+  cwrite("      if (!new_order) goto fail;\n");
+  cwrite("      order = (%s_astnode_t**)new_order;\n", ctx->lower);
+  cwrite("    }\n");
+  cwrite("    for (size_t c = 0; c < nc; c++)\n");
+  cwrite("      order[len++] = %s_astnode_child(node, c);\n", ctx->lower);
+  cwrite("  }\n");
+  cwrite("  if (len >= UINT32_MAX || pool_len >= UINT32_MAX) goto fail;\n\n");
+
+  cwrite("  pgen_write_u32(w, %s_AST_MAGIC);\n", ctx->upper);
+  cwrite("  pgen_write_u32(w, %s_AST_VERSION);\n", ctx->upper);
+  cwrite("  pgen_write_u32(w, %s_NUM_NODEKINDS);\n", ctx->upper);
+  cwrite("  pgen_write_u32(w, (uint32_t)%s_GRAMMAR_FINGERPRINT);\n",
+         ctx->upper);
+  cwrite("  pgen_write_u32(w, (uint32_t)(%s_GRAMMAR_FINGERPRINT >> 32));\n",
+         ctx->upper);
+  cwrite("  pgen_write_u32(w, (uint32_t)len);\n");
+  cwrite("  pgen_write_u32(w, (uint32_t)pool_len);\n\n");
+
+  cwrite("  uint32_t next_child = 1, repr_off = 0;\n");
+  cwrite("  for (size_t i = 0; i < len; i++) {\n");
+  cwrite("    %s_astnode_t* node = order[i];\n", ctx->lower);
+  cwrite("    uint32_t rec[%s_AST_RECORD_WORDS] = {%s_AST_NULL, 0, 0, "
+         "%s_AST_NULL, 0};\n",
+         ctx->upper, ctx->upper, ctx->upper);
+  cwrite("    if ((uintptr_t)node > succ) {\n");
+  cwrite("      rec[0] = (uint32_t)node->kind;\n");
+  cwrite("      rec[1] = (uint32_t)%s_astnode_num_children(node);\n",
+         ctx->lower);
+  cwrite("      rec[2] = next_child;\n");
+  if (ctx->args->compact) {
+    cwrite("      size_t text_len;\n");
+    cwrite("      codepoint_t* text = %s_astnode_text(node, tokens, "
+           "&text_len);\n",
+           ctx->lower);
+    cwrite("      rec[4] = (uint32_t)text_len;\n");
+  } else {
+    cwrite("      rec[4] = (uint32_t)node->repr_len;\n");
+  }
+  cwrite("      next_child += rec[1];\n");
+  cwrite("      if (%s) {\n", ctx->args->compact ? "text" : "node->tok_repr");
+  cwrite("        rec[3] = repr_off;\n");
+  cwrite("        repr_off += rec[4];\n");
+  cwrite("      }\n");
+  cwrite("    }\n");
+  cwrite("    pgen_write(w, rec, sizeof(rec));\n");
+  cwrite("  }\n\n");
+
+  cwrite("  for (size_t i = 0; i < len; i++) {\n");
+  cwrite("    %s_astnode_t* node = order[i];\n", ctx->lower);
+  if (ctx->args->compact) {
+    cwrite("    if ((uintptr_t)node <= succ) continue;\n");
+    cwrite("    size_t text_len;\n");
+    cwrite("    codepoint_t* text = %s_astnode_text(node, tokens, "
+           "&text_len);\n",
+           ctx->lower);
+    cwrite("    if (text) pgen_write(w, text, text_len * "
+           "sizeof(codepoint_t));\n");
+  } else {
+    cwrite("    if ((uintptr_t)node > succ && node->tok_repr)\n");
+    cwrite("      pgen_write(w, node->tok_repr, "
+           "node->repr_len * sizeof(codepoint_t));\n");
+  }
+  cwrite("  }\n\n");
+
+  cwrite("  free(order);\n");
+  cwrite("  return !w->err;\n");
+  cwrite("fail:\n");
+  cwrite("  free(order);\n");
+  cwrite("  return 0;\n");
+  cwrite("}\n\n");
+
+  // Zero-copy reader
+  codegen_to_header(ctx);
+  cwrite("// A read only view of a serialized AST, which is used in place.\n");
+  cwrite("// Node 0 is the root.\n");
+  cwrite("typedef struct {\n");
+  cwrite("  const uint32_t* nodes;\n");
+  cwrite("  const codepoint_t* pool;\n");
+  cwrite("  uint32_t num_nodes;\n");
+  cwrite("  uint32_t pool_len;\n");
+  cwrite("} %s_ast_view;\n\n", ctx->lower);
+
+  cwrite("// Validates the data and initializes the view. Returns 1 on "
+         "success, 0 if\n");
+  cwrite("// the data is not a well formed AST for this grammar. data "
+         "must be 4 byte\n");
+  cwrite("// aligned, and must outlive the view.\n");
+  cwrite_api(ctx,
+             "int %s_ast_view_init(%s_ast_view* view, const void* data, "
+             "size_t len)",
+             ctx->lower, ctx->lower);
+  cwrite("  const uint32_t* words = (const uint32_t*)data;\n");
+  cwrite("  if ((uintptr_t)data %% _Alignof(uint32_t)) return 0;\n");
+  cwrite("  if (len %% sizeof(uint32_t) || "
+         "len < %s_AST_HEADER_WORDS * sizeof(uint32_t)) return 0;\n",
+         ctx->upper);
+  cwrite("  uint64_t fingerprint = words[3] | ((uint64_t)words[4] << 32);\n");
+  cwrite("  if ((words[0] != %s_AST_MAGIC) | (words[1] != %s_AST_VERSION) |\n"
+         "      (words[2] != %s_NUM_NODEKINDS) |\n"
+         "      (fingerprint != %s_GRAMMAR_FINGERPRINT) | !words[5]) "
+         "return 0;\n",
+         ctx->upper, ctx->upper, ctx->upper, ctx->upper);
+  cwrite("  uint64_t num_nodes = words[5], pool_len = words[6];\n");
+  cwrite("  uint64_t total = %s_AST_HEADER_WORDS + "
+         "num_nodes * %s_AST_RECORD_WORDS + pool_len;\n",
+         ctx->upper, ctx->upper);
+  cwrite("  if (total != (uint64_t)(len / sizeof(uint32_t))) return 0;\n\n");
+
+  cwrite("  const uint32_t* rec = words + %s_AST_HEADER_WORDS;\n",
+         ctx->upper);
+  cwrite("  uint64_t next_child = 1;\n");
+  cwrite("  for (uint64_t i = 0; i < num_nodes; i++, "
+         "rec += %s_AST_RECORD_WORDS) {\n",
+         ctx->upper);
+  cwrite("    if (rec[0] == %s_AST_NULL) {\n", ctx->upper);
+  cwrite("      if (rec[1]) return 0;\n");
+  cwrite("      continue;\n");
+  cwrite("    }\n");
+  cwrite("    // Children come after their parents, so the view has no "
+         "cycles and can\n");
+  cwrite("    // be loaded from the back.\n");
+  cwrite("    if ((rec[0] >= %s_NUM_NODEKINDS) | (rec[2] != next_child) |\n"
+         "        ((rec[1] != 0) & (rec[2] <= i)))\n",
+         ctx->upper);
+  cwrite("      return 0;\n");
+  cwrite("    next_child += rec[1];\n");
+  cwrite("    if (rec[3] != %s_AST_NULL && "
+         "(uint64_t)rec[3] + rec[4] > pool_len) return 0;\n",
+         ctx->upper);
+  cwrite("  }\n");
+  cwrite("  if (next_child != num_nodes) return 0;\n\n");
+
+  cwrite("  view->nodes = words + %s_AST_HEADER_WORDS;\n", ctx->upper);
+  cwrite("  view->pool = (const codepoint_t*)rec;\n");
+  cwrite("  view->num_nodes = (uint32_t)num_nodes;\n");
+  cwrite("  view->pool_len = (uint32_t)pool_len;\n");
+  cwrite("  return 1;\n");
+  cwrite("}\n\n");
+
+  // The accessors are small enough to inline into the caller.
+  codegen_to_header(ctx);
+  cwrite("static inline int %s_ast_view_isnull(const %s_ast_view* view, "
+         "uint32_t n) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  return view->nodes[n * %s_AST_RECORD_WORDS] == %s_AST_NULL;\n",
+         ctx->upper, ctx->upper);
+  cwrite("}\n\n");
+
+  cwrite("static inline %s_astnode_kind %s_ast_view_kind("
+         "const %s_ast_view* view, uint32_t n) {\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  return (%s_astnode_kind)view->nodes[n * %s_AST_RECORD_WORDS];\n",
+         ctx->lower, ctx->upper);
+  cwrite("}\n\n");
+
+  cwrite("static inline uint32_t %s_ast_view_num_children("
+         "const %s_ast_view* view, uint32_t n) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  return view->nodes[n * %s_AST_RECORD_WORDS + 1];\n", ctx->upper);
+  cwrite("}\n\n");
+
+  cwrite("static inline uint32_t %s_ast_view_child("
+         "const %s_ast_view* view, uint32_t n, uint32_t i) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  return view->nodes[n * %s_AST_RECORD_WORDS + 2] + i;\n",
+         ctx->upper);
+  cwrite("}\n\n");
+
+  cwrite("// Returns NULL if the node has no tok_repr.\n");
+  cwrite("static inline const codepoint_t* %s_ast_view_repr("
+         "const %s_ast_view* view, uint32_t n, size_t* len) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  const uint32_t* rec = view->nodes + n * %s_AST_RECORD_WORDS;\n",
+         ctx->upper);
+  cwrite("  *len = rec[4];\n");
+  cwrite("  return rec[3] == %s_AST_NULL ? NULL : view->pool + rec[3];\n",
+         ctx->upper);
+  cwrite("}\n\n");
+  codegen_to_impl(ctx);
+
+  // Materializer. Compact nodes can't point into the pool, so compact trees
+  // are only read through views.
+  if (ctx->args->compact)
+    return;
+  cwrite("// Rebuilds a %s_astnode_t tree from a view. The tok_repr of each "
+         "node points\n",
+         ctx->lower);
+  cwrite("// into the view's pool, so the view's data must outlive the tree. "
+         "The nodes\n");
+  cwrite("// are allocated like fixed nodes, so children cannot be added to "
+         "them.\n");
+  cwrite_api(ctx,
+             "%s_astnode_t* %s_ast_view_load(const %s_ast_view* view, "
+             "pgen_allocator* alloc)",
+             ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  %s_astnode_t** built = (%s_astnode_t**)malloc("
+         "sizeof(%s_astnode_t*) * view->num_nodes);\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  if (!ctx->args->u)
+    cwrite("  if (!built) PGEN_OOM();\n");
+  cwrite("  // Children come after their parents, so build from the back.\n");
+  cwrite("  for (uint32_t i = view->num_nodes; i-- > 0;) {\n");
+  cwrite("    const uint32_t* rec = view->nodes + i * %s_AST_RECORD_WORDS;\n",
+         ctx->upper);
+  cwrite("    if (rec[0] == %s_AST_NULL) {\n", ctx->upper);
+  cwrite("      built[i] = NULL;\n");
+  cwrite("      continue;\n");
+  cwrite("    }\n");
+  cwrite("    uint32_t nc = rec[1];\n");
+  cwrite("    %s_astnode_t *node;\n", ctx->lower);
+  cwrite("    if (nc >= UINT16_MAX) {\n");
+  cwrite("      // Too many children for a fixed node. Only lists get this "
+         "big, and\n");
+  cwrite("      // lists have no NULL children.\n");
+  cwrite("      node = %s_astnode_list(alloc, (%s_astnode_kind)rec[0], 16);\n",
+         ctx->lower, ctx->lower);
+  cwrite("      for (uint32_t c = 0; c < nc; c++)\n");
+  cwrite("        if (built[rec[2] + c])\n");
+  cwrite("          %s_astnode_add(alloc, node, built[rec[2] + c]);\n",
+         ctx->lower);
+  cwrite("    } else {\n");
+  cwrite("      char* ret = pgen_alloc(alloc,\n"
+         "                             sizeof(%s_astnode_t) +\n"
+         "                             sizeof(%s_astnode_t *) * nc,\n"
+         "                             _Alignof(%s_astnode_t));\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("      node = (%s_astnode_t *)ret;\n", ctx->lower);
+  cwrite("      node->kind = (%s_astnode_kind)rec[0];\n", ctx->lower);
+  cwrite("      node->parent = NULL;\n");
+  cwrite("      node->max_children = 0;\n");
+  cwrite("      node->num_children = (uint16_t)nc;\n");
+  cwrite("      node->children = nc ? (%s_astnode_t **)(node + 1) : NULL;\n",
+         ctx->lower);
+  cwrite("      for (uint32_t c = 0; c < nc; c++) {\n");
+  cwrite("        node->children[c] = built[rec[2] + c];\n");
+  cwrite("        if (node->children[c]) node->children[c]->parent = node;\n");
+  cwrite("      }\n");
+  cwrite("    }\n");
+  cwrite("    node->tok_repr = rec[3] == %s_AST_NULL ? NULL : "
+         "(codepoint_t*)(uintptr_t)(view->pool + rec[3]);\n",
+         ctx->upper);
+  cwrite("    node->repr_len = rec[4];\n");
+  peg_write_extrainit(ctx);
+  cwrite("    built[i] = node;\n");
+  cwrite("  }\n");
+  cwrite("  %s_astnode_t* root = built[0];\n", ctx->lower);
+  cwrite("  free(built);\n");
+  cwrite("  return root;\n");
+  cwrite("}\n\n");
+}
+
+static inline void peg_write_parse_cache(codegen_ctx *ctx) {
+  cwrite("/*\n");
+  cwrite(" * Parse cache. Serialized ASTs are stored in a directory, in "
+         "files named\n");
+  cwrite(" * after a hash of the UTF-8 input and the grammar fingerprint. "
+         "Only store\n");
+  cwrite(" * the results of parses without errors.\n");
+  cwrite(" */\n");
+  cwrite_api(ctx, "uint64_t %s_parse_cache_key(const char* utf8, size_t len)",
+             ctx->lower);
+  cwrite("  return pgen_hash64(utf8, len, %s_GRAMMAR_FINGERPRINT);\n",
+         ctx->upper);
+  cwrite("}\n\n");
+
+  cwrite("static inline char* %s_parse_cache_path(const char* dir, "
+         "uint64_t key, uint64_t tmp) {\n",
+         ctx->lower);
+  cwrite("  size_t dirlen = strlen(dir);\n");
+  cwrite("  size_t pathlen = dirlen + 64;\n");
+  cwrite("  char* path = (char*)malloc(pathlen);\n");
+  cwrite("  if (!path) return NULL;\n");
+  cwrite("  const char* sep = (dirlen && dir[dirlen - 1] != '/') ? \"/\" : "
+         "\"\";\n");
+  cwrite("  if (tmp)\n");
+  cwrite("    snprintf(path, pathlen, \"%%s%%s%%016\" PRIx64 \".ast.%%016\" "
+         "PRIx64, dir, sep, key, tmp);\n");
+  cwrite("  else\n");
+  cwrite("    snprintf(path, pathlen, \"%%s%%s%%016\" PRIx64 \".ast\", dir, "
+         "sep, key);\n");
+  cwrite("  return path;\n");
+  cwrite("}\n\n");
+
+  // Loading builds nodes from the view, so it needs the full layout.
+  if (!ctx->args->compact) {
+    cwrite("// Returns the cached AST for the input, allocated on alloc, or "
+           "NULL on a miss.\n");
+    cwrite("// The cache file stays mapped until alloc is destroyed.\n");
+    cwrite_api(ctx,
+               "%s_astnode_t* %s_parse_cache_load(const char* dir, "
+               "const char* utf8, size_t len, pgen_allocator* alloc)",
+               ctx->lower, ctx->lower);
+    cwrite("  char* path = %s_parse_cache_path(dir, "
+           "%s_parse_cache_key(utf8, len), 0);\n",
+           ctx->lower, ctx->lower);
+    cwrite("  pgen_mapped_file* m = (pgen_mapped_file*)malloc("
+           "sizeof(pgen_mapped_file));\n");
+    cwrite("  %s_ast_view view;\n", ctx->lower);
+    cwrite("  int hit = path && m && pgen_map_file(path, m) &&\n"
+           "            %s_ast_view_init(&view, m->data, m->len);\n",
+           ctx->lower);
+    cwrite("  free(path);\n");
+    cwrite("  if (!hit) {\n");
+    cwrite("    if (m) pgen_free_mapped_file(m);\n");
+    cwrite("    return NULL;\n");
+    cwrite("  }\n");
+    cwrite("  %s_astnode_t* ast = %s_ast_view_load(&view, alloc);\n",
+           ctx->lower, ctx->lower);
+    cwrite("  pgen_defer(alloc, pgen_free_mapped_file, m, alloc->rew);\n");
+    cwrite("  return ast;\n");
+    cwrite("}\n\n");
+  }
+
+  cwrite("// Saves the AST for the input. The file is written under a "
+         "temporary name\n");
+  cwrite("// and then renamed, so readers never see a partial file. Returns "
+         "1 on success.\n");
+  char tokens_param[PGEN_PREFIX_LEN + 32] = "";
+  if (ctx->args->compact)
+    sprintf(tokens_param, ", %s_token* tokens", ctx->lower);
+  cwrite_api(ctx,
+             "int %s_parse_cache_store(const char* dir, const char* utf8, "
+             "size_t len, %s_astnode_t* ast%s)",
+             ctx->lower, ctx->lower, tokens_param);
+  cwrite("  static uint64_t counter = 0;\n");
+  cwrite("  if (!ast) return 0;\n");
+  cwrite("  // Make the temporary name unique between threads and "
+         "processes.\n");
+  cwrite("  uintptr_t here = (uintptr_t)&counter ^ (uintptr_t)&here;\n");
+  cwrite("  uint64_t tmp = pgen_hash64(&here, sizeof(here), ++counter);\n");
+  cwrite("#if PGEN_USE_POSIX\n");
+  cwrite("  tmp ^= (uint64_t)getpid() << 32;\n");
+  cwrite("#endif\n");
+  cwrite("  tmp |= 1;\n");
+  cwrite("  uint64_t key = %s_parse_cache_key(utf8, len);\n", ctx->lower);
+  cwrite("  char* path = %s_parse_cache_path(dir, key, 0);\n", ctx->lower);
+  cwrite("  char* tmp_path = %s_parse_cache_path(dir, key, tmp);\n",
+         ctx->lower);
+  cwrite("  FILE* f = (path && tmp_path) ? fopen(tmp_path, \"wb\") : NULL;\n");
+  cwrite("  int success = 0;\n");
+  cwrite("  if (f) {\n");
+  cwrite("    pgen_writer w = pgen_writer_file(f);\n");
+  cwrite("    success = %s_astnode_serialize(ast, %s&w);\n", ctx->lower,
+         ctx->args->compact ? "tokens, " : "");
+  cwrite("    success &= pgen_writer_destroy(&w);\n");
+  cwrite("    success &= !fclose(f);\n");
+  cwrite("    if (success) success = !rename(tmp_path, path);\n");
+  cwrite("    if (!success) remove(tmp_path);\n");
+  cwrite("  }\n");
+  cwrite("  free(path);\n");
+  cwrite("  free(tmp_path);\n");
+  cwrite("  return success;\n");
+  cwrite("}\n\n");
+}
+
+static inline void peg_write_rule_ids(codegen_ctx *ctx) {
+  if (!ctx->args->incremental & !ctx->args->profile)
+    return;
+
+  // Rule ids start at 1, so a zeroed memo slot is empty.
+  codegen_to_header(ctx);
+  cwrite("typedef enum {\n");
+  cwrite("  %s_RULE_NONE,\n", ctx->upper);
+  for (size_t n = 0; n < ctx->definitions.len; n++) {
+    ASTNode *def = ctx->definitions.buf[n];
+    cwrite("  %s_RULE_%s,\n", ctx->upper, (char *)def->children[0]->extra);
+  }
+  cwrite("} %s_rule_id;\n\n", ctx->lower);
+  cwrite("#define %s_NUM_RULES %zu\n", ctx->upper, ctx->definitions.len + 1);
+  if (ctx->args->profile) {
+    cwrite_api_var(ctx, "const char* %s_rule_name[%s_NUM_RULES]", ctx->lower,
+                   ctx->upper);
+    cwrite("{\n");
+    cwrite("  \"\",\n");
+    for (size_t n = 0; n < ctx->definitions.len; n++) {
+      ASTNode *def = ctx->definitions.buf[n];
+      cwrite("  \"%s\",\n", (char *)def->children[0]->extra);
+    }
+    cwrite("};\n\n");
+  } else {
+    cwrite("\n");
+  }
+
+  codegen_to_header(ctx);
+  cwrite("typedef %s_astnode_t* (*%s_parse_fn)(%s_parser_ctx*);\n\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  codegen_to_impl(ctx);
+
+  cwrite("// Records that the parser looked at the token at ctx->pos.\n");
+  cwrite("static inline void %s_parser_examine(%s_parser_ctx* ctx) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  if (ctx->pos >= ctx->hwm)\n");
+  cwrite("    ctx->hwm = ctx->pos + 1;\n");
+  cwrite("}\n\n");
+}
+
+static inline void peg_write_memo(codegen_ctx *ctx) {
+  if (!ctx->args->incremental)
+    return;
+
+  // A document holds its memo, so the header needs the layout.
+  codegen_to_header(ctx);
+  cwrite("// The result of a rule at a token, for incremental reparsing. len "
+         "is how\n");
+  cwrite("// many tokens it consumed, and examined is how many it looked at. "
+         "gen is the\n");
+  cwrite("// parse that the result is from, or 0 if the result is dead.\n");
+  cwrite("typedef struct {\n");
+  cwrite("  %s_astnode_t* node;\n", ctx->lower);
+  cwrite("  size_t len;\n");
+  cwrite("  size_t examined;\n");
+  cwrite("  uint32_t id;\n");
+  cwrite("  uint32_t rule;\n");
+  cwrite("  uint32_t gen;\n");
+  cwrite("} %s_memo_entry;\n", ctx->lower);
+  cwrite("\n");
+  cwrite("// Results are keyed by the id of the token they start at, which "
+         "stays with\n");
+  cwrite("// the token when an edit moves it, so results don't have to be "
+         "moved. There\n");
+  cwrite("// is a column for each token, and one for the end of the stream.\n");
+  cwrite("typedef struct {\n");
+  cwrite("  uint32_t id;\n");
+  cwrite("  // Results from parses before min_gen are dead.\n");
+  cwrite("  uint32_t min_gen;\n");
+  cwrite("  // The most tokens that any result here looked at.\n");
+  cwrite("  size_t ext;\n");
+  cwrite("} %s_memo_col;\n", ctx->lower);
+  cwrite("\n");
+  cwrite("// A result with a node stored during the current parse, and where "
+         "the\n");
+  cwrite("// allocator was when its rule was called.\n");
+  cwrite("typedef struct {\n");
+  cwrite("  uint32_t id;\n");
+  cwrite("  uint32_t rule;\n");
+  cwrite("  pgen_allocator_rewind_t before;\n");
+  cwrite("} %s_memo_undo;\n", ctx->lower);
+  cwrite("\n");
+  cwrite("struct %s_memo {\n", ctx->lower);
+  cwrite("  %s_memo_entry* slots;\n", ctx->lower);
+  cwrite("  size_t cap;\n");
+  cwrite("  size_t len;\n");
+  cwrite("  uint32_t gen;\n");
+  cwrite("  size_t hits;\n");
+  cwrite("  %s_memo_col* cols;\n", ctx->lower);
+  cwrite("  %s_memo_undo* log;\n", ctx->lower);
+  cwrite("  size_t log_len;\n");
+  cwrite("  size_t log_cap;\n");
+  cwrite("};\n\n");
+  codegen_to_impl(ctx);
+  cwrite("static inline size_t %s_memo_slot(%s_memo* memo, uint32_t rule, "
+         "uint32_t id) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  uint64_t h = pgen_hash_fmix(((uint64_t)rule << 32) | id);\n");
+  cwrite("  return (size_t)h & (memo->cap - 1);\n");
+  cwrite("}\n\n");
+  cwrite("// Returns the entry for the rule at the token, or the empty slot "
+         "where it\n");
+  cwrite("// would go.\n");
+  cwrite("static inline %s_memo_entry* %s_memo_find(%s_memo* memo, uint32_t "
+         "rule, uint32_t id) {\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  for (size_t i = %s_memo_slot(memo, rule, id);; i = (i + 1) & "
+         "(memo->cap - 1)) {\n",
+         ctx->lower);
+  cwrite("    %s_memo_entry* e = memo->slots + i;\n", ctx->lower);
+  cwrite("    if (!e->rule || (e->rule == rule && e->id == id))\n");
+  cwrite("      return e;\n");
+  cwrite("  }\n");
+  cwrite("}\n\n");
+  cwrite("static inline void %s_memo_put(%s_memo* memo, %s_memo_entry entry) "
+         "{\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  if ((memo->len + 1) * 2 > memo->cap) {\n");
+  cwrite("    %s_memo_entry* old = memo->slots;\n", ctx->lower);
+  cwrite("    size_t old_cap = memo->cap;\n");
+  cwrite("    memo->cap = old_cap ? old_cap * 2 : 1024;\n");
+  cwrite("    memo->len = 0;\n");
+  cwrite("    memo->slots = (%s_memo_entry*)calloc(memo->cap, "
+         "sizeof(%s_memo_entry));\n",
+         ctx->lower, ctx->lower);
+  if (!ctx->args->u)
+    cwrite("    if (!memo->slots) PGEN_OOM();\n");
+  cwrite("    for (size_t i = 0; i < old_cap; i++)\n");
+  cwrite("      if (old[i].rule && old[i].gen) %s_memo_put(memo, old[i]);\n",
+         ctx->lower);
+  cwrite("    free(old);\n");
+  cwrite("  }\n");
+  cwrite("  %s_memo_entry* e = %s_memo_find(memo, entry.rule, entry.id);\n",
+         ctx->lower, ctx->lower);
+  cwrite("  if (!e->rule) memo->len++;\n");
+  cwrite("  *e = entry;\n");
+  cwrite("}\n\n");
+  cwrite("static inline void %s_memo_init(%s_memo* memo) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  memo->slots = NULL;\n");
+  cwrite("  memo->cap = 0;\n");
+  cwrite("  memo->len = 0;\n");
+  cwrite("  memo->gen = 0;\n");
+  cwrite("  memo->hits = 0;\n");
+  cwrite("  memo->cols = NULL;\n");
+  cwrite("  memo->log = NULL;\n");
+  cwrite("  memo->log_len = 0;\n");
+  cwrite("  memo->log_cap = 0;\n");
+  cwrite("}\n\n");
+  cwrite("static inline void %s_memo_clear(%s_memo* memo) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  free(memo->slots);\n");
+  cwrite("  memo->slots = NULL;\n");
+  cwrite("  memo->cap = 0;\n");
+  cwrite("  memo->len = 0;\n");
+  cwrite("  memo->log_len = 0;\n");
+  cwrite("}\n\n");
+  cwrite("// Called when the parser rewinds. Results stored since then hold "
+         "nodes that\n");
+  cwrite("// were just freed, so they're marked dead.\n");
+  cwrite("static inline void %s_memo_rewind(%s_memo* memo, "
+         "pgen_allocator_rewind_t rew) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  while (memo->log_len) {\n");
+  cwrite("    %s_memo_undo u = memo->log[memo->log_len - 1];\n", ctx->lower);
+  cwrite("    if (u.before.arena_idx < rew.arena_idx ||\n");
+  cwrite("        (u.before.arena_idx == rew.arena_idx && u.before.filled < "
+         "rew.filled))\n");
+  cwrite("      break;\n");
+  cwrite("    memo->log_len--;\n");
+  cwrite("    %s_memo_entry* e = %s_memo_find(memo, u.rule, u.id);\n",
+         ctx->lower, ctx->lower);
+  cwrite("    if (e->rule && e->gen == memo->gen)\n");
+  cwrite("      e->gen = 0;\n");
+  cwrite("  }\n");
+  cwrite("}\n\n");
+  cwrite("// Calls a rule, or replays its result from an earlier parse. "
+         "Results from\n");
+  cwrite("// the current parse are only replayed when they hold no node, so "
+         "that no\n");
+  cwrite("// node is used twice.\n");
+  cwrite("static inline %s_astnode_t* %s_memo_call(%s_parser_ctx* ctx, "
+         "uint32_t rule, %s_parse_fn fn) {\n",
+         ctx->lower, ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  const uintptr_t succ = (uintptr_t)_Alignof(%s_astnode_t);\n",
+         ctx->lower);
+  cwrite("  %s_memo* memo = ctx->memo;\n", ctx->lower);
+  cwrite("  if (!memo)\n");
+  cwrite("    return fn(ctx);\n");
+  cwrite("  size_t pos = ctx->pos;\n");
+  cwrite("  %s_memo_col* col = memo->cols + pos;\n", ctx->lower);
+  cwrite("\n");
+  cwrite("  if (memo->cap) {\n");
+  cwrite("    %s_memo_entry* e = %s_memo_find(memo, rule, col->id);\n",
+         ctx->lower, ctx->lower);
+  cwrite("    if (e->rule && e->gen && e->gen >= col->min_gen &&\n");
+  cwrite("        (e->gen != memo->gen || (uintptr_t)e->node <= succ)) {\n");
+  cwrite("      memo->hits++;\n");
+  cwrite("      ctx->pos = pos + e->len;\n");
+  cwrite("      if (pos + e->examined > ctx->hwm)\n");
+  cwrite("        ctx->hwm = pos + e->examined;\n");
+  cwrite("      return e->node;\n");
+  cwrite("    }\n");
+  cwrite("  }\n\n");
+  cwrite("  size_t hwm = ctx->hwm, num_errors = ctx->num_errors;\n");
+  cwrite("  pgen_allocator_rewind_t before = ctx->alloc->rew;\n");
+  cwrite("  ctx->hwm = pos;\n");
+  cwrite("  %s_astnode_t* ret = fn(ctx);\n", ctx->lower);
+  cwrite("  %s_memo_entry entry = {ret, ctx->pos - pos, ctx->hwm - pos, "
+         "col->id, rule, memo->gen};\n",
+         ctx->lower);
+  cwrite("  if (hwm > ctx->hwm)\n");
+  cwrite("    ctx->hwm = hwm;\n\n");
+  cwrite("  // Results that reported errors can't be replayed.\n");
+  cwrite("  if (ctx->exit || ctx->num_errors != num_errors)\n");
+  cwrite("    return ret;\n");
+  cwrite("  if (entry.examined > col->ext)\n");
+  cwrite("    col->ext = entry.examined;\n");
+  cwrite("  %s_memo_put(memo, entry);\n", ctx->lower);
+  cwrite("  if ((uintptr_t)ret > succ) {\n");
+  cwrite("    if (memo->log_len == memo->log_cap) {\n");
+  cwrite("      memo->log_cap = memo->log_cap ? memo->log_cap * 2 : 256;\n");
+  cwrite("      memo->log = (%s_memo_undo*)realloc(memo->log, "
+         "sizeof(%s_memo_undo) * memo->log_cap);\n",
+         ctx->lower, ctx->lower);
+  if (!ctx->args->u)
+    cwrite("      if (!memo->log) PGEN_OOM();\n");
+  cwrite("    }\n");
+  cwrite("    %s_memo_undo u = {col->id, rule, before};\n", ctx->lower);
+  cwrite("    memo->log[memo->log_len++] = u;\n");
+  cwrite("  }\n");
+  cwrite("  return ret;\n");
+  cwrite("}\n");
+}
+
+static inline void peg_write_profile(codegen_ctx *ctx) {
+  if (!ctx->args->profile)
+    return;
+
+  cwrite("#include <time.h>\n\n");
+  cwrite("/*\n");
+  cwrite(" * Rule profiling. Every call to a rule is counted, along with "
+         "whether it\n");
+  cwrite(" * failed, how many tokens a failed call looked at before giving "
+         "up, and how\n");
+  cwrite(" * long it took. Times are in ticks of the CPU's timestamp counter "
+         "where there\n");
+  cwrite(" * is one, and in nanoseconds otherwise. A rule's time includes "
+         "the rules it\n");
+  cwrite(" * calls, so recursive rules count some time more than once, but "
+         "its self time\n");
+  cwrite(" * doesn't. The counters are global, so don't profile parsers on "
+         "two threads\n");
+  cwrite(" * at once.\n");
+  cwrite(" */\n");
+  cwrite("static inline uint64_t %s_profile_clock(void) {\n", ctx->lower);
+  cwrite("#if (defined(__GNUC__) || defined(__clang__)) && "
+         "(defined(__x86_64__) || defined(__i386__))\n");
+  cwrite("  return __builtin_ia32_rdtsc();\n");
+  cwrite("#else\n");
+  cwrite("  struct timespec ts;\n");
+  cwrite("  timespec_get(&ts, TIME_UTC);\n");
+  cwrite("  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;\n");
+  cwrite("#endif\n");
+  cwrite("}\n\n");
+  cwrite("typedef struct {\n");
+  cwrite("  uint64_t calls;\n");
+  cwrite("  uint64_t failures;\n");
+  cwrite("  uint64_t backtracked;\n");
+  cwrite("  uint64_t ticks;\n");
+  cwrite("  uint64_t self_ticks;\n");
+  cwrite("} %s_rule_profile;\n", ctx->lower);
+  cwrite("\n");
+  cwrite("static %s_rule_profile %s_profile[%s_NUM_RULES];\n",
+         ctx->lower, ctx->lower, ctx->upper);
+  cwrite("// The ticks spent in rules called by the one that's running.\n");
+  cwrite("static uint64_t %s_profile_nested;\n", ctx->lower);
+  cwrite("\n");
+  cwrite_api(ctx, "void %s_profile_reset(void)", ctx->lower);
+  cwrite("  memset(%s_profile, 0, sizeof(%s_profile));\n",
+         ctx->lower, ctx->lower);
+  cwrite("  %s_profile_nested = 0;\n", ctx->lower);
+  cwrite("}\n\n");
+  cwrite("// Calls a rule, and adds the call to its profile.\n");
+  cwrite("static inline %s_astnode_t* %s_profile_call(%s_parser_ctx* ctx, "
+         "%s_rule_id rule, %s_parse_fn fn) {\n",
+         ctx->lower, ctx->lower, ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  size_t pos = ctx->pos, hwm = ctx->hwm;\n");
+  cwrite("  uint64_t nested = %s_profile_nested;\n", ctx->lower);
+  cwrite("  %s_profile_nested = 0;\n", ctx->lower);
+  cwrite("  ctx->hwm = pos;\n");
+  cwrite("  uint64_t start = %s_profile_clock();\n", ctx->lower);
+  cwrite("  %s_astnode_t* ret = fn(ctx);\n", ctx->lower);
+  cwrite("  uint64_t spent = %s_profile_clock() - start;\n", ctx->lower);
+  cwrite("\n");
+  cwrite("  %s_rule_profile* p = %s_profile + rule;\n", ctx->lower, ctx->lower);
+  cwrite("  p->calls++;\n");
+  cwrite("  if (!ret) {\n");
+  cwrite("    p->failures++;\n");
+  cwrite("    p->backtracked += ctx->hwm - pos;\n");
+  cwrite("  }\n");
+  cwrite("  p->ticks += spent;\n");
+  cwrite("  p->self_ticks += spent - %s_profile_nested;\n", ctx->lower);
+  cwrite("  %s_profile_nested = nested + spent;\n", ctx->lower);
+  cwrite("  if (hwm > ctx->hwm)\n");
+  cwrite("    ctx->hwm = hwm;\n");
+  cwrite("  return ret;\n");
+  cwrite("}\n\n");
+  cwrite("static inline int %s_profile_cmp(const void* a, const void* b) {\n",
+         ctx->lower);
+  cwrite("  uint64_t ta = %s_profile[*(const size_t*)a].self_ticks;\n",
+         ctx->lower);
+  cwrite("  uint64_t tb = %s_profile[*(const size_t*)b].self_ticks;\n",
+         ctx->lower);
+  cwrite("  return (ta < tb) - (ta > tb);\n");
+  cwrite("}\n\n");
+  cwrite("// Writes a table of the rules that were called, the most "
+         "expensive first.\n");
+  cwrite_api(ctx, "void %s_profile_dump(FILE* f)", ctx->lower);
+  cwrite("  size_t order[%s_NUM_RULES], n = 0;\n", ctx->upper);
+  cwrite("  uint64_t total = 0;\n");
+  cwrite("  for (size_t i = 1; i < %s_NUM_RULES; i++) {\n", ctx->upper);
+  cwrite("    if (!%s_profile[i].calls) continue;\n", ctx->lower);
+  cwrite("    order[n++] = i;\n");
+  cwrite("    total += %s_profile[i].self_ticks;\n", ctx->lower);
+  cwrite("  }\n");
+  cwrite("  qsort(order, n, sizeof(size_t), %s_profile_cmp);\n", ctx->lower);
+  cwrite("  fprintf(f, \"%%-24s %%12s %%12s %%12s %%14s %%14s %%6s\\n\", "
+         "\"rule\", \"calls\",\n");
+  cwrite("          \"failures\", \"backtracked\", \"ticks\", \"self "
+         "ticks\", \"self%%\");\n");
+  cwrite("  for (size_t i = 0; i < n; i++) {\n");
+  cwrite("    %s_rule_profile* p = %s_profile + order[i];\n",
+         ctx->lower, ctx->lower);
+  cwrite("    fprintf(f, \"%%-24s %%12llu %%12llu %%12llu %%14llu %%14llu "
+         "%%5.1f%%%%\\n\",\n");
+  cwrite("            %s_rule_name[order[i]], (unsigned long long)p->calls,\n",
+         ctx->lower);
+  cwrite("            (unsigned long long)p->failures, (unsigned long "
+         "long)p->backtracked,\n");
+  cwrite("            (unsigned long long)p->ticks, (unsigned long "
+         "long)p->self_ticks,\n");
+  cwrite("            total ? 100.0 * (double)p->self_ticks / (double)total "
+         ": 0.0);\n");
+  cwrite("  }\n");
+  cwrite("}\n");
+}
+
 static inline void peg_write_definition_stub(codegen_ctx *ctx, ASTNode *def) {
   char *def_name = (char *)def->children[0]->extra;
-  cwrite("static inline %s_astnode_t* %s_parse_%s(%s_parser_ctx* ctx);\n",
-         ctx->lower, ctx->lower, def_name, ctx->lower);
+  // With --emit=split, rules are the header's entry points.
+  codegen_to_header(ctx);
+  cwrite("%s%s_astnode_t* %s_parse_%s(%s_parser_ctx* ctx);\n",
+         ctx->args->split ? "" : "static inline ", ctx->lower, ctx->lower,
+         def_name, ctx->lower);
+  codegen_to_impl(ctx);
 }
 
 static inline void peg_visit_add_labels(codegen_ctx *ctx, ASTNode *expr,
                                         list_cstr *idlist) {
-  if (expr->num_children >= 2 && !strcmp(expr->name, "ModExpr") &&
-      !strcmp(expr->children[1]->name, "LowerIdent")) {
+  if (expr->num_children >= 2 && expr->kind == AST_ModExpr &&
+      expr->children[1]->kind == AST_LowerIdent) {
     ASTNode *label_ident = expr->children[1];
 
     char *idname = (char *)label_ident->extra;
@@ -1447,9 +3940,11 @@ static inline void peg_visit_add_labels(codegen_ctx *ctx, ASTNode *expr,
 }
 
 static inline void indent(codegen_ctx *ctx) {
-  for (size_t i = 0; i < ctx->indent_cnt; i++) {
-    cwrite("  ");
-  }
+  static const char spaces[] = "                                ";
+  size_t n = ctx->indent_cnt * 2;
+  for (; n > sizeof(spaces) - 1; n -= sizeof(spaces) - 1)
+    cwrite_raw(ctx, spaces, sizeof(spaces) - 1);
+  cwrite_raw(ctx, spaces, n);
 }
 static inline void start_block(codegen_ctx *ctx) {
   indent(ctx);
@@ -1490,7 +3985,7 @@ static inline void start_embed(codegen_ctx *ctx, size_t line) {
   iwrite("#line %zu \"%s\"\n", line, ctx->args->grammarTarget);
 }
 static inline void end_embed(codegen_ctx *ctx) {
-  iwrite("#line %zu \"%s\"\n\n", ctx->line_nbr + 1, ctx->args->outputTarget);
+  iwrite("#line %zu \"%s\"\n\n", ctx->line_nbr + 1, codegen_target(ctx));
 }
 static inline void peg_write_interactive_macro(codegen_ctx *ctx) {
   cwrite("#ifndef PGEN_INTERACTIVE\n");
@@ -1506,7 +4001,7 @@ static inline void peg_write_interactive_stack(codegen_ctx *ctx) {
     size_t max_len = strlen("STREAMBEGIN");
     for (size_t n = 0; n < ctx->definitions.len; n++) {
       ASTNode *def = ctx->definitions.buf[n];
-      if (strcmp(def->name, "Definition"))
+      if (def->kind != AST_Definition)
         continue;
       ASTNode *li = def->children[0];
       char *rulename = (char *)li->extra;
@@ -1716,10 +4211,16 @@ static inline void peg_write_interactive_stack(codegen_ctx *ctx) {
   }
 }
 
+// Takes a step at rule entry or a loop's back edge.
+static inline void peg_write_step(codegen_ctx *ctx) {
+  iwrite("if (!--ctx->fuel && %s_parser_refuel(ctx)) return NULL;\n",
+         ctx->lower);
+}
+
 static inline void peg_visit_write_exprs(codegen_ctx *ctx, ASTNode *expr,
                                          size_t ret_to, int capture) {
 
-  if (!strcmp(expr->name, "SlashExpr")) {
+  if (expr->kind == AST_SlashExpr) {
     if (expr->num_children == 1) {
       // Forward capture
       peg_visit_write_exprs(ctx, expr->children[0], ret_to, capture);
@@ -1737,7 +4238,7 @@ static inline void peg_visit_write_exprs(codegen_ctx *ctx, ASTNode *expr,
     comment("SlashExpr end");
     iwrite("expr_ret_%zu = expr_ret_%zu;\n\n", ret_to, ret);
 
-  } else if (!strcmp(expr->name, "ModExprList")) {
+  } else if (expr->kind == AST_ModExprList) {
     size_t ret = ctx->expr_cnt++;
     iwrite("%s_astnode_t* expr_ret_%zu = NULL;\n", ctx->lower, ret);
     iwrite("rec(mod_%zu);\n", ret);
@@ -1761,10 +4262,10 @@ static inline void peg_visit_write_exprs(codegen_ctx *ctx, ASTNode *expr,
     iwrite("if (!expr_ret_%zu) rew(mod_%zu);\n", ret, ret);
     iwrite("expr_ret_%zu = expr_ret_%zu;\n", ret_to, ret);
 
-  } else if (!strcmp(expr->name, "ModExpr")) {
+  } else if (expr->kind == AST_ModExpr) {
     ModExprOpts opts = *(ModExprOpts *)expr->extra;
     int has_label = expr->num_children >= 2 &&
-                    !strcmp(expr->children[1]->name, "LowerIdent");
+                    expr->children[1]->kind == AST_LowerIdent;
     int has_errhandler = (expr->num_children - (size_t)has_label) == 2;
     ASTNode *errhandler =
         has_errhandler ? expr->children[has_label ? 2 : 1] : NULL;
@@ -1790,6 +4291,7 @@ static inline void peg_visit_write_exprs(codegen_ctx *ctx, ASTNode *expr,
       iwrite("int plus_times_%zu = 0;\n", ret);
       iwrite("while (1) ");
       start_block(ctx);
+      peg_write_step(ctx);
       if (!stateless)
         iwrite("rec(plus_rew_%zu);\n", ret);
       peg_visit_write_exprs(ctx, expr->children[0], ret, 0);
@@ -1809,6 +4311,7 @@ static inline void peg_visit_write_exprs(codegen_ctx *ctx, ASTNode *expr,
       iwrite("%s_astnode_t* expr_ret_%zu = SUCC;\n", ctx->lower, sentinel);
       iwrite("while (expr_ret_%zu)\n", sentinel);
       start_block(ctx);
+      peg_write_step(ctx);
       if (!stateless)
         iwrite("rec(kleene_rew_%zu);\n", ret);
       peg_visit_write_exprs(ctx, expr->children[0], sentinel, 0);
@@ -1844,7 +4347,7 @@ static inline void peg_visit_write_exprs(codegen_ctx *ctx, ASTNode *expr,
 
     // Handle errors
     if (errhandler) {
-      if (!strcmp(errhandler->name, "ErrString")) {
+      if (errhandler->kind == AST_ErrString) {
         codepoint_t *cps = (codepoint_t *)errhandler->extra;
         String_View sv =
             UTF8_encode_view((Codepoint_String_View){cps, cpstrlen(cps)});
@@ -1859,6 +4362,7 @@ static inline void peg_visit_write_exprs(codegen_ctx *ctx, ASTNode *expr,
         size_t err_val = ctx->expr_cnt++;
         iwrite("%s_astnode_t* expr_ret_%zu = NULL;\n", ctx->lower, err_val);
         peg_visit_write_exprs(ctx, errhandler, err_val, 0);
+        iwrite("ctx->depth--;\n");
         iwrite("return expr_ret_%zu==SUCC ? NULL : expr_ret_%zu;\n", err_val,
                err_val);
 
@@ -1873,13 +4377,15 @@ static inline void peg_visit_write_exprs(codegen_ctx *ctx, ASTNode *expr,
       iwrite("%s = expr_ret_%zu;\n", label_name, ret);
     }
 
-  } else if (!strcmp(expr->name, "BaseExpr")) {
+  } else if (expr->kind == AST_BaseExpr) {
     peg_visit_write_exprs(ctx, expr->children[0], ret_to, capture);
 
-  } else if (!strcmp(expr->name, "UpperIdent")) {
+  } else if (expr->kind == AST_UpperIdent) {
     char *tokname = (char *)expr->extra;
     if (ctx->args->i)
       iwrite("intr_enter(ctx, \"%s\", ctx->pos);\n", tokname);
+    if (peg_tracks_examined(ctx))
+      iwrite("%s_parser_examine(ctx);\n", ctx->lower);
     iwrite(
         "if (ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == %s_TOK_%s) ",
         ctx->upper, tokname);
@@ -1888,9 +4394,15 @@ static inline void peg_visit_write_exprs(codegen_ctx *ctx, ASTNode *expr,
       if (!ctx->args->u)
         comment("Capturing %s.", tokname);
       iwrite("expr_ret_%zu = leaf(%s);\n", ret_to, tokname);
-      iwrite("expr_ret_%zu->tok_repr = ctx->tokens[ctx->pos].content;\n",
-             ret_to);
-      iwrite("expr_ret_%zu->repr_len = ctx->tokens[ctx->pos].len;\n", ret_to);
+      if (ctx->args->compact) {
+        iwrite("expr_ret_%zu->tok_start = (uint32_t)ctx->pos;\n", ret_to);
+        iwrite("expr_ret_%zu->tok_len = 1;\n", ret_to);
+      } else {
+        iwrite("expr_ret_%zu->tok_repr = ctx->tokens[ctx->pos].content;\n",
+               ret_to);
+        iwrite("expr_ret_%zu->repr_len = ctx->tokens[ctx->pos].len;\n",
+               ret_to);
+      }
       if (!ctx->args->u)
         peg_ensure_kind(ctx, tokname);
     } else {
@@ -1909,11 +4421,11 @@ static inline void peg_visit_write_exprs(codegen_ctx *ctx, ASTNode *expr,
           "if (expr_ret_%zu) intr_accept(ctx, \"%s\"); else intr_reject(ctx, "
           "\"%s\");\n",
           ret_to, tokname, tokname);
-  } else if (!strcmp(expr->name, "LowerIdent")) {
+  } else if (expr->kind == AST_LowerIdent) {
     iwrite("expr_ret_%zu = %s_parse_%s(ctx);\n", ret_to, ctx->lower,
            (char *)expr->extra);
     iwrite("if (ctx->exit) return NULL;\n");
-  } else if (!strcmp(expr->name, "CodeExpr")) {
+  } else if (expr->kind == AST_CodeExpr) {
     // No need to respect capturing for a CodeExpr.
     // The user will allocate their own with node() or list() if they want to.
     // At the start of the block we'll write SUCC to ret_to. If that's not okay,
@@ -1939,13 +4451,10 @@ static inline void peg_visit_write_exprs(codegen_ctx *ctx, ASTNode *expr,
   }
 }
 
-static inline void peg_write_definition(codegen_ctx *ctx, ASTNode *def) {
+static inline void peg_write_c_body(codegen_ctx *ctx, ASTNode *def) {
   char *def_name = (char *)def->children[0]->extra;
   ASTNode *def_expr = def->children[1];
 
-  cwrite("static inline %s_astnode_t* %s_parse_%s(%s_parser_ctx* ctx) {\n",
-         ctx->lower, ctx->lower, def_name, ctx->lower);
-
   // Visit labels, write variables.
   if (def->num_children == 3) {
     ASTNode *sdefs = def->children[2];
@@ -1965,6 +4474,13 @@ static inline void peg_write_definition(codegen_ctx *ctx, ASTNode *def) {
   cwrite("  #define rule expr_ret_%zu\n", ult_ret);
   cwrite("  %s_astnode_t* expr_ret_%zu = NULL;\n", ctx->lower, ult_ret);
   cwrite("  %s_astnode_t* expr_ret_%zu = NULL;\n", ctx->lower, ret);
+  // Returns that come from ctx->exit don't restore the depth, since the parse
+  // is over.
+  iwrite("if (++ctx->depth > ctx->max_depth) {\n");
+  iwrite("  %s_parser_too_deep(ctx);\n", ctx->lower);
+  iwrite("  return NULL;\n");
+  iwrite("}\n");
+  peg_write_step(ctx);
   if (ctx->args->i)
     iwrite("intr_enter(ctx, \"%s\", ctx->pos);\n", def_name);
 
@@ -1982,11 +4498,53 @@ static inline void peg_write_definition(codegen_ctx *ctx, ASTNode *def) {
            "SUCC.\\n\"), exit(1);\n",
            def_name);
   }
+  cwrite("  ctx->depth--;\n");
   cwrite("  return rule;\n");
   cwrite("  #undef rule\n");
   cwrite("}\n\n");
 }
 
+#ifndef PGEN_VMGEN_INCLUDE
+#include "vmgen.h"
+#endif
+
+static inline void peg_write_definition(codegen_ctx *ctx, ASTNode *def) {
+  char *def_name = (char *)def->children[0]->extra;
+
+  // With --incremental, the rule is wrapped so that its results can be
+  // reused across parses. With --profile-rules, it's wrapped to count calls.
+  // The outermost of them has the rule's name, and is what the stub declared.
+  int wrapped = ctx->args->incremental | ctx->args->profile;
+  const char *api = ctx->args->split ? "" : "static inline ";
+  cwrite("%s%s_astnode_t* %s_parse_%s%s(%s_parser_ctx* ctx) {\n",
+         wrapped ? "static inline " : api, ctx->lower, ctx->lower, def_name,
+         wrapped ? "_impl" : "", ctx->lower);
+
+  if (ctx->args->vm) {
+    peg_write_vm_body(ctx, def);
+  } else {
+    peg_write_c_body(ctx, def);
+  }
+
+  if (ctx->args->profile) {
+    cwrite("%s%s_astnode_t* %s_parse_%s%s(%s_parser_ctx* ctx) {\n",
+           ctx->args->incremental ? "static inline " : api, ctx->lower,
+           ctx->lower, def_name, ctx->args->incremental ? "_profiled" : "",
+           ctx->lower);
+    cwrite("  return %s_profile_call(ctx, %s_RULE_%s, %s_parse_%s_impl);\n",
+           ctx->lower, ctx->upper, def_name, ctx->lower, def_name);
+    cwrite("}\n\n");
+  }
+  if (ctx->args->incremental) {
+    cwrite("%s%s_astnode_t* %s_parse_%s(%s_parser_ctx* ctx) {\n", api,
+           ctx->lower, ctx->lower, def_name, ctx->lower);
+    cwrite("  return %s_memo_call(ctx, %s_RULE_%s, %s_parse_%s%s);\n",
+           ctx->lower, ctx->upper, def_name, ctx->lower, def_name,
+           ctx->args->profile ? "_profiled" : "_impl");
+    cwrite("}\n\n");
+  }
+}
+
 static inline void peg_write_parser_body(codegen_ctx *ctx) {
   // Write stubs
 
@@ -1995,18 +4553,36 @@ static inline void peg_write_parser_body(codegen_ctx *ctx) {
     peg_write_definition_stub(ctx, def);
   }
   cwrite("\n\n");
+  if (ctx->args->vm)
+    peg_write_vm_header(ctx);
 
   // Write bodies
   for (size_t n = 0; n < ctx->definitions.len; n++) {
     peg_write_definition(ctx, ctx->definitions.buf[n]);
   }
   cwrite("\n\n");
+
+  // The bytecode is complete once every rule has been compiled.
+  if (ctx->args->vm)
+    peg_write_vm_program(ctx);
 }
 
 static inline void peg_write_include_header(codegen_ctx *ctx) {
   cwrite("#ifndef PGEN_%s_PARSER_H\n", ctx->upper);
   cwrite("#define PGEN_%s_PARSER_H\n\n", ctx->upper);
+  cwrite("// Changes whenever the grammar file changes.\n");
+  cwrite("#define %s_GRAMMAR_FINGERPRINT UINT64_C(0x%016" PRIx64 ")\n\n",
+         ctx->upper, ctx->fingerprint);
+}
+// With --emit=split, the implementation starts by including its header.
+static inline void peg_write_include_impl(codegen_ctx *ctx) {
+  if (!ctx->args->split)
+    return;
+  char *base = strrchr(ctx->args->outputTarget, '/');
+  base = base ? base + 1 : ctx->args->outputTarget;
+  cwrite("#include \"%s\"\n\n", base);
 }
+
 static inline void peg_write_include_footer(codegen_ctx *ctx) {
   cwrite("#endif /* PGEN_%s_PARSER_H */\n", ctx->upper);
 }
@@ -2024,6 +4600,8 @@ static inline void peg_write_undef_parsermacros(codegen_ctx *ctx) {
   cwrite("#undef repr\n");
   cwrite("#undef srepr\n");
   cwrite("#undef cprepr\n");
+  if (ctx->args->compact)
+    cwrite("#undef tokrepr\n");
   cwrite("#undef rret\n");
   cwrite("#undef SUCC\n\n");
 
@@ -2049,14 +4627,403 @@ static inline void peg_write_undef_parsermacros(codegen_ctx *ctx) {
   cwrite("#undef FATAL_F\n");
 }
 
+static inline int peg_token_is_ignored(codegen_ctx *ctx, char *tokname) {
+  return symtab_is_ignored(ctx->directives, tokname);
+}
+
+static inline void peg_write_document(codegen_ctx *ctx) {
+  if (!ctx->args->incremental)
+    return;
+
+  cwrite("static inline int %s_token_ignored(%s_token_kind kind) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  switch (kind) {\n");
+  int any_ignored = 0;
+  for (size_t i = 0; i < ctx->tok_kind_names.len; i++) {
+    if (!peg_token_is_ignored(ctx, ctx->tok_kind_names.buf[i]))
+      continue;
+    any_ignored = 1;
+    cwrite("  case %s_TOK_%s:\n", ctx->upper, ctx->tok_kind_names.buf[i]);
+  }
+  if (any_ignored)
+    cwrite("    return 1;\n");
+  cwrite("  default:\n");
+  cwrite("    return 0;\n");
+  cwrite("  }\n");
+  cwrite("}\n\n");
+
+  codegen_to_header(ctx);
+  cwrite("/*\n");
+  cwrite(" * Incremental reparsing. A document holds the tokens, the AST, "
+         "and the rule\n");
+  cwrite(" * results from the last parse. After an edit, only the tokens "
+         "near the edit\n");
+  cwrite(" * are relexed, and rule results that didn't look at the changed "
+         "tokens are\n");
+  cwrite(" * reused, along with their nodes.\n");
+  cwrite(" *\n");
+  cwrite(" * Token contents are copied into the document's allocator, so "
+         "nodes never\n");
+  cwrite(" * point into the text, and the text may be freed as soon as a "
+         "call returns.\n");
+  cwrite(" *\n");
+  cwrite(" * Code expressions must be pure for this to be correct. They "
+         "shouldn't\n");
+  cwrite(" * keep state in the parser ctx, modify nodes returned by other "
+         "rules, or\n");
+  cwrite(" * read tokens except through expect().\n");
+  cwrite(" */\n\n");
+  cwrite("// The text in [start, old_end) was replaced by [start, new_end).\n");
+  cwrite("// Positions are in codepoints.\n");
+  cwrite("typedef struct {\n");
+  cwrite("  size_t start;\n");
+  cwrite("  size_t old_end;\n");
+  cwrite("  size_t new_end;\n");
+  cwrite("} %s_edit;\n", ctx->lower);
+  cwrite("\n");
+  cwrite("typedef struct {\n");
+  cwrite("  // Every token, including %%ignore tokens, where it starts in "
+         "the text, and\n");
+  cwrite("  // one past the last codepoint the tokenizer looked at to find "
+         "it.\n");
+  cwrite("  %s_token* lexed;\n", ctx->lower);
+  cwrite("  size_t* offs;\n");
+  cwrite("  size_t* reach;\n");
+  cwrite("  size_t num_lexed;\n");
+  cwrite("  size_t cap_lexed;\n");
+  cwrite("  // Where tokenizing stopped, and the line and column there.\n");
+  cwrite("  size_t lex_end;\n");
+  cwrite("  size_t end_line;\n");
+  cwrite("  size_t end_col;\n");
+  cwrite("  // The tokens passed to the parser, followed by a STREAMEND "
+         "token, and\n");
+  cwrite("  // their memo columns.\n");
+  cwrite("  %s_token* tokens;\n", ctx->lower);
+  cwrite("  %s_memo_col* cols;\n", ctx->lower);
+  cwrite("  size_t num_tokens;\n");
+  cwrite("  size_t cap_tokens;\n");
+  cwrite("  uint32_t next_id;\n");
+  cwrite("  pgen_allocator alloc;\n");
+  cwrite("  uint32_t full_arenas;\n");
+  cwrite("  size_t full_memo;\n");
+  cwrite("  %s_memo memo;\n", ctx->lower);
+  cwrite("  %s_parser_ctx parser;\n", ctx->lower);
+  cwrite("  %s_astnode_t* ast;\n", ctx->lower);
+  cwrite("} %s_document;\n", ctx->lower);
+  cwrite("\n");
+  codegen_to_impl(ctx);
+  cwrite("static inline void %s_document_reserve(%s_document* doc, size_t "
+         "num_lexed, size_t num_tokens) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  if (doc->cap_lexed < num_lexed) {\n");
+  cwrite("    doc->cap_lexed = doc->cap_lexed * 2 > num_lexed ? "
+         "doc->cap_lexed * 2 : num_lexed;\n");
+  cwrite("    doc->lexed = (%s_token*)realloc(doc->lexed, sizeof(%s_token) * "
+         "doc->cap_lexed);\n",
+         ctx->lower, ctx->lower);
+  cwrite("    doc->offs = (size_t*)realloc(doc->offs, sizeof(size_t) * "
+         "doc->cap_lexed);\n");
+  cwrite("    doc->reach = (size_t*)realloc(doc->reach, sizeof(size_t) * "
+         "doc->cap_lexed);\n");
+  if (!ctx->args->u)
+    cwrite("    if (!doc->lexed | !doc->offs | !doc->reach) PGEN_OOM();\n");
+  cwrite("  }\n");
+  cwrite("  if (doc->cap_tokens < num_tokens) {\n");
+  cwrite("    doc->cap_tokens = doc->cap_tokens * 2 > num_tokens ? "
+         "doc->cap_tokens * 2 : num_tokens;\n");
+  cwrite("    doc->tokens = (%s_token*)realloc(doc->tokens, sizeof(%s_token) "
+         "* (doc->cap_tokens + 1));\n",
+         ctx->lower, ctx->lower);
+  cwrite("    doc->cols = (%s_memo_col*)realloc(doc->cols, "
+         "sizeof(%s_memo_col) * (doc->cap_tokens + 1));\n",
+         ctx->lower, ctx->lower);
+  if (!ctx->args->u)
+    cwrite("    if (!doc->tokens | !doc->cols) PGEN_OOM();\n");
+  cwrite("  }\n");
+  cwrite("}\n\n");
+  cwrite_api(ctx, "void %s_document_init(%s_document* doc)", ctx->lower,
+             ctx->lower);
+  cwrite("  doc->lexed = NULL;\n");
+  cwrite("  doc->offs = NULL;\n");
+  cwrite("  doc->reach = NULL;\n");
+  cwrite("  doc->num_lexed = 0;\n");
+  cwrite("  doc->cap_lexed = 0;\n");
+  cwrite("  doc->lex_end = 0;\n");
+  cwrite("  doc->end_line = 1;\n");
+  cwrite("  doc->end_col = 0;\n");
+  cwrite("  doc->tokens = NULL;\n");
+  cwrite("  doc->cols = NULL;\n");
+  cwrite("  doc->num_tokens = 0;\n");
+  cwrite("  doc->cap_tokens = 0;\n");
+  cwrite("  %s_document_reserve(doc, 64, 64);\n", ctx->lower);
+  cwrite("  %s_memo_col end = {0, 0, 0};\n", ctx->lower);
+  cwrite("  doc->cols[0] = end;\n");
+  cwrite("  doc->next_id = 1;\n");
+  cwrite("  doc->alloc = pgen_allocator_new();\n");
+  cwrite("  doc->full_arenas = 0;\n");
+  cwrite("  doc->full_memo = 0;\n");
+  cwrite("  %s_memo_init(&doc->memo);\n", ctx->lower);
+  cwrite("  doc->ast = NULL;\n");
+  cwrite("}\n\n");
+  cwrite_api(ctx, "void %s_document_destroy(%s_document* doc)", ctx->lower,
+             ctx->lower);
+  cwrite("  %s_memo_clear(&doc->memo);\n", ctx->lower);
+  cwrite("  free(doc->memo.log);\n");
+  cwrite("  pgen_allocator_destroy(&doc->alloc);\n");
+  cwrite("  free(doc->lexed);\n");
+  cwrite("  free(doc->offs);\n");
+  cwrite("  free(doc->reach);\n");
+  cwrite("  free(doc->tokens);\n");
+  cwrite("  free(doc->cols);\n");
+  cwrite("}\n\n");
+  cwrite("static inline codepoint_t* %s_document_copy(%s_document* doc, "
+         "codepoint_t* cps, size_t len) {\n",
+         ctx->lower, ctx->lower);
+  cwrite("  codepoint_t* copy = (codepoint_t*)pgen_alloc(&doc->alloc, "
+         "sizeof(codepoint_t) * len, _Alignof(codepoint_t));\n");
+  cwrite("  memcpy(copy, cps, sizeof(codepoint_t) * len);\n");
+  cwrite("  return copy;\n");
+  cwrite("}\n\n");
+  cwrite("static inline %s_astnode_t* %s_document_run(%s_document* doc, "
+         "codepoint_t* cps, %s_parse_fn entry) {\n",
+         ctx->lower, ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  // Nodes and results that aren't reused are left behind. When "
+         "there are\n");
+  cwrite("  // too many of them, start over with a fresh allocator and a "
+         "full parse.\n");
+  cwrite("  pgen_allocator old_alloc = doc->alloc;\n");
+  cwrite("  int fresh = doc->alloc.rew.arena_idx > doc->full_arenas * 2 + 1 "
+         "||\n");
+  cwrite("              doc->memo.len > doc->full_memo * 2 + 1024;\n");
+  cwrite("  if (fresh) {\n");
+  cwrite("    doc->alloc = pgen_allocator_new();\n");
+  cwrite("    %s_memo_clear(&doc->memo);\n", ctx->lower);
+  cwrite("    doc->next_id = 1;\n");
+  cwrite("    doc->num_tokens = 0;\n");
+  cwrite("    for (size_t i = 0; i < doc->num_lexed; i++) {\n");
+  cwrite("      doc->lexed[i].content = %s_document_copy(doc, cps + "
+         "doc->offs[i], doc->lexed[i].len);\n",
+         ctx->lower);
+  cwrite("      if (%s_token_ignored(doc->lexed[i].kind))\n", ctx->lower);
+  cwrite("        continue;\n");
+  cwrite("      %s_memo_col col = {doc->next_id++, 0, 0};\n", ctx->lower);
+  cwrite("      doc->cols[doc->num_tokens] = col;\n");
+  cwrite("      doc->tokens[doc->num_tokens++] = doc->lexed[i];\n");
+  cwrite("    }\n");
+  cwrite("    %s_memo_col end_col = {0, 0, 0};\n", ctx->lower);
+  cwrite("    doc->cols[doc->num_tokens] = end_col;\n");
+  cwrite("  }\n\n");
+  cwrite("  // Errors at the end of the stream are reported at the STREAMEND "
+         "token.\n");
+  cwrite("  %s_token* end = doc->tokens + doc->num_tokens;\n", ctx->lower);
+  cwrite("  memset(end, 0, sizeof(%s_token));\n", ctx->lower);
+  cwrite("  end->kind = %s_TOK_STREAMEND;\n", ctx->upper);
+  cwrite("  end->line = doc->end_line;\n");
+  cwrite("  end->col = doc->end_col;\n\n");
+  cwrite("  %s_parser_ctx_init(&doc->parser, &doc->alloc, doc->tokens, "
+         "doc->num_tokens);\n",
+         ctx->lower);
+  cwrite("  doc->parser.memo = &doc->memo;\n");
+  cwrite("  doc->memo.cols = doc->cols;\n");
+  cwrite("  doc->memo.gen++;\n");
+  cwrite("  doc->memo.hits = 0;\n");
+  cwrite("  doc->memo.log_len = 0;\n");
+  cwrite("  doc->ast = entry(&doc->parser);\n\n");
+  cwrite("  if (fresh) {\n");
+  cwrite("    pgen_allocator_destroy(&old_alloc);\n");
+  cwrite("    doc->full_arenas = doc->alloc.rew.arena_idx;\n");
+  cwrite("    doc->full_memo = doc->memo.len;\n");
+  cwrite("  }\n");
+  cwrite("  return doc->ast;\n");
+  cwrite("}\n\n");
+  cwrite("// Reparses the document after an edit. cps is the whole new text. "
+         "Returns\n");
+  cwrite("// the new AST, which reuses nodes from the old one. The old AST "
+         "must not be\n");
+  cwrite("// used afterward.\n");
+  cwrite_api(ctx,
+             "%s_astnode_t* %s_reparse(%s_document* doc, codepoint_t* cps, "
+             "size_t len, %s_edit edit, %s_parse_fn entry)",
+             ctx->lower, ctx->lower, ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  size_t n = doc->num_lexed;\n");
+  cwrite("  size_t shift_from = edit.old_end, shift_to = edit.new_end;\n\n");
+  cwrite("  // Tokens that never looked at the edited text are kept as they "
+         "are.\n");
+  cwrite("  size_t i0 = 0, d0 = 0;\n");
+  cwrite("  while (i0 < n && doc->reach[i0] <= edit.start)\n");
+  cwrite("    if (!%s_token_ignored(doc->lexed[i0++].kind))\n", ctx->lower);
+  cwrite("      d0++;\n\n");
+  cwrite("  // Relex from there until a token boundary past the edit lines "
+         "up with one\n");
+  cwrite("  // in the old stream. The tokenizer keeps no state between "
+         "tokens, so the\n");
+  cwrite("  // old tokens from that point on are still right.\n");
+  cwrite("  %s_tokenizer tokenizer;\n", ctx->lower);
+  cwrite("  %s_tokenizer_init(&tokenizer, cps, len);\n", ctx->lower);
+  cwrite("  if (i0 < n) {\n");
+  cwrite("    tokenizer.pos = doc->offs[i0];\n");
+  cwrite("    tokenizer.pos_line = doc->lexed[i0].line;\n");
+  cwrite("    tokenizer.pos_col = doc->lexed[i0].col;\n");
+  cwrite("  } else {\n");
+  cwrite("    tokenizer.pos = doc->lex_end;\n");
+  cwrite("    tokenizer.pos_line = doc->end_line;\n");
+  cwrite("    tokenizer.pos_col = doc->end_col;\n");
+  cwrite("  }\n");
+  cwrite("  size_t wcap = 64, wn = 0, j = i0;\n");
+  cwrite("  %s_token* wlexed = (%s_token*)malloc(sizeof(%s_token) * wcap);\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  size_t* woffs = (size_t*)malloc(sizeof(size_t) * wcap);\n");
+  cwrite("  size_t* wreach = (size_t*)malloc(sizeof(size_t) * wcap);\n");
+  if (!ctx->args->u)
+    cwrite("  if (!wlexed | !woffs | !wreach) PGEN_OOM();\n");
+  cwrite("  int synced = 0;\n");
+  cwrite("  while (1) {\n");
+  cwrite("    if (tokenizer.pos >= edit.new_end) {\n");
+  cwrite("      size_t old_pos = tokenizer.pos - shift_to + shift_from;\n");
+  cwrite("      while (j < n && doc->offs[j] < old_pos)\n");
+  cwrite("        j++;\n");
+  cwrite("      if (j < n ? doc->offs[j] == old_pos : old_pos == "
+         "doc->lex_end) {\n");
+  cwrite("        synced = 1;\n");
+  cwrite("        break;\n");
+  cwrite("      }\n");
+  cwrite("    }\n");
+  cwrite("    size_t off = tokenizer.pos;\n");
+  cwrite("    %s_token tok = %s_nextToken(&tokenizer);\n",
+         ctx->lower, ctx->lower);
+  cwrite("    if (!tok.len)\n");
+  cwrite("      break;\n");
+  cwrite("    if (wn == wcap) {\n");
+  cwrite("      wcap *= 2;\n");
+  cwrite("      wlexed = (%s_token*)realloc(wlexed, sizeof(%s_token) * "
+         "wcap);\n",
+         ctx->lower, ctx->lower);
+  cwrite("      woffs = (size_t*)realloc(woffs, sizeof(size_t) * wcap);\n");
+  cwrite("      wreach = (size_t*)realloc(wreach, sizeof(size_t) * wcap);\n");
+  if (!ctx->args->u)
+    cwrite("      if (!wlexed | !woffs | !wreach) PGEN_OOM();\n");
+  cwrite("    }\n");
+  cwrite("    tok.content = %s_document_copy(doc, tok.content, tok.len);\n",
+         ctx->lower);
+  cwrite("    wlexed[wn] = tok;\n");
+  cwrite("    woffs[wn] = off;\n");
+  cwrite("    wreach[wn++] = tokenizer.reach;\n");
+  cwrite("  }\n");
+  cwrite("  if (!synced)\n");
+  cwrite("    j = n;\n\n");
+  cwrite("  // Count the parser's tokens in the old and new windows.\n");
+  cwrite("  size_t d1_old = d0, d1_new = d0;\n");
+  cwrite("  for (size_t k = i0; k < j; k++)\n");
+  cwrite("    if (!%s_token_ignored(doc->lexed[k].kind))\n", ctx->lower);
+  cwrite("      d1_old++;\n");
+  cwrite("  for (size_t k = 0; k < wn; k++)\n");
+  cwrite("    if (!%s_token_ignored(wlexed[k].kind))\n", ctx->lower);
+  cwrite("      d1_new++;\n\n");
+  cwrite("  // Kill the results before the window that looked into it.\n");
+  cwrite("  for (size_t c = 0; c < d0; c++) {\n");
+  cwrite("    if (doc->cols[c].ext > d0 - c) {\n");
+  cwrite("      doc->cols[c].min_gen = doc->memo.gen + 1;\n");
+  cwrite("      doc->cols[c].ext = 0;\n");
+  cwrite("    }\n");
+  cwrite("  }\n\n");
+  cwrite("  // The line and column where the old tokens after the window "
+         "start, and\n");
+  cwrite("  // where they start now.\n");
+  cwrite("  size_t old_line = j < n ? doc->lexed[j].line : doc->end_line;\n");
+  cwrite("  size_t old_col = j < n ? doc->lexed[j].col : doc->end_col;\n");
+  cwrite("  size_t line = tokenizer.pos_line, col = tokenizer.pos_col;\n\n");
+  cwrite("  // Splice the window into the tokens, and shift the ones after "
+         "it.\n");
+  cwrite("  size_t tail = n - j, ptail = doc->num_tokens - d1_old;\n");
+  cwrite("  %s_document_reserve(doc, i0 + wn + tail, d1_new + ptail);\n",
+         ctx->lower);
+  cwrite("  memmove(doc->lexed + i0 + wn, doc->lexed + j, sizeof(%s_token) * "
+         "tail);\n",
+         ctx->lower);
+  cwrite("  memmove(doc->offs + i0 + wn, doc->offs + j, sizeof(size_t) * "
+         "tail);\n");
+  cwrite("  memmove(doc->reach + i0 + wn, doc->reach + j, sizeof(size_t) * "
+         "tail);\n");
+  cwrite("  memmove(doc->tokens + d1_new, doc->tokens + d1_old, "
+         "sizeof(%s_token) * ptail);\n",
+         ctx->lower);
+  cwrite("  memmove(doc->cols + d1_new, doc->cols + d1_old, "
+         "sizeof(%s_memo_col) * (ptail + 1));\n",
+         ctx->lower);
+  cwrite("  for (size_t k = i0 + wn; k < i0 + wn + tail; k++) {\n");
+  cwrite("    %s_token* tok = doc->lexed + k;\n", ctx->lower);
+  cwrite("    doc->offs[k] = doc->offs[k] - shift_from + shift_to;\n");
+  cwrite("    doc->reach[k] = doc->reach[k] - shift_from + shift_to;\n");
+  cwrite("    if (tok->line == old_line)\n");
+  cwrite("      tok->col = tok->col - old_col + col;\n");
+  cwrite("    tok->line = tok->line - old_line + line;\n");
+  cwrite("  }\n");
+  cwrite("  for (size_t k = d1_new; k < d1_new + ptail; k++) {\n");
+  cwrite("    %s_token* tok = doc->tokens + k;\n", ctx->lower);
+  cwrite("    if (tok->line == old_line)\n");
+  cwrite("      tok->col = tok->col - old_col + col;\n");
+  cwrite("    tok->line = tok->line - old_line + line;\n");
+  cwrite("  }\n");
+  cwrite("  memcpy(doc->lexed + i0, wlexed, sizeof(%s_token) * wn);\n",
+         ctx->lower);
+  cwrite("  memcpy(doc->offs + i0, woffs, sizeof(size_t) * wn);\n");
+  cwrite("  memcpy(doc->reach + i0, wreach, sizeof(size_t) * wn);\n");
+  cwrite("  for (size_t k = 0, p = d0; k < wn; k++) {\n");
+  cwrite("    if (%s_token_ignored(wlexed[k].kind))\n", ctx->lower);
+  cwrite("      continue;\n");
+  cwrite("    %s_memo_col c = {doc->next_id++, 0, 0};\n", ctx->lower);
+  cwrite("    doc->cols[p] = c;\n");
+  cwrite("    doc->tokens[p++] = wlexed[k];\n");
+  cwrite("  }\n");
+  cwrite("  doc->num_lexed = i0 + wn + tail;\n");
+  cwrite("  doc->num_tokens = d1_new + ptail;\n");
+  cwrite("  free(wlexed);\n");
+  cwrite("  free(woffs);\n");
+  cwrite("  free(wreach);\n\n");
+  cwrite("  if (synced) {\n");
+  cwrite("    doc->lex_end = doc->lex_end - shift_from + shift_to;\n");
+  cwrite("    if (doc->end_line == old_line)\n");
+  cwrite("      doc->end_col = doc->end_col - old_col + col;\n");
+  cwrite("    doc->end_line = doc->end_line - old_line + line;\n");
+  cwrite("  } else {\n");
+  cwrite("    doc->lex_end = tokenizer.pos;\n");
+  cwrite("    doc->end_line = tokenizer.pos_line;\n");
+  cwrite("    doc->end_col = tokenizer.pos_col;\n");
+  cwrite("  }\n\n");
+  cwrite("  return %s_document_run(doc, cps, entry);\n", ctx->lower);
+  cwrite("}\n\n");
+  cwrite("// Tokenizes and parses the whole text, discarding any earlier "
+         "state.\n");
+  cwrite_api(ctx,
+             "%s_astnode_t* %s_document_parse(%s_document* doc, "
+             "codepoint_t* cps, size_t len, %s_parse_fn entry)",
+             ctx->lower, ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  %s_document_destroy(doc);\n", ctx->lower);
+  cwrite("  %s_document_init(doc);\n", ctx->lower);
+  cwrite("  %s_edit edit = {0, 0, len};\n", ctx->lower);
+  cwrite("  %s_reparse(doc, cps, len, edit, entry);\n", ctx->lower);
+  cwrite("  doc->full_arenas = doc->alloc.rew.arena_idx;\n");
+  cwrite("  doc->full_memo = doc->memo.len;\n");
+  cwrite("  return doc->ast;\n");
+  cwrite("}\n");
+}
+
 static inline void codegen_write_parser(codegen_ctx *ctx) {
+  // With --emit=split, the types go to the header, and the functions to the
+  // implementation.
+  codegen_to_header(ctx);
   peg_write_header(ctx);
   peg_write_parser_errdef(ctx);
   peg_write_parser_ctx(ctx);
+  codegen_to_impl(ctx);
   peg_write_parser_ctx_init(ctx);
+  peg_write_sizehints(ctx);
   peg_write_report_parse_error(ctx);
+  peg_write_budget(ctx);
+  codegen_to_header(ctx);
   peg_write_astnode_kind(ctx);
   peg_write_astnode_def(ctx);
+  codegen_to_impl(ctx);
   peg_write_minmax(ctx);
   peg_write_astnode_init(ctx);
   peg_write_astnode_add(ctx);
@@ -2064,13 +5031,24 @@ static inline void codegen_write_parser(codegen_ctx *ctx) {
   peg_write_repr(ctx);
   peg_write_node_print(ctx);
   peg_write_astnode_print(ctx);
+  peg_write_astnode_write_json(ctx);
+  peg_write_astnode_walk(ctx);
+  peg_write_ast_compact(ctx);
+  peg_write_astnode_serialize(ctx);
+  peg_write_parse_cache(ctx);
+  peg_write_rule_ids(ctx);
+  peg_write_memo(ctx);
+  peg_write_profile(ctx);
   peg_write_parsermacros(ctx);
   peg_write_middirectives(ctx);
   peg_write_interactive_stack(ctx);
   peg_write_parser_body(ctx);
   peg_write_postdirectives(ctx);
   peg_write_undef_parsermacros(ctx);
+  peg_write_document(ctx);
+  codegen_to_header(ctx);
   peg_write_footer(ctx);
+  codegen_to_impl(ctx);
 }
 
 /**************/
@@ -2081,26 +5059,44 @@ static inline void codegen_write_parser(codegen_ctx *ctx) {
 #include "pythongen.h"
 #endif
 
+#ifndef PGEN_BENCHGEN_INCLUDE
+#include "benchgen.h"
+#endif
+
 static inline void codegen_write(codegen_ctx *ctx) {
 
   // Write headers
+  codegen_to_header(ctx);
+  cwrite(CODEGEN_FINGERPRINT_FMT, ctx->output_fingerprint);
+  codegen_to_impl(ctx);
+  if (ctx->args->split)
+    cwrite(CODEGEN_FINGERPRINT_FMT, ctx->output_fingerprint);
+  codegen_to_header(ctx);
   peg_write_include_header(ctx);
   write_utf8_lib(ctx);
 
   peg_write_interactive_macro(ctx);
   write_arena_lib(ctx);
+  write_io_lib(ctx);
   peg_write_predirectives(ctx);
   write_helpermacros(ctx);
+  codegen_to_impl(ctx);
+  peg_write_include_impl(ctx);
 
   // Write bodies
   codegen_write_tokenizer(ctx);
   codegen_write_parser(ctx);
 
   // Write footer
+  codegen_to_header(ctx);
   peg_write_include_footer(ctx);
+  codegen_to_impl(ctx);
 
   // Write Python bindings
   generate_python_module(ctx);
+
+  // Write the benchmark runner
+  generate_bench_runner(ctx);
 }
 
 #endif /* TOKCODEGEN_INCLUDE */
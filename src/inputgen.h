@@ -0,0 +1,882 @@
+#ifndef PGEN_INPUTGEN_INCLUDE
+#define PGEN_INPUTGEN_INCLUDE
+#include "argparse.h"
+#include "ast.h"
+#include "automata.h"
+#include "parserctx.h"
+#include "symtab.h"
+#include "utf8.h"
+#include "util.h"
+
+// Random inputs for --gen-inputs. Each one is a random derivation from the
+// first rule, spelled out with random text for each token.
+//
+// Every token gets a pool of spellings, made by random walks through its
+// state machine and kept if the tokenizer reads them back as the same token.
+// Rules are expanded at random, choosing shorter alternatives more often the
+// deeper they nest, and only alternatives that can still finish within
+// --depth. PEG choices are ordered and loops are greedy, so not every
+// derivation parses. Each expanded rule is checked against the grammar the
+// way the generated parser would read it, and expanded again if it doesn't.
+//
+// The size is reached by repeating the first loop that the first rule can
+// get to, like the (block)* of a program, until the input is big enough.
+
+#define GEN_INF SIZE_MAX
+#define GEN_POOL 64     // Spellings kept per token
+#define GEN_TRIES 8     // Expansions of a rule before keeping a bad one
+#define GEN_MAX_SPELL 48
+#define GEN_MAX_LOOP 64 // Iterations of a loop, besides the one that fills
+
+typedef struct {
+  SMAutomaton *aut;
+  size_t num_states;
+  int *ascii;     // The next state for each state and ASCII character
+  bool *accept;   // Per state
+  size_t *dist;   // Per state, characters to an accepting state
+} gen_sm;
+
+typedef struct {
+  list_ASTNodePtr *defs;
+  list_ASTNodePtr *tokdefs;
+  Symindex rule_ix;
+  Symindex tok_ix;
+  size_t num_rules;
+  size_t num_toks;
+
+  // Tokenizing
+  gen_sm *sms;
+  size_t num_sms;
+  codepoint_t *alphabet;
+  size_t alphabet_len;
+  bool *ignored;                   // Per token
+  list_Codepoint_String_View *pool; // Per token
+  double *avg_len;                 // Per token
+  list_Codepoint_String_View ws;     // Whitespace between tokens. ws.buf[0]
+                                   // is the usual one.
+  list_Codepoint_String_View extras; // Spellings of ignored tokens.
+
+  // Expanding
+  size_t *height; // Per rule, how deep it nests at the least, or GEN_INF.
+  bool *bad;      // Per rule, whether it's failed every expansion.
+  size_t *to_filler; // Per rule, rule calls to the filler, or GEN_INF.
+  ASTNode *filler;
+  bool filled;
+  bool chase; // Whether to head for the filler.
+  size_t depth;
+  size_t max_depth;
+  size_t size;
+  double est_bytes;
+  list_size_t toks;
+  bool fatal;
+  uint64_t rng;
+} gen_ctx;
+
+/**********/
+/* Random */
+/**********/
+
+static inline uint64_t gen_rand(gen_ctx *g) {
+  // splitmix64
+  uint64_t z = (g->rng += UINT64_C(0x9E3779B97F4A7C15));
+  z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+  return z ^ (z >> 31);
+}
+
+static inline size_t gen_below(gen_ctx *g, size_t n) {
+  return n ? (size_t)(gen_rand(g) % n) : 0;
+}
+
+static inline bool gen_chance(gen_ctx *g, double p) {
+  return (double)(gen_rand(g) >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+/**************/
+/* Tokenizing */
+/**************/
+
+static inline int gen_step(gen_sm *sm, int state, codepoint_t c) {
+  if ((c >= 0) & (c < 128))
+    return sm->ascii[(size_t)state * 128 + (size_t)c];
+  return SMAutomaton_step(sm->aut, state, c);
+}
+
+static inline void gen_sm_init(gen_ctx *g, gen_sm *sm, SMAutomaton *aut) {
+  int max = 0;
+  for (size_t i = 0; i < aut->accepting.len; i++)
+    max = MAX(max, aut->accepting.buf[i].s);
+  for (size_t t = 0; t < aut->trans.len; t++) {
+    max = MAX(max, aut->trans.buf[t].to);
+    for (size_t i = 0; i < aut->trans.buf[t].from.len; i++)
+      max = MAX(max, aut->trans.buf[t].from.buf[i].s);
+  }
+  sm->aut = aut;
+  sm->num_states = (size_t)max + 1;
+  sm->ascii = (int *)malloc(sizeof(int) * sm->num_states * 128);
+  sm->accept = (bool *)malloc(sizeof(bool) * sm->num_states);
+  sm->dist = (size_t *)malloc(sizeof(size_t) * sm->num_states);
+  if (!sm->ascii | !sm->accept | !sm->dist)
+    OOM();
+  for (size_t q = 0; q < sm->num_states; q++) {
+    for (codepoint_t c = 0; c < 128; c++)
+      sm->ascii[q * 128 + (size_t)c] = SMAutomaton_step(aut, (int)q, c);
+    sm->accept[q] = stateranges_contain(aut->accepting, (int)q);
+    sm->dist[q] = sm->accept[q] ? 0 : GEN_INF;
+  }
+
+  // Only over the characters that spellings are made of.
+  bool changed = 1;
+  while (changed) {
+    changed = 0;
+    for (size_t q = 0; q < sm->num_states; q++) {
+      for (size_t a = 0; a < g->alphabet_len; a++) {
+        int n = gen_step(sm, (int)q, g->alphabet[a]);
+        if (n >= 0 && sm->dist[n] != GEN_INF && sm->dist[n] + 1 < sm->dist[q])
+          sm->dist[q] = sm->dist[n] + 1, changed = 1;
+      }
+    }
+  }
+}
+
+// The printable ASCII characters, tabs and newlines, and the first character
+// of every range of characters that the state machines go on.
+static inline void gen_alphabet_init(gen_ctx *g, list_SMAutomaton smauts) {
+  list_codepoint_t l = list_codepoint_t_new();
+  list_codepoint_t_add(&l, '\t');
+  list_codepoint_t_add(&l, '\n');
+  for (codepoint_t c = ' '; c < 127; c++)
+    list_codepoint_t_add(&l, c);
+  for (size_t s = 0; s < smauts.len; s++) {
+    for (size_t t = 0; t < smauts.buf[s].trans.len; t++) {
+      SMTransition *trans = smauts.buf[s].trans.buf + t;
+      for (size_t i = 0; i < trans->on.len && !trans->inverted; i++) {
+        codepoint_t c = trans->on.buf[i].f;
+        bool have = c < 127;
+        for (size_t j = 0; j < l.len && !have; j++)
+          have = l.buf[j] == c;
+        if (!have)
+          list_codepoint_t_add(&l, c);
+      }
+    }
+  }
+  g->alphabet = l.buf;
+  g->alphabet_len = l.len;
+}
+
+// The length of the token that the generated tokenizer would read from the
+// start of the text, leaving its kind in kind. Like the tokenizer, the
+// longest match wins, then literals, then the state machine defined first.
+static inline size_t gen_munch(gen_ctx *g, codepoint_t *s, size_t len,
+                               size_t *kind) {
+  size_t max = 0, sm = 0;
+  *kind = SIZE_MAX;
+  for (size_t a = g->num_sms; a-- > 0;) {
+    gen_sm *m = g->sms + a;
+    size_t munch = 0;
+    int q = 0;
+    for (size_t i = 0; i < len && (q = gen_step(m, q, s[i])) != -1; i++)
+      if (m->accept[q])
+        munch = i + 1;
+    if (munch && munch >= max)
+      max = munch, sm = a;
+  }
+  if (max)
+    *kind = symindex_find(&g->tok_ix, g->sms[sm].aut->ident);
+
+  size_t lit = 0, litkind = SIZE_MAX;
+  for (size_t t = 0; t < g->num_toks; t++) {
+    ASTNode *def = g->tokdefs->buf[t]->children[1];
+    if (def->kind != AST_LitDef)
+      continue;
+    codepoint_t *cps = (codepoint_t *)def->extra;
+    size_t n = cpstrlen(cps);
+    if (n > lit && n <= len && !memcmp(cps, s, sizeof(codepoint_t) * n))
+      lit = n, litkind = t;
+  }
+  if (lit && lit >= max)
+    max = lit, *kind = litkind;
+  return max;
+}
+
+// A random walk through the state machine, ending in an accepting state.
+static inline bool gen_walk(gen_ctx *g, gen_sm *sm, list_codepoint_t *out) {
+  out->len = 0;
+  if (sm->dist[0] == GEN_INF)
+    return 0;
+  size_t want = 1 + gen_below(g, 8);
+  int q = 0;
+  while (1) {
+    if (sm->accept[q] && out->len && (out->len >= want || !gen_below(g, 4)))
+      return 1;
+    if (out->len >= GEN_MAX_SPELL)
+      return 0;
+
+    // Once the spelling is long enough, head for the nearest accepting state.
+    size_t n = 0;
+    codepoint_t pick = 0;
+    for (size_t a = 0; a < g->alphabet_len; a++) {
+      int next = gen_step(sm, q, g->alphabet[a]);
+      if (next < 0 || sm->dist[next] == GEN_INF ||
+          (out->len >= want && sm->dist[next] >= sm->dist[q]))
+        continue;
+      if (!gen_below(g, ++n))
+        pick = g->alphabet[a];
+    }
+    if (!n)
+      return 0;
+    list_codepoint_t_add(out, pick);
+    q = gen_step(sm, q, pick);
+  }
+}
+
+static inline Codepoint_String_View gen_copy(codepoint_t *s, size_t len) {
+  Codepoint_String_View v;
+  v.str = (codepoint_t *)malloc(sizeof(codepoint_t) * (len ? len : 1));
+  if (!v.str)
+    OOM();
+  memcpy(v.str, s, sizeof(codepoint_t) * len);
+  v.len = len;
+  return v;
+}
+
+// Whether the text is read back as nothing but ignored tokens.
+static inline bool gen_all_ignored(gen_ctx *g, codepoint_t *s, size_t len) {
+  size_t kind;
+  for (size_t pos = 0, m; pos < len; pos += m)
+    if (!(m = gen_munch(g, s + pos, len - pos, &kind)) || !g->ignored[kind])
+      return 0;
+  return 1;
+}
+
+// Fills the pools of spellings for each token, and of what goes between them.
+static inline void gen_pools_init(gen_ctx *g) {
+  static const codepoint_t whitespace[] = {' ', '\n', '\t'};
+  for (size_t i = 0; i < 3; i++) {
+    codepoint_t *c = (codepoint_t *)whitespace + i;
+    size_t kind;
+    if (gen_munch(g, c, 1, &kind) == 1 && g->ignored[kind])
+      list_Codepoint_String_View_add(&g->ws, gen_copy(c, 1));
+  }
+  codepoint_t none = 0;
+  if (!g->ws.len)
+    list_Codepoint_String_View_add(&g->ws, gen_copy(&none, 0));
+  Codepoint_String_View sep = g->ws.buf[0];
+
+  list_codepoint_t buf = list_codepoint_t_new();
+  for (size_t t = 0; t < g->num_toks; t++) {
+    ASTNode *def = g->tokdefs->buf[t]->children[1];
+    char *name = (char *)g->tokdefs->buf[t]->children[0]->extra;
+    gen_sm *sm = NULL;
+    for (size_t a = 0; a < g->num_sms && !sm; a++)
+      if (!strcmp(g->sms[a].aut->ident, name))
+        sm = g->sms + a;
+    size_t total = 0, extras = 0;
+    for (size_t tries = 0; tries < GEN_POOL * 8 && g->pool[t].len < GEN_POOL;
+         tries++) {
+      if (def->kind == AST_LitDef) {
+        if (tries)
+          break;
+        codepoint_t *cps = (codepoint_t *)def->extra;
+        buf.len = 0;
+        for (size_t i = 0; cps[i]; i++)
+          list_codepoint_t_add(&buf, cps[i]);
+      } else if (!sm || !gen_walk(g, sm, &buf)) {
+        continue;
+      }
+
+      // The tokenizer has to read it back as this token, and stop at the
+      // whitespace after it. Ignored tokens only have to read back as ignored
+      // tokens, and whitespace is already taken care of.
+      size_t len = buf.len, kind;
+      if (g->ignored[t]) {
+        bool blank = 1;
+        for (size_t i = 0; i < len; i++)
+          blank &= buf.buf[i] == ' ' || buf.buf[i] == '\n' ||
+                   buf.buf[i] == '\t' || buf.buf[i] == '\r';
+        if (blank || extras == GEN_POOL / 4 ||
+            !gen_all_ignored(g, buf.buf, len))
+          continue;
+        list_Codepoint_String_View_add(&g->extras, gen_copy(buf.buf, len));
+        extras++;
+        continue;
+      }
+      for (size_t i = 0; i < sep.len; i++)
+        list_codepoint_t_add(&buf, sep.str[i]);
+      if (gen_munch(g, buf.buf, buf.len, &kind) != len || kind != t)
+        continue;
+      list_Codepoint_String_View_add(g->pool + t, gen_copy(buf.buf, len));
+      total += len;
+    }
+    g->avg_len[t] = g->pool[t].len ? (double)total / (double)g->pool[t].len : 0;
+  }
+  free(buf.buf);
+}
+
+/*************/
+/* Expanding */
+/*************/
+
+static inline size_t gen_rule_idx(gen_ctx *g, ASTNode *ident) {
+  return symindex_find(&g->rule_ix, (char *)ident->extra);
+}
+
+static inline size_t gen_tok_idx(gen_ctx *g, ASTNode *ident) {
+  return symindex_find(&g->tok_ix, (char *)ident->extra);
+}
+
+// How deep rules have to nest for the expression to match, at the least.
+static inline size_t gen_height(gen_ctx *g, ASTNode *expr) {
+  size_t h = 0;
+  if (expr->kind == AST_SlashExpr) {
+    h = GEN_INF;
+    for (size_t i = 0; i < expr->num_children; i++)
+      h = MIN(h, gen_height(g, expr->children[i]));
+  } else if (expr->kind == AST_ModExprList) {
+    for (size_t i = 0; i < expr->num_children; i++)
+      h = MAX(h, gen_height(g, expr->children[i]));
+  } else if (expr->kind == AST_ModExpr) {
+    ModExprOpts opts = *(ModExprOpts *)expr->extra;
+    if (!(opts.inverted | opts.rewind | opts.optional |
+          (opts.kleene_plus == 2)))
+      h = gen_height(g, expr->children[0]);
+  } else if (expr->kind == AST_BaseExpr) {
+    h = gen_height(g, expr->children[0]);
+  } else if (expr->kind == AST_UpperIdent) {
+    // The parser never sees ignored tokens.
+    size_t tok = gen_tok_idx(g, expr);
+    if (tok == SIZE_MAX || g->ignored[tok] || !g->pool[tok].len)
+      h = GEN_INF;
+  } else if (expr->kind == AST_LowerIdent) {
+    size_t rule = gen_rule_idx(g, expr);
+    h = rule == SIZE_MAX || g->height[rule] == GEN_INF ? GEN_INF
+                                                       : g->height[rule] + 1;
+  }
+  return h;
+}
+
+// How many rule calls it takes the expression to get to the filler.
+static inline size_t gen_to_filler(gen_ctx *g, ASTNode *expr) {
+  size_t d = GEN_INF;
+  if (expr == g->filler) {
+    d = 0;
+  } else if (expr->kind == AST_LowerIdent) {
+    size_t rule = gen_rule_idx(g, expr);
+    if (rule != SIZE_MAX && g->to_filler[rule] != GEN_INF)
+      d = g->to_filler[rule] + 1;
+  } else if (expr->kind == AST_ModExpr) {
+    ModExprOpts opts = *(ModExprOpts *)expr->extra;
+    if (!(opts.inverted | opts.rewind))
+      d = gen_to_filler(g, expr->children[0]);
+  } else {
+    for (size_t i = 0; i < expr->num_children; i++)
+      d = MIN(d, gen_to_filler(g, expr->children[i]));
+  }
+  return d;
+}
+
+// The first loop in the rule, in the order it's written.
+static inline ASTNode *gen_first_loop(gen_ctx *g, ASTNode *expr) {
+  if (expr->kind == AST_ModExpr) {
+    ModExprOpts opts = *(ModExprOpts *)expr->extra;
+    if (opts.inverted | opts.rewind)
+      return NULL;
+    if (opts.kleene_plus && gen_height(g, expr->children[0]) != GEN_INF)
+      return expr;
+    return gen_first_loop(g, expr->children[0]);
+  }
+  if (expr->kind == AST_LowerIdent || expr->kind == AST_UpperIdent ||
+      expr->kind == AST_CodeExpr)
+    return NULL;
+  for (size_t i = 0; i < expr->num_children; i++) {
+    ASTNode *loop = gen_first_loop(g, expr->children[i]);
+    if (loop)
+      return loop;
+  }
+  return NULL;
+}
+
+// Heights and distances only shrink, so iterate until they stop.
+static inline void gen_grammar_init(gen_ctx *g) {
+  bool changed = 1;
+  while (changed) {
+    changed = 0;
+    for (size_t r = 0; r < g->num_rules; r++) {
+      size_t h = gen_height(g, g->defs->buf[r]->children[1]);
+      if (h < g->height[r])
+        g->height[r] = h, changed = 1;
+    }
+  }
+
+  // The filler is the first loop in the rules nearest to the first rule,
+  // searching breadth first like analyze_callers().
+  size_t *queue = (size_t *)malloc(sizeof(size_t) * g->num_rules);
+  bool *seen = (bool *)calloc(g->num_rules, sizeof(bool));
+  if (!queue | !seen)
+    OOM();
+  size_t head = 0, tail = 0;
+  queue[tail++] = 0;
+  seen[0] = 1;
+  g->filler = NULL;
+  while (head < tail && !g->filler) {
+    size_t r = queue[head++];
+    g->filler = gen_first_loop(g, g->defs->buf[r]->children[1]);
+    list_ASTNodePtr stack = list_ASTNodePtr_new();
+    list_ASTNodePtr_add(&stack, g->defs->buf[r]->children[1]);
+    while (stack.len) {
+      ASTNode *e = stack.buf[--stack.len];
+      size_t c;
+      if (e->kind == AST_LowerIdent &&
+          (c = gen_rule_idx(g, e)) != SIZE_MAX && !seen[c])
+        seen[c] = 1, queue[tail++] = c;
+      for (size_t i = e->num_children; i-- > 0;)
+        list_ASTNodePtr_add(&stack, e->children[i]);
+    }
+    free(stack.buf);
+  }
+  free(queue);
+  free(seen);
+
+  changed = 1;
+  while (changed && g->filler) {
+    changed = 0;
+    for (size_t r = 0; r < g->num_rules; r++) {
+      size_t d = gen_to_filler(g, g->defs->buf[r]->children[1]);
+      if (d < g->to_filler[r])
+        g->to_filler[r] = d, changed = 1;
+    }
+  }
+}
+
+// Matches the expression against the tokens the way the generated parser
+// would, without running any code. An expression with an error handler that
+// fails ends the parse.
+static inline bool gen_match(gen_ctx *g, ASTNode *expr, size_t *pos,
+                             size_t end) {
+  if (expr->kind == AST_SlashExpr) {
+    for (size_t i = 0; i < expr->num_children && !g->fatal; i++) {
+      size_t p = *pos;
+      if (gen_match(g, expr->children[i], &p, end))
+        return *pos = p, 1;
+    }
+    return 0;
+  } else if (expr->kind == AST_ModExprList) {
+    size_t p = *pos;
+    for (size_t i = 0; i < expr->num_children; i++)
+      if (!gen_match(g, expr->children[i], &p, end))
+        return 0;
+    return *pos = p, 1;
+  } else if (expr->kind == AST_ModExpr) {
+    ModExprOpts opts = *(ModExprOpts *)expr->extra;
+    size_t has_label = expr->num_children >= 2 &&
+                       expr->children[1]->kind == AST_LowerIdent;
+    bool handled = expr->num_children - has_label == 2;
+    size_t p = *pos;
+    bool ok;
+    if (opts.kleene_plus) {
+      size_t n = 0, last;
+      do {
+        last = p;
+      } while (gen_match(g, expr->children[0], &p, end) && ++n && p != last);
+      ok = (opts.kleene_plus == 2) | (n > 0);
+    } else {
+      ok = gen_match(g, expr->children[0], &p, end);
+    }
+    if (g->fatal)
+      return 0;
+    if (opts.optional && !ok)
+      ok = 1, p = *pos;
+    if (opts.inverted)
+      ok = !ok, p = *pos;
+    if (opts.rewind)
+      p = *pos;
+    if (!ok && handled)
+      g->fatal = 1;
+    if (ok)
+      *pos = p;
+    return ok;
+  } else if (expr->kind == AST_BaseExpr) {
+    return gen_match(g, expr->children[0], pos, end);
+  } else if (expr->kind == AST_UpperIdent) {
+    if (*pos >= end || g->toks.buf[*pos] != gen_tok_idx(g, expr))
+      return 0;
+    return (*pos)++, 1;
+  } else if (expr->kind == AST_LowerIdent) {
+    size_t rule = gen_rule_idx(g, expr);
+    return gen_match(g, g->defs->buf[rule]->children[1], pos, end);
+  }
+  return 1; // CodeExpr
+}
+
+// Whether the expression matches exactly the tokens from start to the end.
+static inline bool gen_matches(gen_ctx *g, ASTNode *expr, size_t start) {
+  size_t pos = start;
+  g->fatal = 0;
+  return gen_match(g, expr, &pos, g->toks.len) && !g->fatal &&
+         pos == g->toks.len;
+}
+
+static inline void gen_expr(gen_ctx *g, ASTNode *expr);
+
+static inline void gen_rule(gen_ctx *g, size_t rule) {
+  ASTNode *body = g->defs->buf[rule]->children[1];
+  size_t start = g->toks.len;
+  double est = g->est_bytes;
+  g->depth++;
+  for (size_t t = 0;; t++) {
+    bool filled = g->filled;
+    gen_expr(g, body);
+    // The expansion that holds the filler is only checked as a whole.
+    if (filled != g->filled || gen_matches(g, body, start))
+      break;
+    if (g->bad[rule] || t + 1 == GEN_TRIES) {
+      g->bad[rule] = 1;
+      break;
+    }
+    g->toks.len = start;
+    g->est_bytes = est;
+  }
+  g->depth--;
+}
+
+// Repeats the loop until the input is big enough, keeping the iterations
+// that parse the way they were generated.
+static inline void gen_fill(gen_ctx *g, ASTNode *loop) {
+  g->filled = 1;
+  g->chase = 0;
+  size_t misses = 0;
+  while (g->est_bytes < (double)g->size && misses < GEN_TRIES * 4) {
+    size_t start = g->toks.len;
+    double est = g->est_bytes;
+    gen_expr(g, loop);
+    if (g->toks.len > start && gen_matches(g, loop, start)) {
+      misses = 0;
+    } else {
+      g->toks.len = start;
+      g->est_bytes = est;
+      misses++;
+    }
+  }
+}
+
+static inline bool gen_fits(gen_ctx *g, size_t h) {
+  return h != GEN_INF && g->depth + h <= g->max_depth;
+}
+
+static inline void gen_expr(gen_ctx *g, ASTNode *expr) {
+  // The deeper the rules nest, the likelier the shortest way out.
+  double deep = (double)g->depth / (double)g->max_depth;
+  if (expr->kind == AST_SlashExpr) {
+    // Head for the filler by the shortest way, if there is one.
+    size_t n = expr->num_children, pick = SIZE_MAX, fit = 0;
+    size_t shortest = 0, best = GEN_INF;
+    for (size_t i = 0; i < n && g->chase; i++) {
+      size_t d = gen_to_filler(g, expr->children[i]);
+      if (d < best)
+        best = d, pick = i;
+    }
+    // Otherwise take any that fits, or the shortest.
+    if (pick == SIZE_MAX) {
+      best = GEN_INF;
+      for (size_t i = 0; i < n; i++) {
+        size_t h = gen_height(g, expr->children[i]);
+        if (h < best)
+          best = h, shortest = i;
+        if (gen_fits(g, h) && !gen_below(g, ++fit))
+          pick = i;
+      }
+      if (pick == SIZE_MAX || gen_chance(g, deep))
+        pick = shortest;
+    }
+    gen_expr(g, expr->children[pick]);
+  } else if (expr->kind == AST_ModExprList) {
+    // Only the part that's nearest to the filler heads for it.
+    size_t nearest = SIZE_MAX, best = GEN_INF;
+    for (size_t i = 0; i < expr->num_children && g->chase; i++) {
+      size_t d = gen_to_filler(g, expr->children[i]);
+      if (d < best)
+        best = d, nearest = i;
+    }
+    bool chase = g->chase;
+    for (size_t i = 0; i < expr->num_children; i++) {
+      g->chase = chase && !g->filled && i == nearest;
+      gen_expr(g, expr->children[i]);
+    }
+    g->chase = chase && !g->filled;
+  } else if (expr->kind == AST_ModExpr) {
+    ModExprOpts opts = *(ModExprOpts *)expr->extra;
+    ASTNode *inner = expr->children[0];
+    if (opts.inverted | opts.rewind)
+      return;
+    if (expr == g->filler && !g->filled) {
+      gen_fill(g, inner);
+      return;
+    }
+    bool reach = g->chase && gen_to_filler(g, inner) != GEN_INF;
+    bool fits = gen_fits(g, gen_height(g, inner));
+    double more = 0.5 * (1.0 - deep);
+    if (opts.optional) {
+      if (reach || (fits && gen_chance(g, more)))
+        gen_expr(g, inner);
+    } else if (opts.kleene_plus) {
+      size_t n = 0;
+      if (opts.kleene_plus == 1 || reach)
+        gen_expr(g, inner), n++;
+      while (fits && n < GEN_MAX_LOOP && gen_chance(g, more))
+        gen_expr(g, inner), n++;
+    } else {
+      gen_expr(g, inner);
+    }
+  } else if (expr->kind == AST_BaseExpr) {
+    gen_expr(g, expr->children[0]);
+  } else if (expr->kind == AST_UpperIdent) {
+    size_t tok = gen_tok_idx(g, expr);
+    if (tok != SIZE_MAX && !g->ignored[tok] && g->pool[tok].len) {
+      list_size_t_add(&g->toks, tok);
+      g->est_bytes += g->avg_len[tok] + (double)g->ws.buf[0].len;
+    }
+  } else if (expr->kind == AST_LowerIdent) {
+    size_t rule = gen_rule_idx(g, expr);
+    if (rule != SIZE_MAX)
+      gen_rule(g, rule);
+  }
+}
+
+/************/
+/* Spelling */
+/************/
+
+static inline void gen_append(list_codepoint_t *out, Codepoint_String_View v) {
+  for (size_t i = 0; i < v.len; i++)
+    list_codepoint_t_add(out, v.str[i]);
+}
+
+// Whether the tokenizer reads the previous token back the same way with the
+// whitespace and the next token after it, and reads nothing but ignored
+// tokens in between.
+static inline bool gen_gap_ok(gen_ctx *g, codepoint_t *s, size_t total,
+                              size_t prev_len, size_t prev_kind,
+                              size_t gap_len) {
+  size_t kind;
+  if (prev_len &&
+      (gen_munch(g, s, total, &kind) != prev_len || kind != prev_kind))
+    return 0;
+  // The ignored tokens can't run on into the next one.
+  size_t pos = prev_len, end = prev_len + gap_len, m;
+  for (; pos < end; pos += m)
+    if (!(m = gen_munch(g, s + pos, total - pos, &kind)) || !g->ignored[kind])
+      return 0;
+  return pos == end;
+}
+
+static inline void gen_spell(gen_ctx *g, list_codepoint_t *out) {
+  size_t prev_start = 0, prev_len = 0, prev_kind = 0;
+  out->len = 0;
+  for (size_t i = 0; i < g->toks.len; i++) {
+    size_t tok = g->toks.buf[i];
+    Codepoint_String_View spelling;
+    bool ok = 0;
+    for (size_t t = 0; t < GEN_TRIES * 2 && !ok; t++) {
+      // Mostly the usual whitespace, sometimes other whitespace, and now and
+      // then an ignored token like a comment. Fall back on the usual.
+      out->len = prev_start + prev_len;
+      size_t r = gen_below(g, 32);
+      if (i && t >= GEN_TRIES) {
+        gen_append(out, g->ws.buf[0]);
+      } else if (i && r < 2 && g->extras.len) {
+        gen_append(out, g->extras.buf[gen_below(g, g->extras.len)]);
+        gen_append(out, g->ws.buf[gen_below(g, g->ws.len)]);
+      } else if (i) {
+        gen_append(out, g->ws.buf[r < 3 ? gen_below(g, g->ws.len) : 0]);
+      }
+      size_t gap_len = out->len - prev_start - prev_len;
+      spelling = g->pool[tok].buf[gen_below(g, g->pool[tok].len)];
+      gen_append(out, spelling);
+      ok = gen_gap_ok(g, out->buf + prev_start, out->len - prev_start,
+                      prev_len, prev_kind, gap_len);
+    }
+    if (!ok)
+      ERROR("Could not find a way to separate %s from the %s before it.",
+            (char *)g->tokdefs->buf[tok]->children[0]->extra,
+            (char *)g->tokdefs->buf[prev_kind]->children[0]->extra);
+    prev_start = out->len - spelling.len;
+    prev_len = spelling.len;
+    prev_kind = tok;
+  }
+
+  // End with a newline, if it's whitespace and doesn't change the last token.
+  for (size_t i = 0; i < g->ws.len; i++) {
+    Codepoint_String_View ws = g->ws.buf[i];
+    if (ws.len != 1 || ws.str[0] != '\n')
+      continue;
+    gen_append(out, ws);
+    if (!gen_gap_ok(g, out->buf + prev_start, out->len - prev_start, prev_len,
+                    prev_kind, 1))
+      out->len--;
+  }
+}
+
+// Whether the whole text tokenizes into the tokens it was spelled from.
+static inline bool gen_verify(gen_ctx *g, list_codepoint_t *out) {
+  size_t i = 0, kind;
+  for (size_t pos = 0, m; pos < out->len; pos += m) {
+    if (!(m = gen_munch(g, out->buf + pos, out->len - pos, &kind)))
+      return 0;
+    if (g->ignored[kind])
+      continue;
+    if (i == g->toks.len || g->toks.buf[i++] != kind)
+      return 0;
+  }
+  return i == g->toks.len;
+}
+
+static inline void gen_write(char *path, list_codepoint_t *out) {
+  char *str = NULL;
+  size_t len = 0;
+  if (out->len && !UTF8_encode(out->buf, out->len, &str, &len))
+    ERROR("Could not encode %s.", path);
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    ERROR("Could not open %s for writing.", path);
+  if (len && fwrite(str, 1, len, f) != len)
+    ERROR("Could not write %s.", path);
+  fclose(f);
+  free(str);
+}
+
+static inline void generateInputs(Args *args, Symtabs symtabs,
+                                  list_SMAutomaton smauts) {
+  if (!symtabs.definitions.len)
+    ERROR("There are no rules to generate inputs from.");
+
+  gen_ctx g;
+  g.defs = &symtabs.definitions;
+  g.tokdefs = &symtabs.tokendefs;
+  g.num_rules = symtabs.definitions.len;
+  g.num_toks = symtabs.tokendefs.len;
+  char **names = (char **)malloc(sizeof(char *) * (g.num_rules + g.num_toks));
+  if (!names)
+    OOM();
+  for (size_t r = 0; r < g.num_rules; r++)
+    names[r] = (char *)g.defs->buf[r]->children[0]->extra;
+  for (size_t t = 0; t < g.num_toks; t++)
+    names[g.num_rules + t] = (char *)g.tokdefs->buf[t]->children[0]->extra;
+  g.rule_ix = symindex_new(names, g.num_rules);
+  g.tok_ix = symindex_new(names + g.num_rules, g.num_toks);
+  free(names);
+
+  g.rng = (uint64_t)args->genSeed;
+  gen_alphabet_init(&g, smauts);
+  g.num_sms = smauts.len;
+  g.sms = (gen_sm *)malloc(sizeof(gen_sm) * (g.num_sms ? g.num_sms : 1));
+  g.ignored = (bool *)calloc(g.num_toks + 1, sizeof(bool));
+  g.pool = (list_Codepoint_String_View *)calloc(
+      g.num_toks + 1, sizeof(list_Codepoint_String_View));
+  g.avg_len = (double *)calloc(g.num_toks + 1, sizeof(double));
+  g.height = (size_t *)malloc(sizeof(size_t) * g.num_rules);
+  g.bad = (bool *)calloc(g.num_rules, sizeof(bool));
+  g.to_filler = (size_t *)malloc(sizeof(size_t) * g.num_rules);
+  if (!g.sms | !g.ignored | !g.pool | !g.avg_len | !g.height | !g.bad |
+      !g.to_filler)
+    OOM();
+  for (size_t a = 0; a < g.num_sms; a++)
+    gen_sm_init(&g, g.sms + a, smauts.buf + a);
+  for (size_t t = 0; t < g.num_toks; t++)
+    g.ignored[t] = symtab_is_ignored(
+        symtabs.directives, (char *)g.tokdefs->buf[t]->children[0]->extra);
+  for (size_t r = 0; r < g.num_rules; r++)
+    g.height[r] = g.to_filler[r] = GEN_INF;
+  g.ws = list_Codepoint_String_View_new();
+  g.extras = list_Codepoint_String_View_new();
+  g.toks = list_size_t_new();
+  g.max_depth = args->genDepth;
+  g.size = args->genSize;
+
+  gen_pools_init(&g);
+  gen_grammar_init(&g);
+  char *start = (char *)g.defs->buf[0]->children[0]->extra;
+  if (g.height[0] == GEN_INF)
+    ERROR("Every way to match %s needs a token that can't be spelled, or "
+          "that's ignored.",
+          start);
+  if (g.height[0] > g.max_depth)
+    ERROR("%s can't match without nesting rules %zu deep. Try --depth %zu.",
+          start, g.height[0], g.height[0]);
+  if (!g.filler)
+    fprintf(stderr, "%s doesn't repeat anything, so the inputs can't be made "
+                    "any bigger.\n",
+            start);
+
+  // The inputs go to OUTPUT_0.txt, OUTPUT_1.txt, and so on. OUTPUT defaults
+  // to the grammar's path without the .peg.
+  char *prefix = args->outputTarget;
+  size_t plen = strlen(prefix ? prefix : args->grammarTarget);
+  char *path = (char *)malloc(plen + 32);
+  if (!path)
+    OOM();
+  if (!prefix) {
+    strcpy(path, args->grammarTarget);
+    if (plen >= 4 && !strcmp(path + plen - 4, ".peg"))
+      path[plen -= 4] = '\0';
+  } else {
+    strcpy(path, prefix);
+  }
+
+  list_codepoint_t out = list_codepoint_t_new();
+  ASTNode *body = g.defs->buf[0]->children[1];
+  for (size_t n = 0; n < args->genInputs; n++) {
+    bool ok = 0;
+    for (size_t t = 0; t < GEN_TRIES && !ok; t++) {
+      g.toks.len = 0;
+      g.est_bytes = 0;
+      g.filled = 0;
+      g.chase = 1;
+      g.depth = 0;
+      gen_rule(&g, 0);
+      ok = gen_matches(&g, body, 0);
+    }
+    if (!ok)
+      ERROR("Could not generate an input that %s parses. --analyze may say "
+            "why.",
+            start);
+    gen_spell(&g, &out);
+    if (!gen_verify(&g, &out))
+      ERROR("An input doesn't tokenize the way it was generated.");
+
+    snprintf(path + plen, 32, "_%zu.txt", n);
+    gen_write(path, &out);
+    printf("Wrote %s (%zu tokens).\n", path, g.toks.len);
+  }
+
+  free(out.buf);
+  free(path);
+  for (size_t t = 0; t < g.num_toks; t++) {
+    for (size_t i = 0; i < g.pool[t].len; i++)
+      free(g.pool[t].buf[i].str);
+    free(g.pool[t].buf);
+  }
+  for (size_t i = 0; i < g.ws.len; i++)
+    free(g.ws.buf[i].str);
+  for (size_t i = 0; i < g.extras.len; i++)
+    free(g.extras.buf[i].str);
+  for (size_t a = 0; a < g.num_sms; a++) {
+    free(g.sms[a].ascii);
+    free(g.sms[a].accept);
+    free(g.sms[a].dist);
+  }
+  free(g.ws.buf);
+  free(g.extras.buf);
+  free(g.toks.buf);
+  free(g.sms);
+  free(g.alphabet);
+  free(g.ignored);
+  free(g.pool);
+  free(g.avg_len);
+  free(g.height);
+  free(g.bad);
+  free(g.to_filler);
+  symindex_destroy(&g.rule_ix);
+  symindex_destroy(&g.tok_ix);
+}
+
+#endif /* PGEN_INPUTGEN_INCLUDE */
@@ -0,0 +1,267 @@
+#ifndef PGEN_KWHASH_INCLUDE
+#define PGEN_KWHASH_INCLUDE
+
+#ifndef TOKCODEGEN_INCLUDE
+#include "codegen.h"
+#endif
+
+/*
+ * Keyword recognition, for --keyword-hash. A literal token that a state
+ * machine token also matches, like "begin" and an identifier, is a keyword.
+ * Keywords are left out of the trie. Once the tokenizer has matched a token,
+ * its text is looked up in a minimal perfect hash table of the keywords, and
+ * if it's there, the keyword is the token. The trie wins ties with the state
+ * machines, so this finds the same tokens as matching keywords in the trie.
+ *
+ * The table is built with hash and displace. Keywords are put into buckets
+ * by one hash. Then, biggest buckets first, each bucket gets the first seed
+ * for a second hash that puts all of its keywords into free slots.
+ */
+
+// Splits the literal token definitions into keywords, and what goes into the
+// trie. Everything but literals goes into the trie list, which only looks at
+// literals.
+static inline void kwhash_split(list_ASTNodePtr tokdefs,
+                                list_SMAutomaton smauts,
+                                list_ASTNodePtr *keywords,
+                                list_ASTNodePtr *rest) {
+  *keywords = list_ASTNodePtr_new();
+  *rest = list_ASTNodePtr_new();
+  for (size_t n = 0; n < tokdefs.len; n++) {
+    ASTNode *rule = tokdefs.buf[n];
+    ASTNode *def = rule->children[1];
+    int keyword = 0;
+    if (def->kind == AST_LitDef) {
+      codepoint_t *cpstr = (codepoint_t *)def->extra;
+      size_t cplen = cpstrlen(cpstr);
+      for (size_t a = 0; a < smauts.len && !keyword; a++)
+        keyword = cplen && SMAutomaton_accepts(smauts.buf + a, cpstr, cplen);
+    }
+    list_ASTNodePtr_add(keyword ? keywords : rest, rule);
+  }
+}
+
+// The same hash as the generated <prefix>_kw_hash().
+static inline uint32_t kwhash_hash(codepoint_t *s, size_t n, uint32_t seed) {
+  uint32_t h = UINT32_C(2166136261) ^ seed;
+  for (size_t i = 0; i < n; i++) {
+    h ^= (uint32_t)s[i];
+    h *= UINT32_C(16777619);
+  }
+  h ^= h >> 16;
+  h *= UINT32_C(0x85ebca6b);
+  h ^= h >> 13;
+  return h;
+}
+
+typedef struct {
+  size_t num_buckets;
+  uint32_t *seeds; // Per bucket
+  size_t *slots;   // Per keyword
+} KeywordHash;
+
+static inline codepoint_t *kwhash_text(ASTNode *keyword) {
+  return (codepoint_t *)keyword->children[1]->extra;
+}
+
+#define KWHASH_MAX_SEED 100000
+
+// Tries to place every keyword with the given number of buckets.
+static inline bool kwhash_try(list_ASTNodePtr keywords, KeywordHash *kh) {
+  size_t n = keywords.len, nb = kh->num_buckets;
+  size_t *bucket = (size_t *)malloc(sizeof(size_t) * n);
+  size_t *first = (size_t *)calloc(nb + 1, sizeof(size_t));
+  size_t *fill = (size_t *)malloc(sizeof(size_t) * nb);
+  size_t *members = (size_t *)malloc(sizeof(size_t) * n);
+  size_t *order = (size_t *)malloc(sizeof(size_t) * nb);
+  bool *taken = (bool *)calloc(n, sizeof(bool));
+  if (!bucket | !first | !fill | !members | !order | !taken)
+    OOM();
+
+  // Group the keywords by bucket. Bucket b has the keywords from
+  // members[first[b]] up to members[first[b + 1]].
+  for (size_t k = 0; k < n; k++) {
+    codepoint_t *s = kwhash_text(keywords.buf[k]);
+    bucket[k] = kwhash_hash(s, cpstrlen(s), 0) % nb;
+    first[bucket[k] + 1]++;
+  }
+  size_t biggest = 0;
+  for (size_t b = 0; b < nb; b++) {
+    biggest = first[b + 1] > biggest ? first[b + 1] : biggest;
+    first[b + 1] += first[b];
+    fill[b] = first[b];
+  }
+  for (size_t k = 0; k < n; k++)
+    members[fill[bucket[k]]++] = k;
+
+  // Biggest buckets first, while there are the most free slots.
+  size_t num_order = 0;
+  for (size_t size = biggest; size; size--)
+    for (size_t b = 0; b < nb; b++)
+      if (first[b + 1] - first[b] == size)
+        order[num_order++] = b;
+
+  for (size_t b = 0; b < nb; b++)
+    kh->seeds[b] = 0;
+
+  bool ok = 1;
+  for (size_t o = 0; o < num_order && ok; o++) {
+    size_t b = order[o];
+    ok = 0;
+    for (uint32_t seed = 1; seed <= KWHASH_MAX_SEED && !ok; seed++) {
+      // Place the bucket's keywords, and take them back out on a collision.
+      size_t m = first[b];
+      for (; m < first[b + 1]; m++) {
+        size_t k = members[m];
+        codepoint_t *s = kwhash_text(keywords.buf[k]);
+        size_t slot = kwhash_hash(s, cpstrlen(s), seed) % n;
+        if (taken[slot])
+          break;
+        taken[slot] = 1;
+        kh->slots[k] = slot;
+      }
+      ok = m == first[b + 1];
+      if (ok)
+        kh->seeds[b] = seed;
+      else
+        while (m-- > first[b])
+          taken[kh->slots[members[m]]] = 0;
+    }
+  }
+
+  free(bucket);
+  free(first);
+  free(fill);
+  free(members);
+  free(order);
+  free(taken);
+  return ok;
+}
+
+static inline KeywordHash kwhash_build(list_ASTNodePtr keywords) {
+  KeywordHash kh;
+  size_t n = keywords.len;
+  kh.slots = (size_t *)malloc(sizeof(size_t) * (n ? n : 1));
+  kh.seeds = NULL;
+  if (!kh.slots)
+    OOM();
+
+  // Fewer buckets make a smaller table, and more make it easier to build.
+  for (kh.num_buckets = n / 4 + 1; kh.num_buckets <= n * 4;
+       kh.num_buckets *= 2) {
+    kh.seeds = (uint32_t *)realloc(kh.seeds, sizeof(uint32_t) * kh.num_buckets);
+    if (!kh.seeds)
+      OOM();
+    if (kwhash_try(keywords, &kh))
+      return kh;
+  }
+  ERROR("Could not build a perfect hash of the keywords. Are two of them the "
+        "same?");
+}
+
+static inline void kwhash_destroy(KeywordHash *kh) {
+  free(kh->seeds);
+  free(kh->slots);
+}
+
+// Writes <prefix>_keyword(), which returns the kind of the keyword that the
+// token's text is, or the kind it was matched as.
+static inline void kwhash_write(codegen_ctx *ctx) {
+  list_ASTNodePtr keywords = ctx->keywords;
+  if (!keywords.len)
+    return;
+
+  size_t n = keywords.len;
+  KeywordHash kh = kwhash_build(keywords);
+
+  // Sort the keywords into their slots.
+  ASTNode **slotted = (ASTNode **)malloc(sizeof(ASTNode *) * n);
+  if (!slotted)
+    OOM();
+  for (size_t k = 0; k < n; k++)
+    slotted[kh.slots[k]] = keywords.buf[k];
+  size_t minlen = SIZE_MAX, maxlen = 0;
+  for (size_t k = 0; k < n; k++) {
+    size_t len = cpstrlen(kwhash_text(keywords.buf[k]));
+    minlen = len < minlen ? len : minlen;
+    maxlen = len > maxlen ? len : maxlen;
+  }
+
+  if (!ctx->args->u)
+    cwrite("// Keywords, in the slots of a minimal perfect hash table.\n");
+  cwrite("static const codepoint_t %s_kw_text[] = {\n", ctx->lower);
+  for (size_t k = 0; k < n; k++) {
+    codepoint_t *s = kwhash_text(slotted[k]);
+    cwrite(" ");
+    for (size_t i = 0; s[i]; i++)
+      cwrite(" %" PRI_CODEPOINT ",", s[i]);
+    if (!ctx->args->u)
+      cwrite(" // %s", (char *)slotted[k]->children[0]->extra);
+    cwrite("\n");
+  }
+  cwrite("};\n");
+  cwrite("static const uint32_t %s_kw_off[%zu] = {", ctx->lower, n);
+  for (size_t k = 0, off = 0; k < n; k++) {
+    cwrite("%s%zu", k ? ", " : "", off);
+    off += cpstrlen(kwhash_text(slotted[k]));
+  }
+  cwrite("};\n");
+  cwrite("static const uint32_t %s_kw_len[%zu] = {", ctx->lower, n);
+  for (size_t k = 0; k < n; k++)
+    cwrite("%s%zu", k ? ", " : "", cpstrlen(kwhash_text(slotted[k])));
+  cwrite("};\n");
+  cwrite("static const %s_token_kind %s_kw_kind[%zu] = {\n", ctx->lower,
+         ctx->lower, n);
+  for (size_t k = 0; k < n; k++)
+    cwrite("  %s_TOK_%s,\n", ctx->upper,
+           (char *)slotted[k]->children[0]->extra);
+  cwrite("};\n");
+  cwrite("static const uint32_t %s_kw_seed[%zu] = {", ctx->lower,
+         kh.num_buckets);
+  for (size_t b = 0; b < kh.num_buckets; b++)
+    cwrite("%s%" PRIu32, b ? ", " : "", kh.seeds[b]);
+  cwrite("};\n\n");
+
+  cwrite("static inline uint32_t %s_kw_hash(codepoint_t* s, size_t n, "
+         "uint32_t seed) {\n",
+         ctx->lower);
+  cwrite("  uint32_t h = UINT32_C(2166136261) ^ seed;\n");
+  cwrite("  for (size_t i = 0; i < n; i++) {\n");
+  cwrite("    h ^= (uint32_t)s[i];\n");
+  cwrite("    h *= UINT32_C(16777619);\n");
+  cwrite("  }\n");
+  cwrite("  h ^= h >> 16;\n");
+  cwrite("  h *= UINT32_C(0x85ebca6b);\n");
+  cwrite("  h ^= h >> 13;\n");
+  cwrite("  return h;\n");
+  cwrite("}\n\n");
+
+  cwrite("static inline %s_token_kind %s_keyword(codepoint_t* s, size_t n, "
+         "%s_token_kind kind) {\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  if ((n < %zu) | (n > %zu))\n", minlen, maxlen);
+  cwrite("    return kind;\n");
+  cwrite("  uint32_t seed = %s_kw_seed[%s_kw_hash(s, n, 0) %% %zuu];\n",
+         ctx->lower, ctx->lower, kh.num_buckets);
+  cwrite("  uint32_t slot = %s_kw_hash(s, n, seed) %% %zuu;\n", ctx->lower,
+         n);
+  cwrite("  if ((%s_kw_len[slot] != n) ||\n", ctx->lower);
+  cwrite("      memcmp(s, %s_kw_text + %s_kw_off[slot], sizeof(codepoint_t) "
+         "* n))\n",
+         ctx->lower, ctx->lower);
+  cwrite("    return kind;\n");
+  cwrite("  return %s_kw_kind[slot];\n", ctx->lower);
+  cwrite("}\n\n");
+
+  free(slotted);
+  kwhash_destroy(&kh);
+}
+
+// Writes the lookup of the token that was just matched.
+static inline void kwhash_write_lookup(codegen_ctx *ctx) {
+  if (ctx->keywords.len)
+    cwrite("  tok.kind = %s_keyword(tok.content, tok.len, tok.kind);\n",
+           ctx->lower);
+}
+
+#endif /* PGEN_KWHASH_INCLUDE */
@@ -42,7 +42,7 @@ static inline void parser_ctx_init(parser_ctx *ctx, Args args,
 #define REWIND(id)                                                             \
   (ctx->line_nbr = _rew_to_line_nbr_##id, ctx->pos = _rew_to_##id)
 #define WS() parse_ws(ctx)
-#define INIT(name) ASTNode *node = ASTNode_new(name)
+#define INIT(kind) ASTNode *node = ASTNode_new(kind)
 
 #define RULE_BEGIN(rulename)                                                   \
   /* Can't be in a do block. Oh well. */                                       \
@@ -5,7 +5,7 @@
 static inline void nodecmp(ASTNode *first, ASTNode *second) {}
 
 static inline void left_factor_rule(ASTNode *expr) {
-  if (!strcmp(expr->name, "SlashExpr")) {
+  if (expr->kind == AST_SlashExpr) {
     for (size_t i = 0; i < expr->num_children; i++) {
       for (size_t j = i + 1; j < expr->num_children; j++) {
       }
@@ -20,7 +20,7 @@ static inline ASTNode *left_factor(ASTNode *pegast) {
 
   for (size_t i = 0; i < pegast->num_children; i++) {
     ASTNode *rule = pegast->children[i];
-    if (strcmp(rule->name, "Definition"))
+    if (rule->kind != AST_Definition)
       continue;
     char *rulename = (char *)rule->children[0]->extra;
     left_factor_rule(rule->children[1]);
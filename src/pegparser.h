@@ -34,6 +34,7 @@ static inline ASTNode *peg_parse_CodeExpr(parser_ctx *ctx);
 static inline ASTNode *peg_parse_TokenDef(parser_ctx *ctx);
 static inline ASTNode *peg_parse_LitDef(parser_ctx *ctx);
 static inline ASTNode *peg_parse_SMDef(parser_ctx *ctx);
+static inline ASTNode *peg_parse_RegexDef(parser_ctx *ctx);
 static inline ASTNode *peg_parse_NumSet(parser_ctx *ctx);
 static inline ASTNode *peg_parse_CharSet(parser_ctx *ctx);
 static inline ASTNode *peg_parse_Pair(parser_ctx *ctx);
@@ -54,7 +55,7 @@ static inline ASTNode *peg_parse_GrammarFile(parser_ctx *ctx) {
   // This rule looks a lot like peg_parse_TokenFile().
   RULE_BEGIN("GrammarFile");
 
-  INIT("GrammarFile");
+  INIT(AST_GrammarFile);
 
   while (1) {
     WS();
@@ -144,7 +145,7 @@ static inline ASTNode *peg_parse_Directive(parser_ctx *ctx) {
       cpbuf[newlen++] = cpbuf[capture_size - 1];
     cpbuf[newlen] = '\0';
 
-    ASTNode *dir = ASTNode_new("Directive");
+    ASTNode *dir = ASTNode_new(AST_Directive);
     dir->extra = cpbuf;
     ASTNode_addChild(dir, id);
     RETURN(dir);
@@ -187,7 +188,7 @@ static inline ASTNode *peg_parse_Definition(parser_ctx *ctx) {
     RETURN(NULL);
   }
 
-  INIT("Definition");
+  INIT(AST_Definition);
   ASTNode_addChild(node, id);
   ASTNode_addChild(node, slash);
   if (stdef)
@@ -204,7 +205,7 @@ static inline ASTNode *peg_parse_Variables(parser_ctx *ctx) {
   }
   NEXT();
 
-  INIT("Variables");
+  INIT(AST_Variables);
 
   while (1) {
 
@@ -240,7 +241,7 @@ static inline ASTNode *peg_parse_Variables(parser_ctx *ctx) {
     else
       ERROR("Unexpected end of input.");
 
-    ASTNode *member = ASTNode_new("Member");
+    ASTNode *member = ASTNode_new(AST_Member);
     ASTNode_addChild(node, member);
     char *str;
     member->extra = str = (char *)malloc(diff + 1);
@@ -271,7 +272,7 @@ static inline ASTNode *peg_parse_SlashExpr(parser_ctx *ctx) {
   if (!l1)
     RETURN(NULL);
 
-  INIT("SlashExpr");
+  INIT(AST_SlashExpr);
   ASTNode_addChild(node, l1);
 
   while (1) {
@@ -303,7 +304,7 @@ static inline ASTNode *peg_parse_ModExprList(parser_ctx *ctx) {
 
   RULE_BEGIN("ModExprList");
 
-  INIT("ModExprList");
+  INIT(AST_ModExprList);
 
   while (1) {
     WS();
@@ -324,7 +325,7 @@ static inline ASTNode *peg_parse_ModExprList(parser_ctx *ctx) {
 static inline ASTNode *peg_parse_ModExpr(parser_ctx *ctx) {
 
   RULE_BEGIN("ModExpr");
-  INIT("ModExpr");
+  INIT(AST_ModExpr);
   ModExprOpts *opts;
   node->extra = opts = (ModExprOpts *)malloc(sizeof(ModExprOpts));
   if (!opts)
@@ -401,7 +402,7 @@ static inline ASTNode *peg_parse_ModExpr(parser_ctx *ctx) {
     int err = 0;
     list_codepoint_t cps = parse_codepoint_string(ctx, &err);
     if (!err) {
-      errhandler = ASTNode_new("ErrString");
+      errhandler = ASTNode_new(AST_ErrString);
       codepoint_t *cpstr;
       errhandler->extra = cpstr = (codepoint_t *)malloc(
           sizeof(codepoint_t) + cps.len * sizeof(codepoint_t));
@@ -439,7 +440,7 @@ static inline ASTNode *peg_parse_BaseExpr(parser_ctx *ctx) {
 
   ASTNode *n = peg_parse_UpperIdent(ctx);
   if (n) {
-    INIT("BaseExpr");
+    INIT(AST_BaseExpr);
     ASTNode_addChild(node, n);
     RETURN(node);
   }
@@ -457,14 +458,14 @@ static inline ASTNode *peg_parse_BaseExpr(parser_ctx *ctx) {
     }
 
     REWIND(before_ws);
-    INIT("BaseExpr");
+    INIT(AST_BaseExpr);
     ASTNode_addChild(node, n);
     RETURN(node);
   }
 
   n = peg_parse_CodeExpr(ctx);
   if (n) {
-    INIT("BaseExpr");
+    INIT(AST_BaseExpr);
     ASTNode_addChild(node, n);
     RETURN(node);
   }
@@ -491,7 +492,7 @@ static inline ASTNode *peg_parse_BaseExpr(parser_ctx *ctx) {
   }
   NEXT();
 
-  INIT("BaseExpr");
+  INIT(AST_BaseExpr);
   ASTNode_addChild(node, n);
   RETURN(node);
 }
@@ -543,7 +544,7 @@ static inline ASTNode *peg_parse_CodeExpr(parser_ctx *ctx) {
 
   size_t diff = ctx->pos - _rew_to_sv_start - 1;
 
-  INIT("CodeExpr");
+  INIT(AST_CodeExpr);
   CodeExprOpts *opts = (CodeExprOpts *)malloc(sizeof(size_t) + diff + 1);
   node->extra = opts;
   opts->line_nbr = _rew_to_line_nbr_sv_start;
@@ -561,7 +562,7 @@ static inline ASTNode *peg_parse_CodeExpr(parser_ctx *ctx) {
 }
 
 // tokendef->children[0] is an ident
-// tokendef->children[1] is a litdef or smdef.
+// tokendef->children[1] is a litdef, smdef, or regexdef.
 static inline ASTNode *peg_parse_TokenDef(parser_ctx *ctx) {
 
   RULE_BEGIN("TokenDef");
@@ -586,6 +587,8 @@ static inline ASTNode *peg_parse_TokenDef(parser_ctx *ctx) {
   ASTNode *rule = peg_parse_LitDef(ctx);
   if (!rule) {
     rule = peg_parse_SMDef(ctx);
+    if (!rule)
+      rule = peg_parse_RegexDef(ctx);
     if (!rule) {
       ASTNode_destroy(id);
       REWIND(begin);
@@ -604,7 +607,7 @@ static inline ASTNode *peg_parse_TokenDef(parser_ctx *ctx) {
   }
   NEXT(); // One char, either ; or \n.
 
-  INIT("TokenDef");
+  INIT(AST_TokenDef);
   ASTNode_addChild(node, id);
   ASTNode_addChild(node, rule);
   RETURN(node);
@@ -632,7 +635,7 @@ static inline ASTNode *peg_parse_LitDef(parser_ctx *ctx) {
   }
 
   // Return a null terminated codepoint string.
-  INIT("LitDef");
+  INIT(AST_LitDef);
   codepoint_t *cpstr;
   node->extra = cpstr = (codepoint_t *)malloc(sizeof(codepoint_t) +
                                               cps.len * sizeof(codepoint_t));
@@ -662,7 +665,7 @@ static inline ASTNode *peg_parse_SMDef(parser_ctx *ctx) {
   if (!accepting_states)
     RETURN(NULL);
 
-  INIT("SMDef");
+  INIT(AST_SMDef);
   ASTNode_addChild(node, accepting_states);
 
   WS();
@@ -678,7 +681,7 @@ static inline ASTNode *peg_parse_SMDef(parser_ctx *ctx) {
   while (1) {
     WS();
 
-    ASTNode *rule = ASTNode_new("Rule");
+    ASTNode *rule = ASTNode_new(AST_Rule);
 
     // Parse the transition conditons of the rule
     ASTNode *pair = peg_parse_Pair(ctx);
@@ -755,6 +758,45 @@ static inline ASTNode *peg_parse_SMDef(parser_ctx *ctx) {
   RETURN(node);
 }
 
+// regexdef->extra is the null terminated codepoint string between the
+// slashes, with its escapes left in. automata.h compiles it.
+static inline ASTNode *peg_parse_RegexDef(parser_ctx *ctx) {
+
+  RULE_BEGIN("RegexDef");
+
+  if (!IS_CURRENT("/"))
+    RETURN(NULL);
+  NEXT();
+
+  // Read up to the closing slash, skipping over escaped ones. A regex
+  // can't be empty or span lines.
+  size_t start = ctx->pos;
+  while (HAS_CURRENT() && !IS_CURRENT("/") && !IS_CURRENT("\n")) {
+    if (IS_CURRENT("\\"))
+      NEXT();
+    if (HAS_CURRENT() && !IS_CURRENT("\n"))
+      NEXT();
+  }
+  size_t len = ctx->pos - start;
+  if (!HAS_CURRENT() || !IS_CURRENT("/") || !len) {
+    REWIND(begin);
+    RETURN(NULL);
+  }
+  NEXT();
+
+  INIT(AST_RegexDef);
+  codepoint_t *cpstr;
+  node->extra = cpstr =
+      (codepoint_t *)malloc(sizeof(codepoint_t) * (len + 1));
+  if (!cpstr)
+    OOM();
+  for (size_t i = 0; i < len; i++)
+    cpstr[i] = ctx->str[start + i];
+  cpstr[len] = 0;
+
+  RETURN(node);
+}
+
 // num->extra = int(int?)
 // or
 // num->children
@@ -766,7 +808,7 @@ static inline ASTNode *peg_parse_NumSet(parser_ctx *ctx) {
   size_t advanced_by;
   int simple = peg_parse_Num(ctx, &advanced_by);
   if (advanced_by) {
-    INIT("Num");
+    INIT(AST_Num);
     int *iptr;
     node->extra = iptr = (int *)malloc(sizeof(int));
     if (!node->extra)
@@ -808,7 +850,7 @@ static inline ASTNode *peg_parse_NumSet(parser_ctx *ctx) {
       }
       NEXT();
 
-      INIT("NumRange");
+      INIT(AST_NumRange);
       int *iptr;
       node->extra = iptr = (int *)malloc(sizeof(int) * 2);
       if (!iptr)
@@ -828,7 +870,7 @@ static inline ASTNode *peg_parse_NumSet(parser_ctx *ctx) {
     RETURN(NULL);
   }
 
-  INIT("NumSetList");
+  INIT(AST_NumSetList);
   ASTNode_addChild(node, first);
 
   WS();
@@ -892,7 +934,7 @@ static inline ASTNode *peg_parse_CharSet(parser_ctx *ctx) {
     }
     NEXT();
 
-    INIT("Char");
+    INIT(AST_Char);
     codepoint_t *cpptr;
     node->extra = cpptr = (codepoint_t *)malloc(sizeof(codepoint_t));
     if (!cpptr)
@@ -911,7 +953,7 @@ static inline ASTNode *peg_parse_CharSet(parser_ctx *ctx) {
   if (is_inverted)
     NEXT();
 
-  INIT("CharSet");
+  INIT(AST_CharSet);
   bool *bptr;
   node->extra = bptr = (bool *)malloc(sizeof(bool));
   if (!bptr)
@@ -948,7 +990,7 @@ static inline ASTNode *peg_parse_CharSet(parser_ctx *ctx) {
     }
 
     // Parsed a single char
-    ASTNode *cld = !c2 ? ASTNode_new("Char") : ASTNode_new("CharRange");
+    ASTNode *cld = !c2 ? ASTNode_new(AST_Char) : ASTNode_new(AST_CharRange);
     codepoint_t *cpptr;
     cld->extra = cpptr =
         (codepoint_t *)malloc(sizeof(codepoint_t) * (c2 ? 2 : 1));
@@ -1017,7 +1059,7 @@ static inline ASTNode *peg_parse_Pair(parser_ctx *ctx) {
   }
   NEXT();
 
-  INIT("Pair");
+  INIT(AST_Pair);
   ASTNode_addChild(node, left_numset);
   ASTNode_addChild(node, right_charset);
 
@@ -1044,7 +1086,7 @@ static inline ASTNode *peg_parse_UpperIdent(parser_ctx *ctx) {
   if (ctx->pos == startpos)
     RETURN(NULL);
 
-  INIT("UpperIdent");
+  INIT(AST_UpperIdent);
   char *idstr;
   size_t idstrsize = ctx->pos - startpos;
   node->extra = idstr = (char *)malloc(idstrsize + 1);
@@ -1078,7 +1120,7 @@ static inline ASTNode *peg_parse_LowerIdent(parser_ctx *ctx) {
   if (ctx->pos == startpos)
     RETURN(NULL);
 
-  INIT("LowerIdent");
+  INIT(AST_LowerIdent);
   char *idstr;
   size_t idstrsize = ctx->pos - startpos;
   node->extra = idstr = (char *)malloc(idstrsize + 1);
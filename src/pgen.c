@@ -1,7 +1,9 @@
+#include "analyze.h"
 #include "argparse.h"
 #include "astvalid.h"
 #include "automata.h"
 #include "codegen.h"
+#include "inputgen.h"
 #include "parserctx.h"
 #include "pegoptim.h"
 #include "pegparser.h"
@@ -28,20 +30,59 @@ int main(int argc, char **argv) {
   Symtabs symtabs = gen_symtabs(ast);
   validateSymtabs(args, symtabs);
 
+  // Report on the grammar instead of generating a parser.
+  if (args.analyze) {
+    analyzeGrammar(symtabs);
+    destroy_symtabs(symtabs);
+    ASTNode_destroy(ast);
+    free(parserFile.str);
+    return 0;
+  }
+
   // Parse IR from symtabs.
-  TrieAutomaton trie = createTrieAutomaton(symtabs.tokendefs);
   list_SMAutomaton smauts = createSMAutomata(symtabs.tokendefs);
 
+  // Write random inputs instead of a parser.
+  if (args.genInputs) {
+    generateInputs(&args, symtabs, smauts);
+    destroySMAutomata(smauts);
+    destroy_symtabs(symtabs);
+    ASTNode_destroy(ast);
+    free(parserFile.str);
+    return 0;
+  }
+
+  // With --keyword-hash, the literals that the state machines also match are
+  // looked up in a hash table instead of the trie.
+  list_ASTNodePtr keywords = list_ASTNodePtr_new();
+  list_ASTNodePtr literals = symtabs.tokendefs;
+  if (args.kwhash)
+    kwhash_split(symtabs.tokendefs, smauts, &keywords, &literals);
+  TrieAutomaton trie = createTrieAutomaton(literals);
+
   // Generate the output file.
   codegen_ctx cctx;
-  codegen_ctx_init(&cctx, &args, ast, symtabs, trie, smauts);
-  codegen_write(&cctx);
+  codegen_ctx_init(&cctx, &args, ast, symtabs, trie, smauts, keywords,
+                   parserFile);
+
+  // Leave the output alone if it's up to date, so that its mtime doesn't
+  // change and everything built from it doesn't have to be rebuilt.
+  int fresh = codegen_is_fresh(&cctx);
+  if (args.check)
+    printf("%s is %s.\n", args.outputTarget,
+           fresh ? "up to date" : "out of date");
+  if (fresh | args.check)
+    cctx.keep_output = 1;
+  else
+    codegen_write(&cctx);
   codegen_ctx_destroy(&cctx);
 
   // Clean up memory
   destroyTrieAutomaton(trie);
   destroySMAutomata(smauts);
+  if (args.kwhash)
+    list_ASTNodePtr_clear(&literals);
   free(parserFile.str);
 
-  return 0;
+  return args.check && !fresh;
 }
@@ -106,15 +106,18 @@ static inline void generate_extension_prologue(codegen_ctx *ctx,
   fprintf(ext_file, "  Py_DECREF(tok_repr_str);\n");
   fprintf(ext_file, "\n");
   fprintf(ext_file, "  // Add children to the dictionary\n");
+  fprintf(ext_file, "  size_t num_children = %s_astnode_num_children(node);\n",
+          ctx->lower);
   fprintf(ext_file,
-          "  PyObject *children_list = PyList_New(node->num_children);\n");
+          "  PyObject *children_list = PyList_New((Py_ssize_t)num_children);\n");
   fprintf(ext_file, "  if (!children_list) {\n");
   fprintf(ext_file, "    Py_DECREF(dict);\n");
   fprintf(ext_file, "    return NULL;\n");
   fprintf(ext_file, "  }\n");
-  fprintf(ext_file, "  for (uint16_t i = 0; i < node->num_children; i++) {\n");
+  fprintf(ext_file, "  for (size_t i = 0; i < num_children; i++) {\n");
   fprintf(ext_file,
-          "    PyObject *child = ast_to_python_dict(node->children[i]);\n");
+          "    PyObject *child = ast_to_python_dict(%s_astnode_child(node, i));\n",
+          ctx->lower);
   fprintf(ext_file, "    if (!child) {\n");
   fprintf(ext_file, "      Py_DECREF(children_list);\n");
   fprintf(ext_file, "      Py_DECREF(dict);\n");
@@ -0,0 +1,561 @@
+#ifndef PGEN_REGEX_INCLUDE
+#define PGEN_REGEX_INCLUDE
+
+#ifndef PGEN_AUTOMATA_INCLUDE
+#include "automata.h"
+#endif
+
+/*
+ * Regex token definitions, like NUMBER: /[-+]?[0-9]+/; are compiled into the
+ * same state machines as the ones written out by hand. The regex is parsed
+ * into a tree, the tree is built into a Thompson NFA, the NFA is made into a
+ * DFA by subset construction, and SMAutomaton_minimize() does the rest.
+ *
+ * The syntax is the usual one. Alternation with |, grouping with (), the
+ * repetitions *, +, ?, {n}, {n,} and {n,m}, character classes like [a-z] and
+ * [^\n], and . for anything but a newline. The escapes \n, \r, \t, \f, \v and
+ * \xHH are characters, \d, \w and \s are classes (and \D, \W and \S are the
+ * opposite), and a backslash before anything else, like \/ or \., makes it an
+ * ordinary character.
+ */
+
+// The most times a {n,m} can repeat something. Every repetition is another
+// copy of it in the NFA.
+#define REGEX_MAX_REPEAT 1000
+
+typedef enum {
+  REGEX_SET,   // One codepoint out of set.
+  REGEX_EMPTY, // The empty string.
+  REGEX_CAT,   // a, then b.
+  REGEX_ALT,   // a or b.
+  REGEX_STAR,  // a, any number of times.
+} RegexKind;
+
+// Nodes refer to each other by index, and can be shared. x+ is xx*, with both
+// x the same node.
+typedef struct {
+  RegexKind kind;
+  int a;
+  int b;
+  list_CharRange set; // Sorted and merged.
+} RegexNode;
+
+LIST_DECLARE(RegexNode)
+LIST_DEFINE(RegexNode)
+
+typedef struct {
+  char *ident;
+  codepoint_t *str;
+  size_t pos;
+  list_RegexNode nodes;
+} RegexParser;
+
+#define REGEX_ERROR(p, msg)                                                    \
+  ERROR("In the regex for %s, at position %zu: %s.", (p)->ident, (p)->pos,     \
+        msg)
+
+static inline int regex_node(RegexParser *p, RegexKind kind, int a, int b,
+                             list_CharRange set) {
+  RegexNode node;
+  node.kind = kind;
+  node.a = a;
+  node.b = b;
+  node.set = set;
+  if (list_RegexNode_add(&p->nodes, node))
+    OOM();
+  return (int)p->nodes.len - 1;
+}
+
+// Everything but the sorted and merged ranges, out of all the codepoints.
+static inline list_CharRange regex_complement(list_CharRange l) {
+  list_CharRange c = list_CharRange_new();
+  int64_t next = INT32_MIN;
+  for (size_t i = 0; i < l.len; i++) {
+    if (l.buf[i].f > next)
+      list_CharRange_add(&c, (CharRange){(codepoint_t)next, l.buf[i].f - 1});
+    next = (int64_t)l.buf[i].s + 1;
+  }
+  if (next <= INT32_MAX)
+    list_CharRange_add(&c, (CharRange){(codepoint_t)next, INT32_MAX});
+  list_CharRange_clear(&l);
+  return c;
+}
+
+static inline int regex_hexdigit(codepoint_t c) {
+  if ((c >= '0') & (c <= '9'))
+    return (int)(c - '0');
+  if ((c >= 'a') & (c <= 'f'))
+    return (int)(c - 'a' + 10);
+  if ((c >= 'A') & (c <= 'F'))
+    return (int)(c - 'A' + 10);
+  return -1;
+}
+
+// Adds what the escape after a backslash stands for to the ranges.
+static inline void regex_parse_escape(RegexParser *p, list_CharRange *l) {
+  codepoint_t c = p->str[p->pos];
+  if (!c)
+    REGEX_ERROR(p, "the regex ends with a backslash");
+  p->pos++;
+
+  list_CharRange cls = list_CharRange_new();
+  codepoint_t lower = (c >= 'A') & (c <= 'Z') ? c - 'A' + 'a' : c;
+  if (lower == 'd') {
+    list_CharRange_add(&cls, (CharRange){'0', '9'});
+  } else if (lower == 'w') {
+    list_CharRange_add(&cls, (CharRange){'0', '9'});
+    list_CharRange_add(&cls, (CharRange){'A', 'Z'});
+    list_CharRange_add(&cls, (CharRange){'_', '_'});
+    list_CharRange_add(&cls, (CharRange){'a', 'z'});
+  } else if (lower == 's') {
+    list_CharRange_add(&cls, (CharRange){'\t', '\r'});
+    list_CharRange_add(&cls, (CharRange){' ', ' '});
+  } else {
+    if (c == 'n')
+      c = '\n';
+    else if (c == 'r')
+      c = '\r';
+    else if (c == 't')
+      c = '\t';
+    else if (c == 'f')
+      c = '\f';
+    else if (c == 'v')
+      c = '\v';
+    else if (c == 'x') {
+      int hi = regex_hexdigit(p->str[p->pos]);
+      int lo = hi == -1 ? -1 : regex_hexdigit(p->str[p->pos + 1]);
+      if (lo == -1)
+        REGEX_ERROR(p, "\\x needs two hex digits");
+      c = (codepoint_t)(hi * 16 + lo);
+      p->pos += 2;
+    }
+    list_CharRange_add(l, (CharRange){c, c});
+    return;
+  }
+
+  if (c != lower)
+    cls = regex_complement(cls);
+  for (size_t i = 0; i < cls.len; i++)
+    list_CharRange_add(l, cls.buf[i]);
+  list_CharRange_clear(&cls);
+}
+
+// One codepoint of a class, or a range's end. Returns -1 for an escape that's
+// a class, and adds it to the ranges instead.
+static inline int64_t regex_parse_classchar(RegexParser *p,
+                                            list_CharRange *l) {
+  codepoint_t c = p->str[p->pos];
+  if (!c)
+    REGEX_ERROR(p, "unclosed [");
+  p->pos++;
+  if (c != '\\')
+    return c;
+
+  size_t len = l->len;
+  regex_parse_escape(p, l);
+  if ((l->len != len + 1) || (l->buf[len].f != l->buf[len].s))
+    return -1;
+  return l->buf[--l->len].f;
+}
+
+static inline int regex_parse_class(RegexParser *p) {
+  bool inverted = p->str[p->pos] == '^';
+  if (inverted)
+    p->pos++;
+
+  // A ] first is part of the class, like [])].
+  list_CharRange l = list_CharRange_new();
+  bool first = 1;
+  while (first || p->str[p->pos] != ']') {
+    first = 0;
+    int64_t f = regex_parse_classchar(p, &l);
+    if (f == -1)
+      continue;
+    int64_t s = f;
+    if (p->str[p->pos] == '-' && p->str[p->pos + 1] &&
+        (p->str[p->pos + 1] != ']')) {
+      p->pos++;
+      if ((s = regex_parse_classchar(p, &l)) == -1)
+        REGEX_ERROR(p, "a range can't end with a class");
+      if (s < f)
+        REGEX_ERROR(p, "the range is backwards");
+    }
+    list_CharRange_add(&l, (CharRange){(codepoint_t)f, (codepoint_t)s});
+  }
+  p->pos++;
+
+  l = compressCharRanges(l);
+  if (inverted)
+    l = regex_complement(l);
+  return regex_node(p, REGEX_SET, -1, -1, l);
+}
+
+static inline int regex_parse_alt(RegexParser *p);
+
+static inline int regex_parse_atom(RegexParser *p) {
+  codepoint_t c = p->str[p->pos++];
+  list_CharRange l = list_CharRange_new();
+  if (c == '(') {
+    int inner = regex_parse_alt(p);
+    if (p->str[p->pos] != ')')
+      REGEX_ERROR(p, "unclosed (");
+    p->pos++;
+    return inner;
+  } else if (c == '[') {
+    return regex_parse_class(p);
+  } else if (c == '.') {
+    list_CharRange_add(&l, (CharRange){'\n', '\n'});
+    l = regex_complement(l);
+  } else if (c == '\\') {
+    regex_parse_escape(p, &l);
+    l = compressCharRanges(l);
+  } else if ((c == '*') | (c == '+') | (c == '?') | (c == '{')) {
+    p->pos--;
+    REGEX_ERROR(p, "there's nothing to repeat");
+  } else {
+    list_CharRange_add(&l, (CharRange){c, c});
+  }
+  return regex_node(p, REGEX_SET, -1, -1, l);
+}
+
+static inline size_t regex_parse_count(RegexParser *p) {
+  size_t n = 0, start = p->pos;
+  while ((p->str[p->pos] >= '0') & (p->str[p->pos] <= '9')) {
+    n = n * 10 + (size_t)(p->str[p->pos++] - '0');
+    if (n > REGEX_MAX_REPEAT)
+      REGEX_ERROR(p, "too many repetitions");
+  }
+  if (p->pos == start)
+    REGEX_ERROR(p, "expected a number");
+  return n;
+}
+
+// a then b, where -1 is nothing.
+static inline int regex_cat(RegexParser *p, int a, int b) {
+  if ((a == -1) | (b == -1))
+    return a == -1 ? b : a;
+  return regex_node(p, REGEX_CAT, a, b, list_CharRange_new());
+}
+
+static inline int regex_parse_repeat(RegexParser *p) {
+  int node = regex_parse_atom(p);
+  for (;;) {
+    codepoint_t c = p->str[p->pos];
+    list_CharRange none = list_CharRange_new();
+    if (c == '*') {
+      p->pos++;
+      node = regex_node(p, REGEX_STAR, node, -1, none);
+    } else if (c == '+') {
+      p->pos++;
+      int star = regex_node(p, REGEX_STAR, node, -1, none);
+      node = regex_cat(p, node, star);
+    } else if (c == '?') {
+      p->pos++;
+      int empty = regex_node(p, REGEX_EMPTY, -1, -1, none);
+      node = regex_node(p, REGEX_ALT, node, empty, none);
+    } else if (c == '{') {
+      p->pos++;
+      size_t min = regex_parse_count(p), max = min;
+      bool unbounded = 0;
+      if (p->str[p->pos] == ',') {
+        p->pos++;
+        unbounded = p->str[p->pos] == '}';
+        if (!unbounded && (max = regex_parse_count(p)) < min)
+          REGEX_ERROR(p, "the repetition is backwards");
+      }
+      if (p->str[p->pos] != '}')
+        REGEX_ERROR(p, "unclosed {");
+      p->pos++;
+
+      // x{2,4} is xx(x(x)?)?, and x{2,} is xxx*.
+      int rep = -1;
+      for (size_t i = 0; i < min; i++)
+        rep = regex_cat(p, rep, node);
+      if (unbounded) {
+        rep = regex_cat(p, rep, regex_node(p, REGEX_STAR, node, -1, none));
+      } else {
+        int tail = -1;
+        for (size_t i = min; i < max; i++) {
+          int empty = regex_node(p, REGEX_EMPTY, -1, -1, none);
+          int more = regex_cat(p, node, tail);
+          tail = regex_node(p, REGEX_ALT, more, empty, none);
+        }
+        if (tail != -1)
+          rep = regex_cat(p, rep, tail);
+      }
+      node = rep == -1 ? regex_node(p, REGEX_EMPTY, -1, -1, none) : rep;
+    } else {
+      return node;
+    }
+  }
+}
+
+static inline int regex_parse_cat(RegexParser *p) {
+  int node = -1;
+  while (p->str[p->pos] && (p->str[p->pos] != '|') &&
+         (p->str[p->pos] != ')'))
+    node = regex_cat(p, node, regex_parse_repeat(p));
+  if (node == -1)
+    node = regex_node(p, REGEX_EMPTY, -1, -1, list_CharRange_new());
+  return node;
+}
+
+static inline int regex_parse_alt(RegexParser *p) {
+  int node = regex_parse_cat(p);
+  while (p->str[p->pos] == '|') {
+    p->pos++;
+    int other = regex_parse_cat(p);
+    node = regex_node(p, REGEX_ALT, node, other, list_CharRange_new());
+  }
+  return node;
+}
+
+// A state of the NFA goes to out[0] on a codepoint in the set of node set, or
+// if set is -1, to out[0] and out[1] on nothing. Unused outs are -1.
+typedef struct {
+  int set;
+  int out[2];
+} RegexState;
+
+LIST_DECLARE(RegexState)
+LIST_DEFINE(RegexState)
+
+static inline int regex_state(list_RegexState *nfa) {
+  RegexState s = {-1, {-1, -1}};
+  if (list_RegexState_add(nfa, s))
+    OOM();
+  return (int)nfa->len - 1;
+}
+
+// Builds the NFA for a node, with its own states. Returns the start, and
+// leaves the end in *end, with no outs.
+static inline int regex_build(RegexParser *p, list_RegexState *nfa, int n,
+                              int *end) {
+  RegexNode node = p->nodes.buf[n];
+  int start = regex_state(nfa);
+  int a_end, b_end;
+  if (node.kind == REGEX_SET) {
+    *end = regex_state(nfa);
+    nfa->buf[start].set = n;
+    nfa->buf[start].out[0] = *end;
+  } else if (node.kind == REGEX_EMPTY) {
+    *end = start;
+  } else if (node.kind == REGEX_CAT) {
+    int a = regex_build(p, nfa, node.a, &a_end);
+    int b = regex_build(p, nfa, node.b, &b_end);
+    nfa->buf[start].out[0] = a;
+    nfa->buf[a_end].out[0] = b;
+    *end = b_end;
+  } else if (node.kind == REGEX_ALT) {
+    int a = regex_build(p, nfa, node.a, &a_end);
+    int b = regex_build(p, nfa, node.b, &b_end);
+    *end = regex_state(nfa);
+    nfa->buf[start].out[0] = a;
+    nfa->buf[start].out[1] = b;
+    nfa->buf[a_end].out[0] = *end;
+    nfa->buf[b_end].out[0] = *end;
+  } else {
+    int a = regex_build(p, nfa, node.a, &a_end);
+    *end = regex_state(nfa);
+    nfa->buf[start].out[0] = a;
+    nfa->buf[start].out[1] = *end;
+    nfa->buf[a_end].out[0] = a;
+    nfa->buf[a_end].out[1] = *end;
+  }
+  return start;
+}
+
+// Adds the states that can be reached from the ones in set on nothing, and
+// sorts it. seen has to be all 0, and is left that way.
+static inline void regex_closure(list_RegexState *nfa, list_int *set,
+                                 bool *seen) {
+  for (size_t i = 0; i < set->len; i++)
+    seen[set->buf[i]] = 1;
+  for (size_t i = 0; i < set->len; i++) {
+    RegexState s = nfa->buf[set->buf[i]];
+    if (s.set != -1)
+      continue;
+    for (size_t o = 0; o < 2; o++) {
+      if (s.out[o] != -1 && !seen[s.out[o]]) {
+        seen[s.out[o]] = 1;
+        list_int_add(set, s.out[o]);
+      }
+    }
+  }
+  for (size_t i = 0; i < set->len; i++)
+    seen[set->buf[i]] = 0;
+  qsort(set->buf, set->len, sizeof(int), codepoint_cmp);
+}
+
+static inline uint64_t regex_set_hash(int *set, size_t len) {
+  uint64_t h = UINT64_C(14695981039346656037);
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint64_t)set[i];
+    h *= UINT64_C(1099511628211);
+  }
+  return h;
+}
+
+// The states of the DFA, each a set of states of the NFA. The sets are
+// stored one after another in states, and found by hash in table.
+typedef struct {
+  list_int states;
+  list_int offs; // Where each set starts in states, and where the last ends.
+  int *table;    // Indices of sets, or -1.
+  size_t table_cap;
+} RegexDFA;
+
+static inline int regex_dfa_find(RegexDFA *dfa, int *set, size_t len,
+                                 uint64_t hash) {
+  size_t mask = dfa->table_cap - 1;
+  for (size_t i = (size_t)hash & mask;; i = (i + 1) & mask) {
+    int d = dfa->table[i];
+    if (d == -1)
+      return -1;
+    size_t off = (size_t)dfa->offs.buf[d];
+    size_t dlen = (size_t)dfa->offs.buf[d + 1] - off;
+    if (dlen == len && !memcmp(dfa->states.buf + off, set, sizeof(int) * len))
+      return d;
+  }
+}
+
+static inline void regex_dfa_insert(RegexDFA *dfa, int d, uint64_t hash) {
+  size_t mask = dfa->table_cap - 1;
+  size_t i = (size_t)hash & mask;
+  while (dfa->table[i] != -1)
+    i = (i + 1) & mask;
+  dfa->table[i] = d;
+}
+
+// Returns the DFA state of the set, adding it if it's new.
+static inline int regex_dfa_add(RegexDFA *dfa, list_int *set) {
+  uint64_t hash = regex_set_hash(set->buf, set->len);
+  int d = regex_dfa_find(dfa, set->buf, set->len, hash);
+  if (d != -1)
+    return d;
+
+  d = (int)dfa->offs.len - 1;
+  for (size_t i = 0; i < set->len; i++)
+    list_int_add(&dfa->states, set->buf[i]);
+  list_int_add(&dfa->offs, (int)dfa->states.len);
+
+  // Keep the table at most half full.
+  if ((size_t)(d + 1) * 2 > dfa->table_cap) {
+    free(dfa->table);
+    dfa->table_cap *= 2;
+    dfa->table = (int *)malloc(sizeof(int) * dfa->table_cap);
+    if (!dfa->table)
+      OOM();
+    for (size_t i = 0; i < dfa->table_cap; i++)
+      dfa->table[i] = -1;
+    for (int e = 0; e < d; e++) {
+      size_t off = (size_t)dfa->offs.buf[e];
+      size_t len = (size_t)dfa->offs.buf[e + 1] - off;
+      regex_dfa_insert(dfa, e, regex_set_hash(dfa->states.buf + off, len));
+    }
+  }
+  regex_dfa_insert(dfa, d, hash);
+  return d;
+}
+
+// Compiles the regex of a token into a state machine that isn't minimized.
+static inline void regex_compile(SMAutomaton *aut, codepoint_t *regex) {
+  RegexParser p;
+  p.ident = aut->ident;
+  p.str = regex;
+  p.pos = 0;
+  p.nodes = list_RegexNode_new();
+  int root = regex_parse_alt(&p);
+  if (p.str[p.pos])
+    REGEX_ERROR(&p, "unmatched )");
+
+  list_RegexState nfa = list_RegexState_new();
+  int accept;
+  int start = regex_build(&p, &nfa, root, &accept);
+
+  // Split the codepoints into intervals that every set treats the same way.
+  list_int starts = list_int_new();
+  list_int_add(&starts, INT32_MIN);
+  for (size_t n = 0; n < p.nodes.len; n++) {
+    list_CharRange set = p.nodes.buf[n].set;
+    for (size_t r = 0; r < set.len; r++) {
+      list_int_add(&starts, set.buf[r].f);
+      if (set.buf[r].s != INT32_MAX)
+        list_int_add(&starts, set.buf[r].s + 1);
+    }
+  }
+  qsort(starts.buf, starts.len, sizeof(int), codepoint_cmp);
+  size_t K = 0;
+  for (size_t i = 0; i < starts.len; i++)
+    if (!i || starts.buf[i] != starts.buf[i - 1])
+      starts.buf[K++] = starts.buf[i];
+  starts.len = K;
+
+  // Subset construction. DFA states are numbered in the order they're
+  // found, so the start is 0.
+  RegexDFA dfa;
+  dfa.states = list_int_new();
+  dfa.offs = list_int_new();
+  list_int_add(&dfa.offs, 0);
+  dfa.table_cap = 16;
+  dfa.table = (int *)malloc(sizeof(int) * dfa.table_cap);
+  bool *seen = (bool *)calloc(nfa.len, sizeof(bool));
+  if (!dfa.table | !seen)
+    OOM();
+  for (size_t i = 0; i < dfa.table_cap; i++)
+    dfa.table[i] = -1;
+
+  list_int set = list_int_new();
+  list_int_add(&set, start);
+  regex_closure(&nfa, &set, seen);
+  regex_dfa_add(&dfa, &set);
+
+  for (int d = 0; d < (int)dfa.offs.len - 1; d++) {
+    bool accepting = 0;
+    for (int i = dfa.offs.buf[d]; i < dfa.offs.buf[d + 1]; i++)
+      accepting |= dfa.states.buf[i] == accept;
+    if (accepting)
+      stateranges_append(&aut->accepting, d);
+    if (!d && accepting)
+      ERROR("The regex for %s matches the empty string.", aut->ident);
+
+    for (size_t k = 0; k < K; k++) {
+      set.len = 0;
+      for (int i = dfa.offs.buf[d]; i < dfa.offs.buf[d + 1]; i++) {
+        RegexState s = nfa.buf[dfa.states.buf[i]];
+        if (s.set != -1 &&
+            charranges_contain(p.nodes.buf[s.set].set, starts.buf[k]))
+          list_int_add(&set, s.out[0]);
+      }
+      if (!set.len)
+        continue;
+      regex_closure(&nfa, &set, seen);
+      int to = regex_dfa_add(&dfa, &set);
+
+      codepoint_t end = k + 1 < K ? starts.buf[k + 1] - 1 : INT32_MAX;
+      SMTransition t;
+      t.from = list_StateRange_new();
+      list_StateRange_add(&t.from, (StateRange){d, d});
+      t.on = list_CharRange_new();
+      list_CharRange_add(&t.on, (CharRange){starts.buf[k], end});
+      t.inverted = 0;
+      t.to = to;
+      list_SMTransition_add(&aut->trans, t);
+    }
+  }
+
+  for (size_t n = 0; n < p.nodes.len; n++)
+    list_CharRange_clear(&p.nodes.buf[n].set);
+  list_RegexNode_clear(&p.nodes);
+  list_RegexState_clear(&nfa);
+  list_int_clear(&starts);
+  list_int_clear(&set);
+  list_int_clear(&dfa.states);
+  list_int_clear(&dfa.offs);
+  free(dfa.table);
+  free(seen);
+}
+
+#undef REGEX_ERROR
+
+#endif /* PGEN_REGEX_INCLUDE */
@@ -11,13 +11,55 @@ typedef struct {
   list_cstr peg_kind_names;
 } Symtabs;
 
+// Names sorted for lookup with bsearch(), remembering where each one came
+// from. Big grammars have thousands of rules, and checking each reference
+// against every name is quadratic.
+typedef struct {
+  char *name;
+  size_t idx;
+} SymName;
+
+typedef struct {
+  SymName *buf;
+  size_t len;
+} Symindex;
+
+static inline int SymName_cmp(const void *a, const void *b) {
+  return strcmp(((SymName *)a)->name, ((SymName *)b)->name);
+}
+
+static inline Symindex symindex_new(char **names, size_t len) {
+  Symindex ix;
+  ix.len = len;
+  ix.buf = (SymName *)malloc(sizeof(SymName) * (len ? len : 1));
+  if (!ix.buf)
+    OOM();
+  for (size_t i = 0; i < len; i++) {
+    ix.buf[i].name = names[i];
+    ix.buf[i].idx = i;
+  }
+  qsort(ix.buf, len, sizeof(SymName), SymName_cmp);
+  return ix;
+}
+
+// Returns the index that the name had in the list, or SIZE_MAX.
+static inline size_t symindex_find(Symindex *ix, char *name) {
+  SymName key;
+  key.name = name;
+  SymName *found =
+      (SymName *)bsearch(&key, ix->buf, ix->len, sizeof(SymName), SymName_cmp);
+  return found ? found->idx : SIZE_MAX;
+}
+
+static inline void symindex_destroy(Symindex *ix) { free(ix->buf); }
+
 static inline void resolvePrevNext(list_ASTNodePtr *defs);
 
 static inline void resolveReplace(ASTNode *node, char *prev_name,
                                   char *next_name) {
 
   // Replace prev or next with the appropriate
-  if (!strcmp(node->name, "LowerIdent")) {
+  if (node->kind == AST_LowerIdent) {
     char *id = (char *)node->extra;
     int prev = !strcmp(id, "prev");
     int next = !strcmp(id, "next");
@@ -38,7 +80,7 @@ static inline void resolveReplace(ASTNode *node, char *prev_name,
     }
   }
 
-  if (!strcmp(node->name, "ModExpr")) {
+  if (node->kind == AST_ModExpr) {
     resolveReplace(node->children[0], prev_name, next_name);
   } else {
     for (size_t i = 0; i < node->num_children; i++)
@@ -62,6 +104,29 @@ static inline void resolvePrevNext(list_ASTNodePtr *defs) {
   }
 }
 
+// Whether the token kind is named in a %ignore directive. The directive
+// lists token names separated by spaces or commas.
+static inline int symtab_is_ignored(list_ASTNodePtr directives,
+                                    char *tokname) {
+  size_t toklen = strlen(tokname);
+  for (size_t n = 0; n < directives.len; n++) {
+    ASTNode *dir = directives.buf[n];
+    if (strcmp((char *)dir->children[0]->extra, "ignore"))
+      continue;
+    char *c = (char *)dir->extra;
+    while (*c) {
+      while (*c == ' ' || *c == ',' || *c == '\t')
+        c++;
+      char *start = c;
+      while (*c && *c != ' ' && *c != ',' && *c != '\t')
+        c++;
+      if ((size_t)(c - start) == toklen && !strncmp(start, tokname, toklen))
+        return 1;
+    }
+  }
+  return 0;
+}
+
 // Creates the symbol tables
 static inline Symtabs gen_symtabs(ASTNode *ast) {
 
@@ -75,16 +140,16 @@ static inline Symtabs gen_symtabs(ASTNode *ast) {
   // Grab all the directives, and make sure their contents are reasonable.
   for (size_t i = 0; i < ast->num_children; i++) {
     ASTNode *node = ast->children[i];
-    if (!strcmp(node->name, "Directive")) {
+    if (node->kind == AST_Directive) {
       list_ASTNodePtr_add(&s.directives, node);
       if (!strcmp((char *)node->children[0]->extra, "node"))
         list_cstr_add(&s.peg_kind_names, (char *)node->extra);
       if (!strcmp((char *)node->children[0]->extra, "token"))
         list_cstr_add(&s.tok_kind_names, (char *)node->extra);
-    } else if (!strcmp(node->name, "TokenDef")) {
+    } else if (node->kind == AST_TokenDef) {
       list_ASTNodePtr_add(&s.tokendefs, node);
       list_cstr_add(&s.tok_kind_names, (char *)node->children[0]->extra);
-    } else if (!strcmp(node->name, "Definition")) {
+    } else if (node->kind == AST_Definition) {
       list_ASTNodePtr_add(&s.definitions, node);
       // list_cstr_add(&s.peg_kind_names, (char *)node->extra);
     } else
@@ -97,4 +162,13 @@ static inline Symtabs gen_symtabs(ASTNode *ast) {
   return s;
 }
 
+// Frees the lists. The nodes belong to the AST.
+static inline void destroy_symtabs(Symtabs s) {
+  list_ASTNodePtr_clear(&s.directives);
+  list_ASTNodePtr_clear(&s.definitions);
+  list_ASTNodePtr_clear(&s.tokendefs);
+  list_cstr_clear(&s.tok_kind_names);
+  list_cstr_clear(&s.peg_kind_names);
+}
+
 #endif /* PGEN_SYMTAB_INCLUDE */
@@ -0,0 +1,527 @@
+#ifndef PGEN_VMGEN_INCLUDE
+#define PGEN_VMGEN_INCLUDE
+
+#ifndef TOKCODEGEN_INCLUDE
+#include "codegen.h"
+#endif
+
+/*
+ * The bytecode backend, for --backend=vm. Rule bodies compile to bytecode
+ * that one shared interpreter runs, instead of to C. Rules are still C
+ * functions, so that memoization, profiling, budgets, and the depth limit
+ * work the same way. A rule's function holds its labels and variables, runs
+ * the interpreter, and runs the rule's code expressions when the interpreter
+ * hands them back. The interpreter keeps the result of the expression it's on
+ * in one register, r, and the places it can backtrack to on a stack.
+ */
+
+typedef enum {
+  VM_TOKEN,  // tok, cap: Match the token, capturing a leaf if cap.
+  VM_TOKJZ,  // tok, cap, to: TOKEN, then JZ.
+  VM_CALL,   // rule: Call the rule.
+  VM_CALLJZ, // rule, to: CALL, then JZ.
+  VM_CODE,   // id: Have the rule run code expression id.
+  VM_JZ,     // to: Jump if r is NULL.
+  VM_JNZ,    // to: Jump if r is not NULL.
+  VM_PUSH,   // Save the position and the allocator.
+  VM_POP,    // Drop what was saved, restoring it if r is NULL.
+  VM_REWIND, // Drop what was saved, restoring it.
+  VM_STEP,   // Take a step of the parse's budget.
+  VM_SUCC,   // Set r to SUCC.
+  VM_OPT,    // Set r to SUCC if it's NULL.
+  VM_NOT,    // Swap NULL and SUCC.
+  VM_LABEL,  // slot: Store r in the label.
+  VM_ERRSTR, // msg: If r is NULL, report a fatal error and stop.
+  VM_RETURN, // Return r from the rule, or NULL if r is SUCC.
+  VM_END,    // Return the rule's result.
+  VM_NUM_OPS
+} vm_op;
+
+static const char *vm_op_names[VM_NUM_OPS] = {
+    "TOKEN", "TOKJZ", "CALL",  "CALLJZ", "CODE",   "JZ",
+    "JNZ",   "PUSH",  "POP",   "REWIND", "STEP",   "SUCC",
+    "OPT",   "NOT",   "LABEL", "ERRSTR", "RETURN", "END"};
+
+// Compiles one rule.
+typedef struct {
+  codegen_ctx *ctx;
+  list_cstr labels;       // Slot 0 is the rule's result.
+  list_ASTNodePtr codes;  // Code expression id - 1.
+  size_t sp;
+  size_t max_sp;
+} vm_compiler;
+
+static inline size_t vm_emit(vm_compiler *vc, size_t word) {
+  list_size_t_add(&vc->ctx->vm_code, word);
+  return vc->ctx->vm_code.len - 1;
+}
+
+static inline size_t vm_here(vm_compiler *vc) { return vc->ctx->vm_code.len; }
+
+static inline void vm_patch(vm_compiler *vc, size_t at, size_t to) {
+  vc->ctx->vm_code.buf[at] = to;
+}
+
+static inline size_t vm_label_slot(vm_compiler *vc, char *name) {
+  if (!strcmp(name, "rule"))
+    return 0;
+  for (size_t i = 1; i < vc->labels.len; i++)
+    if (!strcmp(vc->labels.buf[i], name))
+      return i;
+  ERROR("UNREACHABLE ERROR. Label %s was not collected.", name);
+}
+
+static inline size_t vm_token_idx(vm_compiler *vc, char *name) {
+  size_t i = symindex_find(&vc->ctx->vm_tok_ix, name);
+  if (i == SIZE_MAX)
+    ERROR("UNREACHABLE ERROR. %s is not a token.", name);
+  return i;
+}
+
+static inline size_t vm_rule_idx(vm_compiler *vc, char *name) {
+  size_t i = symindex_find(&vc->ctx->vm_rule_ix, name);
+  if (i == SIZE_MAX)
+    ERROR("UNREACHABLE ERROR. Rule %s does not exist.", name);
+  return i;
+}
+
+// Leaves the result of the expression in r. Mirrors peg_visit_write_exprs(),
+// which has the reasoning behind what's captured where.
+static inline void vm_compile_expr(vm_compiler *vc, ASTNode *expr,
+                                   int capture) {
+  if (expr->kind == AST_SlashExpr) {
+    if (expr->num_children == 1) {
+      vm_compile_expr(vc, expr->children[0], capture);
+      return;
+    }
+    list_size_t jumps = list_size_t_new();
+    for (size_t i = 0; i < expr->num_children; i++) {
+      vm_compile_expr(vc, expr->children[i], capture);
+      if (i != expr->num_children - 1) {
+        vm_emit(vc, VM_JNZ);
+        list_size_t_add(&jumps, vm_emit(vc, 0));
+      }
+    }
+    for (size_t i = 0; i < jumps.len; i++)
+      vm_patch(vc, jumps.buf[i], vm_here(vc));
+    list_size_t_clear(&jumps);
+
+  } else if (expr->kind == AST_ModExprList) {
+    size_t push = vm_emit(vc, VM_PUSH);
+    if (++vc->sp > vc->max_sp)
+      vc->max_sp = vc->sp;
+    list_size_t jumps = list_size_t_new();
+    for (size_t i = 0; i < expr->num_children; i++) {
+      int last = (i == expr->num_children - 1);
+      size_t start = vm_here(vc);
+      vm_compile_expr(vc, expr->children[i], last ? capture : 0);
+      if (last)
+        break;
+
+      // Most elements are a single token or rule, so fold the jump into it.
+      size_t *code = vc->ctx->vm_code.buf;
+      size_t len = vm_here(vc) - start;
+      if ((len == 3) & (code[start] == VM_TOKEN))
+        code[start] = VM_TOKJZ;
+      else if ((len == 2) & (code[start] == VM_CALL))
+        code[start] = VM_CALLJZ;
+      else
+        vm_emit(vc, VM_JZ);
+      list_size_t_add(&jumps, vm_emit(vc, 0));
+    }
+    for (size_t i = 0; i < jumps.len; i++)
+      vm_patch(vc, jumps.buf[i], vm_here(vc));
+    list_size_t_clear(&jumps);
+    vc->sp--;
+
+    // A token doesn't move or allocate when it fails to match, so there's
+    // nothing to save for a list of one.
+    size_t *code = vc->ctx->vm_code.buf;
+    size_t len = vm_here(vc) - (push + 1);
+    int lone_token =
+        (expr->num_children == 1) & (code[push + 1] == VM_TOKEN) &
+        ((len == 3) | ((len == 5) & (code[push + 4] == VM_LABEL)));
+    if (lone_token) {
+      for (size_t i = push; i < push + len; i++)
+        code[i] = code[i + 1];
+      vc->ctx->vm_code.len--;
+    } else {
+      vm_emit(vc, VM_POP);
+    }
+
+  } else if (expr->kind == AST_ModExpr) {
+    ModExprOpts opts = *(ModExprOpts *)expr->extra;
+    int has_label = expr->num_children >= 2 &&
+                    expr->children[1]->kind == AST_LowerIdent;
+    int has_errhandler = (expr->num_children - (size_t)has_label) == 2;
+    ASTNode *errhandler =
+        has_errhandler ? expr->children[has_label ? 2 : 1] : NULL;
+
+    if ((!opts.inverted) & (!opts.kleene_plus) & (!opts.optional) &
+        (!opts.rewind) & (!has_errhandler) & (expr->num_children == 1)) {
+      vm_compile_expr(vc, expr->children[0], capture);
+      return;
+    }
+
+    int stateless = opts.inverted | opts.rewind;
+    if (stateless) {
+      vm_emit(vc, VM_PUSH);
+      if (++vc->sp > vc->max_sp)
+        vc->max_sp = vc->sp;
+    }
+
+    if (opts.kleene_plus == 1) {
+      // One, then zero or more.
+      vm_emit(vc, VM_STEP);
+      vm_compile_expr(vc, expr->children[0], 0);
+      vm_emit(vc, VM_JZ);
+      size_t fail = vm_emit(vc, 0);
+      size_t loop = vm_here(vc);
+      vm_emit(vc, VM_STEP);
+      vm_compile_expr(vc, expr->children[0], 0);
+      vm_emit(vc, VM_JNZ);
+      vm_emit(vc, loop);
+      vm_emit(vc, VM_SUCC);
+      vm_patch(vc, fail, vm_here(vc));
+    } else if (opts.kleene_plus == 2) {
+      size_t loop = vm_here(vc);
+      vm_emit(vc, VM_STEP);
+      vm_compile_expr(vc, expr->children[0], 0);
+      vm_emit(vc, VM_JNZ);
+      vm_emit(vc, loop);
+      vm_emit(vc, VM_SUCC);
+    } else {
+      int f = (capture | has_label) & (!opts.optional) & (!opts.inverted);
+      vm_compile_expr(vc, expr->children[0], f);
+    }
+
+    if (opts.optional)
+      vm_emit(vc, VM_OPT);
+    else if (opts.inverted)
+      vm_emit(vc, VM_NOT);
+
+    if (stateless) {
+      vm_emit(vc, VM_REWIND);
+      vc->sp--;
+    }
+
+    if (errhandler) {
+      if (errhandler->kind == AST_ErrString) {
+        codepoint_t *cps = (codepoint_t *)errhandler->extra;
+        String_View sv =
+            UTF8_encode_view((Codepoint_String_View){cps, cpstrlen(cps)});
+        list_cstr_add(&vc->ctx->vm_msgs, sv.str);
+        vm_emit(vc, VM_ERRSTR);
+        vm_emit(vc, vc->ctx->vm_msgs.len - 1);
+      } else {
+        vm_emit(vc, VM_JNZ);
+        size_t ok = vm_emit(vc, 0);
+        vm_compile_expr(vc, errhandler, 0);
+        vm_emit(vc, VM_RETURN);
+        vm_patch(vc, ok, vm_here(vc));
+      }
+    }
+
+    if (has_label) {
+      vm_emit(vc, VM_LABEL);
+      vm_emit(vc, vm_label_slot(vc, (char *)expr->children[1]->extra));
+    }
+
+  } else if (expr->kind == AST_BaseExpr) {
+    vm_compile_expr(vc, expr->children[0], capture);
+
+  } else if (expr->kind == AST_UpperIdent) {
+    char *tokname = (char *)expr->extra;
+    if (capture && !vc->ctx->args->u)
+      peg_ensure_kind(vc->ctx, tokname);
+    vm_emit(vc, VM_TOKEN);
+    vm_emit(vc, vm_token_idx(vc, tokname));
+    vm_emit(vc, capture ? 1 : 0);
+
+  } else if (expr->kind == AST_LowerIdent) {
+    vm_emit(vc, VM_CALL);
+    vm_emit(vc, vm_rule_idx(vc, (char *)expr->extra));
+
+  } else if (expr->kind == AST_CodeExpr) {
+    list_ASTNodePtr_add(&vc->codes, expr);
+    vm_emit(vc, VM_CODE);
+    vm_emit(vc, vc->codes.len);
+
+  } else {
+    ERROR("UNREACHABLE ERROR. UNKNOWN NODE TYPE:\n %s\n", expr->name);
+  }
+}
+
+// The types the rules need. The interpreter comes after the rules, along
+// with the bytecode they compile to.
+static inline void peg_write_vm_header(codegen_ctx *ctx) {
+  cwrite("/*\n");
+  cwrite(" * Rules are compiled to bytecode, which %s_vm_run() interprets. "
+         "A rule's\n",
+         ctx->lower);
+  cwrite(" * function holds its labels, and runs its code expressions when "
+         "the\n");
+  cwrite(" * interpreter returns their ids.\n");
+  cwrite(" */\n");
+  cwrite("#ifndef %s_VM_GOTO\n", ctx->upper);
+  cwrite("#if defined(__GNUC__) || defined(__clang__)\n");
+  cwrite("#define %s_VM_GOTO 1\n", ctx->upper);
+  cwrite("#else\n");
+  cwrite("#define %s_VM_GOTO 0\n", ctx->upper);
+  cwrite("#endif\n");
+  cwrite("#endif\n\n");
+  cwrite("typedef enum {\n");
+  for (size_t i = 0; i < VM_NUM_OPS; i++)
+    cwrite("  %s_VM_%s,\n", ctx->upper, vm_op_names[i]);
+  cwrite("} %s_vm_op;\n\n", ctx->lower);
+  cwrite("typedef struct {\n");
+  cwrite("  size_t pc;\n");
+  cwrite("  %s_astnode_t* r;\n", ctx->lower);
+  cwrite("  %s_astnode_t** slots;\n", ctx->lower);
+  cwrite("  pgen_parser_rewind_t* stack;\n");
+  cwrite("  size_t sp;\n");
+  cwrite("} %s_vm;\n\n", ctx->lower);
+  cwrite("static inline int %s_vm_run(%s_parser_ctx* ctx, %s_vm* vm);\n\n",
+         ctx->lower, ctx->lower, ctx->lower);
+}
+
+static inline void peg_write_vm_body(codegen_ctx *ctx, ASTNode *def) {
+  char *def_name = (char *)def->children[0]->extra;
+  vm_compiler vc;
+  vc.ctx = ctx;
+  vc.labels = list_cstr_new();
+  vc.codes = list_ASTNodePtr_new();
+  vc.sp = vc.max_sp = 0;
+  list_cstr_add(&vc.labels, "rule");
+  peg_visit_add_labels(ctx, def->children[1], &vc.labels);
+
+  size_t entry = vm_here(&vc);
+  vm_compile_expr(&vc, def->children[1], 1);
+  vm_emit(&vc, VM_END);
+
+  if (def->num_children == 3) {
+    ASTNode *sdefs = def->children[2];
+    for (size_t i = 0; i < sdefs->num_children; i++)
+      cwrite("  %s;\n", (char *)sdefs->children[i]->extra);
+    cwrite("\n");
+  }
+
+  cwrite("  %s_astnode_t* _slots[%zu] = {NULL", ctx->lower, vc.labels.len);
+  for (size_t i = 1; i < vc.labels.len; i++)
+    cwrite(", NULL");
+  cwrite("};\n");
+  cwrite("  pgen_parser_rewind_t _stack[%zu];\n", vc.max_sp ? vc.max_sp : 1);
+  cwrite("  %s_vm _vm = {%zu, NULL, _slots, _stack, 0};\n", ctx->lower, entry);
+  for (size_t i = 0; i < vc.labels.len; i++)
+    cwrite("  #define %s _slots[%zu]\n", vc.labels.buf[i], i);
+  iwrite("if (++ctx->depth > ctx->max_depth) {\n");
+  iwrite("  %s_parser_too_deep(ctx);\n", ctx->lower);
+  iwrite("  return NULL;\n");
+  iwrite("}\n");
+  peg_write_step(ctx);
+
+  if (!vc.codes.len) {
+    iwrite("if (%s_vm_run(ctx, &_vm)) return NULL;\n", ctx->lower);
+  } else {
+    iwrite("int _code;\n");
+    iwrite("while ((_code = %s_vm_run(ctx, &_vm)) > 0) {\n", ctx->lower);
+    iwrite("  #define ret _vm.r\n");
+    iwrite("  switch (_code) {\n");
+    for (size_t i = 0; i < vc.codes.len; i++) {
+      CodeExprOpts *opts = (CodeExprOpts *)vc.codes.buf[i]->extra;
+      iwrite("  case %zu: {\n", i + 1);
+      ctx->indent_cnt += 2;
+      if (ctx->args->l)
+        start_embed(ctx, opts->line_nbr);
+      iwrite("%s;\n", opts->content);
+      if (ctx->args->l)
+        end_embed(ctx);
+      ctx->indent_cnt -= 2;
+      iwrite("  } break;\n");
+    }
+    iwrite("  }\n");
+    iwrite("  #undef ret\n");
+    iwrite("}\n");
+    iwrite("if (_code) return NULL;\n");
+  }
+  for (size_t i = 0; i < vc.labels.len; i++)
+    cwrite("  #undef %s\n", vc.labels.buf[i]);
+
+  if (ctx->args->d)
+    iwrite("if (_vm.r==SUCC) fprintf(stderr, \"ERROR: Rule %s returned "
+           "SUCC.\\n\"), exit(1);\n",
+           def_name);
+  cwrite("  ctx->depth--;\n");
+  cwrite("  return _vm.r;\n");
+  cwrite("}\n\n");
+
+  list_cstr_clear(&vc.labels);
+  list_ASTNodePtr_clear(&vc.codes);
+}
+
+// Sets r to the result of matching the token at pc[0], capturing it if pc[1].
+static inline void vm_write_token_match(codegen_ctx *ctx) {
+  if (peg_tracks_examined(ctx))
+    cwrite("    %s_parser_examine(ctx);\n", ctx->lower);
+  cwrite("    if (ctx->pos < ctx->len && ctx->tokens[ctx->pos].kind == "
+         "(%s_token_kind)(pc[0] + 2)) {\n",
+         ctx->lower);
+  cwrite("      if (pc[1]) {\n");
+  cwrite("        r = %s_astnode_leaf(ctx->alloc, (%s_astnode_kind)pc[0]);\n",
+         ctx->lower, ctx->lower);
+  if (ctx->args->compact) {
+    cwrite("        r->tok_start = (uint32_t)ctx->pos;\n");
+    cwrite("        r->tok_len = 1;\n");
+  } else {
+    cwrite("        r->tok_repr = ctx->tokens[ctx->pos].content;\n");
+    cwrite("        r->repr_len = ctx->tokens[ctx->pos].len;\n");
+  }
+  cwrite("      } else {\n");
+  cwrite("        r = SUCC;\n");
+  cwrite("      }\n");
+  cwrite("      ctx->pos++;\n");
+  cwrite("    } else {\n");
+  cwrite("      r = NULL;\n");
+  cwrite("    }\n");
+}
+
+static inline void peg_write_vm_program(codegen_ctx *ctx) {
+  // Words are 16 bits unless a jump target or an index doesn't fit.
+  size_t max_word = ctx->vm_code.len;
+  for (size_t i = 0; i < ctx->vm_code.len; i++)
+    max_word = MAX(max_word, ctx->vm_code.buf[i]);
+  if (max_word > UINT32_MAX)
+    ERROR("The grammar compiles to %zu words of bytecode, which is too many "
+          "for --backend=vm.",
+          ctx->vm_code.len);
+  const char *word = max_word > UINT16_MAX ? "uint32_t" : "uint16_t";
+
+  cwrite("static const %s %s_vm_code[%zu] = {", word, ctx->lower,
+         ctx->vm_code.len);
+  for (size_t i = 0; i < ctx->vm_code.len; i++)
+    cwrite("%s%zu,", i % 16 ? " " : "\n  ", ctx->vm_code.buf[i]);
+  cwrite("\n};\n\n");
+
+  cwrite("static const char* %s_vm_msgs[%zu] = {\n", ctx->lower,
+         ctx->vm_msgs.len ? ctx->vm_msgs.len : 1);
+  for (size_t i = 0; i < ctx->vm_msgs.len; i++)
+    cwrite("  \"%s\",\n", ctx->vm_msgs.buf[i]);
+  if (!ctx->vm_msgs.len)
+    cwrite("  NULL,\n");
+  cwrite("};\n\n");
+
+  cwrite("static %s_astnode_t* (*const %s_vm_rules[%zu])(%s_parser_ctx*) = {\n",
+         ctx->lower, ctx->lower, ctx->definitions.len, ctx->lower);
+  for (size_t i = 0; i < ctx->definitions.len; i++)
+    cwrite("  %s_parse_%s,\n", ctx->lower,
+           (char *)ctx->definitions.buf[i]->children[0]->extra);
+  cwrite("};\n\n");
+
+  cwrite("// Runs a rule until it has a result, or reaches a code "
+         "expression. Returns\n");
+  cwrite("// 0 when the result is in vm->r, the id of the code expression to "
+         "run, or -1\n");
+  cwrite("// if the parse has to stop.\n");
+  cwrite("static inline int %s_vm_run(%s_parser_ctx* ctx, %s_vm* vm) {\n",
+         ctx->lower, ctx->lower, ctx->lower);
+  cwrite("  const %s* pc = %s_vm_code + vm->pc;\n", word, ctx->lower);
+  cwrite("  %s_astnode_t* r = vm->r;\n", ctx->lower);
+  cwrite("  pgen_parser_rewind_t* sp = vm->stack + vm->sp;\n");
+  cwrite("#if %s_VM_GOTO\n", ctx->upper);
+  cwrite("  static const void* const ops[] = {\n");
+  for (size_t i = 0; i < VM_NUM_OPS; i++)
+    cwrite("    &&op_%s,\n", vm_op_names[i]);
+  cwrite("  };\n");
+  cwrite("#define %s_VM_OP(name) op_##name:\n", ctx->upper);
+  cwrite("#define %s_VM_NEXT goto *ops[*pc++]\n", ctx->upper);
+  cwrite("  %s_VM_NEXT;\n", ctx->upper);
+  cwrite("#else\n");
+  cwrite("#define %s_VM_OP(name) case %s_VM_##name:\n", ctx->upper,
+         ctx->upper);
+  cwrite("#define %s_VM_NEXT break\n", ctx->upper);
+  cwrite("  for (;;) switch ((%s_vm_op)*pc++) {\n", ctx->lower);
+  cwrite("#endif\n");
+
+  cwrite("  %s_VM_OP(TOKEN) {\n", ctx->upper);
+  vm_write_token_match(ctx);
+  cwrite("    pc += 2;\n");
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(TOKJZ) {\n", ctx->upper);
+  vm_write_token_match(ctx);
+  cwrite("    pc = r ? pc + 3 : %s_vm_code + pc[2];\n", ctx->lower);
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(CALL) {\n", ctx->upper);
+  cwrite("    r = %s_vm_rules[*pc++](ctx);\n", ctx->lower);
+  cwrite("    if (ctx->exit) return -1;\n");
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(CALLJZ) {\n", ctx->upper);
+  cwrite("    r = %s_vm_rules[pc[0]](ctx);\n", ctx->lower);
+  cwrite("    if (ctx->exit) return -1;\n");
+  cwrite("    pc = r ? pc + 2 : %s_vm_code + pc[1];\n", ctx->lower);
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(CODE) {\n", ctx->upper);
+  cwrite("    vm->pc = (size_t)(pc + 1 - %s_vm_code);\n", ctx->lower);
+  cwrite("    vm->r = SUCC;\n");
+  cwrite("    vm->sp = (size_t)(sp - vm->stack);\n");
+  cwrite("    return *pc;\n");
+  cwrite("  }\n");
+  cwrite("  %s_VM_OP(JZ) {\n", ctx->upper);
+  cwrite("    pc = r ? pc + 1 : %s_vm_code + *pc;\n", ctx->lower);
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(JNZ) {\n", ctx->upper);
+  cwrite("    pc = r ? %s_vm_code + *pc : pc + 1;\n", ctx->lower);
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(PUSH) {\n", ctx->upper);
+  cwrite("    pgen_parser_rewind_t saved = {ctx->alloc->rew, ctx->pos};\n");
+  cwrite("    *sp++ = saved;\n");
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(POP) {\n", ctx->upper);
+  cwrite("    sp--;\n");
+  cwrite("    if (!r) %s_parser_rewind(ctx, *sp);\n", ctx->lower);
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(REWIND) {\n", ctx->upper);
+  cwrite("    %s_parser_rewind(ctx, *--sp);\n", ctx->lower);
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(STEP) {\n", ctx->upper);
+  cwrite("    if (!--ctx->fuel && %s_parser_refuel(ctx)) return -1;\n",
+         ctx->lower);
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(SUCC) {\n", ctx->upper);
+  cwrite("    r = SUCC;\n");
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(OPT) {\n", ctx->upper);
+  cwrite("    if (!r) r = SUCC;\n");
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(NOT) {\n", ctx->upper);
+  cwrite("    r = r ? NULL : SUCC;\n");
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(LABEL) {\n", ctx->upper);
+  cwrite("    vm->slots[*pc++] = r;\n");
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(ERRSTR) {\n", ctx->upper);
+  cwrite("    if (!r) {\n");
+  cwrite("      %s_report_parse_error(ctx, %s_vm_msgs[*pc], 3);\n", ctx->lower,
+         ctx->lower);
+  cwrite("      return -1;\n");
+  cwrite("    }\n");
+  cwrite("    pc++;\n");
+  cwrite("  } %s_VM_NEXT;\n", ctx->upper);
+  cwrite("  %s_VM_OP(RETURN) {\n", ctx->upper);
+  cwrite("    vm->r = r == SUCC ? NULL : r;\n");
+  cwrite("    return 0;\n");
+  cwrite("  }\n");
+  cwrite("  %s_VM_OP(END) {\n", ctx->upper);
+  cwrite("    if (!vm->slots[0]) vm->slots[0] = r;\n");
+  cwrite("    if (!r) vm->slots[0] = NULL;\n");
+  cwrite("    vm->r = vm->slots[0];\n");
+  cwrite("    return 0;\n");
+  cwrite("  }\n");
+  cwrite("#if !%s_VM_GOTO\n", ctx->upper);
+  cwrite("  }\n");
+  cwrite("#endif\n");
+  cwrite("#undef %s_VM_OP\n", ctx->upper);
+  cwrite("#undef %s_VM_NEXT\n", ctx->upper);
+  cwrite("}\n\n");
+}
+
+#endif /* PGEN_VMGEN_INCLUDE */